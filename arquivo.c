@@ -5,6 +5,24 @@
 #include <stdint.h> // Para int64_t
 #include <limits.h> // Para LLONG_MIN e INT_MIN
 #include <ctype.h>  // Para isdigit() na validao de data
+#include <unistd.h> // Para fsync, ftruncate e close (escrita duravel)
+#include <fcntl.h>  // Para open (fsync do diretorio apos rename)
+#include <time.h>   // Para clock_gettime (latencia das operacoes)
+#include <errno.h>
+#include <signal.h>     // Para encerrar o servidor com SIGINT/SIGTERM
+#include <pthread.h>    // Pool de threads do modo servidor
+#include <sys/socket.h> // Socket de dominio Unix do modo servidor
+#include <sys/un.h>
+#include <sys/mman.h>   // Para mmap dos arquivos de dados (opcional no servidor)
+#include <sys/stat.h>
+#include <sys/file.h>   // Para flock (um unico escritor por vez)
+#include <sys/syscall.h> // io_uring_setup/io_uring_enter (sem liburing)
+#include <linux/io_uring.h>
+#if defined(__AVX2__)
+#include <immintrin.h>  // Separadores do CSV, 32 bytes por vez
+#elif defined(__SSE2__)
+#include <emmintrin.h>  // Separadores do CSV, 16 bytes por vez
+#endif
 
 // --- DEFINES ---
 const char* ARQ_CSV = "jewelry.csv";
@@ -12,11 +30,19 @@ const char* ARQ_PRODUTOS_BIN = "produtos.bin";
 const char* ARQ_PRODUTOS_IDX = "produtos_idx.bin";
 const char* ARQ_COMPRAS_BIN = "compras.bin";
 const char* ARQ_COMPRAS_IDX = "compras_idx.bin";
+const char* ARQ_ITENS_BIN = "itens.bin";
+const char* ARQ_ITENS_IDX = "itens_idx.bin";
+const char* ARQ_WAL = "operacoes.wal";
+const char* ARQ_GERACOES = "geracoes.bin";
+const char* ARQ_TRAVA_ESCRITA = "escrita.lock";
+const char* ARQ_AGREGADOS = "agregados.bin";
+const char* ARQ_AGREGADOS_VENDAS = "agregados_vendas.bin";
 
 #define TAM_BRAND 50
 #define TAM_CATEGORY 100
 #define TAM_DATETIME 30
 #define BLOCO_INDICE 100 // Define o tamanho do bloco para o indice parcial
+#define WAL_GRUPO_MAX 64  // Maximo de operacoes confirmadas com um unico fsync (group commit)
 
 // --- ESTRUTURAS ---
 typedef struct {
@@ -24,29 +50,23 @@ typedef struct {
     char brand[TAM_BRAND];
     double price;
     char category_alias[TAM_CATEGORY];
-    char ativo; // 'S' para ativo, 'N' para removido (remocao logica)
+    char ativo; // 'S' para ativo, 'N' para removido (remocao logica), 'V' vaga do layout em blocos
     char newline;
 } Produto;
 
-typedef struct {
-    int64_t chave; // product_id
-    long offset;   // Posicao (em bytes) do registro no arquivo .bin
-} IndiceProduto;
-
 typedef struct {
     long long order_id;
     int64_t product_id;
     long long user_id;
     char order_datetime[TAM_DATETIME];
     int quantity;
-    char ativo; // 'S' para ativo, 'N' para removido (remocao logica)
+    char ativo; // 'S' para ativo, 'N' para removido (remocao logica), 'V' vaga do layout em blocos
     char newline;
 } Compra;
 
-typedef struct {
-    long long chave; // order_id
-    long offset;    // Posicao (em bytes) do registro no arquivo .bin
-} IndiceCompra;
+// Uma linha de um pedido (tabela de itens): mesmos campos de Compra, mas a
+// chave e o par (order_id, product_id) e um pedido pode ter varias linhas.
+typedef Compra ItemPedido;
 
 // --- FUNÇÕES AUXILIARES COMUNS ---
 
@@ -153,6 +173,14 @@ int validar_e_formatar_data(char* buffer, int tamanho_buffer) {
     return 0;
 }
 
+/** @brief FNV-1a de 32 bits (WAL e cabecalho do indice). */
+uint32_t checksum_fnv1a(const void *dados, size_t n) {
+    const unsigned char *p = dados;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) { h ^= p[i]; h *= 16777619u; }
+    return h;
+}
+
 // --- FUNCOES DE COMPARACAO (para qsort e bsearch) ---
 int comparar_produto(const void* a, const void* b) {
     int64_t id_a = ((Produto*)a)->product_id;
@@ -160,955 +188,8213 @@ int comparar_produto(const void* a, const void* b) {
     return (id_a > id_b) - (id_a < id_b);
 }
 
-// Compara uma struct Produto com uma chave (int64_t)
-int comparar_produto_chave(const void* a, const void* b) {
-    int64_t id_a = ((Produto*)a)->product_id;
-    int64_t id_b = *(int64_t*)b;
-    return (id_a > id_b) - (id_a < id_a);
-}
-
 int comparar_compra(const void* a, const void* b) {
     long long id_a = ((Compra*)a)->order_id;
     long long id_b = ((Compra*)b)->order_id;
     return (id_a > id_b) - (id_a < id_b);
 }
 
-// Compara uma struct Compra com uma chave (long long)
-int comparar_compra_chave(const void* a, const void* b) {
-    long long id_a = ((Compra*)a)->order_id;
-    long long id_b = *(long long*)b;
-    return (id_a > id_b) - (id_a < id_b);
+int comparar_item_pedido(const void* a, const void* b) {
+    const ItemPedido *x = a, *y = b;
+    if (x->order_id != y->order_id) return (x->order_id > y->order_id) - (x->order_id < y->order_id);
+    return (x->product_id > y->product_id) - (x->product_id < y->product_id);
+}
+
+// --- INSTRUMENTACAO DE I/O E LATENCIA ---
+//
+// Todo acesso aos arquivos de dados passa pelos wrappers io_fopen, io_fseek,
+// io_fread e io_fwrite, que acumulam contadores globais. As operacoes
+// principais registram sua latencia em um histograma de potencias de 2
+// (em microssegundos). Os numeros aparecem no menu "Estatisticas de I/O" e,
+// se a variavel de ambiente AED2_ESTATISTICAS estiver definida, sao
+// impressos na saida do programa ("1" = stderr; outro valor = arquivo).
+
+#define N_FAIXAS_LATENCIA 32 // Faixa i cobre [2^(i-1), 2^i) microssegundos
+
+// Os contadores sao atualizados com operacoes atomicas porque o modo
+// servidor atende requisicoes em varias threads ao mesmo tempo.
+#define CONTAR(campo, valor) __atomic_fetch_add(&(campo), (valor), __ATOMIC_RELAXED)
+
+typedef enum {
+    OP_PESQUISA_BINARIA,
+    OP_CRIAR_INDICE,
+    OP_CONSULTAR_PRODUTO,
+    OP_CONSULTAR_COMPRA,
+    OP_BUSCA_INDICE_PRODUTO,
+    OP_BUSCA_INDICE_COMPRA,
+    OP_PRODUTO_MAIS_CARO,
+    OP_VALOR_TOTAL_VENDIDO,
+    OP_MOSTRAR,
+    OP_CONFIRMAR_GRUPO_WAL,
+    OP_REQUISICAO_SERVIDOR,
+    OP_EXPORTAR,
+    OP_TOP_K,
+    OP_AGRUPAR,
+    OP_VERIFICAR_AGREGADOS,
+    OP_ITENS_PEDIDO,
+    OP_BUSCA_LOTE,
+    OP_BUSCA_APRENDIDA,
+    N_OPERACOES_MEDIDAS
+} OperacaoMedida;
+
+const char *NOMES_OPERACOES[N_OPERACOES_MEDIDAS] = {
+    "pesquisa_binaria", "criar_indice", "consultar_produto", "consultar_compra",
+    "busca_indice_produto", "busca_indice_compra", "produto_mais_caro",
+    "valor_total_vendido", "mostrar", "confirmar_grupo_wal", "requisicao_servidor",
+    "exportar", "top_k", "agrupar", "verificar_agregados", "itens_pedido",
+    "busca_lote", "busca_aprendida"
+};
+
+typedef struct {
+    unsigned long long fopens;
+    unsigned long long seeks;
+    unsigned long long registros_lidos;
+    unsigned long long bytes_lidos;
+    unsigned long long registros_escritos;
+    unsigned long long bytes_escritos;
+    unsigned long long bytes_clonados;          // Copiados pelo kernel (copy_file_range) ao publicar uma geracao
+    unsigned long long bloom_consultas;         // Testes de existencia que consultaram um filtro valido
+    unsigned long long bloom_ausentes;          // ... respondidos "ausente" sem tocar no .bin
+    unsigned long long bloom_falsos_positivos;  // ... "talvez", mas a pesquisa nao achou
+    unsigned long long fk_consultas;            // Chaves estrangeiras validadas pelo conjunto em memoria
+    unsigned long long fk_recargas;             // Vezes que o conjunto foi (re)carregado do produtos.bin
+    unsigned long long agregados_consultas;     // Consultas respondidas pelos agregados materializados
+    unsigned long long agregados_varreduras;    // ... que precisaram varrer os .bin (agregados desatualizados)
+    unsigned long long agregados_reconstrucoes; // Vezes que os agregados foram recalculados do zero
+    unsigned long long blocos_regravados;       // Imagens de blocos tocados gravadas numa nova geracao
+    unsigned long long blocos_divididos;        // Blocos cheios divididos por uma insercao
+    unsigned long long blocos_copias;           // Geracoes publicadas pelo layout em blocos
+} ContadoresIO;
+
+typedef struct {
+    unsigned long long chamadas;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long faixas[N_FAIXAS_LATENCIA];
+} HistogramaLatencia;
+
+ContadoresIO estat_io;
+HistogramaLatencia estat_latencia[N_OPERACOES_MEDIDAS];
+
+FILE *io_fopen(const char *caminho, const char *modo) {
+    CONTAR(estat_io.fopens, 1);
+    return fopen(caminho, modo);
 }
 
-// --- FUNCOES DE EXTRACAO DE CHAVE (para o indice generico) ---
-int64_t extrai_chave_produto(const void* reg) {
-    return ((Produto*)reg)->product_id;
+int io_fseek(FILE *f, long offset, int origem) {
+    CONTAR(estat_io.seeks, 1);
+    return fseek(f, offset, origem);
 }
 
-long long extrai_chave_compra(const void* reg) {
-    return ((Compra*)reg)->order_id;
+size_t io_fread(void *buffer, size_t tam, size_t n, FILE *f) {
+    size_t lidos = fread(buffer, tam, n, f);
+    CONTAR(estat_io.registros_lidos, lidos);
+    CONTAR(estat_io.bytes_lidos, lidos * tam);
+    return lidos;
 }
 
-// --- FUNCOES GENERICAS PARA ARQUIVOS ---
+size_t io_fwrite(const void *buffer, size_t tam, size_t n, FILE *f) {
+    size_t gravados = fwrite(buffer, tam, n, f);
+    CONTAR(estat_io.registros_escritos, gravados);
+    CONTAR(estat_io.bytes_escritos, gravados * tam);
+    return gravados;
+}
 
 /**
- * @brief Cria um arquivo de indice parcial (sequencial-indexado).
- * Ele le o arquivo de dados .bin e, a cada 'BLOCO_INDICE' registros ATIVOS,
- * ele grava a chave e o offset (posicao) atual no arquivo .idx.
- *
- * @param arq_dados Caminho do arquivo binario de dados (ex: "produtos.bin").
- * @param arq_indice Caminho do arquivo de indice a ser criado (ex: "produtos_idx.bin").
- * @param tam_registro Tamanho da struct de dados (ex: sizeof(Produto)).
- * @param tam_indice Tamanho da struct de indice (ex: sizeof(IndiceProduto)).
- * @param extrai_chave_i64 Ponteiro de funcao para extrair chave int64_t.
- * @param extrai_chave_ll Ponteiro de funcao para extrair chave long long.
- * @param is_long_long Flag (1 ou 0) para saber qual funcao de extracao usar.
- * @param offset_ativo Posicao (offsetof) do campo 'ativo' na struct.
- */
-void criar_indice(const char *arq_dados, const char *arq_indice,
-                  size_t tam_registro, size_t tam_indice,
-                  int64_t (*extrai_chave_i64)(const void*),
-                  long long (*extrai_chave_ll)(const void*),
-                  int is_long_long,
-                  size_t offset_ativo) {
-    FILE *f_dados = fopen(arq_dados, "rb");
-    FILE *f_indice = fopen(arq_indice, "wb");
-    if (!f_dados || !f_indice) { /* ... (erro) ... */ return; }
-
-    void *registro = malloc(tam_registro);
-    if (!registro) { /* ... (erro) ... */ fclose(f_dados); fclose(f_indice); return; }
-
-    long offset = 0;
-    int contador_registros_ativos = 0; // So conta registros marcados com 'S'
-
-    while (fread(registro, tam_registro, 1, f_dados) == 1) {
-        // Verifica se o registro esta ativo antes de considera-lo para o indice
-        if (((char*)registro)[offset_ativo] == 'S') {
-
-            // Se for o primeiro registro de um bloco, grava no indice
-            if (contador_registros_ativos % BLOCO_INDICE == 0) {
-                if (is_long_long) {
-                    IndiceCompra idx = {extrai_chave_ll(registro), offset};
-                    fwrite(&idx, tam_indice, 1, f_indice);
-                } else {
-                    IndiceProduto idx = {extrai_chave_i64(registro), offset};
-                    fwrite(&idx, tam_indice, 1, f_indice);
-                }
-            }
-            contador_registros_ativos++;
+ * @brief Marca o inicio de uma operacao medida (relogio monotonico, em ns).
+ */
+unsigned long long instr_inicio(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * @brief Registra a latencia (agora - inicio) no histograma da operacao.
+ */
+void instr_registrar(OperacaoMedida op, unsigned long long inicio) {
+    unsigned long long ns = instr_inicio() - inicio;
+    unsigned long long us = ns / 1000;
+    int faixa = 0;
+    while (us > 0 && faixa < N_FAIXAS_LATENCIA - 1) { us >>= 1; faixa++; }
+
+    HistogramaLatencia *h = &estat_latencia[op];
+    CONTAR(h->chamadas, 1);
+    CONTAR(h->total_ns, ns);
+    CONTAR(h->faixas[faixa], 1);
+    unsigned long long max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Estima um percentil a partir do histograma (limite superior da faixa, em us).
+ */
+unsigned long long percentil_histograma(const HistogramaLatencia *h, double p) {
+    unsigned long long alvo = (unsigned long long)(p * h->chamadas + 0.5), acumulado = 0;
+    if (alvo == 0) alvo = 1;
+    for (int i = 0; i < N_FAIXAS_LATENCIA; i++) {
+        acumulado += h->faixas[i];
+        if (acumulado >= alvo) return 1ull << i;
+    }
+    return 1ull << (N_FAIXAS_LATENCIA - 1);
+}
+
+void imprimir_estatisticas(FILE *saida) {
+    fprintf(saida, "\n--- ESTATISTICAS DE I/O ---\n");
+    fprintf(saida, "fopen: %llu | fseek: %llu\n", estat_io.fopens, estat_io.seeks);
+    fprintf(saida, "Lidos: %llu registros (%llu bytes)\n", estat_io.registros_lidos, estat_io.bytes_lidos);
+    fprintf(saida, "Gravados: %llu registros (%llu bytes) | %llu bytes clonados\n",
+            estat_io.registros_escritos, estat_io.bytes_escritos, estat_io.bytes_clonados);
+    fprintf(saida, "Bloom: %llu testes | %llu ausentes sem I/O no .bin | %llu falsos positivos\n",
+            estat_io.bloom_consultas, estat_io.bloom_ausentes, estat_io.bloom_falsos_positivos);
+    fprintf(saida, "Produtos ativos em memoria: %llu consultas de chave estrangeira | %llu recargas\n",
+            estat_io.fk_consultas, estat_io.fk_recargas);
+    fprintf(saida, "Agregados materializados: %llu consultas O(1) | %llu varreduras | %llu reconstrucoes\n",
+            estat_io.agregados_consultas, estat_io.agregados_varreduras, estat_io.agregados_reconstrucoes);
+    fprintf(saida, "Layout em blocos: %llu blocos regravados | %llu divisoes | %llu copias do .bin\n",
+            estat_io.blocos_regravados, estat_io.blocos_divididos, estat_io.blocos_copias);
+
+    fprintf(saida, "\n--- LATENCIA POR OPERACAO (us) ---\n");
+    fprintf(saida, "%-22s %10s %12s %10s %10s %12s\n", "operacao", "chamadas", "media", "p50<=", "p99<=", "max");
+    for (int op = 0; op < N_OPERACOES_MEDIDAS; op++) {
+        const HistogramaLatencia *h = &estat_latencia[op];
+        if (h->chamadas == 0) continue;
+        fprintf(saida, "%-22s %10llu %12.1f %10llu %10llu %12.1f\n", NOMES_OPERACOES[op], h->chamadas,
+                (double)h->total_ns / h->chamadas / 1000.0,
+                percentil_histograma(h, 0.50), percentil_histograma(h, 0.99), h->max_ns / 1000.0);
+        fprintf(saida, "  histograma:");
+        for (int i = 0; i < N_FAIXAS_LATENCIA; i++) {
+            if (h->faixas[i]) fprintf(saida, " [<%lluus]=%llu", 1ull << i, h->faixas[i]);
         }
-        // Atualiza o offset para a posicao do PROXIMO registro
-        offset = ftell(f_dados);
+        fprintf(saida, "\n");
     }
+}
 
-    free(registro);
-    fclose(f_dados);
-    fclose(f_indice);
-    printf("Indice criado com %d entradas.\n", (contador_registros_ativos + BLOCO_INDICE - 1) / BLOCO_INDICE);
+void zerar_estatisticas(void) {
+    memset(&estat_io, 0, sizeof(estat_io));
+    memset(estat_latencia, 0, sizeof(estat_latencia));
+}
+
+/**
+ * @brief Registrada com atexit quando AED2_ESTATISTICAS esta definida.
+ */
+void despejar_estatisticas_na_saida(void) {
+    const char *destino = getenv("AED2_ESTATISTICAS");
+    if (!destino || !*destino) return;
+    if (strcmp(destino, "1") == 0) {
+        imprimir_estatisticas(stderr);
+        return;
+    }
+    FILE *f = fopen(destino, "a");
+    if (!f) { imprimir_estatisticas(stderr); return; }
+    imprimir_estatisticas(f);
+    fclose(f);
 }
 
+// --- ESCRITA SEGURA (ARQUIVO TEMPORARIO + RENAME) ---
 
 /**
- * @brief Realiza uma pesquisa binaria DIRETAMENTE NO ARQUIVO binario.
- * Nao carrega o arquivo para a RAM. Usa fseek para pular entre os registros.
- *
- * @param arq_bin Caminho do arquivo binario de dados.
- * @param tam_registro Tamanho da struct de dados (ex: sizeof(Produto)).
- * @param comparador Ponteiro de funcao de comparacao (ex: comparar_produto_chave).
- * @param chave_busca Ponteiro para a chave (ID) que estamos buscando.
- * @param offset_ativo Posicao (offsetof) do campo 'ativo' na struct.
- * @return long
- * - Retorna o OFFSET (posicao em bytes) se encontrar e o registro estiver ATIVO ('S').
- * - Retorna -1 se nao encontrar o registro.
- * - Retorna -2 se encontrar, mas o registro estiver REMOVIDO ('N').
- */
-long pesquisa_binaria(const char *arq_bin, size_t tam_registro,
-                      int (*comparador)(const void*, const void*),
-                      const void *chave_busca,
-                      size_t offset_ativo) {
-    FILE *fbin = fopen(arq_bin, "rb");
-    if (!fbin) return -1;
-
-    fseek(fbin, 0, SEEK_END);
-    long tamanho_arquivo = ftell(fbin);
-    if (tamanho_arquivo <= 0 || tamanho_arquivo % tam_registro != 0) { fclose(fbin); return -1; }
-    long num_registros = tamanho_arquivo / tam_registro;
-
-    long inicio = 0, fim = num_registros - 1;
-    void *registro = malloc(tam_registro);
-    if (!registro) { fclose(fbin); return -1; }
+ * @brief Monta o caminho do arquivo temporario usado nas reorganizacoes
+ * (ex: "produtos.bin" -> "produtos.bin.tmp"). Se o caminho nao couber em
+ * 'saida' ela fica vazia: a abertura do temporario falha e a publicacao e
+ * abandonada, em vez de gravar num nome truncado.
+ * @return 1 se o caminho coube.
+ */
+int caminho_temporario(const char *destino, char *saida, size_t tam) {
+    int n = snprintf(saida, tam, "%s.tmp", destino);
+    if (n >= 0 && (size_t)n < tam) return 1;
+    if (tam > 0) saida[0] = '\0';
+    return 0;
+}
 
-    while (inicio <= fim) {
-        long meio = inicio + (fim - inicio) / 2;
+/**
+ * @brief Faz fsync do diretorio que contem 'caminho'. Sem isso o rename()
+ * pode ser perdido numa queda, mesmo com os dados do arquivo ja no disco.
+ */
+void sincronizar_diretorio(const char *caminho) {
+    char dir[1024];
+    const char *barra = strrchr(caminho, '/');
+    if (barra) {
+        size_t n = (barra == caminho) ? 1 : (size_t)(barra - caminho);
+        if (n >= sizeof(dir)) return;
+        memcpy(dir, caminho, n);
+        dir[n] = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
 
-        // Pula o cursor do arquivo para a posicao do registro do "meio"
-        if (fseek(fbin, meio * tam_registro, SEEK_SET) != 0) { free(registro); fclose(fbin); return -1; }
+/**
+ * @brief Publica atomicamente um arquivo reescrito.
+ * 1. fflush + fsync do temporario (os dados chegam ao disco).
+ * 2. rename() sobre o destino: quem abrir o arquivo ve a versao antiga
+ *    OU a nova, nunca um arquivo truncado pela metade.
+ * 3. fsync do diretorio para tornar a troca de nome duravel.
+ * Sempre fecha 'ftmp'. Em caso de erro o temporario e apagado e o
+ * destino fica intacto.
+ * @return 1 se publicou, 0 em caso de erro.
+ */
+int publicar_temporario(FILE *ftmp, const char *caminho_tmp, const char *destino) {
+    int ok = !ferror(ftmp) && fflush(ftmp) == 0 && fsync(fileno(ftmp)) == 0;
+    if (fclose(ftmp) != 0) ok = 0;
+    if (!ok || rename(caminho_tmp, destino) != 0) {
+        remove(caminho_tmp);
+        return 0;
+    }
+    sincronizar_diretorio(destino);
+    return 1;
+}
 
-        // Le apenas UM registro (o do "meio")
-        if (fread(registro, tam_registro, 1, fbin) != 1) { free(registro); fclose(fbin); return -1; }
+/**
+ * @brief Acrescenta os bytes [de, ate) de 'origem' ao fim de 'destino'
+ * (aberto para escrita). Usa copy_file_range, em que os dados nao passam
+ * pelo espaco do usuario (e, com reflink, nem sao copiados no disco); se o
+ * sistema de arquivos nao suporta, cai para pread + io_fwrite.
+ * @return 1 se todos os bytes foram copiados.
+ */
+int clonar_trecho(int origem, FILE *destino, int64_t de, int64_t ate) {
+    if (fflush(destino) != 0) return 0; // copy_file_range grava na posicao do descritor
+    int fd_destino = fileno(destino);
+    while (de < ate) {
+        off_t entrada = (off_t)de;
+        long n = syscall(__NR_copy_file_range, origem, &entrada, fd_destino, NULL, (size_t)(ate - de), 0u);
+        if (n <= 0) break; // Sem suporte (ENOSYS, EXDEV, ...): o resto vai pelo caminho comum
+        CONTAR(estat_io.bytes_clonados, (unsigned long long)n);
+        de += n;
+    }
+    char buffer[1 << 16];
+    while (de < ate) {
+        size_t n = (ate - de < (int64_t)sizeof(buffer)) ? (size_t)(ate - de) : sizeof(buffer);
+        ssize_t lidos = pread(origem, buffer, n, (off_t)de);
+        if (lidos <= 0) return 0;
+        CONTAR(estat_io.bytes_lidos, (size_t)lidos);
+        if (io_fwrite(buffer, 1, (size_t)lidos, destino) != (size_t)lidos) return 0;
+        de += lidos;
+    }
+    return 1;
+}
 
-        int cmp = comparador(registro, chave_busca);
+// --- GERACOES DOS ARQUIVOS E TRAVA DO ESCRITOR ---
+//
+// Leitores e escritores podem rodar ao mesmo tempo (outros processos ou as
+// threads do modo servidor). Cada arquivo .bin tem um numero de GERACAO,
+// guardado em ARQ_GERACOES e incrementado a cada versao publicada. O
+// escritor nunca altera registros da geracao publicada: ele grava a nova
+// geracao num temporario e a publica com rename. Um leitor "fixa" a geracao
+// em que comecou simplesmente mantendo o arquivo aberto; o inode antigo so
+// e liberado pelo sistema quando o ultimo leitor fecha o descritor.
+// Grupos que so removem tambem: o .bin e clonado (clonar_trecho) e o byte
+// 'ativo' e trocado na copia.
+// Escritores sao serializados por uma trava (flock) em ARQ_TRAVA_ESCRITA;
+// leitores nunca pegam essa trava.
+// O mesmo arquivo marca as tabelas gravadas no layout em blocos com folga
+// (ver LAYOUT EM BLOCOS).
+
+#define GERACOES_MAGICO 0x52454741u // "AGER"
+
+typedef enum {
+    TABELA_PRODUTOS = 0,
+    TABELA_COMPRAS  = 1,
+    N_TABELAS
+} TabelaDados;
 
-        if (cmp == 0) {
-            // Encontrou a chave! Agora verifica se esta ativa.
-            char ativo = ((char*)registro)[offset_ativo];
-            long result = (ativo == 'S') ? (meio * tam_registro) : -2; // -2 = removido
-            free(registro);
-            fclose(fbin);
-            return result;
-        }
+typedef struct {
+    uint32_t magico;
+    uint32_t em_blocos; // Bit t: .bin da tabela t no layout em blocos com folga
+    uint64_t geracao[N_TABELAS];
+} ArquivoGeracoes;
 
-        (cmp < 0) ? (inicio = meio + 1) : (fim = meio - 1);
-    }
+/**
+ * @brief Le o arquivo de geracoes. Sem o arquivo, tudo e geracao 0 e
+ * layout denso.
+ */
+void ler_arquivo_geracoes(ArquivoGeracoes *g) {
+    ArquivoGeracoes lido;
+    memset(g, 0, sizeof(*g));
+    g->magico = GERACOES_MAGICO;
+    FILE *f = io_fopen(ARQ_GERACOES, "rb");
+    if (!f) return;
+    if (io_fread(&lido, sizeof(lido), 1, f) == 1 && lido.magico == GERACOES_MAGICO) *g = lido;
+    fclose(f);
+}
 
-    free(registro);
-    fclose(fbin);
-    return -1; // Nao encontrou
+/**
+ * @brief Le os numeros de geracao atuais.
+ */
+void ler_geracoes(uint64_t geracao[N_TABELAS]) {
+    ArquivoGeracoes g;
+    ler_arquivo_geracoes(&g);
+    memcpy(geracao, g.geracao, sizeof(g.geracao));
 }
 
+/** @brief O .bin de 'tabela' esta no layout em blocos com folga? */
+int tabela_em_blocos(TabelaDados tabela) {
+    ArquivoGeracoes g;
+    ler_arquivo_geracoes(&g);
+    return (g.em_blocos >> tabela) & 1;
+}
 
-// --- FUNCOES ESPECIFICAS PRODUTOS ---
+/**
+ * @brief Marca que uma nova geracao de 'tabela' foi publicada, gravada no
+ * layout em blocos (em_blocos = 1), denso (0) ou no mesmo de antes (-1).
+ * Deve ser chamada com a trava do escritor adquirida.
+ */
+void avancar_geracao_layout(TabelaDados tabela, int em_blocos) {
+    ArquivoGeracoes g;
+    ler_arquivo_geracoes(&g);
+    g.geracao[tabela]++;
+    if (em_blocos == 1) g.em_blocos |= 1u << tabela;
+    else if (em_blocos == 0) g.em_blocos &= ~(1u << tabela);
+
+    char caminho_tmp[1024];
+    caminho_temporario(ARQ_GERACOES, caminho_tmp, sizeof(caminho_tmp));
+    FILE *f = io_fopen(caminho_tmp, "wb");
+    if (!f) return;
+    io_fwrite(&g, sizeof(g), 1, f);
+    publicar_temporario(f, caminho_tmp, ARQ_GERACOES);
+}
 
 /**
- * @brief Le o CSV, ordena em RAM e grava o arquivo .bin inicial de produtos.
- * Este e o unico momento (alem da insercao) em que muitos dados
- * sao mantidos em RAM, para permitir a ordenacao inicial com qsort.
- * Tambem remove duplicatas de product_id durante a gravacao.
+ * @brief Marca que uma nova geracao de 'tabela' foi publicada (mesmo layout).
  */
-void pre_processar_produtos(const char *csv_path, const char *bin_path) {
-    printf("Pre-processando PRODUTOS de %s...\n", csv_path);
-    FILE *fcsv = fopen(csv_path, "r");
-    if (!fcsv) { printf("ERRO: Nao foi possivel abrir CSV %s\n", csv_path); return; }
+void avancar_geracao(TabelaDados tabela) {
+    avancar_geracao_layout(tabela, -1);
+}
 
-    char linha[2048];
-    if (!fgets(linha, sizeof(linha), fcsv)) { fclose(fcsv); return; } // Ignora cabealho
+/**
+ * @brief Adquire a trava exclusiva do escritor (bloqueia ate conseguir).
+ * @return Descritor a ser passado para trava_escrita_liberar, ou -1 se o
+ * arquivo de trava nao pode ser aberto (segue sem trava).
+ */
+int trava_escrita_adquirir(void) {
+    int fd = open(ARQ_TRAVA_ESCRITA, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    while (flock(fd, LOCK_EX) != 0 && errno == EINTR) {}
+    return fd;
+}
 
-    int capacidade = 100000, n_produtos = 0;
-    Produto* produtos = malloc(capacidade * sizeof(Produto));
-    if (!produtos) { printf("ERRO: Falha ao alocar memoria.\n"); fclose(fcsv); return; }
+void trava_escrita_liberar(int fd) {
+    if (fd < 0) return;
+    flock(fd, LOCK_UN);
+    close(fd);
+}
 
-    // 1. Le CSV para a RAM
-    while (fgets(linha, sizeof(linha), fcsv)) {
-        if (n_produtos >= capacidade) {
-            capacidade *= 2;
-            Produto* temp = realloc(produtos, capacidade * sizeof(Produto));
-            if (!temp) { printf("ERRO: Falha ao realocar memoria.\n"); free(produtos); fclose(fcsv); return; }
-            produtos = temp;
-        }
+// --- FILTROS DE BLOOM (TESTE DE EXISTENCIA SEM I/O NO .bin) ---
+//
+// Cada tabela tem um filtro de Bloom persistido ao lado do .bin
+// ("<arquivo>.bloom") com as chaves ATIVAS, construido junto com o indice
+// parcial. Se o filtro responde "ausente", a chave certamente nao existe
+// ativa e a pesquisa binaria no arquivo (log N leituras) e evitada; um
+// "talvez" ainda precisa da pesquisa (falso positivo com probabilidade
+// ~bloom_taxa_fp). O cabecalho guarda a geracao e o tamanho do .bin para os
+// quais o filtro vale: se nao batem com os atuais o filtro e ignorado, entao
+// ele nunca responde "ausente" para uma chave que existe. As insercoes
+// confirmadas pelo WAL acrescentam suas chaves e avancam a geracao do filtro.
 
-        Produto p = {0};
-        char *token = strtok(linha, ",");
-        for (int i = 0; token != NULL && i < 9; i++) {
-            switch(i) {
-                case 2: p.product_id = atoll(token); break;
-                case 5: strncpy(p.category_alias, token, TAM_CATEGORY-1); p.category_alias[TAM_CATEGORY-1] = '\0'; break;
-                case 6: strncpy(p.brand, token, TAM_BRAND-1); p.brand[TAM_BRAND-1] = '\0'; break;
-                case 7: p.price = atof(token); break;
-            }
-            token = strtok(NULL, ",");
-        }
-        p.category_alias[TAM_CATEGORY-1] = '\0';
-        p.brand[TAM_BRAND-1] = '\0';
+#define BLOOM_MAGICO 0x4D4F4C42u // "BLOM"
+#define BLOOM_TAXA_FP_PADRAO 0.01
+#define BLOOM_MAX_HASHES 16
 
-        pad_string(p.brand, TAM_BRAND);
-        pad_string(p.category_alias, TAM_CATEGORY);
-        p.ativo = 'S';
-        p.newline = '\n';
-        produtos[n_produtos++] = p;
-    }
+double bloom_taxa_fp = BLOOM_TAXA_FP_PADRAO; // Alteravel pela variavel AED2_BLOOM_FP
 
-    fclose(fcsv);
-    printf("%d registros lidos para produtos.\n", n_produtos);
+typedef struct {
+    uint32_t magico;
+    uint32_t n_hashes;
+    uint64_t n_bits;
+    uint64_t geracao;      // Geracao do .bin (ARQ_GERACOES) coberta pelo filtro
+    int64_t tamanho_dados; // Tamanho do .bin nessa geracao
+    uint64_t n_chaves;
+} CabecalhoBloom;
 
-    // 2. Ordena na RAM usando qsort
-    qsort(produtos, n_produtos, sizeof(Produto), comparar_produto);
+typedef struct {
+    CabecalhoBloom cab;
+    unsigned char *bits;
+} FiltroBloom;
 
-    // 3. Grava no arquivo .bin, pulando duplicatas
-    FILE *fbin = fopen(bin_path, "wb");
-    if (fbin) {
-        int n_unicos = 0;
-        int64_t ultimo_id = LLONG_MIN;
-        for (int i = 0; i < n_produtos; i++) {
-            if (produtos[i].product_id != ultimo_id) {
-                fwrite(&produtos[i], sizeof(Produto), 1, fbin);
-                ultimo_id = produtos[i].product_id;
-                n_unicos++;
-            }
-        }
-        fclose(fbin);
-        printf("%s criado com %d produtos unicos.\n", bin_path, n_unicos);
-    } else {
-         printf("ERRO: Nao foi possivel criar o arquivo binario %s.\n", bin_path);
-    }
-    free(produtos);
+// Ultimo filtro lido de cada tabela (por processo)
+typedef struct {
+    int carregado;
+    uint64_t geracao; // Geracao/tamanho do .bin quando o filtro foi lido
+    int64_t tamanho;
+    FiltroBloom *filtro; // NULL se nao havia filtro valido para eles
+} CacheBloom;
+
+CacheBloom bloom_cache[N_TABELAS];
+
+void caminho_bloom(const char *arq_dados, char *saida, size_t tam) {
+    snprintf(saida, tam, "%s.bloom", arq_dados);
 }
 
 /**
- * @brief Le o arquivo .bin sequencialmente e imprime todos os produtos ATIVOS.
+ * @brief Logaritmo natural sem depender da libm (precisao de ~1e-6, suficiente
+ * para dimensionar o filtro).
  */
-void mostrar_produtos(const char *arq_bin) {
-    FILE *fbin = fopen(arq_bin, "rb");
-    if (!fbin) { printf("ERRO ao abrir %s\n", arq_bin); return; }
-
-    Produto p;
-    int contador = 0;
-    printf("\n--- PRODUTOS ATIVOS ---\n");
-    while (fread(&p, sizeof(Produto), 1, fbin) == 1) {
-        if (p.ativo == 'S') {
-            // Logica para "trim" (remover espacos) antes de imprimir
-            char brand_trim[TAM_BRAND+1]={0};
-            char category_trim[TAM_CATEGORY+1]={0};
-            strncpy(brand_trim, p.brand, TAM_BRAND);
-            strncpy(category_trim, p.category_alias, TAM_CATEGORY);
-            for(int i = strlen(brand_trim)-1; i >=0 && brand_trim[i] == ' '; i--) brand_trim[i] = '\0';
-            for(int i = strlen(category_trim)-1; i >=0 && category_trim[i] == ' '; i--) category_trim[i] = '\0';
-
-            printf("ID: %lld | Brand: %s | Price: %.2f | Category: %s\n",
-                   p.product_id, brand_trim, p.price, category_trim);
-            contador++;
-        }
-    }
-    printf("Total: %d produtos\n", contador);
-    fclose(fbin);
+double ln_aproximado(double x) {
+    int expoente = 0;
+    while (x >= 2.0) { x /= 2.0; expoente++; }
+    while (x < 1.0) { x *= 2.0; expoente--; }
+    double t = (x - 1.0) / (x + 1.0), t2 = t * t, soma = 0, termo = t;
+    for (int i = 1; i <= 15; i += 2) { soma += termo / i; termo *= t2; }
+    return 2.0 * soma + expoente * 0.69314718055994531;
 }
 
 /**
- * @brief Insere um novo produto no arquivo binario.
- * ESTRATEGIA: Para manter o arquivo 100% ordenado (necessario para a
- * pesquisa_binaria funcionar), esta funcao:
- * 1. Le o arquivo .bin INTEIRO para a RAM.
- * 2. Adiciona o novo registro no array em RAM.
- * 3. Re-ordena o array INTEIRO com qsort.
- * 4. Re-escreve o arquivo .bin INTEIRO a partir da RAM.
- * Esta e uma operacao custosa, mas garante a consistencia da ordenacao.
- * @return 1 se foi inserido, 0 se houve erro (ex: ID ja existe).
+ * @brief Cria um filtro vazio dimensionado para 'n_previsto' chaves:
+ * m = -n ln(p) / ln(2)^2 bits e k = (m/n) ln(2) funcoes de hash.
  */
-int inserir_produto(const char *arq_bin) {
-    Produto p_novo;
-    printf("\n--- INSERIR NOVO PRODUTO ---\n");
+FiltroBloom *bloom_criar(uint64_t n_previsto) {
+    double p = bloom_taxa_fp;
+    if (p <= 0 || p >= 1) p = BLOOM_TAXA_FP_PADRAO;
+    if (n_previsto == 0) n_previsto = 1;
+    double ln2 = 0.69314718055994531;
+    uint64_t n_bits = (uint64_t)(-(double)n_previsto * ln_aproximado(p) / (ln2 * ln2)) + 1;
+    n_bits = (n_bits + 63) / 64 * 64;
+    int k = (int)((double)n_bits / n_previsto * ln2 + 0.5);
+    if (k < 1) k = 1;
+    if (k > BLOOM_MAX_HASHES) k = BLOOM_MAX_HASHES;
+
+    FiltroBloom *f = calloc(1, sizeof(FiltroBloom));
+    if (!f) return NULL;
+    f->bits = calloc(n_bits / 8, 1);
+    if (!f->bits) { free(f); return NULL; }
+    f->cab.magico = BLOOM_MAGICO;
+    f->cab.n_hashes = (uint32_t)k;
+    f->cab.n_bits = n_bits;
+    return f;
+}
 
-    p_novo.product_id = ler_long_long("Digite o product_id: ");
+void bloom_liberar(FiltroBloom *f) {
+    if (!f) return;
+    free(f->bits);
+    free(f);
+}
 
-    // 1. Verifica se a chave ja existe (usando a pesquisa binaria)
-    int64_t chave = p_novo.product_id;
-    if (pesquisa_binaria(arq_bin, sizeof(Produto), comparar_produto_chave, &chave, offsetof(Produto, ativo)) >= 0) {
-        printf("ERRO: product_id %lld ja existe!\n", p_novo.product_id);
-        return 0;
-    }
+/**
+ * @brief Dois hashes independentes da chave; o i-esimo bit e h1 + i*h2 (double hashing).
+ */
+void bloom_hashes(int64_t chave, uint64_t *h1, uint64_t *h2) {
+    uint64_t z = (uint64_t)chave + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    *h1 = z ^ (z >> 31);
+    z = *h1 + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 33)) * 0xFF51AFD7ED558CCDull;
+    *h2 = (z ^ (z >> 33)) | 1;
+}
 
-    ler_string("Digite a brand: ", p_novo.brand, TAM_BRAND);
-    p_novo.price = ler_double("Digite o preco: ");
-    ler_string("Digite a categoria: ", p_novo.category_alias, TAM_CATEGORY);
+void bloom_adicionar(FiltroBloom *f, int64_t chave) {
+    uint64_t h1, h2;
+    bloom_hashes(chave, &h1, &h2);
+    for (uint32_t i = 0; i < f->cab.n_hashes; i++) {
+        uint64_t bit = (h1 + i * h2) % f->cab.n_bits;
+        f->bits[bit >> 3] |= (unsigned char)(1u << (bit & 7));
+    }
+    f->cab.n_chaves++;
+}
 
-    pad_string(p_novo.brand, TAM_BRAND);
-    pad_string(p_novo.category_alias, TAM_CATEGORY);
-    p_novo.ativo = 'S';
-    p_novo.newline = '\n';
+int bloom_testar(const FiltroBloom *f, int64_t chave) {
+    uint64_t h1, h2;
+    bloom_hashes(chave, &h1, &h2);
+    for (uint32_t i = 0; i < f->cab.n_hashes; i++) {
+        uint64_t bit = (h1 + i * h2) % f->cab.n_bits;
+        if (!(f->bits[bit >> 3] & (1u << (bit & 7)))) return 0;
+    }
+    return 1;
+}
 
-    // 2. Le o arquivo atual para a RAM
-    FILE *fbin = fopen(arq_bin, "rb");
-    long n_registros = 0;
-    Produto *produtos = NULL;
+/**
+ * @brief Grava o filtro de 'tabela' (temporario + rename) e invalida o cache.
+ */
+int bloom_gravar(TabelaDados tabela, const FiltroBloom *f, const char *arq_dados) {
+    char caminho[1024], caminho_tmp[1040];
+    caminho_bloom(arq_dados, caminho, sizeof(caminho));
+    caminho_temporario(caminho, caminho_tmp, sizeof(caminho_tmp));
+    FILE *ftmp = io_fopen(caminho_tmp, "wb");
+    if (!ftmp) return 0;
+    io_fwrite(&f->cab, sizeof(f->cab), 1, ftmp);
+    io_fwrite(f->bits, 1, f->cab.n_bits / 8, ftmp);
+    bloom_cache[tabela].carregado = 0;
+    return publicar_temporario(ftmp, caminho_tmp, caminho);
+}
 
-    if (fbin) {
-        fseek(fbin, 0, SEEK_END);
-        long tamanho_arquivo = ftell(fbin);
-        if (tamanho_arquivo > 0 && tamanho_arquivo % sizeof(Produto) == 0) {
-             n_registros = tamanho_arquivo / sizeof(Produto);
-             produtos = malloc((n_registros + 1) * sizeof(Produto)); // Aloca espaco para +1
-             if (!produtos) { printf("ERRO ao alocar memoria.\n"); fclose(fbin); return 0; }
-             fseek(fbin, 0, SEEK_SET);
-             fread(produtos, sizeof(Produto), n_registros, fbin);
+FiltroBloom *bloom_ler(const char *arq_dados) {
+    char caminho[1024];
+    caminho_bloom(arq_dados, caminho, sizeof(caminho));
+    FILE *fb = io_fopen(caminho, "rb");
+    if (!fb) return NULL;
+    FiltroBloom *f = calloc(1, sizeof(FiltroBloom));
+    if (f && io_fread(&f->cab, sizeof(f->cab), 1, fb) == 1 && f->cab.magico == BLOOM_MAGICO &&
+        f->cab.n_bits > 0 && f->cab.n_bits % 8 == 0 && f->cab.n_hashes <= BLOOM_MAX_HASHES) {
+        f->bits = malloc(f->cab.n_bits / 8);
+        if (f->bits && io_fread(f->bits, 1, f->cab.n_bits / 8, fb) == f->cab.n_bits / 8) {
+            fclose(fb);
+            return f;
         }
-        fclose(fbin);
-    }
-    if (!produtos) { // Caso o arquivo esteja vazio ou nao exista
-         n_registros = 0;
-         produtos = malloc(sizeof(Produto));
-         if (!produtos) { printf("ERRO ao alocar memoria.\n"); return 0; }
     }
+    fclose(fb);
+    bloom_liberar(f);
+    return NULL;
+}
 
-    // 3. Adiciona o novo registro e re-ordena
-    produtos[n_registros] = p_novo;
-    n_registros++;
-    qsort(produtos, n_registros, sizeof(Produto), comparar_produto);
-
-    // 4. Re-escreve o arquivo inteiro
-    fbin = fopen(arq_bin, "wb");
-    if (!fbin) { printf("ERRO ao abrir arquivo para escrita.\n"); free(produtos); return 0; }
-
-    fwrite(produtos, sizeof(Produto), n_registros, fbin);
-    fclose(fbin);
-    free(produtos);
+/**
+ * @brief Teste de existencia em memoria, antes de qualquer leitura do .bin.
+ * @return 0 = chave certamente ausente (ou removida); 1 = talvez presente;
+ * -1 = nao ha filtro valido para a geracao atual (fazer a pesquisa).
+ */
+int bloom_pode_conter(TabelaDados tabela, const char *arq_dados, int64_t chave) {
+    uint64_t geracao[N_TABELAS];
+    struct stat st;
+    ler_geracoes(geracao);
+    if (stat(arq_dados, &st) != 0) return -1;
+
+    CacheBloom *c = &bloom_cache[tabela];
+    if (!c->carregado || c->geracao != geracao[tabela] || c->tamanho != (int64_t)st.st_size) {
+        bloom_liberar(c->filtro);
+        c->filtro = bloom_ler(arq_dados);
+        if (c->filtro && (c->filtro->cab.geracao != geracao[tabela] ||
+                          c->filtro->cab.tamanho_dados != (int64_t)st.st_size)) {
+            bloom_liberar(c->filtro); // Filtro de outra geracao: nao serve
+            c->filtro = NULL;
+        }
+        c->carregado = 1;
+        c->geracao = geracao[tabela];
+        c->tamanho = (int64_t)st.st_size;
+    }
+    if (!c->filtro) return -1;
 
-    printf("Produto %lld inserido com sucesso!\n", p_novo.product_id);
-    return 1; // Retorna 1 para sinalizar que o indice precisa ser reconstruido
+    CONTAR(estat_io.bloom_consultas, 1);
+    if (bloom_testar(c->filtro, chave)) return 1;
+    CONTAR(estat_io.bloom_ausentes, 1);
+    return 0;
 }
 
 /**
- * @brief Realiza a remocao logica de um produto.
- * Ele nao apaga o registro do arquivo. Apenas encontra o registro
- * usando a pesquisa_binaria e altera o campo 'ativo' de 'S' para 'N'.
- * Esta e uma operacao muito rapida (O(log N) + escrita).
- * @return 1 se foi removido, 0 se houve erro (ex: nao encontrado).
+ * @brief Chamada pelo escritor logo apos publicar uma nova geracao do .bin:
+ * se o filtro valia para a geracao anterior, acrescenta as chaves inseridas
+ * e passa a valer para a nova. Caso contrario fica como esta (ignorado ate
+ * o proximo criar_indice).
  */
-int remover_produto(const char *arq_bin) {
-    printf("\n--- REMOVER PRODUTO ---\n");
-    int64_t id = ler_long_long("Digite o product_id para remover: ");
+void bloom_apos_escrita(TabelaDados tabela, const char *arq_dados,
+                        uint64_t geracao_anterior, int64_t tamanho_anterior,
+                        const int64_t *chaves_inseridas, int n) {
+    FiltroBloom *f = bloom_ler(arq_dados);
+    if (!f) return;
+    uint64_t geracao[N_TABELAS];
+    struct stat st;
+    ler_geracoes(geracao);
+    if (f->cab.geracao == geracao_anterior && f->cab.tamanho_dados == tamanho_anterior &&
+        stat(arq_dados, &st) == 0) {
+        for (int i = 0; i < n; i++) bloom_adicionar(f, chaves_inseridas[i]);
+        f->cab.geracao = geracao[tabela];
+        f->cab.tamanho_dados = (int64_t)st.st_size;
+        bloom_gravar(tabela, f, arq_dados);
+    }
+    bloom_liberar(f);
+}
 
-    int64_t chave = id;
-    long offset = pesquisa_binaria(arq_bin, sizeof(Produto), comparar_produto_chave, &chave, offsetof(Produto, ativo));
+// --- CONJUNTO DE PRODUTOS ATIVOS (CHAVE ESTRANGEIRA SEM I/O) ---
+//
+// Tabela hash (enderecamento aberto, sondagem linear) com os product_id
+// ATIVOS de produtos.bin, usada para validar o product_id das compras em
+// O(1). E carregada uma vez por varredura sequencial e depois mantida pelo
+// proprio escritor: o WAL acrescenta/retira as chaves de cada grupo aplicado
+// e a recriacao pelo CSV a refaz a partir do vetor ja em memoria. Guarda a
+// geracao e o tamanho do .bin que reflete; se outro processo publicar uma
+// geracao nova, a proxima consulta recarrega.
 
-    if (offset == -1) { printf("Produto %lld nao encontrado.\n", id); return 0; }
-    if (offset == -2) { printf("Produto %lld ja esta removido.\n", id); return 0; }
+#define CONJUNTO_VAZIO   INT64_MIN       // Posicao nunca usada
+#define CONJUNTO_REMOVIDO (INT64_MIN + 1) // Posicao liberada (continua a sondagem)
 
-    // Encontrou e esta ativo (offset >= 0)
-    FILE *fbin = fopen(arq_bin, "r+b"); // Abre para LEITURA e ESCRITA
-    if (!fbin) { printf("ERRO ao abrir arquivo para remocao.\n"); return 0; }
+typedef struct {
+    int64_t *chaves;
+    uint64_t capacidade;   // Potencia de 2
+    uint64_t n;            // Chaves presentes
+    uint64_t n_removidos;  // Posicoes CONJUNTO_REMOVIDO
+    int carregado;
+    uint64_t geracao;      // Geracao/tamanho do produtos.bin refletidos
+    int64_t tamanho;
+} ConjuntoIds;
 
-    // Pula o cursor direto para o campo 'ativo' do registro encontrado
-    fseek(fbin, offset + offsetof(Produto, ativo), SEEK_SET);
+ConjuntoIds produtos_ativos;
 
-    // Sobrescreve apenas aquele byte
-    fwrite("N", sizeof(char), 1, fbin);
-    fclose(fbin);
+/**
+ * @brief Espalha os bits da chave (ids proximos caem longe na tabela).
+ */
+static inline uint64_t espalhar_chave(int64_t chave) {
+    uint64_t z = (uint64_t)chave * 0x9E3779B97F4A7C15ull;
+    return z ^ (z >> 29);
+}
 
-    printf("Produto %lld removido logicamente.\n", id);
-    return 1; // Retorna 1 para sinalizar que o indice precisa ser reconstruido
+uint64_t conjunto_posicao(const ConjuntoIds *c, int64_t chave) {
+    return espalhar_chave(chave) & (c->capacidade - 1);
+}
+
+void conjunto_liberar(ConjuntoIds *c) {
+    free(c->chaves);
+    c->chaves = NULL;
+    c->capacidade = c->n = c->n_removidos = 0;
+    c->carregado = 0;
 }
 
 /**
- * @brief Consulta um produto usando a pesquisa binaria direta no arquivo.
+ * @brief Reserva espaco para 'n_previsto' chaves (ocupacao <= 50%),
+ * descartando o conteudo atual.
  */
-void consultar_produto(const char *arq_bin) {
-    printf("\n--- CONSULTAR PRODUTO ---\n");
-    int64_t id = ler_long_long("Digite o product_id para consultar: ");
+int conjunto_iniciar(ConjuntoIds *c, uint64_t n_previsto) {
+    conjunto_liberar(c);
+    uint64_t capacidade = 16;
+    while (capacidade < 2 * n_previsto) capacidade *= 2;
+    c->chaves = malloc(capacidade * sizeof(int64_t));
+    if (!c->chaves) return 0;
+    for (uint64_t i = 0; i < capacidade; i++) c->chaves[i] = CONJUNTO_VAZIO;
+    c->capacidade = capacidade;
+    return 1;
+}
 
-    int64_t chave = id;
-    long offset = pesquisa_binaria(arq_bin, sizeof(Produto), comparar_produto_chave, &chave, offsetof(Produto, ativo));
+int conjunto_contem(const ConjuntoIds *c, int64_t chave) {
+    if (c->capacidade == 0) return 0;
+    for (uint64_t i = conjunto_posicao(c, chave); ; i = (i + 1) & (c->capacidade - 1)) {
+        if (c->chaves[i] == chave) return 1;
+        if (c->chaves[i] == CONJUNTO_VAZIO) return 0;
+    }
+}
 
-    if (offset == -1) { printf("Produto %lld nao encontrado.\n", id); }
-    else if (offset == -2) { printf("Produto %lld existe mas foi removido.\n", id); }
-    else {
-        // Encontrou e esta ativo, le o registro completo
-        FILE *fbin = fopen(arq_bin, "rb");
-        if (!fbin) { printf("ERRO ao abrir arquivo para leitura.\n"); return; }
-        fseek(fbin, offset, SEEK_SET);
-        Produto p;
-        fread(&p, sizeof(Produto), 1, fbin);
+int conjunto_inserir(ConjuntoIds *c, int64_t chave);
 
-        // Logica de "trim" para imprimir
-        char brand_trim[TAM_BRAND+1]={0};
-        char category_trim[TAM_CATEGORY+1]={0};
-        strncpy(brand_trim, p.brand, TAM_BRAND);
-        strncpy(category_trim, p.category_alias, TAM_CATEGORY);
-        for(int i = strlen(brand_trim)-1; i >=0 && brand_trim[i] == ' '; i--) brand_trim[i] = '\0';
-        for(int i = strlen(category_trim)-1; i >=0 && category_trim[i] == ' '; i--) category_trim[i] = '\0';
+/**
+ * @brief Realoca com o dobro da capacidade quando as posicoes usadas
+ * (chaves + removidas) passam de 50%; as removidas somem no rehash.
+ */
+int conjunto_crescer(ConjuntoIds *c) {
+    ConjuntoIds novo = {0};
+    if (!conjunto_iniciar(&novo, c->n + 1)) return 0;
+    for (uint64_t i = 0; i < c->capacidade; i++) {
+        if (c->chaves[i] != CONJUNTO_VAZIO && c->chaves[i] != CONJUNTO_REMOVIDO) conjunto_inserir(&novo, c->chaves[i]);
+    }
+    free(c->chaves);
+    c->chaves = novo.chaves;
+    c->capacidade = novo.capacidade;
+    c->n = novo.n;
+    c->n_removidos = 0;
+    return 1;
+}
 
-        printf("\n--- PRODUTO ENCONTRADO ---\n");
-        printf("ID: %lld\nBrand: %s\nPrice: %.2f\nCategory: %s\n",
-               p.product_id, brand_trim, p.price, category_trim);
-        fclose(fbin);
+int conjunto_inserir(ConjuntoIds *c, int64_t chave) {
+    if (chave == CONJUNTO_VAZIO || chave == CONJUNTO_REMOVIDO) return 0; // Reservados
+    if (2 * (c->n + c->n_removidos + 1) > c->capacidade && !conjunto_crescer(c)) return 0;
+    uint64_t livre = UINT64_MAX;
+    for (uint64_t i = conjunto_posicao(c, chave); ; i = (i + 1) & (c->capacidade - 1)) {
+        if (c->chaves[i] == chave) return 1;
+        if (c->chaves[i] == CONJUNTO_REMOVIDO && livre == UINT64_MAX) livre = i;
+        if (c->chaves[i] == CONJUNTO_VAZIO) {
+            if (livre == UINT64_MAX) livre = i;
+            else c->n_removidos--; // Reaproveita uma posicao removida
+            c->chaves[livre] = chave;
+            c->n++;
+            return 1;
+        }
     }
 }
 
-// --- FUNCOES ESPECIFICAS COMPRAS ---
+void conjunto_remover(ConjuntoIds *c, int64_t chave) {
+    if (c->capacidade == 0) return;
+    for (uint64_t i = conjunto_posicao(c, chave); ; i = (i + 1) & (c->capacidade - 1)) {
+        if (c->chaves[i] == CONJUNTO_VAZIO) return;
+        if (c->chaves[i] == chave) {
+            c->chaves[i] = CONJUNTO_REMOVIDO;
+            c->n--;
+            c->n_removidos++;
+            return;
+        }
+    }
+}
 
 /**
- * @brief Le o CSV, ordena em RAM e grava o arquivo .bin inicial de compras.
- * Mesma logica do pre_processar_produtos.
+ * @brief Geracao e tamanho atuais do produtos.bin (-1 se nao existe).
  */
-void pre_processar_compras(const char *csv_path, const char *bin_path) {
-    printf("Pre-processando COMPRAS de %s...\n", csv_path);
-    FILE *fcsv = fopen(csv_path, "r");
-    if (!fcsv) { printf("ERRO: Nao foi possivel abrir CSV %s\n", csv_path); return; }
+void produtos_ativos_versao(uint64_t *geracao, int64_t *tamanho) {
+    uint64_t g[N_TABELAS];
+    struct stat st;
+    ler_geracoes(g);
+    *geracao = g[TABELA_PRODUTOS];
+    *tamanho = stat(ARQ_PRODUTOS_BIN, &st) == 0 ? (int64_t)st.st_size : -1;
+}
 
-    char linha[2048];
-    if (!fgets(linha, sizeof(linha), fcsv)) { fclose(fcsv); return; } // Ignora cabealho
+/**
+ * @brief (Re)carrega o conjunto com uma varredura sequencial do produtos.bin,
+ * lendo em blocos de registros.
+ */
+void produtos_ativos_carregar(void) {
+    ConjuntoIds *c = &produtos_ativos;
+    uint64_t geracao;
+    int64_t tamanho;
+    produtos_ativos_versao(&geracao, &tamanho);
+    CONTAR(estat_io.fk_recargas, 1);
+    if (!conjunto_iniciar(c, tamanho > 0 ? (uint64_t)tamanho / sizeof(Produto) : 0)) return;
+
+    FILE *f = io_fopen(ARQ_PRODUTOS_BIN, "rb");
+    if (f) {
+        Produto bloco[512];
+        size_t lidos;
+        while ((lidos = io_fread(bloco, sizeof(Produto), 512, f)) > 0) {
+            for (size_t i = 0; i < lidos; i++) {
+                if (bloco[i].ativo == 'S') conjunto_inserir(c, bloco[i].product_id);
+            }
+        }
+        fclose(f);
+    }
+    c->carregado = 1;
+    c->geracao = geracao;
+    c->tamanho = tamanho;
+}
 
-    int capacidade = 100000, n_compras = 0;
-    Compra* compras = malloc(capacidade * sizeof(Compra));
-    if (!compras) { printf("ERRO: Falha ao alocar memoria.\n"); fclose(fcsv); return; }
+/**
+ * @brief Chave estrangeira: o produto existe e esta ativo? Consulta so a
+ * memoria (e a geracao em geracoes.bin, para perceber escritas de outros
+ * processos); o produtos.bin so e lido se o conjunto estiver desatualizado.
+ */
+int produto_ativo(int64_t product_id) {
+    uint64_t geracao;
+    int64_t tamanho;
+    produtos_ativos_versao(&geracao, &tamanho);
+    ConjuntoIds *c = &produtos_ativos;
+    if (!c->carregado || c->geracao != geracao || c->tamanho != tamanho) produtos_ativos_carregar();
+    CONTAR(estat_io.fk_consultas, 1);
+    return conjunto_contem(c, product_id);
+}
+
+/**
+ * @brief Chamada pelo escritor depois de publicar uma nova geracao do
+ * produtos.bin: se o conjunto refletia a geracao anterior, aplica as mesmas
+ * mudancas; senao o descarta (sera recarregado na proxima consulta).
+ */
+void produtos_ativos_apos_escrita(uint64_t geracao_anterior, int64_t tamanho_anterior,
+                                  const int64_t *inseridas, int n_inseridas,
+                                  const int64_t *removidas, int n_removidas) {
+    ConjuntoIds *c = &produtos_ativos;
+    if (!c->carregado) return;
+    if (c->geracao != geracao_anterior || c->tamanho != tamanho_anterior) {
+        conjunto_liberar(c);
+        return;
+    }
+    for (int i = 0; i < n_removidas; i++) conjunto_remover(c, removidas[i]);
+    for (int i = 0; i < n_inseridas; i++) conjunto_inserir(c, inseridas[i]);
+    produtos_ativos_versao(&c->geracao, &c->tamanho);
+}
+
+// --- SAIDA BUFFERIZADA E FORMATACAO RAPIDA ---
+//
+// Listagens grandes (mostrar_*) nao usam um printf por linha: cada linha e
+// montada num buffer grande com formatadores proprios de inteiros e precos
+// e o buffer vai para o descritor com um unico write() quando enche. Os
+// campos de texto com padding (pad_string) sao aparados de tras para
+// frente a partir do tamanho fixo do campo, sem strlen.
+
+#define SAIDA_BUFFER_PADRAO (1 << 20) // 1 MB
+
+typedef struct {
+    char *dados;
+    size_t usado;
+    size_t capacidade;
+    int fd;
+    unsigned long long bytes_escritos; // Total entregue ao descritor
+    int erro;                          // write() falhou (ex: pipe fechado)
+} BufferSaida;
+
+int saida_iniciar(BufferSaida *b, int fd, size_t capacidade) {
+    memset(b, 0, sizeof(*b));
+    b->dados = malloc(capacidade);
+    if (!b->dados) return 0;
+    b->capacidade = capacidade;
+    b->fd = fd;
+    return 1;
+}
+
+void saida_descarregar(BufferSaida *b) {
+    size_t enviado = 0;
+    while (enviado < b->usado && !b->erro) {
+        ssize_t r = write(b->fd, b->dados + enviado, b->usado - enviado);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) { b->erro = 1; break; }
+        enviado += (size_t)r;
+    }
+    b->bytes_escritos += enviado;
+    b->usado = 0;
+}
+
+void saida_finalizar(BufferSaida *b) {
+    saida_descarregar(b);
+    free(b->dados);
+    b->dados = NULL;
+}
+
+// Garante espaco para mais 'n' bytes (n <= capacidade)
+static inline void saida_garantir(BufferSaida *b, size_t n) {
+    if (b->usado + n > b->capacidade) saida_descarregar(b);
+}
+
+static inline void saida_bytes(BufferSaida *b, const char *s, size_t n) {
+    saida_garantir(b, n);
+    memcpy(b->dados + b->usado, s, n);
+    b->usado += n;
+}
+
+#define saida_literal(b, s) saida_bytes((b), (s), sizeof(s) - 1)
+
+static inline void saida_char(BufferSaida *b, char c) {
+    saida_garantir(b, 1);
+    b->dados[b->usado++] = c;
+}
+
+/**
+ * @brief Inteiro em decimal, sem printf: os digitos sao gerados de tras
+ * para frente num vetor local.
+ */
+static inline void saida_int64(BufferSaida *b, int64_t v) {
+    char tmp[24];
+    int i = (int)sizeof(tmp);
+    uint64_t u = v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v;
+    do { tmp[--i] = (char)('0' + u % 10); u /= 10; } while (u);
+    if (v < 0) tmp[--i] = '-';
+    saida_bytes(b, tmp + i, sizeof(tmp) - (size_t)i);
+}
+
+/**
+ * @brief Valor com 2 casas decimais, arredondado como "%.2f" (exceto em
+ * empates exatos, que aqui sobem). Fora da faixa de int64 em centavos cai
+ * no snprintf.
+ */
+static inline void saida_preco(BufferSaida *b, double v) {
+    if (!(v > -9.0e16 && v < 9.0e16)) {
+        char tmp[64];
+        int n = snprintf(tmp, sizeof(tmp), "%.2f", v);
+        saida_bytes(b, tmp, (size_t)n);
+        return;
+    }
+    int negativo = v < 0;
+    long long centavos = (long long)((negativo ? -v : v) * 100.0 + 0.5);
+    if (negativo && centavos != 0) saida_char(b, '-');
+    saida_int64(b, centavos / 100);
+    char frac[3] = {'.', (char)('0' + centavos % 100 / 10), (char)('0' + centavos % 10)};
+    saida_bytes(b, frac, 3);
+}
+
+/**
+ * @brief Tamanho do campo de texto de tamanho fixo sem o padding final
+ * (espacos e '\0'), procurando de tras para frente. O padding de
+ * pad_string e pulado 8 bytes por vez.
+ */
+static inline size_t tamanho_aparado(const char *campo, size_t tam) {
+    if (tam > 0 && campo[tam - 1] == '\0') tam--; // Terminador do pad_string
+    while (tam >= 8) {
+        uint64_t palavra;
+        memcpy(&palavra, campo + tam - 8, 8);
+        if (palavra != 0x2020202020202020ull) break;
+        tam -= 8;
+    }
+    while (tam > 0 && (campo[tam - 1] == ' ' || campo[tam - 1] == '\0')) tam--;
+    return tam;
+}
+
+static inline void saida_campo(BufferSaida *b, const char *campo, size_t tam) {
+    saida_bytes(b, campo, tamanho_aparado(campo, tam));
+}
+
+// --- LEITURA SEQUENCIAL (BUFFER GRANDE, READAHEAD E PRE-BUSCA) ---
+//
+// As varreduras dizem ao kernel como vao ler: io_abrir_sequencial abre com
+// um buffer de stdio de 1 MB (em vez dos 4 KB padrao) e marca o arquivo com
+// POSIX_FADV_SEQUENTIAL, que aumenta o readahead. Para quem consome blocos
+// em sequencia ha ainda a pre-busca em segundo plano (PreBusca): uma thread
+// le o proximo bloco com pread enquanto o anterior e processado (buffer
+// duplo), de modo que o processamento e a espera pelo disco se sobrepoem.
+// Ligada com AED2_PREBUSCA=1: so compensa quando o disco e lento; com os
+// dados no page cache o custo da copia e da troca de buffers domina.
+
+#define REGISTROS_POR_LEITURA 512            // Registros lidos por fread nas listagens
+#define BUFFER_LEITURA_SEQUENCIAL (1 << 20)  // Buffer de stdio das varreduras
+#define PREBUSCA_BLOCO (1 << 20)             // Bytes lidos por vez pela thread de pre-busca
+
+int prebusca_ativa = 0;
+
+/** @brief io_fopen para leitura sequencial: buffer grande + readahead maior. */
+FILE *io_abrir_sequencial(const char *caminho) {
+    FILE *f = io_fopen(caminho, "rb");
+    if (!f) return NULL;
+    setvbuf(f, NULL, _IOFBF, BUFFER_LEITURA_SEQUENCIAL);
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+    return f;
+}
+
+typedef struct {
+    int fd;
+    long proximo;        // Offset da proxima leitura da thread
+    long fim;
+    size_t tam_bloco;
+    char *buffers[2];
+    long cheio[2];       // Bytes prontos em cada buffer; -1 = livre para a thread
+    int entregue;        // Buffer em uso pelo consumidor (-1 = nenhum ainda)
+    int terminou;        // O consumidor ja recebeu o fim
+    int encerrar;
+    pthread_t thread;
+    pthread_mutex_t trava;
+    pthread_cond_t mudou;
+} PreBusca;
+
+static void *prebusca_thread(void *arg) {
+    PreBusca *p = arg;
+    for (int i = 0;; i ^= 1) {
+        pthread_mutex_lock(&p->trava);
+        while (p->cheio[i] >= 0 && !p->encerrar) pthread_cond_wait(&p->mudou, &p->trava);
+        int sair = p->encerrar;
+        pthread_mutex_unlock(&p->trava);
+        if (sair) break;
+
+        long quer = p->fim - p->proximo < (long)p->tam_bloco ? p->fim - p->proximo : (long)p->tam_bloco;
+        ssize_t n = quer > 0 ? pread(p->fd, p->buffers[i], (size_t)quer, p->proximo) : 0;
+        if (n < 0) n = 0;
+        p->proximo += n;
+        CONTAR(estat_io.bytes_lidos, (unsigned long long)n);
+
+        pthread_mutex_lock(&p->trava);
+        p->cheio[i] = n;
+        pthread_cond_broadcast(&p->mudou);
+        pthread_mutex_unlock(&p->trava);
+        if (n == 0) break; // Fim (ou erro): o consumidor recebe 0
+    }
+    return NULL;
+}
+
+/**
+ * @brief Comeca a pre-buscar 'fd' a partir de 'inicio', em blocos de
+ * 'tam_bloco' bytes (multiplo do tamanho do registro). O descritor continua
+ * sendo de quem chamou.
+ * @return 1 se a thread foi criada.
+ */
+int prebusca_abrir(PreBusca *p, int fd, long inicio, size_t tam_bloco) {
+    memset(p, 0, sizeof(*p));
+    struct stat st;
+    if (fstat(fd, &st) != 0) return 0;
+    p->fd = fd;
+    p->proximo = inicio;
+    p->fim = (long)st.st_size;
+    p->tam_bloco = tam_bloco;
+    p->cheio[0] = p->cheio[1] = -1;
+    p->entregue = -1;
+    p->buffers[0] = malloc(tam_bloco);
+    p->buffers[1] = malloc(tam_bloco);
+    pthread_mutex_init(&p->trava, NULL);
+    pthread_cond_init(&p->mudou, NULL);
+    if (!p->buffers[0] || !p->buffers[1] || pthread_create(&p->thread, NULL, prebusca_thread, p) != 0) {
+        free(p->buffers[0]);
+        free(p->buffers[1]);
+        pthread_mutex_destroy(&p->trava);
+        pthread_cond_destroy(&p->mudou);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Devolve o proximo bloco lido (valido ate a proxima chamada) e libera
+ * o anterior para a thread.
+ * @return Bytes no bloco; 0 no fim do arquivo.
+ */
+long prebusca_proximo(PreBusca *p, const char **dados) {
+    if (p->terminou) return 0;
+    pthread_mutex_lock(&p->trava);
+    if (p->entregue >= 0) {
+        p->cheio[p->entregue] = -1;
+        pthread_cond_broadcast(&p->mudou);
+    }
+    int i = p->entregue >= 0 ? p->entregue ^ 1 : 0;
+    while (p->cheio[i] < 0) pthread_cond_wait(&p->mudou, &p->trava);
+    p->entregue = i;
+    long n = p->cheio[i];
+    pthread_mutex_unlock(&p->trava);
+    if (n == 0) p->terminou = 1;
+    *dados = p->buffers[i];
+    return n;
+}
+
+void prebusca_fechar(PreBusca *p) {
+    pthread_mutex_lock(&p->trava);
+    p->encerrar = 1;
+    pthread_cond_broadcast(&p->mudou);
+    pthread_mutex_unlock(&p->trava);
+    pthread_join(p->thread, NULL);
+    free(p->buffers[0]);
+    free(p->buffers[1]);
+    pthread_mutex_destroy(&p->trava);
+    pthread_cond_destroy(&p->mudou);
+}
+
+// --- LAYOUT COMPRIMIDO POR BLOCOS (CODEC LZ PROPRIO) ---
+//
+// Opcionalmente cada .bin ganha uma copia comprimida "<arquivo>.z" para
+// leitura: os registros sao cortados em blocos de BLOCO_INDICE registros
+// (ativos ou nao, na mesma ordem do .bin) e cada bloco e comprimido sozinho
+// com um LZ77 simples no estilo do LZ4 (sem dependencias). O padding de
+// espacos dos campos de texto vira poucas "copias" longas.
+// No final do arquivo fica o diretorio de blocos, que faz o papel do
+// indice parcial no layout comprimido: para cada bloco, a primeira chave e
+// o offset/tamanho do bloco COMPRIMIDO. Uma busca com indice le so o
+// diretorio (pesquisa binaria) e descomprime um bloco; as varreduras
+// (LeitorRegistros) leem os blocos em sequencia descomprimindo um por vez.
+// O .bin continua sendo o arquivo de escrita (WAL, geracoes). Assim como o
+// filtro de Bloom, a copia guarda a geracao e o tamanho do .bin de origem
+// e e ignorada quando eles nao batem: depois de uma escrita as leituras
+// voltam ao .bin ate a copia ser refeita (criar_indice com AED2_COMPRIMIR=1
+// ou o comando "comprimir").
+
+#define COMPRIMIDO_MAGICO 0x504D4F43u // "COMP"
+#define LZ_MIN_COPIA 4
+#define LZ_BITS_HASH 12
+
+int layout_comprimido = 0; // AED2_COMPRIMIR=1: criar_indice tambem gera o .z
+
+typedef struct {
+    uint32_t magico;
+    uint32_t tam_registro;
+    uint32_t registros_por_bloco;
+    uint32_t n_blocos;
+    uint64_t geracao;          // Geracao do .bin de origem
+    int64_t tamanho_dados;     // Tamanho do .bin de origem
+    int64_t offset_diretorio;  // Inicio do vetor de BlocoComprimido
+} CabecalhoComprimido;
+
+typedef struct {
+    int64_t primeira_chave;
+    int64_t offset;      // Posicao do bloco comprimido no .z
+    uint32_t tamanho;    // Bytes no .z (== bruto: bloco guardado sem compressao)
+    uint32_t bruto;      // Bytes descomprimidos (n_registros * tam_registro)
+} BlocoComprimido;
+
+static inline uint32_t lz_ler32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * @brief Grava um comprimento no formato do LZ4: o que nao cabe nos 4 bits
+ * do token segue em bytes de 255 terminados por um byte < 255.
+ */
+static inline unsigned char *lz_gravar_extensao(unsigned char *op, size_t valor) {
+    for (; valor >= 255; valor -= 255) *op++ = 255;
+    *op++ = (unsigned char)valor;
+    return op;
+}
+
+/**
+ * @brief Comprime 'n' bytes. Cada sequencia e: token (4 bits de literais,
+ * 4 bits de copia - LZ_MIN_COPIA), extensoes, literais, distancia da copia
+ * (2 bytes) e extensao da copia. A ultima sequencia so tem literais.
+ * @return Tamanho comprimido, ou 0 se nao couber em 'cap' (guardar cru).
+ */
+size_t lz_comprimir(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    uint32_t tabela[1 << LZ_BITS_HASH]; // Ultima posicao + 1 de cada hash de 4 bytes
+    memset(tabela, 0, sizeof(tabela));
+    unsigned char *op = dst, *fim_saida = dst + cap;
+    size_t ancora = 0, i = 0;
+    while (i + LZ_MIN_COPIA <= n) {
+        uint32_t h = (lz_ler32(src + i) * 2654435761u) >> (32 - LZ_BITS_HASH);
+        size_t candidato = tabela[h];
+        tabela[h] = (uint32_t)(i + 1);
+        if (candidato == 0 || i - (candidato - 1) > 65535 || lz_ler32(src + candidato - 1) != lz_ler32(src + i)) {
+            i++;
+            continue;
+        }
+        candidato--;
+        size_t copia = LZ_MIN_COPIA;
+        while (i + copia < n && src[candidato + copia] == src[i + copia]) copia++;
+
+        size_t literais = i - ancora;
+        if ((size_t)(fim_saida - op) < 1 + literais / 255 + 1 + literais + 2 + (copia - LZ_MIN_COPIA) / 255 + 1) return 0;
+        unsigned char *token = op++;
+        *token = (unsigned char)((literais < 15 ? literais : 15) << 4);
+        if (literais >= 15) op = lz_gravar_extensao(op, literais - 15);
+        memcpy(op, src + ancora, literais);
+        op += literais;
+        uint16_t distancia = (uint16_t)(i - candidato);
+        memcpy(op, &distancia, 2);
+        op += 2;
+        size_t resto = copia - LZ_MIN_COPIA;
+        *token |= (unsigned char)(resto < 15 ? resto : 15);
+        if (resto >= 15) op = lz_gravar_extensao(op, resto - 15);
+        i += copia;
+        ancora = i;
+    }
+    size_t literais = n - ancora;
+    if ((size_t)(fim_saida - op) < 1 + literais / 255 + 1 + literais) return 0;
+    *op++ = (unsigned char)((literais < 15 ? literais : 15) << 4);
+    if (literais >= 15) op = lz_gravar_extensao(op, literais - 15);
+    memcpy(op, src + ancora, literais);
+    op += literais;
+    return (size_t)(op - dst);
+}
+
+/**
+ * @brief Descomprime um bloco de lz_comprimir, validando todos os limites
+ * (um bloco corrompido nunca escreve fora de 'dst').
+ * @return Bytes descomprimidos, ou -1 se o bloco for invalido.
+ */
+long lz_descomprimir(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *fim_entrada = src + n;
+    unsigned char *op = dst, *fim_saida = dst + cap;
+    while (ip < fim_entrada) {
+        unsigned token = *ip++;
+        size_t literais = token >> 4;
+        if (literais == 15) {
+            unsigned char b;
+            do {
+                if (ip >= fim_entrada) return -1;
+                b = *ip++;
+                literais += b;
+            } while (b == 255);
+        }
+        if ((size_t)(fim_entrada - ip) < literais || (size_t)(fim_saida - op) < literais) return -1;
+        memcpy(op, ip, literais);
+        ip += literais;
+        op += literais;
+        if (ip == fim_entrada) break; // Ultima sequencia: so literais
+
+        if (fim_entrada - ip < 2) return -1;
+        uint16_t distancia;
+        memcpy(&distancia, ip, 2);
+        ip += 2;
+        size_t copia = (token & 15);
+        if (copia == 15) {
+            unsigned char b;
+            do {
+                if (ip >= fim_entrada) return -1;
+                b = *ip++;
+                copia += b;
+            } while (b == 255);
+        }
+        copia += LZ_MIN_COPIA;
+        if (distancia == 0 || distancia > op - dst || (size_t)(fim_saida - op) < copia) return -1;
+        // Copia sobreposta (ex: sequencia de espacos, distancia 1): o trecho
+        // ja copiado e multiplo do periodo, entao cada memcpy pode dobrar
+        const unsigned char *origem = op - distancia;
+        while (copia > 0) {
+            size_t k = (size_t)(op - origem) < copia ? (size_t)(op - origem) : copia;
+            memcpy(op, origem, k);
+            op += k;
+            copia -= k;
+        }
+    }
+    return (long)(op - dst);
+}
+
+void caminho_comprimido(const char *arq_dados, char *saida, size_t tam) {
+    snprintf(saida, tam, "%s.z", arq_dados);
+}
+
+typedef struct {
+    long registros;
+    long blocos;
+    int64_t bytes_origem;
+    int64_t bytes_comprimidos;
+} ResultadoCompressao;
+
+/**
+ * @brief Gera "<arq_dados>.z" a partir do .bin (temporario + rename).
+ * @return 1 se publicou.
+ */
+int comprimir_tabela(TabelaDados tabela, const char *arq_dados, size_t tam_registro,
+                     size_t offset_chave, ResultadoCompressao *r) {
+    char caminho[1024], caminho_tmp[1024];
+    uint64_t geracao[N_TABELAS];
+    memset(r, 0, sizeof(*r));
+    ler_geracoes(geracao); // Antes de abrir: a copia vale para esta geracao
+    caminho_comprimido(arq_dados, caminho, sizeof(caminho));
+    caminho_temporario(caminho, caminho_tmp, sizeof(caminho_tmp));
+
+    FILE *fbin = io_fopen(arq_dados, "rb");
+    if (!fbin) return 0;
+    io_fseek(fbin, 0, SEEK_END);
+    int64_t tamanho = ftell(fbin);
+    io_fseek(fbin, 0, SEEK_SET);
+    uint32_t n_blocos = (uint32_t)((tamanho / (int64_t)tam_registro + BLOCO_INDICE - 1) / BLOCO_INDICE);
+
+    size_t bruto_max = tam_registro * BLOCO_INDICE;
+    unsigned char *bloco = malloc(bruto_max);
+    unsigned char *comprimido = malloc(bruto_max);
+    BlocoComprimido *diretorio = malloc(((size_t)n_blocos + 1) * sizeof(BlocoComprimido));
+    FILE *fz = io_fopen(caminho_tmp, "wb");
+    int ok = bloco && comprimido && diretorio && fz;
+
+    CabecalhoComprimido cab = {COMPRIMIDO_MAGICO, (uint32_t)tam_registro, BLOCO_INDICE, n_blocos,
+                               geracao[tabela], tamanho, 0};
+    if (ok) ok = io_fwrite(&cab, sizeof(cab), 1, fz) == 1;
+    int64_t offset = (int64_t)sizeof(cab);
+    size_t lidos;
+    uint32_t b = 0;
+    while (ok && b < n_blocos && (lidos = io_fread(bloco, tam_registro, BLOCO_INDICE, fbin)) > 0) {
+        size_t bruto = lidos * tam_registro;
+        size_t tam = lz_comprimir(bloco, bruto, comprimido, bruto - 1);
+        const unsigned char *gravar = tam > 0 ? comprimido : bloco;
+        if (tam == 0) tam = bruto; // Nao compensou: bloco cru
+        memcpy(&diretorio[b].primeira_chave, bloco + offset_chave, sizeof(int64_t));
+        diretorio[b].offset = offset;
+        diretorio[b].tamanho = (uint32_t)tam;
+        diretorio[b].bruto = (uint32_t)bruto;
+        ok = io_fwrite(gravar, 1, tam, fz) == tam;
+        offset += (int64_t)tam;
+        r->registros += (long)lidos;
+        b++;
+    }
+    if (ok && b != n_blocos) ok = 0; // .bin mudou de tamanho durante a leitura
+    if (ok) {
+        cab.offset_diretorio = offset;
+        ok = io_fwrite(diretorio, sizeof(BlocoComprimido), n_blocos, fz) == n_blocos &&
+             io_fseek(fz, 0, SEEK_SET) == 0 && io_fwrite(&cab, sizeof(cab), 1, fz) == 1;
+    }
+    fclose(fbin);
+    free(bloco);
+    free(comprimido);
+    free(diretorio);
+    if (fz && !ok) { fclose(fz); remove(caminho_tmp); }
+    if (!ok || !publicar_temporario(fz, caminho_tmp, caminho)) return 0;
+    r->blocos = (long)n_blocos;
+    r->bytes_origem = tamanho;
+    r->bytes_comprimidos = offset + (int64_t)n_blocos * (int64_t)sizeof(BlocoComprimido);
+    return 1;
+}
+
+/**
+ * @brief Abre a copia comprimida se ela vale para a geracao/tamanho atuais
+ * do .bin e tem o tamanho de registro esperado.
+ * @return Arquivo posicionado depois do cabecalho, ou NULL.
+ */
+FILE *abrir_comprimido(TabelaDados tabela, const char *arq_dados, size_t tam_registro, CabecalhoComprimido *cab) {
+    char caminho[1024];
+    uint64_t geracao[N_TABELAS];
+    struct stat st;
+    caminho_comprimido(arq_dados, caminho, sizeof(caminho));
+    FILE *fz = io_fopen(caminho, "rb");
+    if (!fz) return NULL;
+    ler_geracoes(geracao);
+    if (io_fread(cab, sizeof(*cab), 1, fz) != 1 || cab->magico != COMPRIMIDO_MAGICO ||
+        cab->tam_registro != tam_registro || cab->registros_por_bloco == 0 ||
+        cab->geracao != geracao[tabela] || stat(arq_dados, &st) != 0 || cab->tamanho_dados != (int64_t)st.st_size) {
+        fclose(fz);
+        return NULL;
+    }
+    return fz;
+}
+
+/**
+ * @brief Le e descomprime o bloco 'b' do diretorio.
+ * @return Registros no bloco, ou -1 em caso de erro.
+ */
+static long ler_bloco_comprimido(FILE *fz, const CabecalhoComprimido *cab, const BlocoComprimido *d,
+                                 unsigned char *entrada, void *registros, uint64_t *bytes_lidos) {
+    size_t cap = (size_t)cab->tam_registro * cab->registros_por_bloco;
+    if (d->bruto > cap || d->tamanho > cap || d->bruto % cab->tam_registro != 0) return -1;
+    if (io_fseek(fz, (long)d->offset, SEEK_SET) != 0) return -1;
+    if (d->tamanho == d->bruto) {
+        if (io_fread(registros, 1, d->bruto, fz) != d->bruto) return -1;
+    } else {
+        if (io_fread(entrada, 1, d->tamanho, fz) != d->tamanho) return -1;
+        if (lz_descomprimir(entrada, d->tamanho, registros, cap) != (long)d->bruto) return -1;
+    }
+    if (bytes_lidos) *bytes_lidos += d->tamanho;
+    return (long)(d->bruto / cab->tam_registro);
+}
+
+/**
+ * @brief Busca com o layout comprimido: pesquisa binaria no diretorio de
+ * blocos (direto no arquivo) e descompressao do bloco que pode conter a
+ * chave em 'registros' (espaco para BLOCO_INDICE registros).
+ * @param primeiro Recebe o numero do primeiro registro do bloco no .bin.
+ * @return Registros no bloco; 0 se a chave e menor que todas; -1 se nao ha
+ * copia comprimida valida (usar o .bin).
+ */
+long buscar_bloco_comprimido(TabelaDados tabela, const char *arq_dados, size_t tam_registro,
+                             int64_t chave, void *registros, long *primeiro) {
+    CabecalhoComprimido cab;
+    FILE *fz = abrir_comprimido(tabela, arq_dados, tam_registro, &cab);
+    if (!fz) return -1;
+    if (cab.registros_por_bloco != BLOCO_INDICE) { fclose(fz); return -1; }
+    long inicio = 0, fim = (long)cab.n_blocos - 1, achado = -1;
+    BlocoComprimido d, escolhido;
+    while (inicio <= fim) {
+        long meio = inicio + (fim - inicio) / 2;
+        if (io_fseek(fz, (long)(cab.offset_diretorio + meio * (int64_t)sizeof(d)), SEEK_SET) != 0 ||
+            io_fread(&d, sizeof(d), 1, fz) != 1) { fclose(fz); return -1; }
+        if (d.primeira_chave <= chave) { achado = meio; escolhido = d; inicio = meio + 1; }
+        else fim = meio - 1;
+    }
+    long n = 0;
+    if (achado >= 0) {
+        unsigned char *entrada = malloc(tam_registro * BLOCO_INDICE);
+        n = entrada ? ler_bloco_comprimido(fz, &cab, &escolhido, entrada, registros, NULL) : -1;
+        free(entrada);
+        *primeiro = achado * BLOCO_INDICE;
+    }
+    fclose(fz);
+    return n;
+}
+
+/**
+ * @brief Offset do primeiro registro (ativo ou nao) com chave >= 'chave',
+ * por pesquisa binaria no arquivo ordenado; o tamanho do arquivo se nao
+ * houver nenhum.
+ */
+long offset_primeira_chave(FILE *f, size_t tam_registro, size_t offset_chave, int64_t chave) {
+    io_fseek(f, 0, SEEK_END);
+    long inicio = 0, fim = ftell(f) / (long)tam_registro; // Intervalo [inicio, fim)
+    while (inicio < fim) {
+        long meio = inicio + (fim - inicio) / 2;
+        int64_t chave_meio;
+        if (io_fseek(f, meio * (long)tam_registro + (long)offset_chave, SEEK_SET) != 0 ||
+            io_fread(&chave_meio, sizeof(chave_meio), 1, f) != 1) break;
+        if (chave_meio < chave) inicio = meio + 1;
+        else fim = meio;
+    }
+    return inicio * (long)tam_registro;
+}
+
+// Varredura sequencial de uma tabela: usa a copia comprimida quando ela e
+// valida e o .bin caso contrario; quem le ve sempre registros inteiros.
+typedef struct {
+    FILE *f;
+    size_t tam_registro;
+    size_t offset_chave;
+    int comprimido;
+    CabecalhoComprimido cab;
+    BlocoComprimido *diretorio;
+    uint32_t proximo_bloco;
+    unsigned char *entrada;   // Bloco comprimido lido
+    unsigned char *bloco;     // Bloco descomprimido
+    size_t n_bloco, pos_bloco;
+    int64_t pular_ate;        // Descarta registros com chave menor (inicio de faixa)
+    uint64_t bytes_lidos;     // Bytes efetivamente lidos do disco
+    int64_t prebuscado_ate;   // Comprimido: fim da janela ja pedida ao kernel (WILLNEED)
+    int usa_prebusca;         // .bin: blocos lidos pela thread de pre-busca
+    PreBusca pre;
+    const char *pre_dados;
+    long pre_n, pre_pos;      // Bytes no bloco pre-buscado atual e quanto ja foi consumido
+} LeitorRegistros;
+
+/**
+ * @brief Abre a varredura de 'arq_dados' a partir do primeiro registro com
+ * chave >= 'chave_inicial' (INT64_MIN = desde o inicio).
+ * @return 1 se abriu.
+ */
+int leitor_abrir(LeitorRegistros *l, TabelaDados tabela, const char *arq_dados, size_t tam_registro,
+                 size_t offset_chave, int64_t chave_inicial) {
+    memset(l, 0, sizeof(*l));
+    l->tam_registro = tam_registro;
+    l->offset_chave = offset_chave;
+    l->pular_ate = chave_inicial;
+    l->f = abrir_comprimido(tabela, arq_dados, tam_registro, &l->cab);
+    if (l->f) {
+        size_t tam_bloco = tam_registro * l->cab.registros_por_bloco;
+        l->diretorio = malloc(((size_t)l->cab.n_blocos + 1) * sizeof(BlocoComprimido));
+        l->entrada = malloc(tam_bloco);
+        l->bloco = malloc(tam_bloco);
+        if (l->diretorio && l->entrada && l->bloco &&
+            io_fseek(l->f, (long)l->cab.offset_diretorio, SEEK_SET) == 0 &&
+            io_fread(l->diretorio, sizeof(BlocoComprimido), l->cab.n_blocos, l->f) == l->cab.n_blocos) {
+            l->comprimido = 1;
+            // Pula direto para o bloco da chave inicial pelo diretorio
+            while (chave_inicial != INT64_MIN && l->proximo_bloco + 1 < l->cab.n_blocos &&
+                   l->diretorio[l->proximo_bloco + 1].primeira_chave <= chave_inicial) l->proximo_bloco++;
+            posix_fadvise(fileno(l->f), 0, 0, POSIX_FADV_SEQUENTIAL);
+            l->prebuscado_ate = l->cab.n_blocos > 0 ? l->diretorio[l->proximo_bloco].offset : 0;
+            return 1;
+        }
+        free(l->diretorio);
+        free(l->entrada);
+        free(l->bloco);
+        fclose(l->f);
+        memset(l, 0, sizeof(*l));
+        l->tam_registro = tam_registro;
+    }
+    l->f = io_abrir_sequencial(arq_dados);
+    if (!l->f) return 0;
+    long inicio = chave_inicial == INT64_MIN ? 0 : offset_primeira_chave(l->f, tam_registro, offset_chave, chave_inicial);
+    io_fseek(l->f, inicio, SEEK_SET);
+    if (prebusca_ativa) // Blocos com um numero inteiro de registros
+        l->usa_prebusca = prebusca_abrir(&l->pre, fileno(l->f), inicio,
+                                         (PREBUSCA_BLOCO / tam_registro) * tam_registro);
+    return 1;
+}
+
+/**
+ * @brief Le ate 'max' registros em 'destino'.
+ * @return Registros lidos; 0 no fim (ou erro).
+ */
+size_t leitor_ler(LeitorRegistros *l, void *destino, size_t max) {
+    if (!l->comprimido && !l->usa_prebusca) {
+        size_t lidos = io_fread(destino, l->tam_registro, max, l->f);
+        l->bytes_lidos += lidos * l->tam_registro;
+        return lidos;
+    }
+    size_t n = 0;
+    if (!l->comprimido) {
+        // Copia do bloco ja lido pela thread de pre-busca
+        while (n < max) {
+            if (l->pre_pos == l->pre_n) {
+                l->pre_n = prebusca_proximo(&l->pre, &l->pre_dados);
+                l->pre_pos = 0;
+                if (l->pre_n <= 0) break;
+            }
+            size_t k = (size_t)(l->pre_n - l->pre_pos) / l->tam_registro;
+            if (k > max - n) k = max - n;
+            if (k == 0) break; // Sobra de registro incompleto no fim
+            memcpy((char*)destino + n * l->tam_registro, l->pre_dados + l->pre_pos, k * l->tam_registro);
+            l->pre_pos += (long)(k * l->tam_registro);
+            n += k;
+        }
+        l->bytes_lidos += n * l->tam_registro;
+        CONTAR(estat_io.registros_lidos, n);
+        return n;
+    }
+    while (n < max) {
+        if (l->pos_bloco == l->n_bloco) {
+            if (l->proximo_bloco >= l->cab.n_blocos) break;
+            // Mantem uma janela a frente pedida ao kernel (leitura assincrona)
+            const BlocoComprimido *d = &l->diretorio[l->proximo_bloco];
+            if (d->offset + PREBUSCA_BLOCO >= l->prebuscado_ate) {
+                posix_fadvise(fileno(l->f), (off_t)l->prebuscado_ate, 2 * PREBUSCA_BLOCO, POSIX_FADV_WILLNEED);
+                l->prebuscado_ate += 2 * PREBUSCA_BLOCO;
+            }
+            long lidos = ler_bloco_comprimido(l->f, &l->cab, &l->diretorio[l->proximo_bloco++],
+                                              l->entrada, l->bloco, &l->bytes_lidos);
+            if (lidos < 0) { l->proximo_bloco = l->cab.n_blocos; break; }
+            l->n_bloco = (size_t)lidos;
+            l->pos_bloco = 0;
+            while (l->pular_ate != INT64_MIN && l->pos_bloco < l->n_bloco) {
+                int64_t chave;
+                memcpy(&chave, l->bloco + l->pos_bloco * l->tam_registro + l->offset_chave, sizeof(chave));
+                if (chave >= l->pular_ate) { l->pular_ate = INT64_MIN; break; }
+                l->pos_bloco++;
+            }
+            continue;
+        }
+        size_t k = l->n_bloco - l->pos_bloco;
+        if (k > max - n) k = max - n;
+        memcpy((char*)destino + n * l->tam_registro, l->bloco + l->pos_bloco * l->tam_registro, k * l->tam_registro);
+        l->pos_bloco += k;
+        n += k;
+    }
+    return n;
+}
+
+void leitor_fechar(LeitorRegistros *l) {
+    if (l->usa_prebusca) prebusca_fechar(&l->pre);
+    l->usa_prebusca = 0;
+    if (l->f) fclose(l->f);
+    free(l->diretorio);
+    free(l->entrada);
+    free(l->bloco);
+    l->f = NULL;
+    l->diretorio = NULL;
+    l->entrada = l->bloco = NULL;
+}
+
+// --- INDICE PARCIAL COMPACTO (FOR + BIT PACKING) ---
+//
+// O .idx guarda, a cada BLOCO_INDICE registros ativos, a chave e a posicao
+// do registro. Em vez de pares (chave, offset) de 16 bytes, as entradas sao
+// reunidas em grupos de ENTRADAS_POR_GRUPO e cada coluna do grupo vira um
+// "frame of reference" linear:
+//     valor[i] = base + i * passo + residuo[i]
+// com passo = menor diferenca entre entradas consecutivas do grupo. Como
+// chaves e posicoes sao crescentes, os residuos sao >= 0 e crescentes e
+// cabem na largura do ultimo deles; sao gravados com largura fixa num vetor
+// de palavras de 64 bits. A posicao e o ORDINAL do registro no .bin
+// (offset = ordinal * tamanho do registro): sem remocoes ela avanca
+// exatamente BLOCO_INDICE por entrada e a coluna ocupa 0 bits.
+// Qualquer entrada e decodificada em O(1), sem somas de prefixo nem desvios
+// que dependam dos dados, entao a pesquisa binaria le so as entradas que
+// sonda. Formato: CabecalhoIndice, n_grupos GrupoIndice e n_palavras uint64_t.
+//
+// O cabecalho tambem registra para qual .bin o indice foi feito: geracao
+// (ARQ_GERACOES), tamanho e uma impressao (hash dos primeiros e ultimos
+// bytes, que pega um .bin trocado por fora das geracoes), alem do checksum
+// do proprio cabecalho. indice_atualizado confere isso lendo so o
+// cabecalho, em O(1), e um indice desatualizado nunca e usado.
+
+#define INDICE_MAGICO 0x32584449u // "IDX2"
+#define ENTRADAS_POR_GRUPO 64
+#define IMPRESSAO_BYTES 64 // Bytes do inicio e do fim do .bin na impressao
+
+typedef struct {
+    uint32_t magico;
+    uint32_t entradas_por_grupo;
+    int64_t n_entradas;
+    int64_t n_grupos;
+    int64_t n_palavras;
+    uint64_t geracao;         // Geracao do .bin quando o indice foi criado
+    int64_t tamanho_dados;    // Tamanho do .bin nessa geracao
+    uint32_t impressao_dados; // Ver impressao_dados
+    uint32_t checksum;        // FNV-1a do cabecalho com este campo zerado
+} CabecalhoIndice;
+
+typedef struct {
+    int64_t chave_base;   // Chave da primeira entrada do grupo
+    int64_t chave_passo;
+    int64_t ordinal_base; // Ordinal (no .bin) da primeira entrada
+    int64_t ordinal_passo;
+    int64_t palavra;      // Primeira palavra do grupo (residuos das chaves, depois dos ordinais)
+    uint8_t bits_chave;
+    uint8_t bits_ordinal;
+    uint8_t reservado[6];
+} GrupoIndice;
+
+typedef struct {
+    CabecalhoIndice cab;
+    GrupoIndice *grupos;
+    uint64_t *palavras; // n_palavras + 1: a ultima e folga para ler sempre 2 palavras
+} IndiceCompacto;
+
+static inline unsigned bits_necessarios(uint64_t v) {
+    return v ? 64u - (unsigned)__builtin_clzll(v) : 0u;
+}
+
+/** @brief Le 'bits' bits a partir do bit 'pos' (palavras little-endian, bits <= 64). */
+static inline uint64_t extrair_bits(const uint64_t *palavras, uint64_t pos, unsigned bits) {
+    const uint64_t *p = palavras + (pos >> 6);
+    unsigned s = (unsigned)(pos & 63);
+    uint64_t v = (p[0] >> s) | ((p[1] << 1) << (63 - s)); // Sem deslocamento de 64
+    return bits ? v & (~0ULL >> (64 - bits)) : 0;
+}
+
+static inline void inserir_bits(uint64_t *palavras, uint64_t pos, unsigned bits, uint64_t v) {
+    if (bits == 0) return;
+    uint64_t *p = palavras + (pos >> 6);
+    unsigned s = (unsigned)(pos & 63);
+    p[0] |= v << s;
+    if (s + bits > 64) p[1] |= v >> (64 - s);
+}
+
+/** @brief Chave e ordinal da entrada 'i' (0 <= i < n_entradas). */
+static inline void indice_entrada(const IndiceCompacto *ic, int64_t i, int64_t *chave, int64_t *ordinal) {
+    const GrupoIndice *g = &ic->grupos[i / ENTRADAS_POR_GRUPO];
+    uint64_t j = (uint64_t)(i % ENTRADAS_POR_GRUPO);
+    int64_t inicio = (i / ENTRADAS_POR_GRUPO) * ENTRADAS_POR_GRUPO;
+    uint64_t n = (uint64_t)(ic->cab.n_entradas - inicio < ENTRADAS_POR_GRUPO
+                            ? ic->cab.n_entradas - inicio : ENTRADAS_POR_GRUPO);
+    uint64_t base_bits = (uint64_t)g->palavra * 64;
+    // Aritmetica sem sinal: o residuo pode usar os 64 bits
+    *chave = (int64_t)((uint64_t)g->chave_base + j * (uint64_t)g->chave_passo +
+                       extrair_bits(ic->palavras, base_bits + j * g->bits_chave, g->bits_chave));
+    *ordinal = (int64_t)((uint64_t)g->ordinal_base + j * (uint64_t)g->ordinal_passo +
+                         extrair_bits(ic->palavras, base_bits + n * g->bits_chave + j * g->bits_ordinal,
+                                      g->bits_ordinal));
+}
+
+void indice_compacto_liberar(IndiceCompacto *ic) {
+    free(ic->grupos);
+    free(ic->palavras);
+    ic->grupos = NULL;
+    ic->palavras = NULL;
+    ic->cab.n_entradas = ic->cab.n_grupos = 0;
+}
+
+/**
+ * @brief Codifica as 'n' entradas (chaves e ordinais crescentes) em 'ic'.
+ * @return 1 se ok, 0 sem memoria.
+ */
+int indice_compacto_montar(IndiceCompacto *ic, const int64_t *chaves, const int64_t *ordinais, int64_t n) {
+    memset(ic, 0, sizeof(*ic));
+    ic->cab.magico = INDICE_MAGICO;
+    ic->cab.entradas_por_grupo = ENTRADAS_POR_GRUPO;
+    ic->cab.n_entradas = n;
+    ic->cab.n_grupos = (n + ENTRADAS_POR_GRUPO - 1) / ENTRADAS_POR_GRUPO;
+    ic->grupos = calloc((size_t)ic->cab.n_grupos + 1, sizeof(GrupoIndice));
+    if (!ic->grupos) return 0;
+
+    // 1a passada: passos e larguras de cada grupo
+    int64_t palavra = 0;
+    for (int64_t gi = 0; gi < ic->cab.n_grupos; gi++) {
+        GrupoIndice *g = &ic->grupos[gi];
+        int64_t inicio = gi * ENTRADAS_POR_GRUPO;
+        int64_t m = (n - inicio < ENTRADAS_POR_GRUPO) ? n - inicio : ENTRADAS_POR_GRUPO;
+        const int64_t *c = chaves + inicio, *o = ordinais + inicio;
+        g->chave_base = c[0];
+        g->ordinal_base = o[0];
+        uint64_t passo_c = UINT64_MAX, passo_o = UINT64_MAX;
+        for (int64_t j = 1; j < m; j++) {
+            uint64_t dc = (uint64_t)c[j] - (uint64_t)c[j - 1], d_o = (uint64_t)o[j] - (uint64_t)o[j - 1];
+            if (dc < passo_c) passo_c = dc;
+            if (d_o < passo_o) passo_o = d_o;
+        }
+        if (m == 1) passo_c = passo_o = 0;
+        g->chave_passo = (int64_t)passo_c;
+        g->ordinal_passo = (int64_t)passo_o;
+        // Residuos crescentes: o ultimo define a largura
+        g->bits_chave = (uint8_t)bits_necessarios((uint64_t)c[m - 1] - (uint64_t)c[0] - (uint64_t)(m - 1) * passo_c);
+        g->bits_ordinal = (uint8_t)bits_necessarios((uint64_t)o[m - 1] - (uint64_t)o[0] - (uint64_t)(m - 1) * passo_o);
+        g->palavra = palavra;
+        palavra += (m * (g->bits_chave + g->bits_ordinal) + 63) / 64;
+    }
+    ic->cab.n_palavras = palavra;
+    ic->palavras = calloc((size_t)palavra + 1, sizeof(uint64_t));
+    if (!ic->palavras) { indice_compacto_liberar(ic); return 0; }
+
+    // 2a passada: residuos com largura fixa
+    for (int64_t gi = 0; gi < ic->cab.n_grupos; gi++) {
+        const GrupoIndice *g = &ic->grupos[gi];
+        int64_t inicio = gi * ENTRADAS_POR_GRUPO;
+        int64_t m = (n - inicio < ENTRADAS_POR_GRUPO) ? n - inicio : ENTRADAS_POR_GRUPO;
+        uint64_t base_bits = (uint64_t)g->palavra * 64;
+        for (int64_t j = 0; j < m; j++) {
+            uint64_t rc = (uint64_t)chaves[inicio + j] - (uint64_t)g->chave_base - (uint64_t)j * (uint64_t)g->chave_passo;
+            uint64_t ro = (uint64_t)ordinais[inicio + j] - (uint64_t)g->ordinal_base - (uint64_t)j * (uint64_t)g->ordinal_passo;
+            inserir_bits(ic->palavras, base_bits + (uint64_t)j * g->bits_chave, g->bits_chave, rc);
+            inserir_bits(ic->palavras, base_bits + (uint64_t)m * g->bits_chave + (uint64_t)j * g->bits_ordinal,
+                         g->bits_ordinal, ro);
+        }
+    }
+    return 1;
+}
+
+/** @brief Bytes do indice codificado (como fica no arquivo). */
+long indice_compacto_bytes(const IndiceCompacto *ic) {
+    return (long)(sizeof(CabecalhoIndice) + (size_t)ic->cab.n_grupos * sizeof(GrupoIndice) +
+                  (size_t)ic->cab.n_palavras * sizeof(uint64_t));
+}
+
+static uint32_t checksum_cabecalho_indice(const CabecalhoIndice *cab) {
+    CabecalhoIndice c = *cab;
+    c.checksum = 0;
+    return checksum_fnv1a(&c, sizeof(c));
+}
+
+/**
+ * @brief Impressao do .bin: FNV-1a dos primeiros e dos ultimos
+ * IMPRESSAO_BYTES bytes (duas leituras pequenas, qualquer que seja o tamanho).
+ */
+uint32_t impressao_dados(int fd, int64_t tamanho) {
+    unsigned char bytes[2 * IMPRESSAO_BYTES];
+    size_t n = tamanho < IMPRESSAO_BYTES ? (size_t)tamanho : IMPRESSAO_BYTES;
+    memset(bytes, 0, sizeof(bytes));
+    if (n > 0 && (pread(fd, bytes, n, 0) != (ssize_t)n ||
+                  pread(fd, bytes + IMPRESSAO_BYTES, n, (off_t)(tamanho - (int64_t)n)) != (ssize_t)n))
+        return 0;
+    return checksum_fnv1a(bytes, sizeof(bytes));
+}
+
+/**
+ * @brief Registra no cabecalho o .bin para o qual o indice vale ('fd'
+ * aberto nele, com 'tamanho' bytes na geracao 'geracao').
+ */
+void indice_compacto_carimbar(IndiceCompacto *ic, uint64_t geracao, int fd, int64_t tamanho) {
+    ic->cab.geracao = geracao;
+    ic->cab.tamanho_dados = tamanho;
+    ic->cab.impressao_dados = impressao_dados(fd, tamanho);
+}
+
+/** @brief Grava o indice em temporario e publica com rename. @return 1 se ok. */
+int indice_compacto_gravar(const IndiceCompacto *ic, const char *arq_indice) {
+    char caminho_tmp[1024];
+    caminho_temporario(arq_indice, caminho_tmp, sizeof(caminho_tmp));
+    FILE *f = io_fopen(caminho_tmp, "wb");
+    if (!f) return 0;
+    CabecalhoIndice cab = ic->cab;
+    cab.checksum = checksum_cabecalho_indice(&cab);
+    int ok = io_fwrite(&cab, sizeof(cab), 1, f) == 1 &&
+             io_fwrite(ic->grupos, sizeof(GrupoIndice), (size_t)ic->cab.n_grupos, f) == (size_t)ic->cab.n_grupos &&
+             io_fwrite(ic->palavras, sizeof(uint64_t), (size_t)ic->cab.n_palavras, f) == (size_t)ic->cab.n_palavras;
+    if (!ok) { fclose(f); remove(caminho_tmp); return 0; }
+    return publicar_temporario(f, caminho_tmp, arq_indice);
+}
+
+/**
+ * @brief Le e valida o cabecalho do .idx aberto em 'f' (formato, checksum
+ * e tamanho do arquivo coerente com as contagens). @return 1 se ok.
+ */
+static int indice_ler_cabecalho(FILE *f, CabecalhoIndice *cab) {
+    struct stat st;
+    return fstat(fileno(f), &st) == 0 && io_fread(cab, sizeof(*cab), 1, f) == 1 &&
+           cab->magico == INDICE_MAGICO && cab->checksum == checksum_cabecalho_indice(cab) &&
+           cab->entradas_por_grupo == ENTRADAS_POR_GRUPO && cab->n_entradas >= 0 &&
+           cab->n_grupos == (cab->n_entradas + ENTRADAS_POR_GRUPO - 1) / ENTRADAS_POR_GRUPO &&
+           cab->n_palavras >= 0 &&
+           (long)(sizeof(*cab) + (size_t)cab->n_grupos * sizeof(GrupoIndice) +
+                  (size_t)cab->n_palavras * sizeof(uint64_t)) == (long)st.st_size;
+}
+
+/**
+ * @brief O .bin atual e o descrito por (geracao, tamanho, impressao)? Se
+ * 'tabela' < 0 a geracao nao e conferida. A tabela de itens usa a geracao
+ * de compras (TABELA_COMPRAS): ela e derivada de compras.bin.
+ */
+int dados_conferem(const char *arq_dados, int tabela, uint64_t geracao, int64_t tamanho, uint32_t impressao) {
+    if (tabela >= 0) {
+        uint64_t atual[N_TABELAS];
+        ler_geracoes(atual);
+        if (geracao != atual[tabela]) return 0;
+    }
+    int fd = open(arq_dados, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    int ok = fstat(fd, &st) == 0 && (int64_t)st.st_size == tamanho && impressao_dados(fd, tamanho) == impressao;
+    close(fd);
+    return ok;
+}
+
+static int indice_confere_dados(const CabecalhoIndice *cab, const char *arq_dados, int tabela) {
+    return dados_conferem(arq_dados, tabela, cab->geracao, cab->tamanho_dados, cab->impressao_dados);
+}
+
+/**
+ * @brief O .idx existe, esta integro e foi feito para o .bin atual? Le so o
+ * cabecalho do indice: custo O(1), qualquer que seja o tamanho dos arquivos.
+ */
+int indice_atualizado(const char *arq_indice, const char *arq_dados, int tabela) {
+    FILE *f = io_fopen(arq_indice, "rb");
+    if (!f) return 0;
+    CabecalhoIndice cab;
+    int ok = indice_ler_cabecalho(f, &cab);
+    fclose(f);
+    return ok && indice_confere_dados(&cab, arq_dados, tabela);
+}
+
+/**
+ * @brief Carrega o .idx inteiro (cabecalho, grupos e residuos) na RAM.
+ * @return 1 se ok; 0 se faltar, estiver truncado, corrompido ou em outro formato.
+ */
+int indice_compacto_carregar(IndiceCompacto *ic, const char *arq_indice) {
+    memset(ic, 0, sizeof(*ic));
+    FILE *f = io_fopen(arq_indice, "rb");
+    if (!f) return 0;
+    CabecalhoIndice cab;
+    int ok = indice_ler_cabecalho(f, &cab);
+    if (ok) {
+        ic->cab = cab;
+        ic->grupos = malloc(((size_t)cab.n_grupos + 1) * sizeof(GrupoIndice));
+        ic->palavras = calloc((size_t)cab.n_palavras + 1, sizeof(uint64_t));
+        ok = ic->grupos && ic->palavras &&
+             io_fread(ic->grupos, sizeof(GrupoIndice), (size_t)cab.n_grupos, f) == (size_t)cab.n_grupos &&
+             io_fread(ic->palavras, sizeof(uint64_t), (size_t)cab.n_palavras, f) == (size_t)cab.n_palavras;
+    }
+    fclose(f);
+    if (!ok) indice_compacto_liberar(ic);
+    return ok;
+}
+
+/**
+ * @brief indice_compacto_carregar que tambem exige que o indice seja do
+ * .bin atual (ver indice_atualizado); um indice desatualizado conta como ausente.
+ */
+int indice_compacto_carregar_atual(IndiceCompacto *ic, const char *arq_indice, const char *arq_dados, int tabela) {
+    if (!indice_compacto_carregar(ic, arq_indice)) return 0;
+    if (indice_confere_dados(&ic->cab, arq_dados, tabela)) return 1;
+    indice_compacto_liberar(ic);
+    return 0;
+}
+
+/**
+ * @brief Ordinal da entrada do indice onde 'chave' deveria estar (a ultima
+ * com chave <= 'chave'), ou -1 se a chave e menor que a primeira.
+ * Pesquisa binaria nas bases dos grupos e depois dentro do grupo.
+ */
+int64_t indice_compacto_bloco(const IndiceCompacto *ic, int64_t chave) {
+    int64_t inicio = 0, fim = ic->cab.n_grupos - 1, g = -1;
+    while (inicio <= fim) {
+        int64_t meio = inicio + (fim - inicio) / 2;
+        if (ic->grupos[meio].chave_base <= chave) { g = meio; inicio = meio + 1; }
+        else fim = meio - 1;
+    }
+    if (g < 0) return -1;
+
+    int64_t primeira = g * ENTRADAS_POR_GRUPO, c, o, achou = primeira;
+    inicio = primeira + 1;
+    fim = (primeira + ENTRADAS_POR_GRUPO < ic->cab.n_entradas ? primeira + ENTRADAS_POR_GRUPO
+                                                               : ic->cab.n_entradas) - 1;
+    while (inicio <= fim) {
+        int64_t meio = inicio + (fim - inicio) / 2;
+        indice_entrada(ic, meio, &c, &o);
+        if (c <= chave) { achou = meio; inicio = meio + 1; }
+        else fim = meio - 1;
+    }
+    indice_entrada(ic, achou, &c, &o);
+    return o;
+}
+
+// --- INDICE APRENDIDO (MODELO LINEAR POR PARTES COM ERRO MAXIMO EPSILON) ---
+//
+// Alternativa opcional ao indice parcial, no estilo do PGM-index: como as
+// chaves do .bin crescem de forma quase regular, a posicao de um registro
+// e aproximada por retas. Cada segmento guarda a primeira chave, o ordinal
+// dela e uma inclinacao, e a posicao prevista de qualquer chave do segmento
+// erra por no maximo 'epsilon' registros. A busca acha o segmento
+// (pesquisa binaria na RAM), preve a posicao e le so a janela
+// [previsto - epsilon, previsto + epsilon + 1] com um unico read.
+// Para eps = 32 isso da 66 registros, contra os BLOCO_INDICE (100) do
+// indice parcial.
+// O modelo cobre TODOS os registros (ativos ou nao), entao um removido da
+// -2, como na pesquisa binaria. Os segmentos saem de uma unica passada pelo
+// .bin: um cone de inclinacoes validas parte do primeiro ponto do
+// segmento e se estreita a cada chave, e quando fica vazio o segmento
+// fecha. Com poucos segmentos um nivel basta (o PGM empilharia modelos
+// sobre as chaves dos segmentos).
+// Persistido em "<arquivo>.pgm", com o mesmo controle de validade do .idx
+// (geracao, tamanho e impressao do .bin; ver indice_atualizado).
+
+#define APRENDIDO_MAGICO 0x314D4750u // "PGM1"
+#define APRENDIDO_EPSILON_PADRAO 32
+#define APRENDIDO_EPSILON_MAXIMO 4096
+
+int epsilon_aprendido = APRENDIDO_EPSILON_PADRAO; // AED2_EPSILON
+int gerar_aprendido = 0; // AED2_APRENDIDO=1: criar_indice tambem gera o .pgm
+
+typedef struct {
+    int64_t chave;     // Primeira chave do segmento
+    int64_t ordinal;   // Posicao dela no .bin
+    double inclinacao; // Registros por unidade de chave
+} SegmentoLinear;
+
+typedef struct {
+    uint32_t magico;
+    uint32_t epsilon;
+    int64_t n_segmentos;
+    int64_t n_registros;
+    uint64_t geracao;         // Como no CabecalhoIndice
+    int64_t tamanho_dados;
+    uint32_t impressao_dados;
+    uint32_t checksum;        // FNV-1a do cabecalho com este campo zerado
+} CabecalhoAprendido;
+
+typedef struct {
+    CabecalhoAprendido cab;
+    SegmentoLinear *segmentos;
+} IndiceAprendido;
+
+typedef struct {
+    long segmentos;
+    long registros;
+    long bytes;
+} ResultadoAprendido;
+
+void caminho_aprendido(const char *arq_dados, char *saida, size_t tam) {
+    snprintf(saida, tam, "%s.pgm", arq_dados);
+}
+
+void indice_aprendido_liberar(IndiceAprendido *ia) {
+    free(ia->segmentos);
+    ia->segmentos = NULL;
+}
+
+static uint32_t checksum_cabecalho_aprendido(const CabecalhoAprendido *cab) {
+    CabecalhoAprendido c = *cab;
+    c.checksum = 0;
+    return checksum_fnv1a(&c, sizeof(c));
+}
+
+/**
+ * @brief Monta o modelo a partir do .bin (uma varredura sequencial) e o
+ * grava em "<arq_dados>.pgm" (temporario + rename).
+ * @return 1 se publicou.
+ */
+int indice_aprendido_criar(TabelaDados tabela, const char *arq_dados, size_t tam_registro, size_t offset_chave,
+                           int epsilon, ResultadoAprendido *r) {
+    memset(r, 0, sizeof(*r));
+    if (epsilon < 1 || epsilon > APRENDIDO_EPSILON_MAXIMO) epsilon = APRENDIDO_EPSILON_PADRAO;
+    uint64_t geracao[N_TABELAS];
+    ler_geracoes(geracao); // Antes de abrir: o modelo vale para esta geracao
+    FILE *f = io_abrir_sequencial(arq_dados);
+    if (!f) return 0;
+    io_fseek(f, 0, SEEK_END);
+    int64_t tamanho = ftell(f);
+    io_fseek(f, 0, SEEK_SET);
+    int64_t n_registros = tamanho / (int64_t)tam_registro;
+    char *bloco = malloc(tam_registro * REGISTROS_POR_LEITURA);
+    SegmentoLinear *seg = NULL;
+    int64_t n_seg = 0, capacidade = 0, ordinal = 0, pontos = 0, anterior = 0;
+    double minima = 0, maxima = 0; // Cone de inclinacoes que ainda servem para todo o segmento
+    int ok = bloco != NULL;
+    size_t lidos;
+    while (ok && ordinal < n_registros && (lidos = io_fread(bloco, tam_registro, REGISTROS_POR_LEITURA, f)) > 0) {
+        for (size_t i = 0; i < lidos && ordinal < n_registros; i++, ordinal++) {
+            int64_t chave;
+            memcpy(&chave, bloco + i * tam_registro + offset_chave, sizeof(chave));
+            // Vagas do layout em blocos repetem a chave anterior: o modelo so ve o registro real
+            if (ordinal > 0 && chave == anterior) continue;
+            anterior = chave;
+            if (n_seg > 0 && chave > seg[n_seg - 1].chave) {
+                // |ordinal0 + s * dx - ordinal| <= epsilon restringe s a [baixo, alto]
+                double dx = (double)(chave - seg[n_seg - 1].chave);
+                double dy = (double)(ordinal - seg[n_seg - 1].ordinal);
+                double baixo = (dy - epsilon) / dx, alto = (dy + epsilon) / dx;
+                if (pontos == 1) { minima = baixo; maxima = alto; pontos++; continue; }
+                if (baixo <= maxima && alto >= minima) {
+                    if (baixo > minima) minima = baixo;
+                    if (alto < maxima) maxima = alto;
+                    pontos++;
+                    continue;
+                }
+            }
+            // Primeira chave ou cone vazio: fecha o segmento e abre outro aqui
+            if (n_seg > 0) seg[n_seg - 1].inclinacao = pontos > 1 ? (minima + maxima) / 2 : 0;
+            if (n_seg == capacidade) {
+                capacidade = capacidade ? capacidade * 2 : 64;
+                SegmentoLinear *novo = realloc(seg, (size_t)capacidade * sizeof(SegmentoLinear));
+                if (!novo) { ok = 0; break; }
+                seg = novo;
+            }
+            seg[n_seg].chave = chave;
+            seg[n_seg].ordinal = ordinal;
+            seg[n_seg++].inclinacao = 0;
+            pontos = 1;
+        }
+    }
+    if (n_seg > 0) seg[n_seg - 1].inclinacao = pontos > 1 ? (minima + maxima) / 2 : 0;
+    uint32_t impressao = impressao_dados(fileno(f), tamanho);
+    fclose(f);
+    free(bloco);
+
+    char caminho[1024], caminho_tmp[1040];
+    caminho_aprendido(arq_dados, caminho, sizeof(caminho));
+    caminho_temporario(caminho, caminho_tmp, sizeof(caminho_tmp));
+    FILE *fp = ok ? io_fopen(caminho_tmp, "wb") : NULL;
+    CabecalhoAprendido cab = {APRENDIDO_MAGICO, (uint32_t)epsilon, n_seg, n_registros,
+                              geracao[tabela], tamanho, impressao, 0};
+    cab.checksum = checksum_cabecalho_aprendido(&cab);
+    ok = fp && io_fwrite(&cab, sizeof(cab), 1, fp) == 1 &&
+         io_fwrite(seg, sizeof(SegmentoLinear), (size_t)n_seg, fp) == (size_t)n_seg;
+    free(seg);
+    if (fp && !ok) { fclose(fp); remove(caminho_tmp); }
+    if (!ok || !publicar_temporario(fp, caminho_tmp, caminho)) return 0;
+    r->segmentos = (long)n_seg;
+    r->registros = (long)n_registros;
+    r->bytes = (long)(sizeof(cab) + (size_t)n_seg * sizeof(SegmentoLinear));
+    return 1;
+}
+
+/**
+ * @brief Carrega o .pgm de 'arq_dados' se ele esta integro e vale para o
+ * .bin atual. @return 1 se ok; 0 se faltar ou estiver desatualizado.
+ */
+int indice_aprendido_carregar(IndiceAprendido *ia, TabelaDados tabela, const char *arq_dados) {
+    char caminho[1024];
+    memset(ia, 0, sizeof(*ia));
+    caminho_aprendido(arq_dados, caminho, sizeof(caminho));
+    FILE *f = io_fopen(caminho, "rb");
+    if (!f) return 0;
+    struct stat st;
+    CabecalhoAprendido *cab = &ia->cab;
+    int ok = fstat(fileno(f), &st) == 0 && io_fread(cab, sizeof(*cab), 1, f) == 1 &&
+             cab->magico == APRENDIDO_MAGICO && cab->checksum == checksum_cabecalho_aprendido(cab) &&
+             cab->n_segmentos > 0 && cab->n_registros > 0 && cab->epsilon <= APRENDIDO_EPSILON_MAXIMO &&
+             (int64_t)st.st_size == (int64_t)(sizeof(*cab) + (size_t)cab->n_segmentos * sizeof(SegmentoLinear)) &&
+             dados_conferem(arq_dados, tabela, cab->geracao, cab->tamanho_dados, cab->impressao_dados);
+    if (ok) {
+        ia->segmentos = malloc((size_t)cab->n_segmentos * sizeof(SegmentoLinear));
+        ok = ia->segmentos && io_fread(ia->segmentos, sizeof(SegmentoLinear), (size_t)cab->n_segmentos, f) ==
+                                  (size_t)cab->n_segmentos;
+    }
+    fclose(f);
+    if (!ok) indice_aprendido_liberar(ia);
+    return ok;
+}
+
+/**
+ * @brief Janela do .bin onde 'chave' esta, se existir: o primeiro ordinal
+ * vai em 'primeiro'. @return Registros na janela (0 se a chave e menor
+ * que a primeira do arquivo).
+ */
+long indice_aprendido_janela(const IndiceAprendido *ia, int64_t chave, int64_t *primeiro) {
+    int64_t inicio = 0, fim = ia->cab.n_segmentos - 1, s = -1;
+    while (inicio <= fim) {
+        int64_t meio = inicio + (fim - inicio) / 2;
+        if (ia->segmentos[meio].chave <= chave) { s = meio; inicio = meio + 1; }
+        else fim = meio - 1;
+    }
+    if (s < 0) return 0;
+    const SegmentoLinear *seg = &ia->segmentos[s];
+    double previsto = (double)seg->ordinal + seg->inclinacao * (double)(chave - seg->chave);
+    int64_t ultimo_registro = ia->cab.n_registros - 1;
+    int64_t p = previsto <= 0 ? 0 : previsto >= (double)ultimo_registro ? ultimo_registro : (int64_t)previsto;
+    // p = piso(previsto): a posicao real esta em [p - eps, p + eps + 1]
+    int64_t de = p - (int64_t)ia->cab.epsilon, ate = p + (int64_t)ia->cab.epsilon + 1;
+    if (de < 0) de = 0;
+    if (ate > ultimo_registro) ate = ultimo_registro;
+    *primeiro = de;
+    return (long)(ate - de + 1);
+}
+
+/**
+ * @brief Busca pelo modelo: uma leitura da janela prevista e pesquisa
+ * binaria nela. @return OFFSET (registro ativo copiado em 'saida'), -1 se
+ * nao encontrar, -2 se removido (tambem copiado) e -3 se nao ha modelo
+ * valido ou o .bin nao pode ser lido.
+ */
+long buscar_aprendido(TabelaDados tabela, const char *arq_dados, size_t tam_registro, size_t offset_chave,
+                      size_t offset_ativo, int64_t chave, void *saida) {
+    unsigned long long t0 = instr_inicio();
+    IndiceAprendido ia;
+    if (!indice_aprendido_carregar(&ia, tabela, arq_dados)) { instr_registrar(OP_BUSCA_APRENDIDA, t0); return -3; }
+    int64_t primeiro = 0;
+    long n = indice_aprendido_janela(&ia, chave, &primeiro);
+    char *janela = n > 0 ? malloc((size_t)n * tam_registro) : NULL;
+    indice_aprendido_liberar(&ia);
+    if (n <= 0) { instr_registrar(OP_BUSCA_APRENDIDA, t0); return -1; }
+
+    FILE *f = janela ? io_fopen(arq_dados, "rb") : NULL;
+    if (!f) { free(janela); instr_registrar(OP_BUSCA_APRENDIDA, t0); return -3; }
+    // Como em buscar_*_com_indice: a janela inteira num unico read()
+    setvbuf(f, NULL, _IONBF, 0);
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_RANDOM);
+    io_fseek(f, (long)primeiro * (long)tam_registro, SEEK_SET);
+    long lidos = (long)io_fread(janela, tam_registro, (size_t)n, f);
+    fclose(f);
+
+    long inicio = 0, fim = lidos - 1, resultado = -1;
+    while (inicio <= fim) {
+        long meio = inicio + (fim - inicio) / 2;
+        const char *registro = janela + meio * (long)tam_registro;
+        int64_t c;
+        memcpy(&c, registro + offset_chave, sizeof(c));
+        if (c == chave && registro[offset_ativo] != 'V') {
+            memcpy(saida, registro, tam_registro);
+            resultado = registro[offset_ativo] == 'S' ? (long)(primeiro + meio) * (long)tam_registro : -2;
+            break;
+        }
+        (c < chave) ? (inicio = meio + 1) : (fim = meio - 1); // Vaga: o registro esta a esquerda
+    }
+    free(janela);
+    instr_registrar(OP_BUSCA_APRENDIDA, t0);
+    return resultado;
+}
+
+// --- BUSCA EM LOTE (CHAVES ORDENADAS, CADA TRECHO LIDO UMA VEZ) ---
+//
+// Resolve muitas chaves de uma vez pelo indice parcial. As chaves sao
+// ordenadas (guardando a posicao de entrada) e o cursor no indice so anda
+// para frente, com salto exponencial a partir da ultima entrada usada. O
+// .bin e lido em ordem crescente de offset, um trecho por entrada do
+// indice, e cada trecho uma unica vez mesmo quando varias chaves caem nele.
+// O trecho vai da entrada ate a seguinte (ou o fim do arquivo): registros
+// removidos no meio nao escondem chaves, como na busca individual, que le
+// no maximo BLOCO_INDICE registros. Le sempre o .bin, que e a fonte de
+// verdade, e nunca a copia comprimida.
+
+typedef struct {
+    int64_t chave;
+    long posicao; // Posicao da chave na entrada
+} ChaveLote;
+
+typedef struct {
+    long encontradas;  // Chaves com registro ativo
+    long removidas;
+    long ausentes;
+    long leituras;     // read/pread feitos no .bin (no lote, um por trecho)
+    const char *motor; // "lote", "io_uring" ou "threads"
+} ResultadoLote;
+
+static int comparar_chave_lote(const void *a, const void *b) {
+    const ChaveLote *x = a, *y = b;
+    if (x->chave != y->chave) return x->chave < y->chave ? -1 : 1;
+    return (x->posicao > y->posicao) - (x->posicao < y->posicao);
+}
+
+/**
+ * @brief Ultima entrada do indice com chave <= 'chave', procurando so a
+ * partir de 'desde' (as chaves chegam em ordem): saltos de 1, 2, 4, ...
+ * entradas e pesquisa binaria no intervalo achado.
+ * @return Entrada, ou desde - 1 se ate a entrada 'desde' ja passa da chave.
+ */
+static int64_t indice_compacto_entrada_desde(const IndiceCompacto *ic, int64_t desde, int64_t chave) {
+    int64_t n = ic->cab.n_entradas, c, o;
+    int64_t abaixo = desde - 1, acima, passo = 1; // abaixo: <= chave (ou sentinela)
+    for (;;) {
+        acima = abaixo + passo;
+        if (acima >= n) { acima = n; break; }
+        indice_entrada(ic, acima, &c, &o);
+        if (c > chave) break;
+        abaixo = acima;
+        passo *= 2;
+    }
+    while (acima - abaixo > 1) {
+        int64_t meio = abaixo + (acima - abaixo) / 2;
+        indice_entrada(ic, meio, &c, &o);
+        if (c <= chave) abaixo = meio;
+        else acima = meio;
+    }
+    return abaixo;
+}
+
+/**
+ * @brief Busca 'n' chaves de 64 bits ('chaves', na ordem de entrada) pelo
+ * indice parcial. resultados[i] recebe, para chaves[i], os codigos de
+ * buscar_*_com_indice: OFFSET (registro ativo copiado em saidas[i]), -1,
+ * -2 (removido, tambem copiado) ou -3 (indice/dados ilegiveis).
+ * @return Chaves encontradas ativas, ou -3.
+ */
+long buscar_em_lote(TabelaDados tabela, const char *arq_indice, const char *arq_dados, size_t tam_registro,
+                    size_t offset_chave, size_t offset_ativo, const void *chaves, long n, void *saidas,
+                    long *resultados, ResultadoLote *r) {
+    unsigned long long t0 = instr_inicio();
+    memset(r, 0, sizeof(*r));
+    r->motor = "lote";
+    if (n <= 0) return 0;
+    ChaveLote *ordem = malloc((size_t)n * sizeof(ChaveLote));
+    IndiceCompacto ic;
+    FILE *f = NULL;
+    if (!ordem || !indice_compacto_carregar_atual(&ic, arq_indice, arq_dados, tabela) ||
+        !(f = io_fopen(arq_dados, "rb"))) {
+        if (ordem) indice_compacto_liberar(&ic);
+        free(ordem);
+        for (long i = 0; i < n; i++) resultados[i] = -3;
+        instr_registrar(OP_BUSCA_LOTE, t0);
+        return -3;
+    }
+    for (long i = 0; i < n; i++) {
+        memcpy(&ordem[i].chave, (const char *)chaves + i * (long)sizeof(int64_t), sizeof(int64_t));
+        ordem[i].posicao = i;
+    }
+    qsort(ordem, (size_t)n, sizeof(ChaveLote), comparar_chave_lote);
+
+    // Trechos lidos inteiros num read(), sem buffer do stdio
+    setvbuf(f, NULL, _IONBF, 0);
+    io_fseek(f, 0, SEEK_END);
+    int64_t n_registros = ftell(f) / (long)tam_registro;
+    int64_t posicao_arquivo = -1; // Ordinal onde o arquivo esta posicionado
+
+    char *trecho = NULL;
+    size_t capacidade = 0, lidos = 0, j = 0;
+    int64_t cursor = 0, entrada_lida = -1, inicio = 0;
+    for (long k = 0; k < n; k++) {
+        long *resultado = &resultados[ordem[k].posicao];
+        int64_t e = indice_compacto_entrada_desde(&ic, cursor, ordem[k].chave);
+        if (e < 0) { *resultado = -1; r->ausentes++; continue; }
+        cursor = e;
+        if (e != entrada_lida) {
+            int64_t c, fim;
+            indice_entrada(&ic, e, &c, &inicio);
+            if (e + 1 < ic.cab.n_entradas) indice_entrada(&ic, e + 1, &c, &fim);
+            else fim = n_registros;
+            if (fim > n_registros) fim = n_registros;
+            size_t quantos = fim > inicio ? (size_t)(fim - inicio) : 0;
+            if (quantos > capacidade) {
+                char *novo = realloc(trecho, quantos * tam_registro);
+                if (!novo) { *resultado = -3; entrada_lida = -1; lidos = 0; continue; }
+                trecho = novo;
+                capacidade = quantos;
+            }
+            if (inicio != posicao_arquivo) io_fseek(f, (long)inicio * (long)tam_registro, SEEK_SET);
+            lidos = quantos ? io_fread(trecho, tam_registro, quantos, f) : 0;
+            posicao_arquivo = inicio + (int64_t)lidos;
+            entrada_lida = e;
+            j = 0;
+            r->leituras++;
+        }
+        // As chaves e o trecho estao ordenados: o cursor no trecho tambem so avanca
+        int64_t chave_j = 0;
+        while (j < lidos && (memcpy(&chave_j, trecho + j * tam_registro + offset_chave, sizeof(int64_t)),
+                             chave_j < ordem[k].chave))
+            j++;
+        if (j >= lidos || chave_j != ordem[k].chave) { *resultado = -1; r->ausentes++; continue; }
+        const char *registro = trecho + j * tam_registro;
+        memcpy((char *)saidas + ordem[k].posicao * (long)tam_registro, registro, tam_registro);
+        if (registro[offset_ativo] == 'S') {
+            *resultado = (long)(inicio + (int64_t)j) * (long)tam_registro;
+            r->encontradas++;
+        } else {
+            *resultado = -2;
+            r->removidas++;
+        }
+    }
+    fclose(f);
+    free(trecho);
+    free(ordem);
+    indice_compacto_liberar(&ic);
+    instr_registrar(OP_BUSCA_LOTE, t0);
+    return r->encontradas;
+}
+
+// --- PESQUISAS ASSINCRONAS (MUITAS EM VOO: io_uring OU POOL DE pread) ---
+//
+// Cada pesquisa binaria e uma cadeia de leituras dependentes, mas chaves
+// diferentes sao independentes: com varias pesquisas em andamento ao mesmo
+// tempo o disco recebe 'profundidade' leituras em paralelo. Cada pesquisa e
+// uma maquina de estados (intervalo [inicio, fim] e o registro 'meio' a
+// ler) que avanca a cada leitura concluida, e ha dois motores para ela:
+//   - io_uring (chamadas de sistema diretas, sem liburing): uma thread
+//     mantem ate 'profundidade' leituras submetidas no anel e, a cada
+//     conclusao, avanca a pesquisa e submete a proxima leitura dela;
+//   - pool de 'profundidade' threads, cada uma com pread bloqueante,
+//     usado quando o io_uring nao existe ou e negado (ex.: seccomp) ou com
+//     AED2_IO_URING=0.
+// Com o indice parcial carregado, o intervalo inicial e so o trecho entre
+// duas entradas do indice (~7 leituras em vez de ~20 com 1M registros).
+// Os resultados sao os de pesquisa_binaria_* (a chave e procurada em todos
+// os registros, ativos ou nao), na ordem de entrada.
+
+#define PROFUNDIDADE_MAXIMA 1024
+
+int assincrono_io_uring = 1;
+
+typedef struct {
+    int fd;
+    size_t tam_registro, offset_chave, offset_ativo;
+    int64_t n_registros;
+    const IndiceCompacto *ic; // NULL: pesquisa no arquivo inteiro
+    const void *chaves;
+    long n;
+    void *saidas;             // NULL ou n registros (copiados se a chave existe)
+    long *resultados;
+    long proxima;             // Proxima chave a iniciar (pool: atomico)
+    long leituras;
+} ContextoAssincrono;
+
+typedef struct {
+    long posicao;         // Indice da chave na entrada
+    int64_t chave;
+    int64_t inicio, fim;  // Ordinais ainda possiveis
+    int64_t meio;         // Registro sendo lido
+} PesquisaEmVoo;
+
+/** @brief Escolhe o proximo registro a ler. @return 1 se ha leitura; 0 se terminou. */
+static int pesquisa_proxima(PesquisaEmVoo *p, ContextoAssincrono *ctx) {
+    if (p->inicio > p->fim) {
+        ctx->resultados[p->posicao] = -1;
+        return 0;
+    }
+    p->meio = p->inicio + (p->fim - p->inicio) / 2;
+    return 1;
+}
+
+/** @brief Comeca a pesquisa da chave 'posicao'. @return Como pesquisa_proxima. */
+static int pesquisa_iniciar(PesquisaEmVoo *p, ContextoAssincrono *ctx, long posicao) {
+    p->posicao = posicao;
+    memcpy(&p->chave, (const char *)ctx->chaves + posicao * (long)sizeof(int64_t), sizeof(int64_t));
+    p->inicio = 0;
+    p->fim = ctx->n_registros - 1;
+    if (ctx->ic && ctx->ic->cab.n_entradas > 0) {
+        int64_t e = indice_compacto_entrada_desde(ctx->ic, 0, p->chave), c, o;
+        if (e >= 0) indice_entrada(ctx->ic, e, &c, &p->inicio);
+        if (e + 1 < ctx->ic->cab.n_entradas) {
+            indice_entrada(ctx->ic, e + 1, &c, &o);
+            p->fim = o - 1;
+        }
+    }
+    return pesquisa_proxima(p, ctx);
+}
+
+/**
+ * @brief Avanca a pesquisa com o registro 'meio' lido ('lidos' bytes, ou
+ * erro negativo). @return Como pesquisa_proxima.
+ */
+static int pesquisa_avancar(PesquisaEmVoo *p, ContextoAssincrono *ctx, const char *registro, long lidos) {
+    if (lidos != (long)ctx->tam_registro) {
+        ctx->resultados[p->posicao] = -3;
+        return 0;
+    }
+    int64_t chave_meio;
+    memcpy(&chave_meio, registro + ctx->offset_chave, sizeof(int64_t));
+    if (chave_meio == p->chave && registro[ctx->offset_ativo] != 'V') {
+        ctx->resultados[p->posicao] = registro[ctx->offset_ativo] == 'S'
+                                      ? (long)p->meio * (long)ctx->tam_registro : -2;
+        if (ctx->saidas)
+            memcpy((char *)ctx->saidas + p->posicao * (long)ctx->tam_registro, registro, ctx->tam_registro);
+        return 0;
+    }
+    if (chave_meio < p->chave) p->inicio = p->meio + 1;
+    else p->fim = p->meio - 1; // Maior, ou uma vaga com a chave do registro anterior
+    return pesquisa_proxima(p, ctx);
+}
+
+// Motor 1: pool de threads com pread bloqueante
+
+static void *assincrono_trabalhador(void *arg) {
+    ContextoAssincrono *ctx = arg;
+    char *registro = malloc(ctx->tam_registro);
+    long leituras = 0;
+    for (long i; registro && (i = __atomic_fetch_add(&ctx->proxima, 1, __ATOMIC_RELAXED)) < ctx->n;) {
+        PesquisaEmVoo p;
+        int ler = pesquisa_iniciar(&p, ctx, i);
+        while (ler) {
+            ssize_t lidos = pread(ctx->fd, registro, ctx->tam_registro, (off_t)p.meio * (off_t)ctx->tam_registro);
+            leituras++;
+            ler = pesquisa_avancar(&p, ctx, registro, lidos < 0 ? -errno : (long)lidos);
+        }
+    }
+    free(registro);
+    __atomic_fetch_add(&ctx->leituras, leituras, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/** @return 1 se ok; 0 se nenhuma thread pode ser criada. */
+static int assincrono_pool(ContextoAssincrono *ctx, int profundidade) {
+    pthread_t *threads = malloc((size_t)profundidade * sizeof(pthread_t));
+    int criadas = 0;
+    while (threads && criadas < profundidade &&
+           pthread_create(&threads[criadas], NULL, assincrono_trabalhador, ctx) == 0)
+        criadas++;
+    for (int i = 0; i < criadas; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    return criadas > 0;
+}
+
+// Motor 2: io_uring. Os aneis de submissao (SQ) e conclusao (CQ) sao
+// mapeados do kernel; a aplicacao escreve no tail da SQ e le no head da CQ,
+// com barreiras acquire/release nos indices compartilhados.
+
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_mapa, *cq_mapa;
+    size_t sq_tam, cq_tam, sqes_tam;
+    unsigned a_submeter; // SQEs escritas e ainda nao entregues ao kernel
+} AnelIoUring;
+
+static void anel_fechar(AnelIoUring *a) {
+    if (a->sqes) munmap(a->sqes, a->sqes_tam);
+    if (a->cq_mapa && a->cq_mapa != a->sq_mapa) munmap(a->cq_mapa, a->cq_tam);
+    if (a->sq_mapa) munmap(a->sq_mapa, a->sq_tam);
+    if (a->fd >= 0) close(a->fd);
+}
+
+/** @return 1 se o anel foi criado; 0 se o kernel nao tem ou nega io_uring. */
+static int anel_abrir(AnelIoUring *a, unsigned entradas) {
+    struct io_uring_params p;
+    memset(a, 0, sizeof(*a));
+    memset(&p, 0, sizeof(p));
+    a->fd = (int)syscall(__NR_io_uring_setup, entradas, &p);
+    if (a->fd < 0) return 0;
+    a->sq_tam = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    a->cq_tam = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) { // SQ e CQ num unico mapeamento
+        if (a->cq_tam > a->sq_tam) a->sq_tam = a->cq_tam;
+        a->cq_tam = a->sq_tam;
+    }
+    a->sq_mapa = mmap(NULL, a->sq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_SQ_RING);
+    if (a->sq_mapa == MAP_FAILED) { a->sq_mapa = NULL; anel_fechar(a); return 0; }
+    a->cq_mapa = (p.features & IORING_FEAT_SINGLE_MMAP) ? a->sq_mapa
+                 : mmap(NULL, a->cq_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_CQ_RING);
+    if (a->cq_mapa == MAP_FAILED) { a->cq_mapa = NULL; anel_fechar(a); return 0; }
+    a->sqes_tam = p.sq_entries * sizeof(struct io_uring_sqe);
+    a->sqes = mmap(NULL, a->sqes_tam, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_SQES);
+    if (a->sqes == MAP_FAILED) { a->sqes = NULL; anel_fechar(a); return 0; }
+    char *sq = a->sq_mapa, *cq = a->cq_mapa;
+    a->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    a->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    a->sq_array = (unsigned *)(sq + p.sq_off.array);
+    a->cq_head = (unsigned *)(cq + p.cq_off.head);
+    a->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    a->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    a->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 1;
+}
+
+/** @brief Escreve na SQ a leitura do registro 'meio' da pesquisa 'slot'. */
+static void anel_ler(AnelIoUring *a, int fd, void *destino, size_t tam, int64_t offset, unsigned slot) {
+    unsigned tail = *a->sq_tail, i = tail & *a->sq_mask;
+    struct io_uring_sqe *sqe = &a->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)offset;
+    sqe->addr = (uint64_t)(uintptr_t)destino;
+    sqe->len = (unsigned)tam;
+    sqe->user_data = slot;
+    a->sq_array[i] = i;
+    __atomic_store_n(a->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    a->a_submeter++;
+}
+
+/** @return 1 se ok; 0 se o anel nao pode ser criado ou falhou (usar o pool). */
+static int assincrono_io_uring_executar(ContextoAssincrono *ctx, int profundidade) {
+    AnelIoUring a;
+    if (!anel_abrir(&a, (unsigned)profundidade)) return 0;
+    PesquisaEmVoo *pesquisas = malloc((size_t)profundidade * sizeof(PesquisaEmVoo));
+    char *registros = malloc((size_t)profundidade * ctx->tam_registro);
+    if (!pesquisas || !registros) { free(pesquisas); free(registros); anel_fechar(&a); return 0; }
+
+    int em_voo = 0, ok = 1;
+    for (int s = 0; s < profundidade; s++) { // Enche o anel
+        while (ctx->proxima < ctx->n) {
+            if (pesquisa_iniciar(&pesquisas[s], ctx, ctx->proxima++)) {
+                anel_ler(&a, ctx->fd, registros + (size_t)s * ctx->tam_registro, ctx->tam_registro,
+                         pesquisas[s].meio * (int64_t)ctx->tam_registro, (unsigned)s);
+                em_voo++;
+                break;
+            }
+        }
+    }
+    while (em_voo > 0) {
+        int r = (int)syscall(__NR_io_uring_enter, a.fd, a.a_submeter, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) { ok = 0; break; }
+        a.a_submeter = 0;
+        unsigned head = *a.cq_head, tail = __atomic_load_n(a.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &a.cqes[head & *a.cq_mask];
+            unsigned s = (unsigned)cqe->user_data;
+            char *registro = registros + (size_t)s * ctx->tam_registro;
+            ctx->leituras++;
+            em_voo--;
+            int ler = pesquisa_avancar(&pesquisas[s], ctx, registro, cqe->res);
+            while (!ler && ctx->proxima < ctx->n) ler = pesquisa_iniciar(&pesquisas[s], ctx, ctx->proxima++);
+            if (ler) {
+                anel_ler(&a, ctx->fd, registro, ctx->tam_registro, pesquisas[s].meio * (int64_t)ctx->tam_registro, s);
+                em_voo++;
+            }
+        }
+        __atomic_store_n(a.cq_head, head, __ATOMIC_RELEASE);
+    }
+    // Depois de uma falha ainda pode haver leituras em voo escrevendo em
+    // 'registros': espera todas antes de liberar (o pool refaz as pesquisas)
+    while (em_voo > 0) {
+        int r = (int)syscall(__NR_io_uring_enter, a.fd, a.a_submeter, (unsigned)em_voo, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno != EINTR) break;
+        if (r >= 0) a.a_submeter = 0;
+        unsigned head = *a.cq_head, tail = __atomic_load_n(a.cq_tail, __ATOMIC_ACQUIRE);
+        em_voo -= (int)(tail - head);
+        __atomic_store_n(a.cq_head, tail, __ATOMIC_RELEASE);
+    }
+    anel_fechar(&a);
+    free(pesquisas);
+    if (em_voo == 0) free(registros); // Sem conseguir esperar, vazar e melhor que o kernel escrever em memoria liberada
+    return ok;
+}
+
+/**
+ * @brief Pesquisa binaria de 'n' chaves de 64 bits com ate 'profundidade'
+ * leituras em voo. resultados[i] recebe o de pesquisa_binaria para
+ * chaves[i] (OFFSET, -1, -2; -3 se a leitura falhou) e, se 'saidas' nao
+ * for NULL, saidas[i] o registro achado. 'arq_indice' (ou NULL) so encurta
+ * o intervalo inicial, e so se estiver atualizado.
+ * @return Chaves encontradas ativas, ou -3 se o .bin nao abre.
+ */
+long pesquisar_assincrono(TabelaDados tabela, const char *arq_bin, const char *arq_indice, size_t tam_registro,
+                          size_t offset_chave, size_t offset_ativo, const void *chaves, long n, void *saidas,
+                          long *resultados, int profundidade, ResultadoLote *r) {
+    unsigned long long t0 = instr_inicio();
+    memset(r, 0, sizeof(*r));
+    if (profundidade < 1) profundidade = 1;
+    if (profundidade > PROFUNDIDADE_MAXIMA) profundidade = PROFUNDIDADE_MAXIMA;
+    int fd = open(arq_bin, O_RDONLY);
+    if (fd < 0) {
+        for (long i = 0; i < n; i++) resultados[i] = -3;
+        instr_registrar(OP_BUSCA_LOTE, t0);
+        return -3;
+    }
+    CONTAR(estat_io.fopens, 1);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    struct stat st;
+    IndiceCompacto ic;
+    int com_indice = arq_indice && indice_compacto_carregar_atual(&ic, arq_indice, arq_bin, tabela);
+    ContextoAssincrono ctx = {
+        .fd = fd, .tam_registro = tam_registro, .offset_chave = offset_chave, .offset_ativo = offset_ativo,
+        .n_registros = fstat(fd, &st) == 0 ? (int64_t)st.st_size / (int64_t)tam_registro : 0,
+        .ic = com_indice ? &ic : NULL, .chaves = chaves, .n = n, .saidas = saidas, .resultados = resultados,
+    };
+    // Se o io_uring falhar no meio, o pool refaz tudo (as pesquisas sao so leitura)
+    r->motor = "io_uring";
+    if (!assincrono_io_uring || !assincrono_io_uring_executar(&ctx, profundidade)) {
+        r->motor = "threads";
+        ctx.proxima = 0;
+        ctx.leituras = 0;
+        if (!assincrono_pool(&ctx, profundidade))
+            for (long i = 0; i < n; i++) resultados[i] = -3;
+    }
+    for (long i = 0; i < n; i++) {
+        if (resultados[i] >= 0) r->encontradas++;
+        else if (resultados[i] == -2) r->removidas++;
+        else if (resultados[i] == -1) r->ausentes++;
+    }
+    r->leituras = ctx.leituras;
+    CONTAR(estat_io.registros_lidos, (unsigned long long)ctx.leituras);
+    CONTAR(estat_io.bytes_lidos, (unsigned long long)ctx.leituras * tam_registro);
+    if (com_indice) indice_compacto_liberar(&ic);
+    close(fd);
+    instr_registrar(OP_BUSCA_LOTE, t0);
+    return r->encontradas;
+}
+
+// --- MOTOR DE TABELAS (FUNCOES ESPECIALIZADAS POR TIPO) ---
+//
+// As funcoes de acesso aos arquivos de dados sao geradas pela macro
+// DEFINIR_TABELA para cada tipo de registro. Tipo do registro, campo e tipo
+// da chave sao parametros de compilacao: a comparacao
+// de chaves e um '<' / '==' inline no laco da pesquisa (sem chamada por
+// ponteiro de funcao a cada sondagem) e o campo 'ativo' e lido direto da
+// struct. Uma tabela nova precisa so de uma linha DEFINIR_TABELA(...).
+//
+// Para DEFINIR_TABELA(nome, TABELA_..., ...) sao geradas:
+//   localizar_nome(arq_bin, chave, saida)       -> offset ou -1 (ignora 'ativo')
+//   localizar_nome_wal(arq_bin, chave64, saida) -> idem, assinatura comum usada pelo WAL
+//   pesquisa_binaria_nome(arq_bin, chave)       -> offset, -1 ou -2 (removido)
+//   existe_nome(arq_bin, chave)                 -> 1 se ha registro ativo (filtro de Bloom antes do .bin)
+//   criar_indice_nome(arq_dados, arq_indice)    -> indice parcial compacto + filtro de Bloom
+//   buscar_nome_com_indice(arq_indice, arq_dados, chave, saida) -> offset, -1, -2 ou -3
+//     (com uma copia comprimida valida usa o diretorio de blocos do .z)
+//   buscar_nome_em_lote(arq_indice, arq_dados, chaves, n, saidas, resultados, r)
+//     -> mesmos codigos por chave, resolvidos juntos (ver buscar_em_lote)
+//   pesquisa_nome_assincrona(arq_bin, arq_indice, chaves, n, saidas, resultados, profundidade, r)
+//     -> pesquisa_binaria de cada chave, varias em voo (ver pesquisar_assincrono)
+//   buscar_nome_aprendido(arq_dados, chave, saida) -> offset, -1, -2 ou -3 pelo .pgm (ver buscar_aprendido)
+// Obs: dentro da macro so ha comentarios /* */, pois um // engoliria a
+// continuacao de linha.
+
+#define DEFINIR_TABELA(NOME, TABELA, TIPO, CAMPO_CHAVE, TIPO_CHAVE, OP_BUSCA_INDICE) \
+\
+/* Pesquisa binaria DIRETAMENTE NO ARQUIVO, sem olhar o campo 'ativo' \
+ * (so as vagas do layout em blocos sao puladas). \
+ * Retorna o OFFSET do registro (e a copia em 'saida', se nao for NULL) \
+ * ou -1 se nao encontrar. */ \
+long localizar_##NOME(const char *arq_bin, TIPO_CHAVE chave, TIPO *saida) { \
+    FILE *fbin = io_fopen(arq_bin, "rb"); \
+    if (!fbin) return -1; \
+    io_fseek(fbin, 0, SEEK_END); \
+    long tamanho_arquivo = ftell(fbin); \
+    if (tamanho_arquivo <= 0 || tamanho_arquivo % (long)sizeof(TIPO) != 0) { fclose(fbin); return -1; } \
+\
+    long inicio = 0, fim = tamanho_arquivo / (long)sizeof(TIPO) - 1; \
+    TIPO registro; \
+    while (inicio <= fim) { \
+        long meio = inicio + (fim - inicio) / 2; \
+        if (io_fseek(fbin, meio * (long)sizeof(TIPO), SEEK_SET) != 0 || \
+            io_fread(&registro, sizeof(TIPO), 1, fbin) != 1) break; \
+        if (registro.CAMPO_CHAVE == chave && registro.ativo != 'V') { \
+            if (saida) *saida = registro; \
+            fclose(fbin); \
+            return meio * (long)sizeof(TIPO); \
+        } \
+        /* Uma vaga repete a chave do registro anterior: segue para a esquerda */ \
+        (registro.CAMPO_CHAVE < chave) ? (inicio = meio + 1) : (fim = meio - 1); \
+    } \
+    fclose(fbin); \
+    return -1; \
+} \
+\
+/* Adaptador com chave de 64 bits e registro void* usado pelo WAL, que \
+ * aplica as operacoes das duas tabelas com o mesmo codigo. */ \
+long localizar_##NOME##_wal(const char *arq_bin, int64_t chave, void *saida) { \
+    return localizar_##NOME(arq_bin, (TIPO_CHAVE)chave, (TIPO*)saida); \
+} \
+\
+/* Retorna o OFFSET se encontrar o registro ATIVO, -1 se nao encontrar e \
+ * -2 se encontrar mas estiver REMOVIDO ('N'). */ \
+long pesquisa_binaria_##NOME(const char *arq_bin, TIPO_CHAVE chave) { \
+    unsigned long long t0 = instr_inicio(); \
+    TIPO registro; \
+    long offset = localizar_##NOME(arq_bin, chave, &registro); \
+    if (offset >= 0 && registro.ativo != 'S') offset = -2; \
+    instr_registrar(OP_PESQUISA_BINARIA, t0); \
+    return offset; \
+} \
+\
+/* Existe registro ATIVO com a chave? Consulta primeiro o filtro de Bloom \
+ * (em memoria) e so pesquisa no arquivo se ele responder "talvez". */ \
+int existe_##NOME(const char *arq_bin, TIPO_CHAVE chave) { \
+    int filtro = bloom_pode_conter(TABELA, arq_bin, (int64_t)chave); \
+    if (filtro == 0) return 0; \
+    long offset = pesquisa_binaria_##NOME(arq_bin, chave); \
+    if (filtro == 1 && offset < 0) CONTAR(estat_io.bloom_falsos_positivos, 1); \
+    return offset >= 0; \
+} \
+\
+/* Cria o indice parcial: a cada BLOCO_INDICE registros ATIVOS guarda a \
+ * chave e o ordinal do registro, codificados no formato compacto (no \
+ * layout em blocos, uma entrada no inicio de cada bloco). Gravado em \
+ * temporario e publicado com rename. Na mesma varredura monta o filtro \
+ * de Bloom das chaves ativas. */ \
+void criar_indice_##NOME(const char *arq_dados, const char *arq_indice) { \
+    unsigned long long t0 = instr_inicio(); \
+    uint64_t geracao[N_TABELAS]; \
+    ler_geracoes(geracao); /* Antes de abrir: o filtro vale para esta geracao */ \
+\
+    FILE *f_dados = io_abrir_sequencial(arq_dados); \
+    if (!f_dados) return; \
+    io_fseek(f_dados, 0, SEEK_END); \
+    long tamanho_dados = ftell(f_dados); \
+    io_fseek(f_dados, 0, SEEK_SET); \
+    long n_registros = tamanho_dados / (long)sizeof(TIPO); \
+    int64_t *chaves = malloc(((size_t)n_registros / BLOCO_INDICE + 1) * sizeof(int64_t)); \
+    int64_t *ordinais = malloc(((size_t)n_registros / BLOCO_INDICE + 1) * sizeof(int64_t)); \
+    TIPO *bloco = malloc(sizeof(TIPO) * REGISTROS_POR_LEITURA); \
+    if (!chaves || !ordinais || !bloco) { free(chaves); free(ordinais); free(bloco); fclose(f_dados); return; } \
+    FiltroBloom *bloom = bloom_criar((uint64_t)n_registros); \
+    int em_blocos = tabela_em_blocos(TABELA); \
+\
+    long ordinal = 0, n_entradas = 0; \
+    int contador_registros_ativos = 0; \
+    size_t lidos; \
+    while (ordinal < n_registros && (lidos = io_fread(bloco, sizeof(TIPO), REGISTROS_POR_LEITURA, f_dados)) > 0) { \
+        for (size_t i = 0; i < lidos && ordinal < n_registros; i++, ordinal++) { \
+            const TIPO *registro = &bloco[i]; \
+            if (em_blocos && ordinal % BLOCO_INDICE == 0) { /* 1o registro do bloco: nunca e vaga */ \
+                chaves[n_entradas] = (int64_t)registro->CAMPO_CHAVE; \
+                ordinais[n_entradas++] = ordinal; \
+            } \
+            if (registro->ativo != 'S') continue; \
+            if (bloom) bloom_adicionar(bloom, (int64_t)registro->CAMPO_CHAVE); \
+            if (!em_blocos && contador_registros_ativos % BLOCO_INDICE == 0) { \
+                chaves[n_entradas] = (int64_t)registro->CAMPO_CHAVE; \
+                ordinais[n_entradas++] = ordinal; \
+            } \
+            contador_registros_ativos++; \
+        } \
+    } \
+\
+    uint32_t impressao = impressao_dados(fileno(f_dados), tamanho_dados); \
+    fclose(f_dados); \
+    free(bloco); \
+    if (bloom) { \
+        bloom->cab.geracao = geracao[TABELA]; \
+        bloom->cab.tamanho_dados = tamanho_dados; \
+        bloom_gravar(TABELA, bloom, arq_dados); \
+        bloom_liberar(bloom); \
+    } \
+    IndiceCompacto ic; \
+    int ok = indice_compacto_montar(&ic, chaves, ordinais, n_entradas); \
+    if (ok) { /* Para qual .bin o indice vale (ver indice_atualizado) */ \
+        ic.cab.geracao = geracao[TABELA]; \
+        ic.cab.tamanho_dados = tamanho_dados; \
+        ic.cab.impressao_dados = impressao; \
+        ok = indice_compacto_gravar(&ic, arq_indice); \
+    } \
+    long bytes_indice = indice_compacto_bytes(&ic); \
+    indice_compacto_liberar(&ic); \
+    free(chaves); \
+    free(ordinais); \
+    if (!ok) { \
+        printf("ERRO ao gravar o indice %s.\n", arq_indice); \
+        return; \
+    } \
+    instr_registrar(OP_CRIAR_INDICE, t0); \
+    printf("Indice criado com %ld entradas (%ld bytes; %.1f bytes por entrada).\n", n_entradas, \
+           bytes_indice, n_entradas > 0 ? (double)bytes_indice / (double)n_entradas : 0.0); \
+    ResultadoCompressao rc; \
+    if (layout_comprimido && comprimir_tabela(TABELA, arq_dados, sizeof(TIPO), offsetof(TIPO, CAMPO_CHAVE), &rc)) \
+        printf("Copia comprimida: %ld blocos, %.1f%% do original.\n", rc.blocos, \
+               rc.bytes_origem > 0 ? 100.0 * (double)rc.bytes_comprimidos / (double)rc.bytes_origem : 0.0); \
+    ResultadoAprendido ra; \
+    if (gerar_aprendido && indice_aprendido_criar(TABELA, arq_dados, sizeof(TIPO), offsetof(TIPO, CAMPO_CHAVE), \
+                                                  epsilon_aprendido, &ra)) \
+        printf("Indice aprendido: %ld segmentos (%ld bytes; eps = %d).\n", ra.segmentos, ra.bytes, epsilon_aprendido); \
+} \
+\
+/* Busca com o indice parcial (sem interacao): \
+ * ETAPA 1: Carrega o arquivo de indice (pequeno, compacto) para a RAM. \
+ * ETAPA 2: Busca binaria no indice para achar o BLOCO onde a chave \
+ *          *deveria* estar (decodificando so as entradas sondadas). \
+ * ETAPA 3: fseek no .bin para o inicio do bloco. \
+ * ETAPA 4: Le o bloco inteiro (BLOCO_INDICE registros) com UM read e \
+ *          busca sequencialmente nele. \
+ * Retorna o OFFSET (registro ativo copiado em 'saida'), -1 se nao \
+ * encontrar, -2 se estiver removido e -3 se o indice/dados nao puderem \
+ * ser lidos. */ \
+long buscar_##NOME##_com_indice(const char *arq_indice, const char *arq_dados, TIPO_CHAVE id, TIPO *saida) { \
+    unsigned long long t0 = instr_inicio(); \
+\
+    /* Layout comprimido: o diretorio de blocos substitui o .idx e so um \
+     * bloco e descomprimido */ \
+    TIPO *bloco = malloc(sizeof(TIPO) * BLOCO_INDICE); \
+    if (!bloco) { instr_registrar(OP_BUSCA_INDICE, t0); return -3; } \
+    long primeiro_z = 0; \
+    long n_z = buscar_bloco_comprimido(TABELA, arq_dados, sizeof(TIPO), (int64_t)id, bloco, &primeiro_z); \
+    if (n_z >= 0) { \
+        long resultado_z = -1; \
+        for (long i = 0; i < n_z && bloco[i].CAMPO_CHAVE <= id; i++) { \
+            if (bloco[i].CAMPO_CHAVE != id) continue; \
+            *saida = bloco[i]; \
+            resultado_z = (saida->ativo == 'S') ? (primeiro_z + i) * (long)sizeof(TIPO) : -2; \
+            break; \
+        } \
+        free(bloco); \
+        instr_registrar(OP_BUSCA_INDICE, t0); \
+        return resultado_z; \
+    } \
+\
+    IndiceCompacto ic; \
+    if (!indice_compacto_carregar_atual(&ic, arq_indice, arq_dados, TABELA) || ic.cab.n_entradas == 0) { \
+        indice_compacto_liberar(&ic); \
+        free(bloco); \
+        instr_registrar(OP_BUSCA_INDICE, t0); \
+        return -3; \
+    } \
+    int64_t ordinal_bloco = indice_compacto_bloco(&ic, (int64_t)id); \
+    indice_compacto_liberar(&ic); \
+    if (ordinal_bloco < 0) { free(bloco); instr_registrar(OP_BUSCA_INDICE, t0); return -1; } \
+\
+    FILE *f_dados = io_fopen(arq_dados, "rb"); \
+    if (!f_dados) { free(bloco); instr_registrar(OP_BUSCA_INDICE, t0); return -3; } \
+    /* Acesso pontual: sem readahead do kernel e sem buffer do stdio, o \
+     * bloco inteiro vem num unico read() */ \
+    setvbuf(f_dados, NULL, _IONBF, 0); \
+    posix_fadvise(fileno(f_dados), 0, 0, POSIX_FADV_RANDOM); \
+    long offset = (long)ordinal_bloco * (long)sizeof(TIPO); \
+    io_fseek(f_dados, offset, SEEK_SET); \
+    size_t lidos = io_fread(bloco, sizeof(TIPO), BLOCO_INDICE, f_dados); \
+    fclose(f_dados); \
+\
+    long resultado = -1; \
+    for (size_t i = 0; i < lidos && bloco[i].CAMPO_CHAVE <= id; i++, offset += (long)sizeof(TIPO)) { \
+        if (bloco[i].CAMPO_CHAVE != id) continue; \
+        *saida = bloco[i]; \
+        resultado = (saida->ativo == 'S') ? offset : -2; \
+        break; \
+    } \
+    free(bloco); \
+    instr_registrar(OP_BUSCA_INDICE, t0); \
+    return resultado; \
+} \
+\
+/* Busca em lote: saidas[i] e resultados[i] correspondem a chaves[i]. */ \
+long buscar_##NOME##_em_lote(const char *arq_indice, const char *arq_dados, const TIPO_CHAVE *chaves, long n, \
+                             TIPO *saidas, long *resultados, ResultadoLote *r) { \
+    return buscar_em_lote(TABELA, arq_indice, arq_dados, sizeof(TIPO), offsetof(TIPO, CAMPO_CHAVE), offsetof(TIPO, ativo), \
+                          chaves, n, saidas, resultados, r); \
+} \
+\
+/* Pesquisas binarias com ate 'profundidade' leituras em voo. */ \
+long pesquisa_##NOME##_assincrona(const char *arq_bin, const char *arq_indice, const TIPO_CHAVE *chaves, long n, \
+                                  TIPO *saidas, long *resultados, int profundidade, ResultadoLote *r) { \
+    return pesquisar_assincrono(TABELA, arq_bin, arq_indice, sizeof(TIPO), offsetof(TIPO, CAMPO_CHAVE), \
+                                offsetof(TIPO, ativo), chaves, n, saidas, resultados, profundidade, r); \
+} \
+\
+/* Busca pelo indice aprendido (janela de +-epsilon registros). */ \
+long buscar_##NOME##_aprendido(const char *arq_dados, TIPO_CHAVE chave, TIPO *saida) { \
+    return buscar_aprendido(TABELA, arq_dados, sizeof(TIPO), offsetof(TIPO, CAMPO_CHAVE), offsetof(TIPO, ativo), \
+                            (int64_t)chave, saida); \
+}
+
+DEFINIR_TABELA(produto, TABELA_PRODUTOS, Produto, product_id, int64_t, OP_BUSCA_INDICE_PRODUTO)
+DEFINIR_TABELA(compra, TABELA_COMPRAS, Compra, order_id, long long, OP_BUSCA_INDICE_COMPRA)
+
+// --- LAYOUT EM BLOCOS COM FOLGA (INSERCAO SO NO BLOCO DE DESTINO) ---
+//
+// Alternativa ao .bin denso, em que manter a ordem exige reescrever o
+// arquivo a cada grupo de insercoes. O arquivo e dividido em blocos de
+// BLOCO_INDICE posicoes, alinhados com o indice parcial (uma entrada no
+// inicio de cada bloco), e cada bloco e gravado so em parte cheio. Os
+// registros reais ficam no inicio do bloco, em ordem; as posicoes livres do
+// fim sao VAGAS: ativo = 'V' e a chave do ultimo registro real do bloco.
+// Assim o arquivo continua ordenado (as pesquisas binarias, numa chave
+// repetida por uma vaga, seguem para a esquerda) e as varreduras pulam as
+// vagas como pulam os removidos.
+// Uma insercao desloca registros so dentro do bloco de destino. Um bloco
+// cheio e dividido em partes iguais e o indice ganha uma entrada, sem mexer
+// nos outros blocos. A nova geracao nao e ordenada nem intercalada: os
+// trechos intactos sao clonados do .bin atual (clonar_trecho) e so as
+// imagens dos blocos tocados passam pelo processo. Ela e publicada com
+// rename como no layout denso, entao a geracao publicada nunca muda sob um
+// leitor (pread ou mmap). O layout de cada tabela fica marcado em ARQ_GERACOES.
+
+#define PREENCHIMENTO_PADRAO 80 // % de cada bloco ocupado no comando "blocos"
+
+int preenchimento_blocos = 0; // AED2_PREENCHIMENTO: % ocupado ao gravar do CSV; 0 = .bin denso
+
+/**
+ * @brief Preenche 'vaga' como posicao livre depois de 'ultimo' (o ultimo
+ * registro real do bloco): mesma chave, ativo = 'V' e o resto zerado.
+ */
+void preencher_vaga(char *vaga, const char *ultimo, size_t tam_registro, size_t offset_chave, size_t offset_ativo) {
+    memset(vaga, 0, tam_registro);
+    memcpy(vaga + offset_chave, ultimo + offset_chave, sizeof(int64_t));
+    vaga[offset_ativo] = 'V';
+    vaga[offset_ativo + 1] = '\n'; // 'newline' vem logo depois de 'ativo' nas duas structs
+}
+
+/** @brief Registros reais por bloco com 'preenchimento'% de ocupacao (0 = denso). */
+int registros_por_bloco(int preenchimento) {
+    if (preenchimento <= 0) return 0;
+    if (preenchimento > 100) preenchimento = 100;
+    int n = BLOCO_INDICE * preenchimento / 100;
+    return n > 0 ? n : 1;
+}
+
+// Grava registros ja ordenados num .bin denso ou em blocos com folga
+typedef struct {
+    FILE *f;
+    size_t tam_registro, offset_chave, offset_ativo;
+    int por_bloco; // Registros reais por bloco (0 = denso)
+    int no_bloco;  // Registros reais ja gravados no bloco atual
+    char *ultimo;  // Ultimo registro gravado (chave das vagas)
+    char *vagas;
+    long gravados; // Registros reais
+    int ok;
+} GravadorBlocos;
+
+int gravador_iniciar(GravadorBlocos *g, FILE *f, size_t tam_registro, size_t offset_chave, size_t offset_ativo,
+                     int preenchimento) {
+    memset(g, 0, sizeof(*g));
+    g->f = f;
+    g->tam_registro = tam_registro;
+    g->offset_chave = offset_chave;
+    g->offset_ativo = offset_ativo;
+    g->por_bloco = registros_por_bloco(preenchimento);
+    g->ultimo = malloc(tam_registro);
+    g->vagas = g->por_bloco ? malloc(tam_registro * BLOCO_INDICE) : NULL;
+    g->ok = g->ultimo && (!g->por_bloco || g->vagas);
+    return g->ok;
+}
+
+static void gravador_fechar_bloco(GravadorBlocos *g) {
+    size_t n = (size_t)(BLOCO_INDICE - g->no_bloco);
+    for (size_t i = 0; i < n; i++)
+        preencher_vaga(g->vagas + i * g->tam_registro, g->ultimo, g->tam_registro, g->offset_chave, g->offset_ativo);
+    if (n > 0 && io_fwrite(g->vagas, g->tam_registro, n, g->f) != n) g->ok = 0;
+    g->no_bloco = 0;
+}
+
+int gravador_escrever(GravadorBlocos *g, const void *registro) {
+    if (io_fwrite(registro, g->tam_registro, 1, g->f) != 1) g->ok = 0;
+    memcpy(g->ultimo, registro, g->tam_registro);
+    g->gravados++;
+    if (g->por_bloco && ++g->no_bloco == g->por_bloco) gravador_fechar_bloco(g);
+    return g->ok;
+}
+
+/**
+ * @brief Completa o ultimo bloco com vagas e libera o gravador (o FILE
+ * continua aberto). @return 1 se tudo foi gravado.
+ */
+int gravador_finalizar(GravadorBlocos *g) {
+    if (g->por_bloco && g->no_bloco > 0) gravador_fechar_bloco(g);
+    free(g->ultimo);
+    free(g->vagas);
+    g->ultimo = g->vagas = NULL;
+    return g->ok;
+}
+
+// Primeiras chaves dos blocos, para manter o indice (uma entrada por bloco)
+// sem varrer o .bin
+typedef struct {
+    int64_t *chaves;
+    int64_t n_blocos;
+} IndiceEmBlocos;
+
+/**
+ * @brief Le as primeiras chaves dos blocos do indice da geracao atual, se
+ * ele vale para o .bin e tem uma entrada no inicio de cada bloco.
+ * @return 1 se 'ie' foi preenchido.
+ */
+int indice_em_blocos_ler(TabelaDados tabela, const char *arq_indice, const char *arq_bin, size_t tam_registro,
+                         IndiceEmBlocos *ie) {
+    memset(ie, 0, sizeof(*ie));
+    struct stat st;
+    IndiceCompacto ic;
+    if (stat(arq_bin, &st) != 0 || !indice_compacto_carregar_atual(&ic, arq_indice, arq_bin, tabela)) return 0;
+    int64_t bytes_bloco = (int64_t)tam_registro * BLOCO_INDICE;
+    int64_t n_blocos = ((int64_t)st.st_size + bytes_bloco - 1) / bytes_bloco;
+    if (ic.cab.n_entradas == n_blocos && n_blocos > 0) ie->chaves = malloc((size_t)n_blocos * sizeof(int64_t));
+    for (int64_t i = 0; ie->chaves && i < n_blocos; i++) {
+        int64_t ordinal;
+        indice_entrada(&ic, i, &ie->chaves[i], &ordinal);
+        if (ordinal != i * BLOCO_INDICE) { free(ie->chaves); ie->chaves = NULL; }
+    }
+    indice_compacto_liberar(&ic);
+    if (ie->chaves) ie->n_blocos = n_blocos;
+    return ie->chaves != NULL;
+}
+
+/**
+ * @brief Grava o indice com uma entrada por bloco para a geracao recem
+ * publicada de 'arq_bin'. Libera ie->chaves.
+ */
+void indice_em_blocos_gravar(TabelaDados tabela, const char *arq_indice, const char *arq_bin, IndiceEmBlocos *ie) {
+    int64_t *ordinais = malloc((size_t)ie->n_blocos * sizeof(int64_t) + 1);
+    uint64_t geracao[N_TABELAS];
+    ler_geracoes(geracao);
+    int fd = open(arq_bin, O_RDONLY);
+    struct stat st;
+    IndiceCompacto ic;
+    if (ordinais && ie->chaves && fd >= 0 && fstat(fd, &st) == 0) {
+        for (int64_t i = 0; i < ie->n_blocos; i++) ordinais[i] = i * BLOCO_INDICE;
+        if (indice_compacto_montar(&ic, ie->chaves, ordinais, ie->n_blocos)) {
+            indice_compacto_carimbar(&ic, geracao[tabela], fd, (int64_t)st.st_size);
+            indice_compacto_gravar(&ic, arq_indice);
+        }
+        indice_compacto_liberar(&ic);
+    }
+    if (fd >= 0) close(fd);
+    free(ordinais);
+    free(ie->chaves);
+    ie->chaves = NULL;
+}
+
+// Bloco lido do .bin e alterado em memoria pelo grupo
+typedef struct {
+    int64_t bloco;   // Posicao do bloco no .bin (em blocos)
+    int n;           // Registros reais; passa de BLOCO_INDICE se o bloco vai ser dividido
+    char *registros; // Registros reais em ordem
+} BlocoAlterado;
+
+static int comparar_bloco_alterado(const void *a, const void *b) {
+    int64_t x = ((const BlocoAlterado*)a)->bloco, y = ((const BlocoAlterado*)b)->bloco;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Bloco de destino de 'chave': o ultimo cuja primeira chave e <=
+ * 'chave' (o bloco 0 recebe tambem as menores que todas). Pesquisa binaria
+ * lendo so a chave do primeiro registro de cada bloco sondado.
+ */
+static int64_t bloco_da_chave(int fd, size_t bytes_bloco, size_t offset_chave, int64_t n_blocos, int64_t chave) {
+    int64_t inicio = 1, fim = n_blocos - 1, achado = 0;
+    while (inicio <= fim) {
+        int64_t meio = inicio + (fim - inicio) / 2, k;
+        if (pread(fd, &k, sizeof(k), (off_t)(meio * (int64_t)bytes_bloco + (int64_t)offset_chave)) != sizeof(k)) break;
+        CONTAR(estat_io.bytes_lidos, sizeof(k));
+        if (k <= chave) { achado = meio; inicio = meio + 1; }
+        else fim = meio - 1;
+    }
+    return achado;
+}
+
+/**
+ * @brief Bloco 'bloco' em memoria: o ja alterado pelo grupo ou, na primeira
+ * vez, lido do .bin com espaco para 'capacidade' registros.
+ */
+static BlocoAlterado *obter_bloco_alterado(BlocoAlterado *alterados, int *n_alterados, int64_t bloco, int capacidade,
+                                           int fd, size_t tam_registro, size_t offset_ativo) {
+    for (int i = 0; i < *n_alterados; i++)
+        if (alterados[i].bloco == bloco) return &alterados[i];
+    BlocoAlterado *a = &alterados[*n_alterados];
+    a->bloco = bloco;
+    a->n = 0;
+    a->registros = malloc((size_t)capacidade * tam_registro);
+    if (!a->registros) return NULL;
+    size_t bytes_bloco = tam_registro * BLOCO_INDICE;
+    ssize_t lidos = pread(fd, a->registros, bytes_bloco, (off_t)(bloco * (int64_t)bytes_bloco));
+    if (lidos <= 0) { free(a->registros); a->registros = NULL; return NULL; }
+    CONTAR(estat_io.registros_lidos, (size_t)lidos / tam_registro);
+    CONTAR(estat_io.bytes_lidos, (size_t)lidos);
+    // Os registros reais ficam no inicio; a primeira vaga fecha o bloco
+    long n_lidos = (long)((size_t)lidos / tam_registro);
+    while (a->n < n_lidos && a->registros[(size_t)a->n * tam_registro + offset_ativo] != 'V') a->n++;
+    (*n_alterados)++;
+    return a;
+}
+
+/** @brief Insere 'registro' no bloco em ordem (substitui a mesma chave, se removida). */
+static void bloco_inserir(BlocoAlterado *a, const char *registro, size_t tam_registro, size_t offset_chave) {
+    int64_t chave, k = 0;
+    memcpy(&chave, registro + offset_chave, sizeof(chave));
+    int inicio = 0, fim = a->n; // Primeira posicao com chave >= 'chave'
+    while (inicio < fim) {
+        int meio = (inicio + fim) / 2;
+        memcpy(&k, a->registros + (size_t)meio * tam_registro + offset_chave, sizeof(k));
+        if (k < chave) inicio = meio + 1;
+        else fim = meio;
+    }
+    char *destino = a->registros + (size_t)inicio * tam_registro;
+    if (inicio < a->n && (memcpy(&k, destino + offset_chave, sizeof(k)), k == chave)) {
+        memcpy(destino, registro, tam_registro); // Registro removido sendo reaproveitado
+        return;
+    }
+    memmove(destino + tam_registro, destino, (size_t)(a->n - inicio) * tam_registro);
+    memcpy(destino, registro, tam_registro);
+    a->n++;
+}
+
+/**
+ * @brief Publica as mudancas de um grupo numa tabela no layout em blocos.
+ * Cada insercao vai para o seu bloco de destino (bloco_da_chave) e as
+ * remocoes desses blocos entram na mesma imagem. Um bloco que passa de
+ * BLOCO_INDICE registros e dividido em partes iguais completadas com vagas.
+ * A nova geracao clona os trechos intactos e grava as imagens na posicao dos
+ * blocos tocados; ela e publicada com rename.
+ * Deve ser chamada com a trava do escritor adquirida.
+ * @param novos Registros a inserir, ordenados pela chave.
+ * @param offsets_removidas Offsets dos registros a remover.
+ * @param ie Primeiras chaves dos blocos da geracao atual (indice_em_blocos_ler),
+ * atualizadas para a nova; chaves = NULL se o indice nao valia.
+ * @return 1 se publicou, 0 em caso de erro e -1 se nao ha .bin (o chamador
+ * usa a copia do layout denso).
+ */
+int publicar_em_blocos(const char *arq_bin, size_t tam_registro, size_t offset_chave, size_t offset_ativo,
+                       const char *novos, int n_novos, const long *offsets_removidas, int n_removidas,
+                       IndiceEmBlocos *ie) {
+    int fd = open(arq_bin, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return -1; }
+    size_t bytes_bloco = tam_registro * BLOCO_INDICE;
+    int64_t n_blocos = ((int64_t)st.st_size + (int64_t)bytes_bloco - 1) / (int64_t)bytes_bloco;
+    if (ie->chaves && ie->n_blocos != n_blocos) { free(ie->chaves); ie->chaves = NULL; }
+
+    // 1. Remocoes e insercoes nas imagens dos blocos tocados
+    int capacidade = BLOCO_INDICE + n_novos, n_alterados = 0;
+    BlocoAlterado *alterados = calloc((size_t)(n_novos + n_removidas) + 1, sizeof(BlocoAlterado));
+    int ok = alterados != NULL;
+    for (int j = 0; ok && j < n_removidas; j++) {
+        BlocoAlterado *a = obter_bloco_alterado(alterados, &n_alterados, offsets_removidas[j] / (long)bytes_bloco,
+                                                capacidade, fd, tam_registro, offset_ativo);
+        long pos = (offsets_removidas[j] % (long)bytes_bloco) / (long)tam_registro;
+        if (!a) ok = 0;
+        else if (pos < a->n) a->registros[(size_t)pos * tam_registro + offset_ativo] = 'N';
+    }
+    for (int j = 0; ok && j < n_novos; j++) {
+        const char *registro = novos + (size_t)j * tam_registro;
+        int64_t chave;
+        memcpy(&chave, registro + offset_chave, sizeof(chave));
+        BlocoAlterado *a = obter_bloco_alterado(alterados, &n_alterados,
+                                                bloco_da_chave(fd, bytes_bloco, offset_chave, n_blocos, chave),
+                                                capacidade, fd, tam_registro, offset_ativo);
+        if (!a) ok = 0;
+        else bloco_inserir(a, registro, tam_registro, offset_chave);
+    }
+    if (ok) qsort(alterados, (size_t)n_alterados, sizeof(BlocoAlterado), comparar_bloco_alterado);
+
+    // 2. Imagens: cada bloco em 'partes' blocos completados com vagas
+    int n_imagens = 0;
+    for (int i = 0; ok && i < n_alterados; i++) {
+        int partes = (alterados[i].n + BLOCO_INDICE - 1) / BLOCO_INDICE;
+        n_imagens += partes;
+        if (partes > 1) CONTAR(estat_io.blocos_divididos, (unsigned long long)(partes - 1));
+    }
+    char *dados = ok ? malloc((size_t)n_imagens * bytes_bloco + 1) : NULL;
+    int64_t *chaves_novas = ie->chaves ? malloc((size_t)(n_blocos + n_imagens) * sizeof(int64_t)) : NULL;
+    ok = ok && dados;
+    int k = 0;
+    int64_t n_novas = 0, proximo = 0; // proximo: bloco antigo ainda nao copiado para chaves_novas
+    for (int i = 0; ok && i < n_alterados; i++) {
+        const BlocoAlterado *a = &alterados[i];
+        int partes = (a->n + BLOCO_INDICE - 1) / BLOCO_INDICE;
+        for (; chaves_novas && proximo < a->bloco; proximo++) chaves_novas[n_novas++] = ie->chaves[proximo];
+        proximo = a->bloco + 1;
+        for (int p = 0; p < partes; p++, k++) {
+            int de = (int)((long)a->n * p / partes), ate = (int)((long)a->n * (p + 1) / partes);
+            char *imagem = dados + (size_t)k * bytes_bloco;
+            memcpy(imagem, a->registros + (size_t)de * tam_registro, (size_t)(ate - de) * tam_registro);
+            for (int v = ate - de; v < BLOCO_INDICE; v++)
+                preencher_vaga(imagem + (size_t)v * tam_registro, imagem + (size_t)(ate - de - 1) * tam_registro,
+                               tam_registro, offset_chave, offset_ativo);
+            if (chaves_novas) memcpy(&chaves_novas[n_novas++], imagem + offset_chave, sizeof(int64_t));
+        }
+    }
+    for (; chaves_novas && proximo < n_blocos; proximo++) chaves_novas[n_novas++] = ie->chaves[proximo];
+
+    // 3. Nova geracao: trechos intactos clonados, imagens na posicao dos blocos tocados
+    if (ok) {
+        char caminho_tmp[1024];
+        caminho_temporario(arq_bin, caminho_tmp, sizeof(caminho_tmp));
+        FILE *ftmp = io_fopen(caminho_tmp, "wb");
+        int64_t copiado_ate = 0; // Bytes do .bin atual ja copiados
+        ok = ftmp != NULL;
+        k = 0;
+        for (int i = 0; ok && i < n_alterados; i++) {
+            int64_t inicio_bloco = alterados[i].bloco * (int64_t)bytes_bloco;
+            size_t registros = (size_t)((alterados[i].n + BLOCO_INDICE - 1) / BLOCO_INDICE) * BLOCO_INDICE;
+            ok = clonar_trecho(fd, ftmp, copiado_ate, inicio_bloco) &&
+                 io_fwrite(dados + (size_t)k * bytes_bloco, tam_registro, registros, ftmp) == registros;
+            k += (int)(registros / BLOCO_INDICE);
+            copiado_ate = inicio_bloco + (int64_t)bytes_bloco;
+        }
+        if (ok) ok = clonar_trecho(fd, ftmp, copiado_ate, (int64_t)st.st_size);
+        if (ftmp && !ok) { fclose(ftmp); remove(caminho_tmp); }
+        else if (ftmp) ok = publicar_temporario(ftmp, caminho_tmp, arq_bin);
+        if (ok) {
+            CONTAR(estat_io.blocos_regravados, (unsigned long long)n_imagens);
+            CONTAR(estat_io.blocos_copias, 1);
+        }
+    }
+    close(fd);
+
+    free(ie->chaves);
+    ie->chaves = ok ? chaves_novas : NULL;
+    ie->n_blocos = n_novas;
+    if (!ok) free(chaves_novas);
+    for (int i = 0; i < n_alterados; i++) free(alterados[i].registros);
+    free(alterados);
+    free(dados);
+    return ok;
+}
+
+// Recarimbados por reorganizar_em_blocos (ver AGREGADOS MATERIALIZADOS e ITENS DOS PEDIDOS)
+void agregados_recarimbar(TabelaDados tabela, uint64_t geracao_anterior, int64_t tamanho_anterior);
+void itens_recarimbar(uint64_t geracao_anterior);
+
+/**
+ * @brief Regrava o .bin de uma tabela no layout em blocos com
+ * 'preenchimento'% de cada bloco ocupado (0 = volta ao layout denso). As
+ * vagas sao descartadas e os registros reais (inclusive os removidos)
+ * redistribuidos; a nova geracao e publicada com rename e marcada em
+ * ARQ_GERACOES. Os agregados (e, para compras, o indice de itens) sao
+ * recarimbados para a nova geracao; o indice da tabela precisa ser recriado depois.
+ * @return Registros reais gravados, ou -1 em caso de erro.
+ */
+long reorganizar_em_blocos(TabelaDados tabela, const char *arq_bin, size_t tam_registro, size_t offset_chave,
+                           size_t offset_ativo, int preenchimento) {
+    int trava = trava_escrita_adquirir();
+    uint64_t geracao_anterior[N_TABELAS];
+    struct stat st_anterior;
+    ler_geracoes(geracao_anterior);
+    int64_t tamanho_anterior = stat(arq_bin, &st_anterior) == 0 ? (int64_t)st_anterior.st_size : -1;
+    char caminho_tmp[1024];
+    caminho_temporario(arq_bin, caminho_tmp, sizeof(caminho_tmp));
+    FILE *fsrc = io_abrir_sequencial(arq_bin);
+    FILE *ftmp = fsrc ? io_fopen(caminho_tmp, "wb") : NULL;
+    char *bloco = malloc(tam_registro * REGISTROS_POR_LEITURA);
+    GravadorBlocos g;
+    int ok = ftmp && bloco && gravador_iniciar(&g, ftmp, tam_registro, offset_chave, offset_ativo, preenchimento);
+    if (ok) {
+        size_t lidos;
+        while (ok && (lidos = io_fread(bloco, tam_registro, REGISTROS_POR_LEITURA, fsrc)) > 0) {
+            for (size_t i = 0; ok && i < lidos; i++) {
+                const char *registro = bloco + i * tam_registro;
+                if (registro[offset_ativo] != 'V') ok = gravador_escrever(&g, registro);
+            }
+        }
+        ok = gravador_finalizar(&g) && ok;
+    }
+    long gravados = ok ? g.gravados : -1;
+    free(bloco);
+    if (fsrc) fclose(fsrc);
+    if (ftmp && !ok) { fclose(ftmp); remove(caminho_tmp); }
+    else if (ftmp && !publicar_temporario(ftmp, caminho_tmp, arq_bin)) gravados = -1;
+    if (gravados >= 0) {
+        avancar_geracao_layout(tabela, preenchimento > 0);
+        agregados_recarimbar(tabela, geracao_anterior[tabela], tamanho_anterior);
+        if (tabela == TABELA_COMPRAS) itens_recarimbar(geracao_anterior[tabela]);
+    }
+    trava_escrita_liberar(trava);
+    return gravados;
+}
+
+// --- LOG DE ESCRITA ANTECIPADA (WAL) E GROUP COMMIT ---
+//
+// Toda insercao/remocao e primeiro gravada no ARQ_WAL e so depois aplicada
+// aos arquivos .bin. As operacoes sao acumuladas em um grupo de ate
+// WAL_GRUPO_MAX entradas e confirmadas com UM unico fsync (group commit).
+// Se o programa cair no meio da aplicacao, o grupo e re-aplicado na
+// inicializacao (wal_recuperar). Grupos sem o registro de COMMIT nao
+// chegaram a ser confirmados e sao descartados.
+
+#define WAL_MAGICO 0x4C415741u // "AWAL" - marca o inicio de cada registro do log
+
+typedef enum {
+    WAL_INSERIR_PRODUTO = 1,
+    WAL_REMOVER_PRODUTO = 2,
+    WAL_INSERIR_COMPRA  = 3,
+    WAL_REMOVER_COMPRA  = 4,
+    WAL_COMMIT          = 5  // Fim de um grupo confirmado (sem carga util)
+} TipoOperacaoWAL;
+
+typedef struct {
+    uint32_t magico;
+    uint32_t tipo;     // TipoOperacaoWAL
+    uint32_t tamanho;  // Bytes da carga util gravados logo apos o cabecalho
+    uint32_t checksum; // FNV-1a da carga util (detecta escrita parcial)
+} CabecalhoWAL;
+
+typedef struct {
+    TipoOperacaoWAL tipo;
+    union {
+        Produto produto; // WAL_INSERIR_PRODUTO
+        Compra compra;   // WAL_INSERIR_COMPRA
+        int64_t chave;   // WAL_REMOVER_PRODUTO / WAL_REMOVER_COMPRA
+    } dados;
+} OperacaoWAL;
+
+// Grupo em formacao (ainda nao gravado no log)
+OperacaoWAL wal_pendentes[WAL_GRUPO_MAX];
+int wal_n_pendentes = 0;
+
+/**
+ * @brief Tamanho da carga util gravada no log para cada tipo de operacao.
+ * @return 0 para tipos desconhecidos (registro corrompido).
+ */
+size_t tamanho_carga_wal(uint32_t tipo) {
+    switch (tipo) {
+        case WAL_INSERIR_PRODUTO: return sizeof(Produto);
+        case WAL_INSERIR_COMPRA:  return sizeof(Compra);
+        case WAL_REMOVER_PRODUTO:
+        case WAL_REMOVER_COMPRA:  return sizeof(int64_t);
+        default: return 0;
+    }
+}
+
+/**
+ * @brief Grava um grupo de operacoes + COMMIT no final do log e faz UM fsync.
+ * So depois que esta funcao retorna 1 as operacoes podem ser aplicadas.
+ */
+int wal_gravar_grupo(const OperacaoWAL *ops, int n) {
+    FILE *f = io_fopen(ARQ_WAL, "ab");
+    if (!f) return 0;
+
+    for (int i = 0; i < n; i++) {
+        size_t tam = tamanho_carga_wal(ops[i].tipo);
+        CabecalhoWAL cab = {WAL_MAGICO, (uint32_t)ops[i].tipo, (uint32_t)tam, checksum_fnv1a(&ops[i].dados, tam)};
+        io_fwrite(&cab, sizeof(cab), 1, f);
+        io_fwrite(&ops[i].dados, tam, 1, f);
+    }
+    CabecalhoWAL commit = {WAL_MAGICO, WAL_COMMIT, 0, 0};
+    io_fwrite(&commit, sizeof(commit), 1, f);
+
+    int ok = !ferror(f) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = 0;
+    return ok;
+}
+
+/**
+ * @brief Esvazia o log depois que os grupos foram aplicados e os .bin
+ * sincronizados (checkpoint). Nao precisa de fsync: se o truncamento se
+ * perder, a re-aplicacao do log e idempotente.
+ */
+void wal_truncar(void) {
+    FILE *f = io_fopen(ARQ_WAL, "wb");
+    if (f) fclose(f);
+}
+
+int comparar_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Publica uma NOVA GERACAO do arquivo .bin a partir da atual.
+ * Le e grava em streaming, sem carregar o arquivo inteiro na RAM:
+ * - 'novos' (ordenados) sao intercalados; se a chave ja existe no arquivo
+ *   (registro removido sendo reaproveitado) o registro e substituido.
+ * - As chaves de 'removidas' (ordenadas) sao gravadas com 'ativo' = 'N'.
+ * A copia vai para um temporario publicado com rename, entao quem ja abriu
+ * o arquivo continua lendo a geracao anterior, inteira.
+ * @return 1 se o arquivo foi publicado, 0 em caso de erro.
+ */
+int publicar_geracao_tabela(const char *arq_bin, size_t tam_registro,
+                            size_t offset_chave, size_t offset_ativo,
+                            int (*comparador)(const void*, const void*),
+                            const char *novos, int n_novos,
+                            const int64_t *removidas, int n_removidas) {
+    char caminho_tmp[1024];
+    caminho_temporario(arq_bin, caminho_tmp, sizeof(caminho_tmp));
+
+    FILE *fsrc = io_fopen(arq_bin, "rb"); // Pode nao existir ainda
+    FILE *ftmp = io_fopen(caminho_tmp, "wb");
+    if (!ftmp) { if (fsrc) fclose(fsrc); return 0; }
+
+    char *registro = malloc(tam_registro);
+    if (!registro) { if (fsrc) fclose(fsrc); fclose(ftmp); remove(caminho_tmp); return 0; }
+
+    int i = 0, r = 0;
+    while (fsrc && io_fread(registro, tam_registro, 1, fsrc) == 1) {
+        // Grava antes todos os novos que vem antes do registro atual
+        while (i < n_novos && comparador(novos + (size_t)i * tam_registro, registro) < 0) {
+            io_fwrite(novos + (size_t)i * tam_registro, tam_registro, 1, ftmp);
+            i++;
+        }
+        if (i < n_novos && comparador(novos + (size_t)i * tam_registro, registro) == 0) {
+            io_fwrite(novos + (size_t)i * tam_registro, tam_registro, 1, ftmp); // Substitui
+            i++;
+            continue;
+        }
+        int64_t chave;
+        memcpy(&chave, registro + offset_chave, sizeof(chave));
+        while (r < n_removidas && removidas[r] < chave) r++;
+        if (r < n_removidas && removidas[r] == chave) registro[offset_ativo] = 'N';
+        io_fwrite(registro, tam_registro, 1, ftmp);
+    }
+    if (i < n_novos) io_fwrite(novos + (size_t)i * tam_registro, tam_registro, n_novos - i, ftmp);
+
+    free(registro);
+    if (fsrc) fclose(fsrc);
+    return publicar_temporario(ftmp, caminho_tmp, arq_bin);
+}
+
+/**
+ * @brief Publica uma nova geracao de 'arq_bin' que so difere da atual no
+ * byte 'ativo' dos registros em 'offsets' (grupo que so remove): o arquivo
+ * e clonado num temporario, os bytes sao trocados na copia e ela e
+ * publicada com rename.
+ * @return 1 se o arquivo foi publicado, 0 em caso de erro.
+ */
+int publicar_remocoes(const char *arq_bin, const long *offsets, int n, size_t offset_ativo) {
+    char caminho_tmp[1024];
+    caminho_temporario(arq_bin, caminho_tmp, sizeof(caminho_tmp));
+    int fd = open(arq_bin, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    FILE *ftmp = fstat(fd, &st) == 0 ? io_fopen(caminho_tmp, "wb") : NULL;
+    int ok = ftmp && clonar_trecho(fd, ftmp, 0, (int64_t)st.st_size);
+    close(fd);
+    if (!ftmp) return 0;
+    for (int j = 0; ok && j < n; j++) {
+        ok = pwrite(fileno(ftmp), "N", 1, (off_t)(offsets[j] + (long)offset_ativo)) == 1;
+        CONTAR(estat_io.bytes_escritos, 1);
+    }
+    if (!ok) { fclose(ftmp); remove(caminho_tmp); return 0; }
+    return publicar_temporario(ftmp, caminho_tmp, arq_bin);
+}
+
+// Mantidos por quem publica uma geracao (ver AGREGADOS MATERIALIZADOS e ITENS DOS PEDIDOS)
+void agregados_apos_escrita(TabelaDados tabela, uint64_t geracao_anterior, int64_t tamanho_anterior,
+                            const void *novos, int n_novos, const void *antigos, int n_antigos);
+int agregados_reconstruir(void);
+int itens_apos_escrita(uint64_t geracao_anterior, const Compra *novos, int n_novos,
+                       const int64_t *removidas, int n_removidas, ItemPedido **saem, int *n_saem);
+int criar_indice_itens(const char *arq_dados, const char *arq_indice);
+
+/**
+ * @brief Aplica, em ordem, as operacoes de UMA tabela contidas em um grupo.
+ * As operacoes sao idempotentes, o que permite re-aplicar o log na recuperacao:
+ * - Insercao de chave ativa: ignorada (duplicada).
+ * - Insercao de chave removida ou nova: acumulada no grupo.
+ * - Remocao de chave ativa: acumulada no grupo.
+ * No final, se houver insercoes, UMA nova geracao do arquivo e publicada
+ * (publicar_geracao_tabela) com todas as mudancas do grupo. Um grupo que so
+ * remove publica um clone com o byte 'ativo' trocado (publicar_remocoes). No layout
+ * em blocos as insercoes vao para os blocos de destino (publicar_em_blocos)
+ * e o indice, se valia, e atualizado em vez de invalidado.
+ * Deve ser chamada com a trava do escritor adquirida.
+ *
+ * @param arq_indice Indice da tabela (mantido no layout em blocos).
+ * @param offset_chave Posicao (offsetof) da chave de 64 bits na struct.
+ * @param localizar localizar_<tabela>_wal, gerada por DEFINIR_TABELA.
+ * @param resultados Se nao for NULL, resultados[i] recebe 1 se ops[i] mudou
+ * algo e 0 se foi ignorada. So as posicoes desta tabela sao preenchidas.
+ */
+void aplicar_grupo_tabela(TabelaDados tabela, const char *arq_bin, const char *arq_indice, size_t tam_registro,
+                          size_t offset_chave, size_t offset_ativo,
+                          int (*comparador)(const void*, const void*),
+                          long (*localizar)(const char*, int64_t, void*),
+                          TipoOperacaoWAL tipo_inserir, TipoOperacaoWAL tipo_remover,
+                          const OperacaoWAL *ops, int n, int *resultados) {
+    char *novos = malloc((size_t)n * tam_registro + 1);
+    int *novo_era_ativo = malloc((size_t)n * sizeof(int) + 1);  // A chave estava ativa no arquivo?
+    int64_t *removidas = malloc((size_t)n * sizeof(int64_t) + 1);
+    long *offsets_removidas = malloc((size_t)n * sizeof(long) + 1);
+    void *atual = malloc(tam_registro);
+    if (!novos || !novo_era_ativo || !removidas || !offsets_removidas || !atual) {
+        free(novos); free(novo_era_ativo); free(removidas); free(offsets_removidas); free(atual);
+        return;
+    }
+    int n_novos = 0, n_removidas = 0;
+
+    // 1a passada: decide o efeito de cada operacao sem tocar no arquivo
+    for (int i = 0; i < n; i++) {
+        if (ops[i].tipo != tipo_inserir && ops[i].tipo != tipo_remover) continue;
+        if (resultados) resultados[i] = 0;
+
+        int64_t chave;
+        if (ops[i].tipo == tipo_inserir) memcpy(&chave, (const char*)&ops[i].dados + offset_chave, sizeof(chave));
+        else chave = ops[i].dados.chave;
+
+        int pos_novo = -1, pos_removida = -1;
+        for (int j = 0; j < n_novos; j++) {
+            int64_t chave_novo;
+            memcpy(&chave_novo, novos + (size_t)j * tam_registro + offset_chave, sizeof(chave_novo));
+            if (chave_novo == chave) { pos_novo = j; break; }
+        }
+        for (int j = 0; j < n_removidas; j++) {
+            if (removidas[j] == chave) { pos_removida = j; break; }
+        }
+
+        if (ops[i].tipo == tipo_inserir) {
+            if (pos_novo >= 0) continue; // Duplicada dentro do proprio grupo
+            int era_ativo;
+            if (pos_removida >= 0) {
+                // Removida neste grupo e inserida de novo: vira substituicao
+                n_removidas--;
+                removidas[pos_removida] = removidas[n_removidas];
+                offsets_removidas[pos_removida] = offsets_removidas[n_removidas];
+                era_ativo = 1;
+            } else {
+                long offset = localizar(arq_bin, chave, atual);
+                if (offset >= 0 && ((char*)atual)[offset_ativo] == 'S') continue; // Ja existe ativa
+                era_ativo = 0;
+            }
+            memcpy(novos + (size_t)n_novos * tam_registro, &ops[i].dados, tam_registro);
+            novo_era_ativo[n_novos++] = era_ativo;
+            if (resultados) resultados[i] = 1;
+        } else {
+            if (pos_novo >= 0) {
+                // Removendo algo inserido no mesmo grupo: descarta a insercao e,
+                // se a chave estava ativa no arquivo, volta a remove-la
+                if (novo_era_ativo[pos_novo]) {
+                    long offset = localizar(arq_bin, chave, NULL);
+                    removidas[n_removidas] = chave;
+                    offsets_removidas[n_removidas++] = offset;
+                }
+                n_novos--;
+                memmove(novos + (size_t)pos_novo * tam_registro, novos + (size_t)(pos_novo + 1) * tam_registro,
+                        (size_t)(n_novos - pos_novo) * tam_registro);
+                memmove(novo_era_ativo + pos_novo, novo_era_ativo + pos_novo + 1,
+                        (size_t)(n_novos - pos_novo) * sizeof(int));
+                if (resultados) resultados[i] = 1;
+                continue;
+            }
+            if (pos_removida >= 0) continue; // Ja removida neste grupo
+            long offset = localizar(arq_bin, chave, atual);
+            if (offset < 0 || ((char*)atual)[offset_ativo] != 'S') continue; // Inexistente ou ja removida
+            removidas[n_removidas] = chave;
+            offsets_removidas[n_removidas++] = offset;
+            if (resultados) resultados[i] = 1;
+        }
+    }
+
+    // Produtos que deixam de valer (removidos ou substituidos), lidos da
+    // geracao atual antes de publicar: os agregados descontam o que eles
+    // somavam. Em compras os agregados somam os itens (ver itens_apos_escrita).
+    char *antigos = tabela == TABELA_PRODUTOS ? malloc((size_t)(n_removidas + n_novos) * tam_registro + 1) : NULL;
+    int n_antigos = 0;
+    if (antigos) {
+        FILE *fbin = io_fopen(arq_bin, "rb");
+        for (int j = 0; fbin && j < n_removidas; j++) {
+            if (io_fseek(fbin, offsets_removidas[j], SEEK_SET) == 0 &&
+                io_fread(antigos + (size_t)n_antigos * tam_registro, tam_registro, 1, fbin) == 1) n_antigos++;
+        }
+        if (fbin) fclose(fbin);
+        for (int j = 0; j < n_novos; j++) {
+            if (!novo_era_ativo[j]) continue;
+            int64_t chave;
+            memcpy(&chave, novos + (size_t)j * tam_registro + offset_chave, sizeof(chave));
+            if (localizar(arq_bin, chave, antigos + (size_t)n_antigos * tam_registro) >= 0) n_antigos++;
+        }
+    }
+
+    // 2a passada: publica as mudancas
+    uint64_t geracao_anterior[N_TABELAS];
+    struct stat st_anterior;
+    ler_geracoes(geracao_anterior);
+    int64_t tamanho_anterior = stat(arq_bin, &st_anterior) == 0 ? (int64_t)st_anterior.st_size : -1;
+    int publicou = 0;
+    IndiceEmBlocos ie = {NULL, 0};
+    if (tabela_em_blocos(tabela) && (n_novos > 0 || n_removidas > 0))
+        indice_em_blocos_ler(tabela, arq_indice, arq_bin, tam_registro, &ie);
+    if (n_novos > 0) {
+        qsort(novos, n_novos, tam_registro, comparador);
+        qsort(removidas, n_removidas, sizeof(int64_t), comparar_int64);
+        publicou = -1;
+        if (tabela_em_blocos(tabela))
+            publicou = publicar_em_blocos(arq_bin, tam_registro, offset_chave, offset_ativo,
+                                          novos, n_novos, offsets_removidas, n_removidas, &ie);
+        if (publicou < 0)
+            publicou = publicar_geracao_tabela(arq_bin, tam_registro, offset_chave, offset_ativo, comparador,
+                                               novos, n_novos, removidas, n_removidas);
+        if (!publicou) printf("ERRO ao reescrever %s.\n", arq_bin);
+    } else if (n_removidas > 0) {
+        publicou = publicar_remocoes(arq_bin, offsets_removidas, n_removidas, offset_ativo);
+        if (!publicou) printf("ERRO ao reescrever %s.\n", arq_bin);
+    }
+    // Os itens dos pedidos tocados sao publicados antes da geracao de compras
+    // avancar: quem ler a geracao nova ja abre os itens dela
+    ItemPedido *itens_saem = NULL;
+    int n_itens_saem = 0, itens_publicados = 0;
+    if (publicou > 0 && tabela == TABELA_COMPRAS) {
+        qsort(removidas, n_removidas, sizeof(int64_t), comparar_int64);
+        itens_publicados = itens_apos_escrita(geracao_anterior[tabela], (const Compra*)novos, n_novos,
+                                              removidas, n_removidas, &itens_saem, &n_itens_saem);
+    }
+    if (publicou > 0) {
+        avancar_geracao(tabela);
+        if (itens_publicados) criar_indice_itens(ARQ_ITENS_BIN, ARQ_ITENS_IDX);
+        if (ie.chaves) indice_em_blocos_gravar(tabela, arq_indice, arq_bin, &ie);
+        int64_t *chaves_novas = malloc((size_t)n_novos * sizeof(int64_t) + 1);
+        if (chaves_novas) {
+            for (int j = 0; j < n_novos; j++)
+                memcpy(&chaves_novas[j], novos + (size_t)j * tam_registro + offset_chave, sizeof(int64_t));
+            // Remocoes nao invalidam o filtro (ele so pode ter bits a mais);
+            // as chaves inseridas sao acrescentadas e o filtro segue a geracao
+            bloom_apos_escrita(tabela, arq_bin, geracao_anterior[tabela], tamanho_anterior, chaves_novas, n_novos);
+            if (tabela == TABELA_PRODUTOS)
+                produtos_ativos_apos_escrita(geracao_anterior[tabela], tamanho_anterior,
+                                             chaves_novas, n_novos, removidas, n_removidas);
+            free(chaves_novas);
+        } else if (tabela == TABELA_PRODUTOS) {
+            conjunto_liberar(&produtos_ativos);
+        }
+        if (tabela == TABELA_COMPRAS && itens_publicados)
+            agregados_apos_escrita(tabela, geracao_anterior[tabela], tamanho_anterior,
+                                   novos, n_novos, itens_saem, n_itens_saem);
+        else if (tabela == TABELA_PRODUTOS && antigos)
+            agregados_apos_escrita(tabela, geracao_anterior[tabela], tamanho_anterior,
+                                   novos, n_novos, antigos, n_antigos);
+        else agregados_reconstruir();
+    }
+
+    free(ie.chaves);
+    free(itens_saem);
+    free(antigos);
+    free(atual);
+    free(offsets_removidas);
+    free(removidas);
+    free(novo_era_ativo);
+    free(novos);
+}
+
+/**
+ * @brief Aplica um grupo ja gravado no log aos arquivos de produtos e compras.
+ */
+void aplicar_grupo(const OperacaoWAL *ops, int n, int *resultados) {
+    aplicar_grupo_tabela(TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX, sizeof(Produto),
+                         offsetof(Produto, product_id), offsetof(Produto, ativo),
+                         comparar_produto, localizar_produto_wal,
+                         WAL_INSERIR_PRODUTO, WAL_REMOVER_PRODUTO, ops, n, resultados);
+    aplicar_grupo_tabela(TABELA_COMPRAS, ARQ_COMPRAS_BIN, ARQ_COMPRAS_IDX, sizeof(Compra),
+                         offsetof(Compra, order_id), offsetof(Compra, ativo),
+                         comparar_compra, localizar_compra_wal,
+                         WAL_INSERIR_COMPRA, WAL_REMOVER_COMPRA, ops, n, resultados);
+}
+
+/**
+ * @brief Confirma o grupo pendente: grava no log (um fsync), aplica nos .bin
+ * e faz o checkpoint do log.
+ * @param resultados Opcional; recebe, por operacao do grupo, 1 se foi aplicada
+ * e 0 se foi ignorada (ex: chave duplicada).
+ * @return 1 se o grupo foi confirmado, 0 se nao foi possivel gravar o log
+ * (nesse caso nada e aplicado).
+ */
+int wal_confirmar_grupo(int *resultados) {
+    if (wal_n_pendentes == 0) return 1;
+
+    unsigned long long t0 = instr_inicio();
+    int n = wal_n_pendentes;
+    wal_n_pendentes = 0;
+    int trava = trava_escrita_adquirir(); // Um escritor por vez (log + .bin)
+    if (!wal_gravar_grupo(wal_pendentes, n)) {
+        trava_escrita_liberar(trava);
+        printf("ERRO: falha ao gravar o log %s. Operacoes descartadas.\n", ARQ_WAL);
+        return 0;
+    }
+    aplicar_grupo(wal_pendentes, n, resultados);
+    wal_truncar();
+    trava_escrita_liberar(trava);
+    instr_registrar(OP_CONFIRMAR_GRUPO_WAL, t0);
+    return 1;
+}
+
+/**
+ * @brief Acrescenta uma operacao ao grupo pendente. Quando o grupo atinge
+ * WAL_GRUPO_MAX operacoes ele e confirmado automaticamente; caso contrario
+ * o chamador decide quando confirmar com wal_confirmar_grupo.
+ * @param dados Produto, Compra ou int64_t (chave), conforme o tipo.
+ */
+void wal_registrar(TipoOperacaoWAL tipo, const void *dados) {
+    if (wal_n_pendentes >= WAL_GRUPO_MAX) wal_confirmar_grupo(NULL);
+
+    OperacaoWAL *op = &wal_pendentes[wal_n_pendentes++];
+    memset(op, 0, sizeof(*op));
+    op->tipo = tipo;
+    memcpy(&op->dados, dados, tamanho_carga_wal(tipo));
+}
+
+/**
+ * @brief Re-aplica o log na inicializacao (recuperacao apos queda).
+ * Le registro a registro validando magico, tamanho e checksum; cada grupo
+ * terminado por COMMIT e aplicado. Um final corrompido ou sem COMMIT
+ * corresponde a um grupo que nunca foi confirmado e e descartado.
+ * @return Numero de operacoes re-aplicadas.
+ */
+int wal_recuperar(void) {
+    int trava = trava_escrita_adquirir();
+    FILE *f = io_fopen(ARQ_WAL, "rb");
+    if (!f) { trava_escrita_liberar(trava); return 0; }
+
+    OperacaoWAL *grupo = malloc(WAL_GRUPO_MAX * sizeof(OperacaoWAL));
+    if (!grupo) { fclose(f); trava_escrita_liberar(trava); return 0; }
+
+    int n = 0, total = 0;
+    CabecalhoWAL cab;
+    while (io_fread(&cab, sizeof(cab), 1, f) == 1 && cab.magico == WAL_MAGICO) {
+        if (cab.tipo == WAL_COMMIT) {
+            aplicar_grupo(grupo, n, NULL);
+            total += n;
+            n = 0;
+            continue;
+        }
+        size_t esperado = tamanho_carga_wal(cab.tipo);
+        if (esperado == 0 || cab.tamanho != esperado || n >= WAL_GRUPO_MAX) break;
+
+        memset(&grupo[n], 0, sizeof(OperacaoWAL));
+        grupo[n].tipo = (TipoOperacaoWAL)cab.tipo;
+        if (io_fread(&grupo[n].dados, esperado, 1, f) != 1) break;
+        if (checksum_fnv1a(&grupo[n].dados, esperado) != cab.checksum) break;
+        n++;
+    }
+    fclose(f);
+    free(grupo);
+
+    wal_truncar();
+    trava_escrita_liberar(trava);
+    return total;
+}
+
+
+// --- LEITURA RAPIDA DO CSV (MAPEAMENTO + SEPARADORES POR SIMD) ---
+//
+// Caminho rapido de pre_processar_*. O leitor por fgets/strtok copia cada
+// linha para um buffer, percorre a linha de novo no strtok, converte com
+// atoll/atof e ainda copia o registro para um vetor que cresce com realloc.
+// Aqui o CSV e mapeado (mmap, lido direto do page cache) e as virgulas e
+// quebras de linha sao achadas CSV_LARGURA bytes por vez: uma comparacao
+// SIMD vira uma mascara de bits, consumida com __builtin_ctz. So as colunas
+// usadas sao convertidas (conversores de inteiro e de preco especializados)
+// e o resto da linha e pulado com memchr. Os registros sao escritos direto
+// numa Arena: uma regiao virtual reservada de uma vez, que o qsort usa como
+// vetor, sem realloc nem copia.
+// Diferente do strtok, um campo vazio ("a,,b") ocupa a sua coluna.
+// AED2_CSV_SIMD=0 volta ao leitor por fgets/strtok.
+
+#if defined(__AVX2__)
+#define CSV_LARGURA 32
+#else
+#define CSV_LARGURA 16 // SSE2 (base do x86-64) ou laco escalar
+#endif
+#define CSV_DIGITOS_EXATOS 15 // Ate 15 digitos a mantissa cabe num double sem arredondar
+
+int csv_simd = 1; // AED2_CSV_SIMD=0: leitor por fgets/strtok
+
+// Alocador por avanco de ponteiro sobre uma regiao contigua
+typedef struct {
+    char *base;
+    size_t reservado, usado;
+} Arena;
+
+/** @brief Reserva 'bytes' de espaco virtual; as paginas so ocupam memoria quando tocadas. */
+int arena_reservar(Arena *a, size_t bytes) {
+    a->usado = 0;
+    a->reservado = bytes;
+    a->base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (a->base == MAP_FAILED) { a->base = NULL; a->reservado = 0; return 0; }
+    return 1;
+}
+
+/** @brief Proximos 'n' bytes (zerados) da arena, ou NULL se a reserva acabou. */
+static inline void *arena_alocar(Arena *a, size_t n) {
+    if (a->reservado - a->usado < n) return NULL;
+    void *p = a->base + a->usado;
+    a->usado += n;
+    return p;
+}
+
+void arena_liberar(Arena *a) {
+    if (a->base) munmap(a->base, a->reservado);
+    a->base = NULL;
+    a->reservado = a->usado = 0;
+}
+
+// CSV mapeado, percorrido de separador em separador
+typedef struct {
+    const char *dados, *fim;
+    size_t tamanho;
+    const char *primeira_linha; // Depois do cabecalho
+    const char *bloco;          // Trecho de CSV_LARGURA bytes descrito pela mascara
+    uint32_t mascara;           // Bit i: bloco[i] e ',' ou '\n' ainda nao consumido
+} LeitorCSV;
+
+static inline uint32_t csv_mascara(const char *p, const char *fim) {
+#if defined(__AVX2__)
+    if (fim - p >= CSV_LARGURA) {
+        __m256i b = _mm256_loadu_si256((const __m256i*)p);
+        return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(b, _mm256_set1_epi8(',')),
+                                                              _mm256_cmpeq_epi8(b, _mm256_set1_epi8('\n'))));
+    }
+#elif defined(__SSE2__)
+    if (fim - p >= CSV_LARGURA) {
+        __m128i b = _mm_loadu_si128((const __m128i*)p);
+        return (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8(',')),
+                                                        _mm_cmpeq_epi8(b, _mm_set1_epi8('\n'))));
+    }
+#endif
+    uint32_t m = 0; // Final do arquivo (nao le alem do mapeamento) ou sem SIMD
+    for (int i = 0; i < CSV_LARGURA && p + i < fim; i++)
+        if (p[i] == ',' || p[i] == '\n') m |= 1u << i;
+    return m;
+}
+
+static inline void csv_posicionar(LeitorCSV *l, const char *p) {
+    l->bloco = p;
+    l->mascara = p < l->fim ? csv_mascara(p, l->fim) : 0;
+}
+
+/** @brief Proximo ',' ou '\n' ainda nao consumido, ou l->fim. */
+static inline const char *csv_proximo_separador(LeitorCSV *l) {
+    while (l->mascara == 0) {
+        if (l->fim - l->bloco <= CSV_LARGURA) { l->bloco = l->fim; return l->fim; }
+        l->bloco += CSV_LARGURA;
+        l->mascara = csv_mascara(l->bloco, l->fim);
+    }
+    const char *sep = l->bloco + __builtin_ctz(l->mascara);
+    l->mascara &= l->mascara - 1;
+    return sep;
+}
+
+/** @brief Pula o resto da linha que contem 'p'. @return Inicio da proxima (ou l->fim). */
+static inline const char *csv_proxima_linha(LeitorCSV *l, const char *p) {
+    const char *nl = p < l->fim ? memchr(p, '\n', (size_t)(l->fim - p)) : NULL;
+    const char *proxima = nl ? nl + 1 : l->fim;
+    csv_posicionar(l, proxima);
+    return proxima;
+}
+
+/**
+ * @brief Mapeia o CSV e pula o cabecalho.
+ * @return 1 se mapeou; 0 se nao abriu ou esta vazio (o leitor por strtok
+ * trata esses casos).
+ */
+int csv_abrir(LeitorCSV *l, const char *caminho) {
+    memset(l, 0, sizeof(*l));
+    int fd = open(caminho, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return 0; }
+    void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return 0;
+    madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+    CONTAR(estat_io.fopens, 1);
+    CONTAR(estat_io.bytes_lidos, (unsigned long long)st.st_size);
+    l->dados = m;
+    l->tamanho = (size_t)st.st_size;
+    l->fim = l->dados + l->tamanho;
+    l->primeira_linha = csv_proxima_linha(l, l->dados); // Ignora o cabecalho
+    return 1;
+}
+
+void csv_fechar(LeitorCSV *l) {
+    if (l->dados) munmap((void*)l->dados, l->tamanho);
+    l->dados = NULL;
+}
+
+/** @brief Como atoll sobre o campo [p, fim): espacos, sinal e digitos ate o primeiro nao digito. */
+static inline int64_t csv_inteiro(const char *p, const char *fim) {
+    while (p < fim && (*p == ' ' || *p == '\t')) p++;
+    int negativo = 0;
+    if (p < fim && (*p == '-' || *p == '+')) negativo = (*p++ == '-');
+    uint64_t v = 0;
+    while (p < fim && (unsigned)(*p - '0') < 10) v = v * 10 + (uint64_t)(*p++ - '0');
+    return negativo ? -(int64_t)v : (int64_t)v;
+}
+
+/**
+ * @brief Como atof sobre o campo [p, fim). O caso comum ("2558.64") e
+ * mantissa inteira / 10^casas, o mesmo double que o strtod devolve (as duas
+ * parcelas sao exatas e a divisao arredonda uma vez so); expoentes, "inf",
+ * "nan" e mantissas longas vao para o strtod.
+ */
+static inline double csv_preco(const char *p, const char *fim) {
+    static const double potencias[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+                                       1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+    const char *q = p;
+    while (q < fim && (*q == ' ' || *q == '\t')) q++;
+    int negativo = 0;
+    if (q < fim && (*q == '-' || *q == '+')) negativo = (*q++ == '-');
+    uint64_t mantissa = 0;
+    int digitos = 0, casas = 0;
+    while (q < fim && (unsigned)(*q - '0') < 10) { mantissa = mantissa * 10 + (uint64_t)(*q++ - '0'); digitos++; }
+    if (q < fim && *q == '.') {
+        q++;
+        while (q < fim && (unsigned)(*q - '0') < 10) {
+            mantissa = mantissa * 10 + (uint64_t)(*q++ - '0');
+            digitos++;
+            casas++;
+        }
+    }
+    int incomum = digitos == 0 || digitos > CSV_DIGITOS_EXATOS || (q < fim && (*q == 'e' || *q == 'E'));
+    if (incomum && p < fim) {
+        char texto[64];
+        size_t n = (size_t)(fim - p) < sizeof(texto) - 1 ? (size_t)(fim - p) : sizeof(texto) - 1;
+        memcpy(texto, p, n);
+        texto[n] = '\0';
+        return strtod(texto, NULL);
+    }
+    double v = (double)mantissa / potencias[casas];
+    return negativo ? -v : v;
+}
+
+/** @brief Como strncpy(destino, campo, tam - 1) seguido de pad_string. */
+static inline void csv_texto(char *destino, int tam, const char *p, const char *fim) {
+    size_t n = (size_t)(fim - p) < (size_t)(tam - 1) ? (size_t)(fim - p) : (size_t)(tam - 1);
+    const char *nulo = n > 0 ? memchr(p, '\0', n) : NULL; // strncpy para no primeiro '\0'
+    if (nulo) n = (size_t)(nulo - p);
+    memcpy(destino, p, n);
+    memset(destino + n, ' ', (size_t)(tam - 1) - n);
+    destino[tam - 1] = '\0';
+}
+
+
+// --- FUNCOES ESPECIFICAS PRODUTOS ---
+
+/**
+ * @brief Le produtos do CSV linha a linha (fgets + strtok) para um vetor
+ * alocado com malloc. Leitor original, usado com AED2_CSV_SIMD=0 ou se o
+ * CSV nao puder ser mapeado.
+ * @return O vetor (n em *n_lidos), ou NULL se o CSV esta vazio ou faltou memoria.
+ */
+Produto *ler_csv_produtos_strtok(FILE *fcsv, int *n_lidos) {
+    char linha[2048];
+    if (!fgets(linha, sizeof(linha), fcsv)) return NULL; // Ignora cabealho
+
+    int capacidade = 100000, n_produtos = 0;
+    Produto* produtos = malloc(capacidade * sizeof(Produto));
+    if (!produtos) { printf("ERRO: Falha ao alocar memoria.\n"); return NULL; }
+
+    while (fgets(linha, sizeof(linha), fcsv)) {
+        if (n_produtos >= capacidade) {
+            capacidade *= 2;
+            Produto* temp = realloc(produtos, capacidade * sizeof(Produto));
+            if (!temp) { printf("ERRO: Falha ao realocar memoria.\n"); free(produtos); return NULL; }
+            produtos = temp;
+        }
+
+        Produto p = {0};
+        char *token = strtok(linha, ",");
+        for (int i = 0; token != NULL && i < 9; i++) {
+            switch(i) {
+                case 2: p.product_id = atoll(token); break;
+                case 5: strncpy(p.category_alias, token, TAM_CATEGORY-1); p.category_alias[TAM_CATEGORY-1] = '\0'; break;
+                case 6: strncpy(p.brand, token, TAM_BRAND-1); p.brand[TAM_BRAND-1] = '\0'; break;
+                case 7: p.price = atof(token); break;
+            }
+            token = strtok(NULL, ",");
+        }
+        p.category_alias[TAM_CATEGORY-1] = '\0';
+        p.brand[TAM_BRAND-1] = '\0';
+
+        pad_string(p.brand, TAM_BRAND);
+        pad_string(p.category_alias, TAM_CATEGORY);
+        p.ativo = 'S';
+        p.newline = '\n';
+        produtos[n_produtos++] = p;
+    }
+    CONTAR(estat_io.bytes_lidos, (unsigned long long)ftell(fcsv));
+    *n_lidos = n_produtos;
+    return produtos;
+}
+
+/**
+ * @brief Caminho rapido da leitura de produtos (ver LEITURA RAPIDA DO CSV):
+ * colunas 2 (product_id), 5 (category_alias), 6 (brand) e 7 (price),
+ * convertidas direto nos registros da arena, na ordem do arquivo.
+ * @return Registros lidos, ou -1 se o CSV nao pode ser mapeado ou a arena
+ * nao coube (o chamador usa ler_csv_produtos_strtok).
+ */
+long ler_csv_produtos_simd(const char *csv_path, Arena *arena) {
+    LeitorCSV l;
+    if (!csv_abrir(&l, csv_path)) return -1;
+    // Uma linha tem ao menos 2 bytes ("x\n"); se nao couber, volta ao strtok
+    if (!arena_reservar(arena, (l.tamanho / 2 + 2) * sizeof(Produto))) { csv_fechar(&l); return -1; }
+
+    long n = 0;
+    const char *campo = l.primeira_linha;
+    while (campo < l.fim) {
+        Produto *p = arena_alocar(arena, sizeof(Produto));
+        if (!p) { n = -1; break; }
+        csv_texto(p->category_alias, TAM_CATEGORY, campo, campo); // Colunas ausentes ficam em branco
+        csv_texto(p->brand, TAM_BRAND, campo, campo);
+        for (int coluna = 0;; coluna++) {
+            const char *sep = csv_proximo_separador(&l);
+            switch (coluna) {
+                case 2: p->product_id = csv_inteiro(campo, sep); break;
+                case 5: csv_texto(p->category_alias, TAM_CATEGORY, campo, sep); break;
+                case 6: csv_texto(p->brand, TAM_BRAND, campo, sep); break;
+                case 7: p->price = csv_preco(campo, sep); break;
+            }
+            if (sep == l.fim) { campo = l.fim; break; }
+            campo = sep + 1;
+            if (*sep == '\n') break;
+            if (coluna == 7) { campo = csv_proxima_linha(&l, campo); break; } // O resto da linha nao e usado
+        }
+        p->ativo = 'S';
+        p->newline = '\n';
+        n++;
+    }
+    csv_fechar(&l);
+    return n;
+}
+
+/**
+ * @brief Le o CSV, ordena em RAM e grava o arquivo .bin inicial de produtos.
+ * Este e o unico momento (alem da insercao) em que muitos dados
+ * sao mantidos em RAM, para permitir a ordenacao inicial com qsort.
+ * Tambem remove duplicatas de product_id durante a gravacao.
+ */
+void pre_processar_produtos(const char *csv_path, const char *bin_path) {
+    printf("Pre-processando PRODUTOS de %s...\n", csv_path);
+    unsigned long long t0 = instr_inicio();
+
+    // 1. Le CSV para a RAM (arena do caminho rapido ou vetor do strtok)
+    Arena arena = {NULL, 0, 0};
+    long lidos = csv_simd ? ler_csv_produtos_simd(csv_path, &arena) : -1;
+    Produto *produtos = (Produto*)arena.base;
+    int n_produtos = (int)lidos;
+    if (lidos < 0) {
+        arena_liberar(&arena);
+        FILE *fcsv = io_fopen(csv_path, "r");
+        if (!fcsv) { printf("ERRO: Nao foi possivel abrir CSV %s\n", csv_path); return; }
+        produtos = ler_csv_produtos_strtok(fcsv, &n_produtos);
+        fclose(fcsv);
+        if (!produtos) return;
+    }
+    struct stat st_csv;
+    double segundos = (double)(instr_inicio() - t0) / 1e9;
+    double mb = stat(csv_path, &st_csv) == 0 ? (double)st_csv.st_size / (1024.0 * 1024.0) : 0.0;
+    printf("%d registros lidos para produtos (%.1f MB/s, leitor %s).\n", n_produtos,
+           segundos > 0 ? mb / segundos : 0.0, arena.base ? "simd" : "strtok");
+
+    // 2. Ordena na RAM usando qsort
+    qsort(produtos, n_produtos, sizeof(Produto), comparar_produto);
+
+    // 3. Grava no arquivo .bin, pulando duplicatas
+    // Grava em um temporario: se algo falhar, o .bin anterior continua valido
+    // Com AED2_PREENCHIMENTO > 0 o arquivo ja sai no layout em blocos com folga
+    char caminho_tmp[1024];
+    caminho_temporario(bin_path, caminho_tmp, sizeof(caminho_tmp));
+    int trava = trava_escrita_adquirir(); // Um escritor por vez
+    FILE *fbin = io_fopen(caminho_tmp, "wb");
+    GravadorBlocos g;
+    if (fbin && !gravador_iniciar(&g, fbin, sizeof(Produto), offsetof(Produto, product_id),
+                                  offsetof(Produto, ativo), preenchimento_blocos)) {
+        gravador_finalizar(&g);
+        fclose(fbin);
+        remove(caminho_tmp);
+        fbin = NULL;
+    }
+    if (fbin) {
+        int n_unicos = 0;
+        int64_t ultimo_id = LLONG_MIN;
+        for (int i = 0; i < n_produtos; i++) {
+            if (produtos[i].product_id != ultimo_id) {
+                gravador_escrever(&g, &produtos[i]);
+                ultimo_id = produtos[i].product_id;
+                n_unicos++;
+            }
+        }
+        int gravou = gravador_finalizar(&g);
+        if (!gravou) { fclose(fbin); remove(caminho_tmp); }
+        if (gravou && publicar_temporario(fbin, caminho_tmp, bin_path)) {
+            avancar_geracao_layout(TABELA_PRODUTOS, preenchimento_blocos > 0);
+            printf("%s criado com %d produtos unicos.\n", bin_path, n_unicos);
+            // Refaz o conjunto de produtos ativos a partir do vetor ja ordenado
+            if (strcmp(bin_path, ARQ_PRODUTOS_BIN) == 0 && conjunto_iniciar(&produtos_ativos, n_unicos)) {
+                for (int i = 0; i < n_produtos; i++) conjunto_inserir(&produtos_ativos, produtos[i].product_id);
+                produtos_ativos.carregado = 1;
+                produtos_ativos_versao(&produtos_ativos.geracao, &produtos_ativos.tamanho);
+            }
+            if (strcmp(bin_path, ARQ_PRODUTOS_BIN) == 0) agregados_reconstruir();
+        } else {
+            printf("ERRO: Falha ao gravar o arquivo binario %s.\n", bin_path);
+        }
+    } else {
+         printf("ERRO: Nao foi possivel criar o arquivo binario %s.\n", bin_path);
+    }
+    trava_escrita_liberar(trava);
+    if (arena.base) arena_liberar(&arena);
+    else free(produtos);
+}
+
+/**
+ * @brief Offset do 'n_ativo'-esimo registro ATIVO (contando de 0).
+ * Com o indice parcial atualizado, a entrada n_ativo / BLOCO_INDICE aponta
+ * para o primeiro ativo do bloco e basta pular menos de BLOCO_INDICE ativos
+ * a partir dali: custo constante, qualquer que seja a pagina. Sem indice
+ * valido (ou no layout em blocos) percorre o arquivo desde o inicio.
+ * @return Offset em bytes, ou -1 se ha menos de n_ativo + 1 registros ativos.
+ */
+long offset_do_ativo(TabelaDados tabela, const char *arq_dados, const char *arq_indice,
+                     size_t tam_registro, size_t offset_ativo, long n_ativo) {
+    long inicio = 0, pular = n_ativo;
+    // No layout em blocos as entradas marcam blocos, nao contagens de ativos
+    if (n_ativo >= BLOCO_INDICE && !tabela_em_blocos(tabela)) {
+        IndiceCompacto ic; // As remocoes mudam a contagem de ativos: so com o indice da geracao atual
+        if (indice_compacto_carregar_atual(&ic, arq_indice, arq_dados, tabela)) {
+            long bloco = n_ativo / BLOCO_INDICE;
+            int64_t chave, ordinal = 0;
+            int achou = bloco < ic.cab.n_entradas;
+            if (achou) indice_entrada(&ic, bloco, &chave, &ordinal);
+            indice_compacto_liberar(&ic);
+            if (!achou) return -1; // Alem da ultima entrada: menos ativos que o pedido
+            inicio = (long)ordinal * (long)tam_registro;
+            pular = n_ativo % BLOCO_INDICE;
+        }
+    }
+
+    FILE *f = io_abrir_sequencial(arq_dados);
+    if (!f) return -1;
+    char *bloco = malloc(tam_registro * REGISTROS_POR_LEITURA);
+    long resultado = -1, offset = inicio;
+    if (bloco && io_fseek(f, inicio, SEEK_SET) == 0) {
+        size_t lidos;
+        while (resultado < 0 && (lidos = io_fread(bloco, tam_registro, REGISTROS_POR_LEITURA, f)) > 0) {
+            for (size_t i = 0; i < lidos; i++, offset += (long)tam_registro) {
+                if (bloco[i * tam_registro + offset_ativo] != 'S') continue;
+                if (pular-- == 0) { resultado = offset; break; }
+            }
+        }
+    }
+    free(bloco);
+    fclose(f);
+    return resultado;
+}
+
+static inline void formatar_produto(BufferSaida *b, const Produto *p) {
+    saida_literal(b, "ID: ");
+    saida_int64(b, p->product_id);
+    saida_literal(b, " | Brand: ");
+    saida_campo(b, p->brand, TAM_BRAND);
+    saida_literal(b, " | Price: ");
+    saida_preco(b, p->price);
+    saida_literal(b, " | Category: ");
+    saida_campo(b, p->category_alias, TAM_CATEGORY);
+    saida_char(b, '\n');
+}
+
+/**
+ * @brief Imprime os produtos ATIVOS do 'deslocamento'-esimo em diante, no
+ * maximo 'limite' (0 = todos). A pagina e localizada pelo indice parcial
+ * (offset_do_ativo) e as linhas saem por um buffer grande (BufferSaida).
+ */
+void mostrar_produtos(const char *arq_bin, const char *arq_indice, long deslocamento, long limite) {
+    unsigned long long t0 = instr_inicio();
+    // Listagem completa: leitura sequencial com readahead; uma pagina le so o necessario
+    FILE *fbin = limite <= 0 ? io_abrir_sequencial(arq_bin) : io_fopen(arq_bin, "rb");
+    if (!fbin) { printf("ERRO ao abrir %s\n", arq_bin); return; }
+    printf("\n--- PRODUTOS ATIVOS ---\n");
+    fflush(stdout); // As linhas vao direto para o descritor, depois do cabecalho
+
+    long inicio = deslocamento > 0 ? offset_do_ativo(TABELA_PRODUTOS, arq_bin, arq_indice, sizeof(Produto),
+                                                     offsetof(Produto, ativo), deslocamento) : 0;
+    Produto *bloco = malloc(sizeof(Produto) * REGISTROS_POR_LEITURA);
+    BufferSaida b;
+    long contador = 0;
+    if (inicio >= 0 && bloco && saida_iniciar(&b, STDOUT_FILENO, SAIDA_BUFFER_PADRAO)) {
+        io_fseek(fbin, inicio, SEEK_SET);
+        size_t lidos;
+        while ((limite <= 0 || contador < limite) &&
+               (lidos = io_fread(bloco, sizeof(Produto), REGISTROS_POR_LEITURA, fbin)) > 0) {
+            for (size_t i = 0; i < lidos && (limite <= 0 || contador < limite); i++) {
+                if (bloco[i].ativo != 'S') continue;
+                formatar_produto(&b, &bloco[i]);
+                contador++;
+            }
+        }
+        saida_finalizar(&b);
+    }
+    free(bloco);
+    fclose(fbin);
+    if (deslocamento > 0 || limite > 0) printf("Exibidos: %ld produtos a partir do %ld-esimo\n", contador, deslocamento);
+    else printf("Total: %ld produtos\n", contador);
+    instr_registrar(OP_MOSTRAR, t0);
+}
+
+/**
+ * @brief Insere um novo produto no arquivo binario.
+ * ESTRATEGIA: Para manter o arquivo 100% ordenado (necessario para a
+ * pesquisa_binaria funcionar), a insercao e registrada no WAL e aplicada
+ * por aplicar_grupo_tabela, que:
+ * 1. Reaproveita o registro no lugar se a chave existir como removida.
+ * 2. Senao, intercala (merge) o novo registro com o arquivo existente,
+ *    gravando um temporario que substitui o .bin via rename.
+ * Esta e uma operacao custosa (O(N)), mas garante a ordenacao e nunca
+ * deixa o .bin truncado em caso de queda.
+ * @return 1 se foi inserido, 0 se houve erro (ex: ID ja existe).
+ */
+int inserir_produto(const char *arq_bin) {
+    Produto p_novo;
+    memset(&p_novo, 0, sizeof(p_novo));
+    printf("\n--- INSERIR NOVO PRODUTO ---\n");
+
+    p_novo.product_id = ler_long_long("Digite o product_id: ");
+
+    // 1. Verifica se a chave ja existe (usando a pesquisa binaria)
+    int64_t chave = p_novo.product_id;
+    if (existe_produto(arq_bin, chave)) {
+        printf("ERRO: product_id %lld ja existe!\n", p_novo.product_id);
+        return 0;
+    }
+
+    ler_string("Digite a brand: ", p_novo.brand, TAM_BRAND);
+    p_novo.price = ler_double("Digite o preco: ");
+    ler_string("Digite a categoria: ", p_novo.category_alias, TAM_CATEGORY);
+
+    pad_string(p_novo.brand, TAM_BRAND);
+    pad_string(p_novo.category_alias, TAM_CATEGORY);
+    p_novo.ativo = 'S';
+    p_novo.newline = '\n';
+
+    // 2. Registra no WAL e confirma o grupo: o log e sincronizado (fsync)
+    // antes de o .bin ser tocado, e a reescrita ordenada e feita em um
+    // temporario publicado com rename (ver aplicar_grupo_tabela).
+    int resultado = 0;
+    wal_registrar(WAL_INSERIR_PRODUTO, &p_novo);
+    if (!wal_confirmar_grupo(&resultado) || !resultado) {
+        printf("ERRO: Produto %lld nao foi inserido.\n", p_novo.product_id);
+        return 0;
+    }
+
+    printf("Produto %lld inserido com sucesso!\n", p_novo.product_id);
+    return 1; // Retorna 1 para sinalizar que o indice precisa ser reconstruido
+}
+
+/**
+ * @brief Realiza a remocao logica de um produto.
+ * Ele nao apaga o registro do arquivo. Apenas encontra o registro
+ * usando a pesquisa_binaria e altera o campo 'ativo' de 'S' para 'N'
+ * (a alteracao e registrada no WAL antes de ser aplicada).
+ * Esta e uma operacao muito rapida (O(log N) + escrita).
+ * @return 1 se foi removido, 0 se houve erro (ex: nao encontrado).
+ */
+int remover_produto(const char *arq_bin) {
+    printf("\n--- REMOVER PRODUTO ---\n");
+    int64_t id = ler_long_long("Digite o product_id para remover: ");
+
+    int64_t chave = id;
+    long offset = pesquisa_binaria_produto(arq_bin, chave);
+
+    if (offset == -1) { printf("Produto %lld nao encontrado.\n", id); return 0; }
+    if (offset == -2) { printf("Produto %lld ja esta removido.\n", id); return 0; }
+
+    // Encontrou e esta ativo (offset >= 0). A remocao passa pelo WAL;
+    // ao ser aplicada, sobrescreve apenas o byte 'ativo' do registro.
+    int resultado = 0;
+    wal_registrar(WAL_REMOVER_PRODUTO, &chave);
+    if (!wal_confirmar_grupo(&resultado) || !resultado) {
+        printf("ERRO ao remover o produto %lld.\n", id);
+        return 0;
+    }
+
+    printf("Produto %lld removido logicamente.\n", id);
+    return 1; // Retorna 1 para sinalizar que o indice precisa ser reconstruido
+}
+
+/**
+ * @brief Consulta um produto usando a pesquisa binaria direta no arquivo.
+ */
+void consultar_produto(const char *arq_bin) {
+    printf("\n--- CONSULTAR PRODUTO ---\n");
+    int64_t id = ler_long_long("Digite o product_id para consultar: ");
+
+    unsigned long long t0 = instr_inicio();
+    int64_t chave = id;
+    // A pesquisa ja devolve a copia do registro lido do mesmo arquivo aberto:
+    // reabrir o .bin pelo offset poderia cair em outra geracao publicada
+    // entretanto por um escritor.
+    Produto p;
+    long offset = localizar_produto(arq_bin, chave, &p);
+
+    if (offset == -1) { printf("Produto %lld nao encontrado.\n", id); }
+    else if (p.ativo != 'S') { printf("Produto %lld existe mas foi removido.\n", id); }
+    else {
+
+        // Logica de "trim" para imprimir
+        char brand_trim[TAM_BRAND+1]={0};
+        char category_trim[TAM_CATEGORY+1]={0};
+        strncpy(brand_trim, p.brand, TAM_BRAND);
+        strncpy(category_trim, p.category_alias, TAM_CATEGORY);
+        for(int i = strlen(brand_trim)-1; i >=0 && brand_trim[i] == ' '; i--) brand_trim[i] = '\0';
+        for(int i = strlen(category_trim)-1; i >=0 && category_trim[i] == ' '; i--) category_trim[i] = '\0';
+
+        printf("\n--- PRODUTO ENCONTRADO ---\n");
+        printf("ID: %lld\nBrand: %s\nPrice: %.2f\nCategory: %s\n",
+               p.product_id, brand_trim, p.price, category_trim);
+    }
+    instr_registrar(OP_CONSULTAR_PRODUTO, t0);
+}
+
+// --- ITENS DOS PEDIDOS (CHAVE COMPOSTA, AGRUPADOS POR order_id) ---
+//
+// compras.bin guarda uma linha por order_id (a primeira do pedido). A tabela
+// de itens guarda TODAS as linhas do CSV em itens.bin, ordenadas pela chave
+// composta (order_id, product_id), de modo que os itens de um pedido ficam
+// contiguos. Linhas repetidas do mesmo produto no mesmo pedido viram um
+// unico item com as quantidades somadas.
+// O indice parcial (itens_idx.bin, no formato compacto) tem uma entrada a
+// cada BLOCO_INDICE itens ativos, mas um bloco so comeca no PRIMEIRO item de
+// um pedido: a entrada com o maior order_id <= o procurado aponta para
+// antes de todos os itens dele. Um pedido inteiro sai com um seek e uma
+// leitura sequencial; um item (order_id, product_id) e achado na mesma
+// leitura, pela ordem composta. A tabela e gravada do CSV junto com
+// compras.bin e mantida por quem publica uma geracao de compras
+// (itens_apos_escrita): o indice e carimbado com a geracao de compras para a
+// qual os itens valem, e uma leitura com a geracao desatualizada (ex.: queda
+// entre as duas publicacoes) e recusada em vez de devolver itens antigos.
+
+/**
+ * @brief Cria o indice parcial de itens.bin (blocos alinhados ao inicio dos
+ * pedidos), carimbado com a geracao atual de compras. @return 1 se ok.
+ */
+int criar_indice_itens(const char *arq_dados, const char *arq_indice) {
+    unsigned long long t0 = instr_inicio();
+    uint64_t geracao[N_TABELAS];
+    ler_geracoes(geracao);
+    FILE *f = io_abrir_sequencial(arq_dados);
+    if (!f) return 0;
+    io_fseek(f, 0, SEEK_END);
+    long n_registros = ftell(f) / (long)sizeof(ItemPedido);
+    io_fseek(f, 0, SEEK_SET);
+    int64_t *chaves = malloc(((size_t)n_registros / BLOCO_INDICE + 1) * sizeof(int64_t));
+    int64_t *ordinais = malloc(((size_t)n_registros / BLOCO_INDICE + 1) * sizeof(int64_t));
+    ItemPedido *bloco = malloc(REGISTROS_POR_LEITURA * sizeof(ItemPedido));
+    if (!chaves || !ordinais || !bloco) { free(chaves); free(ordinais); free(bloco); fclose(f); return 0; }
+
+    long ordinal = 0, n_entradas = 0, ativos_no_bloco = 0;
+    long long pedido_anterior = LLONG_MIN;
+    size_t lidos;
+    while ((lidos = io_fread(bloco, sizeof(ItemPedido), REGISTROS_POR_LEITURA, f)) > 0) {
+        for (size_t i = 0; i < lidos && ordinal < n_registros; i++, ordinal++) {
+            // Novo bloco so no primeiro item de um pedido
+            if (bloco[i].order_id != pedido_anterior && (n_entradas == 0 || ativos_no_bloco >= BLOCO_INDICE)) {
+                chaves[n_entradas] = bloco[i].order_id;
+                ordinais[n_entradas++] = ordinal;
+                ativos_no_bloco = 0;
+            }
+            if (bloco[i].ativo == 'S') ativos_no_bloco++;
+            pedido_anterior = bloco[i].order_id;
+        }
+    }
+    IndiceCompacto ic;
+    int ok = indice_compacto_montar(&ic, chaves, ordinais, n_entradas);
+    if (ok) indice_compacto_carimbar(&ic, geracao[TABELA_COMPRAS], fileno(f), (int64_t)n_registros * (int64_t)sizeof(ItemPedido));
+    ok = ok && indice_compacto_gravar(&ic, arq_indice);
+    fclose(f);
+    free(bloco);
+    indice_compacto_liberar(&ic);
+    free(chaves);
+    free(ordinais);
+    if (ok) instr_registrar(OP_CRIAR_INDICE, t0);
+    return ok;
+}
+
+/**
+ * @brief Grava itens.bin (ordenado pela chave composta, sem repeticoes) e o
+ * seu indice. O vetor 'itens' e reordenado e compactado no lugar.
+ * @return Numero de itens gravados, ou -1 em caso de erro.
+ */
+long gravar_itens_pedidos(ItemPedido *itens, long n, const char *arq_dados, const char *arq_indice) {
+    qsort(itens, (size_t)n, sizeof(ItemPedido), comparar_item_pedido);
+    long unicos = 0;
+    for (long i = 0; i < n; i++) {
+        if (unicos > 0 && comparar_item_pedido(&itens[unicos - 1], &itens[i]) == 0)
+            itens[unicos - 1].quantity += itens[i].quantity; // Mesmo produto repetido no pedido
+        else
+            itens[unicos++] = itens[i];
+    }
+
+    char caminho_tmp[1024];
+    caminho_temporario(arq_dados, caminho_tmp, sizeof(caminho_tmp));
+    FILE *f = io_fopen(caminho_tmp, "wb");
+    if (!f) return -1;
+    if (io_fwrite(itens, sizeof(ItemPedido), (size_t)unicos, f) != (size_t)unicos) {
+        fclose(f);
+        remove(caminho_tmp);
+        return -1;
+    }
+    if (!publicar_temporario(f, caminho_tmp, arq_dados) || !criar_indice_itens(arq_dados, arq_indice)) return -1;
+    return unicos;
+}
+
+/**
+ * @brief Le os itens ATIVOS do pedido 'order_id' (todos, se product_id < 0,
+ * ou so o item (order_id, product_id)): um seek ate o bloco do indice e
+ * leitura sequencial ate passar da chave.
+ * @param itens Recebe um vetor alocado (liberar com free), ou NULL.
+ * @return Numero de itens (0 se nao existe) ou -3 se o indice ou os dados
+ * nao puderem ser lidos ou nao valerem para a geracao atual de compras.
+ */
+long buscar_itens_pedido(const char *arq_indice, const char *arq_dados, long long order_id,
+                         int64_t product_id, ItemPedido **itens) {
+    unsigned long long t0 = instr_inicio();
+    *itens = NULL;
+    IndiceCompacto ic;
+    if (!indice_compacto_carregar_atual(&ic, arq_indice, arq_dados, TABELA_COMPRAS)) { instr_registrar(OP_ITENS_PEDIDO, t0); return -3; }
+    int64_t ordinal = indice_compacto_bloco(&ic, order_id);
+    indice_compacto_liberar(&ic);
+    if (ordinal < 0) { instr_registrar(OP_ITENS_PEDIDO, t0); return 0; }
+
+    FILE *f = io_fopen(arq_dados, "rb");
+    ItemPedido *bloco = malloc(2 * BLOCO_INDICE * sizeof(ItemPedido));
+    if (!f || !bloco || io_fseek(f, (long)ordinal * (long)sizeof(ItemPedido), SEEK_SET) != 0) {
+        if (f) fclose(f);
+        free(bloco);
+        instr_registrar(OP_ITENS_PEDIDO, t0);
+        return -3;
+    }
+
+    long n = 0, capacidade = 0;
+    int passou = 0;
+    size_t lidos;
+    // Em geral uma unica leitura cobre o comeco do bloco e o pedido inteiro
+    while (!passou && (lidos = io_fread(bloco, sizeof(ItemPedido), 2 * BLOCO_INDICE, f)) > 0) {
+        for (size_t i = 0; i < lidos; i++) {
+            const ItemPedido *it = &bloco[i];
+            if (it->order_id < order_id || (it->order_id == order_id && it->product_id < product_id)) continue;
+            if (it->order_id > order_id || (product_id >= 0 && it->product_id > product_id)) { passou = 1; break; }
+            if (it->ativo != 'S') continue;
+            if (n == capacidade) {
+                capacidade = capacidade ? capacidade * 2 : 8;
+                ItemPedido *novo = realloc(*itens, (size_t)capacidade * sizeof(ItemPedido));
+                if (!novo) { passou = 1; break; }
+                *itens = novo;
+            }
+            (*itens)[n++] = *it;
+        }
+    }
+    fclose(f);
+    free(bloco);
+    instr_registrar(OP_ITENS_PEDIDO, t0);
+    return n;
+}
+
+/**
+ * @brief Carimba itens_idx.bin com a geracao de compras publicada por
+ * reorganizar_em_blocos: mudar o layout de compras.bin nao muda os itens.
+ * So vale se o indice era da geracao anterior e de itens.bin como esta.
+ * Deve ser chamada com a trava do escritor adquirida.
+ */
+void itens_recarimbar(uint64_t geracao_anterior) {
+    IndiceCompacto ic;
+    uint64_t geracao[N_TABELAS];
+    if (!indice_compacto_carregar(&ic, ARQ_ITENS_IDX)) return;
+    if (ic.cab.geracao == geracao_anterior && indice_confere_dados(&ic.cab, ARQ_ITENS_BIN, -1)) {
+        ler_geracoes(geracao);
+        ic.cab.geracao = geracao[TABELA_COMPRAS];
+        indice_compacto_gravar(&ic, ARQ_ITENS_IDX);
+    }
+    indice_compacto_liberar(&ic);
+}
+
+/**
+ * @brief Os itens valem para a geracao atual de compras? Sem compras.bin e
+ * sem itens.bin nada foi vendido e a tabela (vazia) tambem vale.
+ */
+int itens_atuais(void) {
+    struct stat st;
+    if (stat(ARQ_COMPRAS_BIN, &st) != 0 && stat(ARQ_ITENS_BIN, &st) != 0) return 1;
+    return indice_atualizado(ARQ_ITENS_IDX, ARQ_ITENS_BIN, TABELA_COMPRAS);
+}
+
+/**
+ * @brief Leva para itens.bin um grupo do WAL ja publicado em compras.bin:
+ * os itens dos pedidos removidos ou substituidos deixam de valer e cada
+ * compra inserida vira o item (order_id, product_id) ativo. Uma nova geracao
+ * de itens.bin e publicada (intercalacao sequencial, como em
+ * publicar_geracao_tabela) ANTES de avancar a geracao de compras; o indice e
+ * refeito depois (criar_indice_itens carimba a geracao nova). Se os itens nao
+ * valiam para 'geracao_anterior' nada e feito: o indice segue desatualizado
+ * e as leituras sao recusadas.
+ * @param novos Compras inseridas, ordenadas por order_id (os itens que entram).
+ * @param removidas order_id removidos, em ordem crescente.
+ * @param saem Recebe os itens que estavam ativos e deixaram de valer, para
+ * os agregados (liberar com free).
+ * @return 1 se itens.bin foi publicado.
+ * Deve ser chamada com a trava do escritor adquirida.
+ */
+int itens_apos_escrita(uint64_t geracao_anterior, const Compra *novos, int n_novos,
+                       const int64_t *removidas, int n_removidas, ItemPedido **saem, int *n_saem) {
+    *saem = NULL;
+    *n_saem = 0;
+    FILE *fidx = io_fopen(ARQ_ITENS_IDX, "rb");
+    if (!fidx) return 0;
+    CabecalhoIndice cab;
+    int atual = indice_ler_cabecalho(fidx, &cab) && cab.geracao == geracao_anterior &&
+                indice_confere_dados(&cab, ARQ_ITENS_BIN, -1);
+    fclose(fidx);
+    if (!atual) return 0;
+
+    char caminho_tmp[1024];
+    caminho_temporario(ARQ_ITENS_BIN, caminho_tmp, sizeof(caminho_tmp));
+    FILE *fsrc = io_abrir_sequencial(ARQ_ITENS_BIN);
+    FILE *ftmp = fsrc ? io_fopen(caminho_tmp, "wb") : NULL;
+    if (!ftmp) { if (fsrc) fclose(fsrc); return 0; }
+
+    ItemPedido it;
+    int i = 0, r = 0, capacidade = 0, ok = 1;
+    while (ok && io_fread(&it, sizeof(it), 1, fsrc) == 1) {
+        while (i < n_novos && comparar_item_pedido(&novos[i], &it) < 0) io_fwrite(&novos[i++], sizeof(it), 1, ftmp);
+        int substituido = i < n_novos && comparar_item_pedido(&novos[i], &it) == 0;
+        // Pedido removido ou substituido: os itens antigos deixam de valer
+        while (r < n_removidas && removidas[r] < it.order_id) r++;
+        int sai = substituido || (r < n_removidas && removidas[r] == it.order_id) ||
+                  (i > 0 && novos[i - 1].order_id == it.order_id) ||
+                  (i < n_novos && novos[i].order_id == it.order_id);
+        if (sai && it.ativo == 'S') {
+            if (*n_saem == capacidade) {
+                capacidade = capacidade ? capacidade * 2 : 16;
+                ItemPedido *novo = realloc(*saem, (size_t)capacidade * sizeof(ItemPedido));
+                if (!novo) { ok = 0; break; }
+                *saem = novo;
+            }
+            (*saem)[(*n_saem)++] = it;
+        }
+        if (substituido) {
+            io_fwrite(&novos[i++], sizeof(it), 1, ftmp);
+            continue;
+        }
+        if (sai) it.ativo = 'N';
+        io_fwrite(&it, sizeof(it), 1, ftmp);
+    }
+    if (ok && i < n_novos) io_fwrite(&novos[i], sizeof(it), (size_t)(n_novos - i), ftmp);
+    fclose(fsrc);
+    if (ok && publicar_temporario(ftmp, caminho_tmp, ARQ_ITENS_BIN)) return 1;
+    if (!ok) { fclose(ftmp); remove(caminho_tmp); }
+    free(*saem);
+    *saem = NULL;
+    *n_saem = 0;
+    return 0;
+}
+
+// --- FUNCOES ESPECIFICAS COMPRAS ---
+
+/**
+ * @brief Le compras do CSV linha a linha (fgets + strtok). Mesma logica do
+ * ler_csv_produtos_strtok; linhas sem order_id sao ignoradas.
+ */
+Compra *ler_csv_compras_strtok(FILE *fcsv, int *n_lidos) {
+    char linha[2048];
+    if (!fgets(linha, sizeof(linha), fcsv)) return NULL; // Ignora cabealho
+
+    int capacidade = 100000, n_compras = 0;
+    Compra* compras = malloc(capacidade * sizeof(Compra));
+    if (!compras) { printf("ERRO: Falha ao alocar memoria.\n"); return NULL; }
+
+    while (fgets(linha, sizeof(linha), fcsv)) {
+        if (n_compras >= capacidade) {
+            capacidade *= 2;
+            Compra* temp = realloc(compras, capacidade * sizeof(Compra));
+             if (!temp) { printf("ERRO: Falha ao realocar memoria.\n"); free(compras); return NULL; }
+             compras = temp;
+        }
+
+        Compra c = {0};
+        char *token = strtok(linha, ",");
+        for (int i = 0; token != NULL && i < 10; i++) {
+            switch(i) {
+                case 0: strncpy(c.order_datetime, token, TAM_DATETIME-1); c.order_datetime[TAM_DATETIME-1]='\0'; break;
+                case 1: c.order_id = atoll(token); break;
+                case 2: c.product_id = atoll(token); break;
+                case 3: c.quantity = atoi(token); break;
+                case 8: c.user_id = atoll(token); break;
+            }
+            token = strtok(NULL, ",");
+        }
+        c.order_datetime[TAM_DATETIME-1] = '\0';
+
+        pad_string(c.order_datetime, TAM_DATETIME);
+        c.ativo = 'S';
+        c.newline = '\n';
+        if(c.order_id > 0) { // Ignora registros sem ID de compra
+            compras[n_compras++] = c;
+        }
+    }
+    CONTAR(estat_io.bytes_lidos, (unsigned long long)ftell(fcsv));
+    *n_lidos = n_compras;
+    return compras;
+}
+
+/**
+ * @brief Caminho rapido da leitura de compras (ver LEITURA RAPIDA DO CSV):
+ * colunas 0 (order_datetime), 1 (order_id), 2 (product_id), 3 (quantity) e
+ * 8 (user_id). Linhas sem order_id sao devolvidas a arena.
+ * @return Registros lidos, ou -1 (o chamador usa ler_csv_compras_strtok).
+ */
+long ler_csv_compras_simd(const char *csv_path, Arena *arena) {
+    LeitorCSV l;
+    if (!csv_abrir(&l, csv_path)) return -1;
+    if (!arena_reservar(arena, (l.tamanho / 2 + 2) * sizeof(Compra))) { csv_fechar(&l); return -1; }
+
+    long n = 0;
+    const char *campo = l.primeira_linha;
+    while (campo < l.fim) {
+        Compra *c = arena_alocar(arena, sizeof(Compra));
+        if (!c) { n = -1; break; }
+        csv_texto(c->order_datetime, TAM_DATETIME, campo, campo);
+        for (int coluna = 0;; coluna++) {
+            const char *sep = csv_proximo_separador(&l);
+            switch (coluna) {
+                case 0: csv_texto(c->order_datetime, TAM_DATETIME, campo, sep); break;
+                case 1: c->order_id = csv_inteiro(campo, sep); break;
+                case 2: c->product_id = csv_inteiro(campo, sep); break;
+                case 3: c->quantity = (int)csv_inteiro(campo, sep); break;
+                case 8: c->user_id = csv_inteiro(campo, sep); break;
+            }
+            if (sep == l.fim) { campo = l.fim; break; }
+            campo = sep + 1;
+            if (*sep == '\n') break;
+            if (coluna == 8) { campo = csv_proxima_linha(&l, campo); break; }
+        }
+        if (c->order_id <= 0) { // Ignora registros sem ID de compra
+            memset(c, 0, sizeof(*c));
+            arena->usado -= sizeof(Compra);
+            continue;
+        }
+        c->ativo = 'S';
+        c->newline = '\n';
+        n++;
+    }
+    csv_fechar(&l);
+    return n;
+}
+
+/**
+ * @brief Le o CSV, ordena em RAM e grava o arquivo .bin inicial de compras.
+ * Mesma logica do pre_processar_produtos.
+ */
+void pre_processar_compras(const char *csv_path, const char *bin_path) {
+    printf("Pre-processando COMPRAS de %s...\n", csv_path);
+    unsigned long long t0 = instr_inicio();
+
+    // 1. Le CSV para a RAM
+    Arena arena = {NULL, 0, 0};
+    long lidos = csv_simd ? ler_csv_compras_simd(csv_path, &arena) : -1;
+    Compra *compras = (Compra*)arena.base;
+    int n_compras = (int)lidos;
+    if (lidos < 0) {
+        arena_liberar(&arena);
+        FILE *fcsv = io_fopen(csv_path, "r");
+        if (!fcsv) { printf("ERRO: Nao foi possivel abrir CSV %s\n", csv_path); return; }
+        compras = ler_csv_compras_strtok(fcsv, &n_compras);
+        fclose(fcsv);
+        if (!compras) return;
+    }
+    struct stat st_csv;
+    double segundos = (double)(instr_inicio() - t0) / 1e9;
+    double mb = stat(csv_path, &st_csv) == 0 ? (double)st_csv.st_size / (1024.0 * 1024.0) : 0.0;
+    printf("%d registros lidos para compras (%.1f MB/s, leitor %s).\n", n_compras,
+           segundos > 0 ? mb / segundos : 0.0, arena.base ? "simd" : "strtok");
+
+    // 2. Ordena na RAM
+    qsort(compras, n_compras, sizeof(Compra), comparar_compra);
+
+    // 3. Grava no .bin, pulando duplicatas
+    // Grava em um temporario: se algo falhar, o .bin anterior continua valido
+    // Com AED2_PREENCHIMENTO > 0 o arquivo ja sai no layout em blocos com folga
+    char caminho_tmp[1024];
+    caminho_temporario(bin_path, caminho_tmp, sizeof(caminho_tmp));
+    int trava = trava_escrita_adquirir(); // Um escritor por vez
+    FILE *fbin = io_fopen(caminho_tmp, "wb");
+    GravadorBlocos g;
+    if (fbin && !gravador_iniciar(&g, fbin, sizeof(Compra), offsetof(Compra, order_id),
+                                  offsetof(Compra, ativo), preenchimento_blocos)) {
+        gravador_finalizar(&g);
+        fclose(fbin);
+        remove(caminho_tmp);
+        fbin = NULL;
+    }
+    if (fbin) {
+        int n_unicos = 0;
+        long long ultimo_id = LLONG_MIN;
+        for (int i = 0; i < n_compras; i++) {
+            if (compras[i].order_id > 0 && compras[i].order_id != ultimo_id) {
+                gravador_escrever(&g, &compras[i]);
+                ultimo_id = compras[i].order_id;
+                n_unicos++;
+            }
+        }
+        int gravou = gravador_finalizar(&g);
+        if (!gravou) { fclose(fbin); remove(caminho_tmp); }
+        if (gravou && publicar_temporario(fbin, caminho_tmp, bin_path)) {
+            avancar_geracao_layout(TABELA_COMPRAS, preenchimento_blocos > 0);
+            printf("%s criado com %d compras unicas.\n", bin_path, n_unicos);
+            if (strcmp(bin_path, ARQ_COMPRAS_BIN) == 0) {
+                // 4. Todas as linhas vao para a tabela de itens (reordena 'compras')
+                long n_itens = gravar_itens_pedidos(compras, n_compras, ARQ_ITENS_BIN, ARQ_ITENS_IDX);
+                if (n_itens >= 0) printf("%s criado com %ld itens de pedidos.\n", ARQ_ITENS_BIN, n_itens);
+                else printf("ERRO: Falha ao gravar %s.\n", ARQ_ITENS_BIN);
+                // 5. Os agregados somam os itens
+                agregados_reconstruir();
+            }
+        } else {
+            printf("ERRO: Falha ao gravar o arquivo binario %s.\n", bin_path);
+        }
+    } else {
+         printf("ERRO: Nao foi possivel criar o arquivo binario %s.\n", bin_path);
+    }
+    trava_escrita_liberar(trava);
+    if (arena.base) arena_liberar(&arena);
+    else free(compras);
+}
+
+static inline void formatar_compra(BufferSaida *b, const Compra *c) {
+    saida_literal(b, "Order: ");
+    saida_int64(b, c->order_id);
+    saida_literal(b, " | Product: ");
+    saida_int64(b, c->product_id);
+    saida_literal(b, " | User: ");
+    saida_int64(b, c->user_id);
+    saida_literal(b, " | Qty: ");
+    saida_int64(b, c->quantity);
+    saida_literal(b, " | Date: ");
+    saida_campo(b, c->order_datetime, TAM_DATETIME);
+    saida_char(b, '\n');
+}
+
+/**
+ * @brief Imprime as compras ATIVAS do 'deslocamento'-esimo em diante, no
+ * maximo 'limite' (0 = todas). Mesma estrategia de mostrar_produtos.
+ */
+void mostrar_compras(const char *arq_bin, const char *arq_indice, long deslocamento, long limite) {
+    unsigned long long t0 = instr_inicio();
+    FILE *fbin = limite <= 0 ? io_abrir_sequencial(arq_bin) : io_fopen(arq_bin, "rb");
+    if (!fbin) { printf("ERRO ao abrir %s\n", arq_bin); return; }
+    printf("\n--- COMPRAS ATIVAS ---\n");
+    fflush(stdout);
+
+    long inicio = deslocamento > 0 ? offset_do_ativo(TABELA_COMPRAS, arq_bin, arq_indice, sizeof(Compra),
+                                                     offsetof(Compra, ativo), deslocamento) : 0;
+    Compra *bloco = malloc(sizeof(Compra) * REGISTROS_POR_LEITURA);
+    BufferSaida b;
+    long contador = 0;
+    if (inicio >= 0 && bloco && saida_iniciar(&b, STDOUT_FILENO, SAIDA_BUFFER_PADRAO)) {
+        io_fseek(fbin, inicio, SEEK_SET);
+        size_t lidos;
+        while ((limite <= 0 || contador < limite) &&
+               (lidos = io_fread(bloco, sizeof(Compra), REGISTROS_POR_LEITURA, fbin)) > 0) {
+            for (size_t i = 0; i < lidos && (limite <= 0 || contador < limite); i++) {
+                if (bloco[i].ativo != 'S') continue;
+                formatar_compra(&b, &bloco[i]);
+                contador++;
+            }
+        }
+        saida_finalizar(&b);
+    }
+    free(bloco);
+    fclose(fbin);
+    if (deslocamento > 0 || limite > 0) printf("Exibidas: %ld compras a partir da %ld-esima\n", contador, deslocamento);
+    else printf("Total: %ld compras\n", contador);
+    instr_registrar(OP_MOSTRAR, t0);
+}
+
+/**
+ * @brief Insere uma nova compra no arquivo binario.
+ * Utiliza a mesma estrategia (WAL + merge ordenado via temporario)
+ * da funcao inserir_produto, para manter o arquivo ordenado.
+ * Tambem valida se o product_id informado existe no arquivo de produtos.
+ * @return 1 se foi inserido, 0 se houve erro.
+ */
+int inserir_compra(const char *arq_bin) {
+    Compra c_nova;
+    memset(&c_nova, 0, sizeof(c_nova));
+    printf("\n--- INSERIR NOVA COMPRA ---\n");
+
+    c_nova.order_id = ler_long_long("Digite o order_id: ");
+     if (c_nova.order_id <= 0) {
+        printf("ERRO: ID do pedido deve ser positivo.\n");
+        return 0;
+    }
+
+    // 1. Verifica duplicidade de ID da compra
+    long long chave = c_nova.order_id;
+    if (existe_compra(arq_bin, chave)) {
+        printf("ERRO: order_id %lld ja existe!\n", c_nova.order_id);
+        return 0;
+    }
+
+    c_nova.product_id = ler_long_long("Digite o product_id: ");
+    // 2. VALIDA CHAVE ESTRANGEIRA (Product ID)
+    int64_t chave_prod = c_nova.product_id;
+    if (!produto_ativo(chave_prod)) {
+        printf("ERRO: product_id %lld nao encontrado ou inativo no cadastro de produtos. Insercao cancelada.\n", c_nova.product_id);
+        return 0;
+    }
+
+    c_nova.user_id = ler_long_long("Digite o user_id: ");
+
+    // 3. Valida formato da data
+    while (1) {
+        ler_string("Digite a data/hora (YYYY-MM-DD HH:MM:SS): ", c_nova.order_datetime, TAM_DATETIME);
+        if (validar_e_formatar_data(c_nova.order_datetime, TAM_DATETIME)) {
+            break;
+        } else {
+            printf("ERRO: Formato de data/hora invalido. Use YYYY-MM-DD HH:MM:SS.\n");
+        }
+    }
+
+    c_nova.quantity = ler_inteiro("Digite a quantidade: ");
+     if (c_nova.quantity <= 0) {
+        printf("ERRO: Quantidade deve ser positiva.\n");
+        return 0;
+    }
+
+    pad_string(c_nova.order_datetime, TAM_DATETIME);
+    c_nova.ativo = 'S';
+    c_nova.newline = '\n';
+
+    // 4. Registra no WAL e aplica (mesma estrategia do inserir_produto)
+    int resultado = 0;
+    wal_registrar(WAL_INSERIR_COMPRA, &c_nova);
+    if (!wal_confirmar_grupo(&resultado) || !resultado) {
+        printf("ERRO: Compra %lld nao foi inserida.\n", c_nova.order_id);
+        return 0;
+    }
+
+    printf("Compra %lld inserida com sucesso!\n", c_nova.order_id);
+    return 1; // Sinaliza para reconstruir indice
+}
+
+/**
+ * @brief Realiza a remocao logica de uma compra (marca ativo = 'N').
+ * Mesma logica do remover_produto.
+ * @return 1 se foi removido, 0 se houve erro.
+ */
+int remover_compra(const char *arq_bin) {
+    printf("\n--- REMOVER COMPRA ---\n");
+    long long id = ler_long_long("Digite o order_id para remover: ");
+
+    long long chave = id;
+    long offset = pesquisa_binaria_compra(arq_bin, chave);
+
+    if (offset == -1) { printf("Compra %lld nao encontrada.\n", id); return 0; }
+    if (offset == -2) { printf("Compra %lld ja esta removida.\n", id); return 0; }
+
+    int64_t chave_wal = chave;
+    int resultado = 0;
+    wal_registrar(WAL_REMOVER_COMPRA, &chave_wal);
+    if (!wal_confirmar_grupo(&resultado) || !resultado) {
+        printf("ERRO ao remover a compra %lld.\n", id);
+        return 0;
+    }
+
+    printf("Compra %lld removida logicamente.\n", id);
+    return 1; // Sinaliza para reconstruir indice
+}
+
+/**
+ * @brief Consulta uma compra usando a pesquisa binaria direta no arquivo.
+ */
+void consultar_compra(const char *arq_bin) {
+    printf("\n--- CONSULTAR COMPRA ---\n");
+    long long id = ler_long_long("Digite o order_id para consultar: ");
+
+    unsigned long long t0 = instr_inicio();
+    long long chave = id;
+    Compra c; // Copia lida na propria pesquisa (mesma geracao do arquivo)
+    long offset = localizar_compra(arq_bin, chave, &c);
+
+    if (offset == -1) { printf("Compra %lld nao encontrada.\n", id); }
+    else if (c.ativo != 'S') { printf("Compra %lld existe mas foi removida.\n", id); }
+    else {
+
+        // "Trim"
+        char datetime_trim[TAM_DATETIME+1]={0};
+        strncpy(datetime_trim, c.order_datetime, TAM_DATETIME);
+        for(int i = strlen(datetime_trim)-1; i >=0 && datetime_trim[i] == ' '; i--) datetime_trim[i] = '\0';
+
+        printf("\n--- COMPRA ENCONTRADA ---\n");
+        printf("Order ID: %lld\nProduct ID: %lld\nUser ID: %lld\nQuantity: %d\nDate: %s\n",
+               c.order_id, c.product_id, c.user_id, c.quantity, datetime_trim);
+    }
+    instr_registrar(OP_CONSULTAR_COMPRA, t0);
+}
+
+// --- CONSULTAS COM INDICE ---
+
+/**
+ * @brief Consulta um produto usando o arquivo de indice parcial.
+ * A busca em si e feita por buscar_produto_com_indice (gerada por DEFINIR_TABELA).
+ */
+void consultar_produto_com_indice(const char *arq_indice, const char *arq_dados) {
+    printf("\n--- CONSULTAR PRODUTO COM INDICE ---\n");
+    int64_t id = ler_long_long("Digite o product_id para buscar: ");
+
+    Produto p;
+    // Com um indice aprendido valido (.pgm) le so a janela prevista
+    long resultado = buscar_produto_aprendido(arq_dados, id, &p);
+    if (resultado == -3) resultado = buscar_produto_com_indice(arq_indice, arq_dados, id, &p);
+
+    if (resultado == -3) {
+        printf("ERRO: Indice %s ou dados %s invalidos/nao encontrados.\n", arq_indice, arq_dados);
+    } else if (resultado == -2) {
+        printf("Produto %lld existe mas foi removido.\n", id);
+    } else if (resultado == -1) {
+        printf("Produto %lld nao encontrado no bloco verificado.\n", id);
+    } else {
+        // "Trim"
+        char brand_trim[TAM_BRAND+1]={0};
+        char category_trim[TAM_CATEGORY+1]={0};
+        strncpy(brand_trim, p.brand, TAM_BRAND);
+        strncpy(category_trim, p.category_alias, TAM_CATEGORY);
+        for(int j = strlen(brand_trim)-1; j >=0 && brand_trim[j] == ' '; j--) brand_trim[j] = '\0';
+        for(int j = strlen(category_trim)-1; j >=0 && category_trim[j] == ' '; j--) category_trim[j] = '\0';
+
+        printf("\n--- PRODUTO ENCONTRADO (via indice) ---\n");
+        printf("ID: %lld | Brand: %s | Price: %.2f | Category: %s\n",
+               p.product_id, brand_trim, p.price, category_trim);
+    }
+}
+
+/**
+ * @brief Consulta uma compra usando o arquivo de indice parcial.
+ * Mesma logica da 'consultar_produto_com_indice'.
+ */
+void consultar_compra_com_indice(const char *arq_indice, const char *arq_dados) {
+    printf("\n--- CONSULTAR COMPRA COM INDICE ---\n");
+    long long id = ler_long_long("Digite o order_id para buscar: ");
+
+    Compra c;
+    long resultado = buscar_compra_aprendido(arq_dados, id, &c);
+    if (resultado == -3) resultado = buscar_compra_com_indice(arq_indice, arq_dados, id, &c);
+
+    if (resultado == -3) {
+        printf("ERRO: Indice %s ou dados %s invalidos/nao encontrados.\n", arq_indice, arq_dados);
+    } else if (resultado == -2) {
+        printf("Compra %lld existe mas foi removida.\n", id);
+    } else if (resultado == -1) {
+        printf("Compra %lld nao encontrada no bloco verificado.\n", id);
+    } else {
+        char datetime_trim[TAM_DATETIME+1]={0};
+        strncpy(datetime_trim, c.order_datetime, TAM_DATETIME);
+        for(int j = strlen(datetime_trim)-1; j >=0 && datetime_trim[j] == ' '; j--) datetime_trim[j] = '\0';
+
+        printf("\n--- COMPRA ENCONTRADA (via indice) ---\n");
+        printf("Order: %lld | Product: %lld | User: %lld | Qty: %d | Date: %s\n",
+               c.order_id, c.product_id, c.user_id, c.quantity, datetime_trim);
+    }
+}
+
+/**
+ * @brief Imprime todos os itens ativos de um pedido (tabela de itens) com o
+ * preco atual de cada produto e o total do pedido.
+ * @return Numero de itens, ou -3 se a tabela de itens nao puder ser lida.
+ */
+long mostrar_pedido(const char *arq_indice, const char *arq_dados, long long order_id) {
+    ItemPedido *itens;
+    long n = buscar_itens_pedido(arq_indice, arq_dados, order_id, -1, &itens);
+    if (n == -3) {
+        printf("ERRO: Tabela de itens %s/%s invalida, desatualizada ou nao encontrada (use 'Recriar do CSV' em compras).\n",
+               arq_dados, arq_indice);
+        return n;
+    }
+    if (n == 0) {
+        printf("Pedido %lld nao encontrado.\n", order_id);
+        return 0;
+    }
+
+    char datetime_trim[TAM_DATETIME+1]={0};
+    strncpy(datetime_trim, itens[0].order_datetime, TAM_DATETIME);
+    for(int j = strlen(datetime_trim)-1; j >=0 && datetime_trim[j] == ' '; j--) datetime_trim[j] = '\0';
+    printf("\n--- PEDIDO %lld (User: %lld | Date: %s) ---\n", order_id, itens[0].user_id, datetime_trim);
+
+    double total = 0;
+    for (long i = 0; i < n; i++) {
+        Produto p;
+        if (localizar_produto(ARQ_PRODUTOS_BIN, itens[i].product_id, &p) >= 0 && p.ativo == 'S') {
+            total += p.price * itens[i].quantity;
+            printf("Product: %lld | Qty: %d | Price: %.2f | Subtotal: %.2f\n",
+                   (long long)itens[i].product_id, itens[i].quantity, p.price, p.price * itens[i].quantity);
+        } else {
+            printf("Product: %lld | Qty: %d | (produto inexistente ou removido)\n",
+                   (long long)itens[i].product_id, itens[i].quantity);
+        }
+    }
+    printf("Itens: %ld | Total: %.2f\n", n, total);
+    free(itens);
+    return n;
+}
+
+/** @brief Consulta interativa de um pedido inteiro pela tabela de itens. */
+void consultar_pedido(const char *arq_indice, const char *arq_dados) {
+    printf("\n--- ITENS DO PEDIDO ---\n");
+    long long id = ler_long_long("Digite o order_id do pedido: ");
+    mostrar_pedido(arq_indice, arq_dados, id);
+}
+
+// --- EXPORTACAO (CSV / NDJSON) ---
+//
+// Copia os registros ATIVOS de um .bin para CSV ou NDJSON (um objeto JSON
+// por linha), opcionalmente so uma faixa de chaves. O .bin e lido em
+// blocos grandes e as linhas vao por um BufferSaida (um write() por MB,
+// numeros com os formatadores proprios). Campos de texto sao aparados pelo
+// tamanho fixo e so passam pelo escape quando contem algum caractere
+// especial.
+
+typedef enum { FORMATO_CSV, FORMATO_NDJSON } FormatoExportacao;
+
+#define EXPORTAR_REGISTROS_POR_LEITURA 4096
+
+typedef struct {
+    long long registros;        // Linhas exportadas
+    unsigned long long bytes_lidos;
+    unsigned long long bytes_escritos;
+    double segundos;
+} ResultadoExportacao;
+
+/**
+ * @brief Campo de texto em CSV: entre aspas (com "" para aspas internas)
+ * apenas se tiver virgula, aspas ou quebra de linha.
+ */
+static inline void saida_texto_csv(BufferSaida *b, const char *campo, size_t tam) {
+    size_t n = tamanho_aparado(campo, tam);
+    size_t i = 0;
+    while (i < n && campo[i] != ',' && campo[i] != '"' && campo[i] != '\n' && campo[i] != '\r') i++;
+    if (i == n) { saida_bytes(b, campo, n); return; }
+    saida_char(b, '"');
+    for (i = 0; i < n; i++) {
+        if (campo[i] == '"') saida_char(b, '"');
+        saida_char(b, campo[i]);
+    }
+    saida_char(b, '"');
+}
+
+/**
+ * @brief Campo de texto como string JSON (com aspas e escapes).
+ */
+static inline void saida_texto_json(BufferSaida *b, const char *campo, size_t tam) {
+    size_t n = tamanho_aparado(campo, tam);
+    size_t i = 0;
+    while (i < n && campo[i] != '"' && campo[i] != '\\' && (unsigned char)campo[i] >= 0x20) i++;
+    saida_char(b, '"');
+    if (i == n) {
+        saida_bytes(b, campo, n);
+    } else {
+        static const char hex[] = "0123456789abcdef";
+        for (i = 0; i < n; i++) {
+            unsigned char c = (unsigned char)campo[i];
+            if (c == '"' || c == '\\') { saida_char(b, '\\'); saida_char(b, (char)c); }
+            else if (c < 0x20) {
+                char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                saida_bytes(b, esc, 6);
+            } else saida_char(b, (char)c);
+        }
+    }
+    saida_char(b, '"');
+}
+
+static inline void exportar_linha_produto(BufferSaida *b, const Produto *p, FormatoExportacao formato) {
+    if (formato == FORMATO_CSV) {
+        saida_int64(b, p->product_id);
+        saida_char(b, ',');
+        saida_texto_csv(b, p->brand, TAM_BRAND);
+        saida_char(b, ',');
+        saida_preco(b, p->price);
+        saida_char(b, ',');
+        saida_texto_csv(b, p->category_alias, TAM_CATEGORY);
+        saida_char(b, '\n');
+    } else {
+        saida_literal(b, "{\"product_id\":");
+        saida_int64(b, p->product_id);
+        saida_literal(b, ",\"brand\":");
+        saida_texto_json(b, p->brand, TAM_BRAND);
+        saida_literal(b, ",\"price\":");
+        saida_preco(b, p->price);
+        saida_literal(b, ",\"category_alias\":");
+        saida_texto_json(b, p->category_alias, TAM_CATEGORY);
+        saida_literal(b, "}\n");
+    }
+}
+
+static inline void exportar_linha_compra(BufferSaida *b, const Compra *c, FormatoExportacao formato) {
+    if (formato == FORMATO_CSV) {
+        saida_int64(b, c->order_id);
+        saida_char(b, ',');
+        saida_int64(b, c->product_id);
+        saida_char(b, ',');
+        saida_int64(b, c->user_id);
+        saida_char(b, ',');
+        saida_int64(b, c->quantity);
+        saida_char(b, ',');
+        saida_texto_csv(b, c->order_datetime, TAM_DATETIME);
+        saida_char(b, '\n');
+    } else {
+        saida_literal(b, "{\"order_id\":");
+        saida_int64(b, c->order_id);
+        saida_literal(b, ",\"product_id\":");
+        saida_int64(b, c->product_id);
+        saida_literal(b, ",\"user_id\":");
+        saida_int64(b, c->user_id);
+        saida_literal(b, ",\"quantity\":");
+        saida_int64(b, c->quantity);
+        saida_literal(b, ",\"order_datetime\":");
+        saida_texto_json(b, c->order_datetime, TAM_DATETIME);
+        saida_literal(b, "}\n");
+    }
+}
+
+/**
+ * @brief Abre o destino da exportacao: NULL ou "-" e a saida padrao.
+ * @return Descritor, ou -1 em caso de erro.
+ */
+int exportar_abrir_destino(const char *destino) {
+    if (!destino || strcmp(destino, "-") == 0) {
+        fflush(stdout);
+        return STDOUT_FILENO;
+    }
+    return open(destino, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+/**
+ * @brief Exporta os produtos ATIVOS com chave em [de, ate].
+ * @return 1 se tudo foi gravado, 0 em caso de erro.
+ */
+int exportar_produtos(const char *arq_bin, const char *destino, FormatoExportacao formato,
+                      int64_t de, int64_t ate, ResultadoExportacao *r) {
+    unsigned long long t0 = instr_inicio();
+    memset(r, 0, sizeof(*r));
+    LeitorRegistros l; // Comeca no primeiro registro com chave >= de
+    if (!leitor_abrir(&l, TABELA_PRODUTOS, arq_bin, sizeof(Produto), offsetof(Produto, product_id), de)) return 0;
+    int fd = exportar_abrir_destino(destino);
+    Produto *bloco = malloc(sizeof(Produto) * EXPORTAR_REGISTROS_POR_LEITURA);
+    BufferSaida b;
+    if (fd < 0 || !bloco || !saida_iniciar(&b, fd, SAIDA_BUFFER_PADRAO)) {
+        if (fd > STDOUT_FILENO) close(fd);
+        free(bloco);
+        leitor_fechar(&l);
+        return 0;
+    }
+
+    if (formato == FORMATO_CSV) saida_literal(&b, "product_id,brand,price,category_alias\n");
+    size_t lidos;
+    int fim = 0;
+    while (!fim && !b.erro && (lidos = leitor_ler(&l, bloco, EXPORTAR_REGISTROS_POR_LEITURA)) > 0) {
+        for (size_t i = 0; i < lidos; i++) {
+            if (bloco[i].product_id > ate) { fim = 1; break; }
+            if (bloco[i].ativo != 'S') continue;
+            exportar_linha_produto(&b, &bloco[i], formato);
+            r->registros++;
+        }
+    }
+    r->bytes_lidos = l.bytes_lidos; // Comprimidos, se a copia .z foi usada
+    saida_descarregar(&b);
+    int ok = !b.erro;
+    r->bytes_escritos = b.bytes_escritos;
+    saida_finalizar(&b);
+    if (fd != STDOUT_FILENO && close(fd) != 0) ok = 0;
+    free(bloco);
+    leitor_fechar(&l);
+    r->segundos = (double)(instr_inicio() - t0) / 1e9;
+    instr_registrar(OP_EXPORTAR, t0);
+    return ok;
+}
+
+/**
+ * @brief Exporta as compras ATIVAS com chave em [de, ate]. Mesma estrategia
+ * de exportar_produtos.
+ */
+int exportar_compras(const char *arq_bin, const char *destino, FormatoExportacao formato,
+                     int64_t de, int64_t ate, ResultadoExportacao *r) {
+    unsigned long long t0 = instr_inicio();
+    memset(r, 0, sizeof(*r));
+    LeitorRegistros l; // Comeca no primeiro registro com chave >= de
+    if (!leitor_abrir(&l, TABELA_COMPRAS, arq_bin, sizeof(Compra), offsetof(Compra, order_id), de)) return 0;
+    int fd = exportar_abrir_destino(destino);
+    Compra *bloco = malloc(sizeof(Compra) * EXPORTAR_REGISTROS_POR_LEITURA);
+    BufferSaida b;
+    if (fd < 0 || !bloco || !saida_iniciar(&b, fd, SAIDA_BUFFER_PADRAO)) {
+        if (fd > STDOUT_FILENO) close(fd);
+        free(bloco);
+        leitor_fechar(&l);
+        return 0;
+    }
 
-    // 1. Le CSV para a RAM
-    while (fgets(linha, sizeof(linha), fcsv)) {
-        if (n_compras >= capacidade) {
+    if (formato == FORMATO_CSV) saida_literal(&b, "order_id,product_id,user_id,quantity,order_datetime\n");
+    size_t lidos;
+    int fim = 0;
+    while (!fim && !b.erro && (lidos = leitor_ler(&l, bloco, EXPORTAR_REGISTROS_POR_LEITURA)) > 0) {
+        for (size_t i = 0; i < lidos; i++) {
+            if (bloco[i].order_id > ate) { fim = 1; break; }
+            if (bloco[i].ativo != 'S') continue;
+            exportar_linha_compra(&b, &bloco[i], formato);
+            r->registros++;
+        }
+    }
+    r->bytes_lidos = l.bytes_lidos; // Comprimidos, se a copia .z foi usada
+    saida_descarregar(&b);
+    int ok = !b.erro;
+    r->bytes_escritos = b.bytes_escritos;
+    saida_finalizar(&b);
+    if (fd != STDOUT_FILENO && close(fd) != 0) ok = 0;
+    free(bloco);
+    leitor_fechar(&l);
+    r->segundos = (double)(instr_inicio() - t0) / 1e9;
+    instr_registrar(OP_EXPORTAR, t0);
+    return ok;
+}
+
+// --- PLANEJADOR DE ACESSO (CUSTO ESTIMADO) ---
+//
+// Em vez de o chamador fixar o caminho de acesso, o planejador estima o
+// custo de cada caminho possivel a partir das estatisticas dos arquivos e
+// fica com o mais barato. As estatisticas de uma tabela (EstatisticasTabela)
+// custam poucas chamadas de sistema: registros e bytes do .bin, se o indice
+// parcial (.idx) e o aprendido (.pgm) existem e valem para o .bin atual (so
+// os cabecalhos sao lidos) e a fracao de cada arquivo que ja esta na cache
+// de paginas (mincore sobre um mapeamento do arquivo, sem ler os dados).
+//
+// Cada candidato recebe uma estimativa de E/S -- leituras (read/pread) e
+// bytes -- e um custo em microssegundos. Leituras aleatorias a uma pagina
+// fria vao ao disco (CUSTO_LEITURA_FRIA), mas cada pagina fria so vai uma
+// vez: as seguintes ja a encontram na cache. Bytes lidos em sequencia
+// custam pela banda do disco na parte fria e pela de memoria na parte
+// residente. As constantes sao de um SSD comum; so a ordem de grandeza
+// importa para a escolha.
+//
+// Busca de n chaves (a consulta pontual e o lote com n = 1..):
+//   binaria    uma pesquisa binaria por chave: n * log2(N) leituras de um
+//              buffer do stdio, com abertura do .bin a cada chave
+//   indice     .idx inteiro + um trecho de BLOCO_INDICE registros por bloco
+//              distinto tocado (buscar_em_lote); exige o .idx atual
+//   aprendido  por chave, o .pgm + uma janela de 2*eps+2 registros
+//   varredura  uma leitura sequencial do .bin cruzada com as chaves ordenadas
+// Juncao compra -> produto (valor total vendido):
+//   agregados       cabecalho de agregados.bin, se estiver atual
+//   hash_join       precos dos produtos numa tabela hash + varredura de compras
+//   juncao_binaria  varredura de compras + uma pesquisa binaria por compra
+//
+// "explain" (linha de comando) imprime as estatisticas, os candidatos com a
+// estimativa de cada um e o plano escolhido. AED2_PLANO=<caminho> forca um
+// caminho sempre que ele servir para a consulta.
+
+#define CUSTO_LEITURA_FRIA 100.0           // read aleatorio que vai ao disco
+#define CUSTO_LEITURA_QUENTE 1.0           // read atendido pela cache (chamada + copia pequena)
+#define CUSTO_BYTE_FRIO (1.0 / 500.0)      // ~500 MB/s em sequencia do disco
+#define CUSTO_BYTE_QUENTE (1.0 / 5000.0)   // ~5 GB/s copiando da cache
+#define CUSTO_ABERTURA 5.0                 // open + fstat + close de uma busca isolada
+#define CUSTO_ENTRADA_HASH 0.05            // Insercao ou consulta na tabela hash
+#define BYTES_POR_PASSO_BINARIA ((double)BUFSIZ) // Buffer do stdio lido a cada passo
+
+typedef enum {
+    CAMINHO_BINARIA,
+    CAMINHO_INDICE,
+    CAMINHO_APRENDIDO,
+    CAMINHO_VARREDURA,
+    CAMINHO_AGREGADOS,
+    CAMINHO_HASH_JOIN,
+    CAMINHO_JUNCAO_BINARIA,
+    N_CAMINHOS
+} CaminhoAcesso;
+
+const char *NOMES_CAMINHOS[N_CAMINHOS] = {
+    "binaria", "indice", "aprendido", "varredura", "agregados", "hash_join", "juncao_binaria"
+};
+
+int caminho_forcado = -1; // AED2_PLANO
+
+typedef struct {
+    TabelaDados tabela;
+    const char *arq_dados;
+    const char *arq_indice;
+    size_t tam_registro;
+    int64_t registros;          // Posicoes do .bin (ativos, removidos e vagas)
+    int64_t bytes;
+    double residente;           // Fracao do .bin na cache de paginas
+    int indice_atual;           // .idx existe e e do .bin atual
+    int64_t entradas_indice;
+    int64_t bytes_indice;
+    double residente_indice;
+    int aprendido_atual;        // .pgm existe e e do .bin atual
+    int64_t janela_aprendido;   // Registros lidos por chave (2*eps+2)
+    int64_t bytes_aprendido;
+    double residente_aprendido;
+} EstatisticasTabela;
+
+typedef struct {
+    CaminhoAcesso caminho;
+    double leituras;
+    double bytes;
+    double custo;               // Microssegundos estimados
+} Plano;
+
+typedef struct {
+    Plano candidatos[N_CAMINHOS];
+    int n;
+    int escolhido;              // Posicao em candidatos
+    int forcado;                // Escolhido por AED2_PLANO, nao pelo custo
+} Planejamento;
+
+int caminho_por_nome(const char *nome) {
+    for (int c = 0; c < N_CAMINHOS; c++)
+        if (strcmp(nome, NOMES_CAMINHOS[c]) == 0) return c;
+    return -1;
+}
+
+/**
+ * @brief Fracao (0..1) das paginas de 'caminho' na cache de paginas: o
+ * arquivo e mapeado (sem ser lido) e o mincore diz quais paginas estao na
+ * memoria. Arquivo ausente ou vazio conta como frio.
+ */
+double fracao_residente(const char *caminho) {
+    int fd = open(caminho, O_RDONLY);
+    if (fd < 0) return 0.0;
+    struct stat st;
+    double fracao = 0.0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t pagina = (size_t)sysconf(_SC_PAGESIZE);
+        size_t n_paginas = ((size_t)st.st_size + pagina - 1) / pagina;
+        void *mapa = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        unsigned char *presentes = malloc(n_paginas);
+        if (mapa != MAP_FAILED && presentes && mincore(mapa, (size_t)st.st_size, presentes) == 0) {
+            size_t residentes = 0;
+            for (size_t i = 0; i < n_paginas; i++) residentes += presentes[i] & 1;
+            fracao = (double)residentes / (double)n_paginas;
+        }
+        free(presentes);
+        if (mapa != MAP_FAILED) munmap(mapa, (size_t)st.st_size);
+    }
+    close(fd);
+    return fracao;
+}
+
+static int64_t tamanho_do_arquivo(const char *caminho) {
+    struct stat st;
+    return stat(caminho, &st) == 0 ? (int64_t)st.st_size : 0;
+}
+
+/**
+ * @brief Coleta as estatisticas de produtos ou compras (ver o comeco da secao).
+ */
+void estatisticas_tabela(TabelaDados tabela, EstatisticasTabela *e) {
+    int produtos = tabela == TABELA_PRODUTOS;
+    memset(e, 0, sizeof(*e));
+    e->tabela = tabela;
+    e->arq_dados = produtos ? ARQ_PRODUTOS_BIN : ARQ_COMPRAS_BIN;
+    e->arq_indice = produtos ? ARQ_PRODUTOS_IDX : ARQ_COMPRAS_IDX;
+    e->tam_registro = produtos ? sizeof(Produto) : sizeof(Compra);
+    e->bytes = tamanho_do_arquivo(e->arq_dados);
+    e->registros = e->bytes / (int64_t)e->tam_registro;
+    e->residente = fracao_residente(e->arq_dados);
+
+    FILE *f = io_fopen(e->arq_indice, "rb");
+    CabecalhoIndice cab;
+    if (f) {
+        e->indice_atual = indice_ler_cabecalho(f, &cab) && indice_confere_dados(&cab, e->arq_dados, tabela);
+        fclose(f);
+    }
+    if (e->indice_atual) {
+        e->entradas_indice = cab.n_entradas;
+        e->bytes_indice = tamanho_do_arquivo(e->arq_indice);
+        e->residente_indice = fracao_residente(e->arq_indice);
+    }
+
+    IndiceAprendido ia;
+    if (indice_aprendido_carregar(&ia, tabela, e->arq_dados)) {
+        char caminho[1024];
+        caminho_aprendido(e->arq_dados, caminho, sizeof(caminho));
+        e->aprendido_atual = 1;
+        e->janela_aprendido = 2 * (int64_t)ia.cab.epsilon + 2;
+        e->bytes_aprendido = tamanho_do_arquivo(caminho);
+        e->residente_aprendido = fracao_residente(caminho);
+        indice_aprendido_liberar(&ia);
+    }
+}
+
+/**
+ * @brief Estatisticas de itens.bin (lido por inteiro no valor total
+ * vendido). O indice so conta como atual se vale para a geracao atual de
+ * compras; a tabela nao tem indice aprendido.
+ */
+void estatisticas_itens(EstatisticasTabela *e) {
+    memset(e, 0, sizeof(*e));
+    e->tabela = TABELA_COMPRAS;
+    e->arq_dados = ARQ_ITENS_BIN;
+    e->arq_indice = ARQ_ITENS_IDX;
+    e->tam_registro = sizeof(ItemPedido);
+    e->bytes = tamanho_do_arquivo(e->arq_dados);
+    e->registros = e->bytes / (int64_t)e->tam_registro;
+    e->residente = fracao_residente(e->arq_dados);
+
+    FILE *f = io_fopen(e->arq_indice, "rb");
+    CabecalhoIndice cab;
+    if (f) {
+        e->indice_atual = indice_ler_cabecalho(f, &cab) && indice_confere_dados(&cab, e->arq_dados, TABELA_COMPRAS);
+        fclose(f);
+    }
+    if (e->indice_atual) {
+        e->entradas_indice = cab.n_entradas;
+        e->bytes_indice = tamanho_do_arquivo(e->arq_indice);
+        e->residente_indice = fracao_residente(e->arq_indice);
+    }
+}
+
+/**
+ * @brief Custo de 'leituras' leituras aleatorias de 'por_leitura' bytes num
+ * arquivo de 'tamanho' bytes com a fracao 'residente' na cache. Cada pagina
+ * fria vai ao disco no maximo uma vez.
+ */
+static double custo_aleatorio(int64_t tamanho, double residente, double leituras, double por_leitura) {
+    double frias = leituras * (1.0 - residente);
+    double paginas_frias = (double)tamanho * (1.0 - residente) / (por_leitura > 0 ? por_leitura : 1.0);
+    if (frias > paginas_frias) frias = paginas_frias;
+    return frias * CUSTO_LEITURA_FRIA + (leituras - frias) * CUSTO_LEITURA_QUENTE +
+           leituras * por_leitura * CUSTO_BYTE_QUENTE;
+}
+
+/** @brief Custo de ler 'bytes' em sequencia em 'leituras' chamadas. */
+static double custo_sequencial(double bytes, double residente, double leituras) {
+    return leituras * CUSTO_LEITURA_QUENTE +
+           bytes * (residente * CUSTO_BYTE_QUENTE + (1.0 - residente) * CUSTO_BYTE_FRIO);
+}
+
+static double leituras_sequenciais(int64_t bytes) {
+    return (double)((bytes + BUFFER_LEITURA_SEQUENCIAL - 1) / BUFFER_LEITURA_SEQUENCIAL);
+}
+
+/** @brief Passos da pesquisa binaria em 'registros' posicoes (floor(log2) + 1). */
+static double niveis_binaria(int64_t registros) {
+    int niveis = 0;
+    for (; registros > 0; registros >>= 1) niveis++;
+    return niveis;
+}
+
+/** @brief base^expoente por quadrados sucessivos (sem a libm). */
+static double potencia(double base, long expoente) {
+    double resultado = 1.0;
+    for (; expoente > 0; expoente >>= 1, base *= base)
+        if (expoente & 1) resultado *= base;
+    return resultado;
+}
+
+void planejamento_iniciar(Planejamento *p) {
+    memset(p, 0, sizeof(*p));
+    p->escolhido = -1;
+}
+
+void planejamento_considerar(Planejamento *p, CaminhoAcesso caminho, double leituras, double bytes, double custo) {
+    Plano *c = &p->candidatos[p->n++];
+    c->caminho = caminho;
+    c->leituras = leituras;
+    c->bytes = bytes;
+    c->custo = custo;
+}
+
+/**
+ * @brief Fica com o candidato de menor custo (ou o de AED2_PLANO, se ele
+ * esta entre os candidatos). @return O caminho escolhido.
+ */
+CaminhoAcesso planejamento_escolher(Planejamento *p) {
+    p->escolhido = 0;
+    p->forcado = 0;
+    for (int i = 0; i < p->n; i++) {
+        if ((int)p->candidatos[i].caminho == caminho_forcado) {
+            p->escolhido = i;
+            p->forcado = 1;
+            break;
+        }
+        if (p->candidatos[i].custo < p->candidatos[p->escolhido].custo) p->escolhido = i;
+    }
+    return p->candidatos[p->escolhido].caminho;
+}
+
+/**
+ * @brief Planeja a busca de 'n' chaves na tabela de 'e'.
+ */
+CaminhoAcesso planejar_busca(const EstatisticasTabela *e, long n, Planejamento *p) {
+    planejamento_iniciar(p);
+    double chaves = n > 0 ? (double)n : 1.0;
+
+    double niveis = niveis_binaria(e->registros);
+    double leituras = chaves * niveis;
+    planejamento_considerar(p, CAMINHO_BINARIA, leituras, leituras * BYTES_POR_PASSO_BINARIA,
+                            chaves * CUSTO_ABERTURA +
+                            custo_aleatorio(e->bytes, e->residente, leituras, BYTES_POR_PASSO_BINARIA));
+
+    if (e->indice_atual && e->entradas_indice > 0) {
+        // Blocos distintos tocados por n chaves espalhadas: B * (1 - (1 - 1/B)^n)
+        double blocos = (double)e->entradas_indice;
+        double tocados = blocos * (1.0 - potencia(1.0 - 1.0 / blocos, (long)chaves));
+        double por_bloco = (double)e->bytes / blocos;
+        double leituras_idx = leituras_sequenciais(e->bytes_indice);
+        planejamento_considerar(p, CAMINHO_INDICE, leituras_idx + tocados,
+                                (double)e->bytes_indice + tocados * por_bloco,
+                                2 * CUSTO_ABERTURA +
+                                custo_sequencial((double)e->bytes_indice, e->residente_indice, leituras_idx) +
+                                custo_aleatorio(e->bytes, e->residente, tocados, por_bloco));
+    }
+
+    if (e->aprendido_atual) {
+        double janela = (double)(e->janela_aprendido * (int64_t)e->tam_registro);
+        planejamento_considerar(p, CAMINHO_APRENDIDO, 2 * chaves, chaves * ((double)e->bytes_aprendido + janela),
+                                chaves * 2 * CUSTO_ABERTURA +
+                                custo_aleatorio(e->bytes_aprendido, e->residente_aprendido, chaves,
+                                                (double)e->bytes_aprendido) +
+                                custo_aleatorio(e->bytes, e->residente, chaves, janela));
+    }
+
+    double leituras_seq = leituras_sequenciais(e->bytes);
+    planejamento_considerar(p, CAMINHO_VARREDURA, leituras_seq, (double)e->bytes,
+                            CUSTO_ABERTURA + custo_sequencial((double)e->bytes, e->residente, leituras_seq));
+    return planejamento_escolher(p);
+}
+
+static void imprimir_bytes(FILE *saida, double bytes) {
+    if (bytes >= 1024.0 * 1024.0) fprintf(saida, "%9.1f MB", bytes / (1024.0 * 1024.0));
+    else if (bytes >= 1024.0) fprintf(saida, "%9.1f KB", bytes / 1024.0);
+    else fprintf(saida, "%9.0f B ", bytes);
+}
+
+void imprimir_estatisticas_tabela(FILE *saida, const EstatisticasTabela *e) {
+    fprintf(saida, "%s: %lld registros, %.1f MB, %.0f%% na cache\n", e->arq_dados, (long long)e->registros,
+            (double)e->bytes / (1024.0 * 1024.0), 100.0 * e->residente);
+    if (e->indice_atual)
+        fprintf(saida, "  indice parcial %s: atual, %lld entradas, %lld bytes, %.0f%% na cache\n", e->arq_indice,
+                (long long)e->entradas_indice, (long long)e->bytes_indice, 100.0 * e->residente_indice);
+    else
+        fprintf(saida, "  indice parcial %s: ausente ou desatualizado\n", e->arq_indice);
+    if (e->aprendido_atual)
+        fprintf(saida, "  indice aprendido: atual, janela de %lld registros, %lld bytes\n",
+                (long long)e->janela_aprendido, (long long)e->bytes_aprendido);
+    else
+        fprintf(saida, "  indice aprendido: ausente ou desatualizado\n");
+}
+
+/**
+ * @brief Tabela dos candidatos (o escolhido marcado com '*') e o motivo.
+ */
+void imprimir_planejamento(FILE *saida, const Planejamento *p) {
+    fprintf(saida, "  %-16s %12s %12s %16s\n", "caminho", "leituras", "bytes", "custo estimado");
+    for (int i = 0; i < p->n; i++) {
+        const Plano *c = &p->candidatos[i];
+        fprintf(saida, "%c %-16s %12.0f ", i == p->escolhido ? '*' : ' ', NOMES_CAMINHOS[c->caminho], c->leituras);
+        imprimir_bytes(saida, c->bytes);
+        fprintf(saida, " %13.3f ms\n", c->custo / 1000.0);
+    }
+    if (p->escolhido >= 0)
+        fprintf(saida, "plano: %s (%s)\n", NOMES_CAMINHOS[p->candidatos[p->escolhido].caminho],
+                p->forcado ? "forcado por AED2_PLANO" : "menor custo estimado");
+}
+
+/**
+ * @brief Busca em lote sem indice: uma leitura sequencial do .bin, a partir
+ * da menor chave, cruzada com as chaves ordenadas. Mesmos codigos de
+ * buscar_em_lote em resultados[]. @return Chaves encontradas ativas, ou -3.
+ */
+long buscar_em_lote_varredura(const char *arq_dados, size_t tam_registro, size_t offset_chave,
+                              size_t offset_ativo, const int64_t *chaves, long n, void *saidas,
+                              long *resultados, ResultadoLote *r) {
+    memset(r, 0, sizeof(*r));
+    r->motor = NOMES_CAMINHOS[CAMINHO_VARREDURA];
+    if (n <= 0) return 0;
+    ChaveLote *ordem = malloc((size_t)n * sizeof(ChaveLote));
+    char *bloco = malloc(tam_registro * REGISTROS_POR_LEITURA);
+    FILE *f = ordem && bloco ? io_abrir_sequencial(arq_dados) : NULL;
+    if (!f) {
+        free(ordem);
+        free(bloco);
+        for (long i = 0; i < n; i++) resultados[i] = -3;
+        return -3;
+    }
+    for (long i = 0; i < n; i++) {
+        ordem[i].chave = chaves[i];
+        ordem[i].posicao = i;
+    }
+    qsort(ordem, (size_t)n, sizeof(ChaveLote), comparar_chave_lote);
+
+    long offset = offset_primeira_chave(f, tam_registro, offset_chave, ordem[0].chave);
+    io_fseek(f, offset, SEEK_SET);
+    long j = 0;
+    size_t lidos;
+    while (j < n && (lidos = io_fread(bloco, tam_registro, REGISTROS_POR_LEITURA, f)) > 0) {
+        r->leituras++;
+        for (size_t i = 0; i < lidos && j < n; i++, offset += (long)tam_registro) {
+            const char *registro = bloco + i * tam_registro;
+            if (registro[offset_ativo] == 'V') continue;
+            int64_t chave;
+            memcpy(&chave, registro + offset_chave, sizeof(chave));
+            for (; j < n && ordem[j].chave < chave; j++) {
+                resultados[ordem[j].posicao] = -1;
+                r->ausentes++;
+            }
+            for (; j < n && ordem[j].chave == chave; j++) {
+                long pos = ordem[j].posicao;
+                memcpy((char *)saidas + (size_t)pos * tam_registro, registro, tam_registro);
+                if (registro[offset_ativo] == 'S') { resultados[pos] = offset; r->encontradas++; }
+                else { resultados[pos] = -2; r->removidas++; }
+            }
+        }
+    }
+    for (; j < n; j++) {
+        resultados[ordem[j].posicao] = -1;
+        r->ausentes++;
+    }
+    fclose(f);
+    free(ordem);
+    free(bloco);
+    return r->encontradas;
+}
+
+/**
+ * @brief Busca em lote uma chave por vez, pela pesquisa binaria
+ * ('localizar') ou, se 'aprendido', pelo indice aprendido. Mesmos codigos de
+ * buscar_em_lote; as leituras sao os seeks feitos no .bin.
+ * @return Chaves encontradas ativas, ou -3.
+ */
+long buscar_chave_a_chave(TabelaDados tabela, const char *arq_dados, size_t tam_registro, size_t offset_chave,
+                          size_t offset_ativo, long (*localizar)(const char *, int64_t, void *), int aprendido,
+                          const int64_t *chaves, long n, void *saidas, long *resultados, ResultadoLote *r) {
+    memset(r, 0, sizeof(*r));
+    r->motor = NOMES_CAMINHOS[aprendido ? CAMINHO_APRENDIDO : CAMINHO_BINARIA];
+    unsigned long long seeks = estat_io.seeks;
+    for (long i = 0; i < n; i++) {
+        char *saida = (char *)saidas + (size_t)i * tam_registro;
+        long offset = aprendido
+                      ? buscar_aprendido(tabela, arq_dados, tam_registro, offset_chave, offset_ativo, chaves[i], saida)
+                      : localizar(arq_dados, chaves[i], saida);
+        if (offset == -3) {
+            for (long k = 0; k < n; k++) resultados[k] = -3;
+            return -3;
+        }
+        if (offset >= 0 && saida[offset_ativo] != 'S') offset = -2;
+        resultados[i] = offset;
+        if (offset >= 0) r->encontradas++;
+        else if (offset == -2) r->removidas++;
+        else r->ausentes++;
+    }
+    r->leituras = (long)(estat_io.seeks - seeks);
+    return r->encontradas;
+}
+
+/**
+ * @brief Busca 'n' chaves de produtos ou compras pelo caminho que
+ * planejar_busca escolher. Mesmos codigos de buscar_em_lote.
+ * @return Chaves encontradas ativas, ou -3.
+ */
+long buscar_planejado(TabelaDados tabela, const int64_t *chaves, long n, void *saidas, long *resultados,
+                      ResultadoLote *r) {
+    EstatisticasTabela e;
+    Planejamento p;
+    int produtos = tabela == TABELA_PRODUTOS;
+    size_t offset_chave = produtos ? offsetof(Produto, product_id) : offsetof(Compra, order_id);
+    size_t offset_ativo = produtos ? offsetof(Produto, ativo) : offsetof(Compra, ativo);
+    estatisticas_tabela(tabela, &e);
+    switch (planejar_busca(&e, n, &p)) {
+    case CAMINHO_INDICE:
+        return buscar_em_lote(tabela, e.arq_indice, e.arq_dados, e.tam_registro, offset_chave, offset_ativo,
+                              chaves, n, saidas, resultados, r);
+    case CAMINHO_VARREDURA:
+        return buscar_em_lote_varredura(e.arq_dados, e.tam_registro, offset_chave, offset_ativo, chaves, n,
+                                        saidas, resultados, r);
+    case CAMINHO_APRENDIDO:
+        return buscar_chave_a_chave(tabela, e.arq_dados, e.tam_registro, offset_chave, offset_ativo, NULL, 1,
+                                    chaves, n, saidas, resultados, r);
+    default:
+        return buscar_chave_a_chave(tabela, e.arq_dados, e.tam_registro, offset_chave, offset_ativo,
+                                    produtos ? localizar_produto_wal : localizar_compra_wal, 0,
+                                    chaves, n, saidas, resultados, r);
+    }
+}
+
+// --- CONSULTA EM LOTE (LINHA DE COMANDO) ---
+//
+// "lote produtos|compras" le as chaves (uma por linha) de um arquivo ou da
+// entrada padrao, resolve todas juntas pelo caminho que o planejador
+// escolher (indice parcial, pesquisa binaria, indice aprendido ou
+// varredura; ou, com --profundidade N, com as pesquisas assincronas) e
+// escreve uma linha por
+// chave, na ordem de entrada, no formato da exportacao. Chave
+// ausente ou removida vira uma linha so com a chave: campos vazios no CSV
+// e um campo "status" no NDJSON.
+
+/**
+ * @brief Le as chaves, uma por linha; linhas que nao sao um inteiro sao
+ * ignoradas. @return Quantidade lida, ou -1 sem memoria.
+ */
+long ler_chaves_lote(FILE *entrada, int64_t **chaves) {
+    long n = 0, capacidade = 1024;
+    int64_t *v = malloc((size_t)capacidade * sizeof(int64_t));
+    char linha[128];
+    while (v && fgets(linha, sizeof(linha), entrada)) {
+        char *fim;
+        errno = 0;
+        long long chave = strtoll(linha, &fim, 10);
+        if (fim == linha || errno != 0) continue;
+        if (n == capacidade) {
+            int64_t *novo = realloc(v, (size_t)capacidade * 2 * sizeof(int64_t));
+            if (!novo) { free(v); v = NULL; break; }
+            v = novo;
             capacidade *= 2;
-            Compra* temp = realloc(compras, capacidade * sizeof(Compra));
-             if (!temp) { printf("ERRO: Falha ao realocar memoria.\n"); free(compras); fclose(fcsv); return; }
-             compras = temp;
         }
+        v[n++] = chave;
+    }
+    *chaves = v;
+    return v ? n : -1;
+}
+
+/**
+ * @brief Consulta em lote de produtos ou compras: chaves de 'origem' (NULL
+ * ou "-" = entrada padrao) e resultado em 'destino' (NULL ou "-" = saida).
+ * Com profundidade > 0 usa as pesquisas assincronas em vez do lote ordenado.
+ * @return 1 se ok, 0 em caso de erro (indice/dados ilegiveis, E/S).
+ */
+int consultar_em_lote(TabelaDados tabela, const char *origem, const char *destino,
+                      FormatoExportacao formato, int profundidade, ResultadoLote *r) {
+    memset(r, 0, sizeof(*r));
+    FILE *entrada = (!origem || strcmp(origem, "-") == 0) ? stdin : fopen(origem, "r");
+    if (!entrada) return 0;
+    int64_t *chaves;
+    long n = ler_chaves_lote(entrada, &chaves);
+    if (entrada != stdin) fclose(entrada);
+    if (n < 0) return 0;
+
+    int produtos = tabela == TABELA_PRODUTOS;
+    size_t tam_registro = produtos ? sizeof(Produto) : sizeof(Compra);
+    void *saidas = malloc((size_t)(n > 0 ? n : 1) * tam_registro);
+    long *resultados = malloc((size_t)(n > 0 ? n : 1) * sizeof(long));
+    int fd = -1;
+    BufferSaida b;
+    const char *arq_indice = produtos ? ARQ_PRODUTOS_IDX : ARQ_COMPRAS_IDX;
+    const char *arq_dados = produtos ? ARQ_PRODUTOS_BIN : ARQ_COMPRAS_BIN;
+    size_t offset_chave = produtos ? offsetof(Produto, product_id) : offsetof(Compra, order_id);
+    size_t offset_ativo = produtos ? offsetof(Produto, ativo) : offsetof(Compra, ativo);
+    int ok = saidas && resultados &&
+             (profundidade > 0
+              ? pesquisar_assincrono(tabela, arq_dados, arq_indice, tam_registro, offset_chave, offset_ativo,
+                                     chaves, n, saidas, resultados, profundidade, r)
+              : buscar_planejado(tabela, chaves, n, saidas, resultados, r)) != -3 &&
+             (fd = exportar_abrir_destino(destino)) >= 0 && saida_iniciar(&b, fd, SAIDA_BUFFER_PADRAO);
+    if (ok) {
+        if (formato == FORMATO_CSV && produtos) saida_literal(&b, "product_id,brand,price,category_alias\n");
+        else if (formato == FORMATO_CSV) saida_literal(&b, "order_id,product_id,user_id,quantity,order_datetime\n");
+        for (long i = 0; i < n && !b.erro; i++) {
+            if (resultados[i] >= 0) {
+                if (produtos) exportar_linha_produto(&b, (Produto *)saidas + i, formato);
+                else exportar_linha_compra(&b, (Compra *)saidas + i, formato);
+            } else if (formato == FORMATO_CSV) {
+                saida_int64(&b, chaves[i]);
+                if (produtos) saida_literal(&b, ",,,\n");
+                else saida_literal(&b, ",,,,\n");
+            } else {
+                if (produtos) saida_literal(&b, "{\"product_id\":");
+                else saida_literal(&b, "{\"order_id\":");
+                saida_int64(&b, chaves[i]);
+                if (resultados[i] == -2) saida_literal(&b, ",\"status\":\"removido\"}\n");
+                else saida_literal(&b, ",\"status\":\"ausente\"}\n");
+            }
+        }
+        saida_descarregar(&b);
+        ok = !b.erro;
+        saida_finalizar(&b);
+    }
+    if (fd > STDOUT_FILENO && close(fd) != 0) ok = 0;
+    free(chaves);
+    free(saidas);
+    free(resultados);
+    return ok;
+}
+
+// --- TOP-K (HEAP LIMITADO) ---
+//
+// "Os K maiores" por uma metrica, numa unica passada: um heap de minimo
+// com no maximo K entradas guarda os melhores vistos ate agora; cada valor
+// novo so entra se for maior que a raiz (o pior dos K). Tempo O(N log K) e
+// memoria O(K) para o ranking.
+//
+// Metricas:
+//   TOPK_PRECO          produtos mais caros (varredura de produtos.bin)
+//   TOPK_RECEITA        produtos com maior receita (preco * quantidade)
+//   TOPK_GASTO_USUARIO  usuarios que mais gastaram
+// As duas ultimas dependem da juncao compra -> produto: e um hash join, com
+// os precos dos produtos ATIVOS numa tabela hash em memoria (uma leitura
+// de produtos.bin) e uma varredura de compras.bin, sem pesquisa binaria
+// por compra. Os totais por produto/usuario vem do AGRUPAMENTO (abaixo),
+// que respeita um limite de memoria; o heap so percorre o resultado.
+
+typedef enum { TOPK_PRECO, TOPK_RECEITA, TOPK_GASTO_USUARIO } MetricaTopK;
+
+typedef struct {
+    int64_t chave; // product_id ou user_id
+    double valor;
+} EntradaTopK;
+
+typedef struct {
+    EntradaTopK *itens;
+    int n, k;
+} HeapTopK;
+
+// Ordem do ranking: maior valor primeiro; no empate, menor chave primeiro
+static inline int topk_pior(const EntradaTopK *a, const EntradaTopK *b) {
+    return a->valor < b->valor || (a->valor == b->valor && a->chave > b->chave);
+}
+
+int topk_iniciar(HeapTopK *h, int k) {
+    h->itens = malloc((size_t)(k > 0 ? k : 1) * sizeof(EntradaTopK));
+    h->n = 0;
+    h->k = k;
+    return h->itens != NULL;
+}
+
+static void topk_descer(HeapTopK *h, int i) {
+    for (;;) {
+        int menor = i, e = 2 * i + 1, d = 2 * i + 2;
+        if (e < h->n && topk_pior(&h->itens[e], &h->itens[menor])) menor = e;
+        if (d < h->n && topk_pior(&h->itens[d], &h->itens[menor])) menor = d;
+        if (menor == i) return;
+        EntradaTopK t = h->itens[i]; h->itens[i] = h->itens[menor]; h->itens[menor] = t;
+        i = menor;
+    }
+}
+
+/**
+ * @brief Oferece um candidato ao heap: O(log K) se entrar, O(1) se nao.
+ */
+static inline void topk_oferecer(HeapTopK *h, int64_t chave, double valor) {
+    EntradaTopK novo = {chave, valor};
+    if (h->k <= 0) return;
+    if (h->n < h->k) {
+        int i = h->n++;
+        h->itens[i] = novo;
+        while (i > 0 && topk_pior(&h->itens[i], &h->itens[(i - 1) / 2])) {
+            EntradaTopK t = h->itens[i]; h->itens[i] = h->itens[(i - 1) / 2]; h->itens[(i - 1) / 2] = t;
+            i = (i - 1) / 2;
+        }
+    } else if (topk_pior(&h->itens[0], &novo)) {
+        h->itens[0] = novo;
+        topk_descer(h, 0);
+    }
+}
+
+/**
+ * @brief Ordena o heap do melhor para o pior (heapsort no lugar).
+ */
+void topk_ordenar(HeapTopK *h) {
+    int n = h->n;
+    while (h->n > 1) {
+        EntradaTopK t = h->itens[0]; h->itens[0] = h->itens[h->n - 1]; h->itens[h->n - 1] = t;
+        h->n--;
+        topk_descer(h, 0);
+    }
+    h->n = n;
+}
+
+// Tabela hash product_id -> (preco, totais de venda), enderecamento aberto,
+// sem remocao
+typedef struct {
+    int64_t chave;
+    double preco;
+    double soma;      // Receita (preco * quantidade) das compras do produto
+    int64_t unidades;
+    int64_t pedidos;
+    int usado;
+} EntradaMapa;
+
+typedef struct {
+    EntradaMapa *itens;
+    uint64_t capacidade; // Potencia de 2
+    uint64_t n;
+} MapaChaves;
+
+int mapa_iniciar(MapaChaves *m, uint64_t n_previsto) {
+    uint64_t capacidade = 16;
+    while (capacidade < 2 * n_previsto) capacidade *= 2;
+    m->itens = calloc(capacidade, sizeof(EntradaMapa));
+    m->capacidade = m->itens ? capacidade : 0;
+    m->n = 0;
+    return m->itens != NULL;
+}
+
+static inline EntradaMapa *mapa_buscar(const MapaChaves *m, int64_t chave) {
+    for (uint64_t i = espalhar_chave(chave) & (m->capacidade - 1); ; i = (i + 1) & (m->capacidade - 1)) {
+        if (!m->itens[i].usado) return NULL;
+        if (m->itens[i].chave == chave) return &m->itens[i];
+    }
+}
+
+/**
+ * @brief Entrada da chave, criada (zerada) se nao existir. Dobra a tabela
+ * acima de 50% de ocupacao.
+ * @return NULL se faltar memoria.
+ */
+EntradaMapa *mapa_obter(MapaChaves *m, int64_t chave) {
+    if (2 * (m->n + 1) > m->capacidade) {
+        MapaChaves maior;
+        if (!mapa_iniciar(&maior, m->n + 1)) return NULL;
+        for (uint64_t i = 0; i < m->capacidade; i++) {
+            if (!m->itens[i].usado) continue;
+            uint64_t j = espalhar_chave(m->itens[i].chave) & (maior.capacidade - 1);
+            while (maior.itens[j].usado) j = (j + 1) & (maior.capacidade - 1);
+            maior.itens[j] = m->itens[i];
+        }
+        maior.n = m->n;
+        free(m->itens);
+        *m = maior;
+    }
+    uint64_t i = espalhar_chave(chave) & (m->capacidade - 1);
+    for (; m->itens[i].usado; i = (i + 1) & (m->capacidade - 1)) {
+        if (m->itens[i].chave == chave) return &m->itens[i];
+    }
+    m->itens[i].usado = 1;
+    m->itens[i].chave = chave;
+    m->n++;
+    return &m->itens[i];
+}
+
+void mapa_liberar(MapaChaves *m) {
+    free(m->itens);
+    m->itens = NULL;
+    m->capacidade = m->n = 0;
+}
+
+/**
+ * @brief Lado "build" do hash join: precos dos produtos ATIVOS.
+ */
+int carregar_precos_produtos(MapaChaves *precos) {
+    struct stat st;
+    LeitorRegistros l;
+    if (stat(ARQ_PRODUTOS_BIN, &st) != 0 ||
+        !leitor_abrir(&l, TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, sizeof(Produto), offsetof(Produto, product_id), INT64_MIN)) return 0;
+    long n = (long)st.st_size / (long)sizeof(Produto);
+    Produto *bloco = malloc(sizeof(Produto) * REGISTROS_POR_LEITURA);
+    int ok = bloco && mapa_iniciar(precos, (uint64_t)n);
+    size_t lidos;
+    while (ok && (lidos = leitor_ler(&l, bloco, REGISTROS_POR_LEITURA)) > 0) {
+        for (size_t i = 0; i < lidos; i++) {
+            if (bloco[i].ativo != 'S') continue;
+            EntradaMapa *e = mapa_obter(precos, bloco[i].product_id);
+            if (!e) { ok = 0; break; }
+            e->preco = bloco[i].price;
+        }
+    }
+    free(bloco);
+    leitor_fechar(&l);
+    if (!ok) mapa_liberar(precos);
+    return ok;
+}
+
+/**
+ * @brief Lado "probe" do hash join: para cada compra ativa de um produto
+ * ativo acumula receita (preco * quantidade), unidades e pedidos na
+ * entrada do produto.
+ */
+int juntar_compras_produtos(MapaChaves *precos) {
+    LeitorRegistros l;
+    if (!leitor_abrir(&l, TABELA_COMPRAS, ARQ_COMPRAS_BIN, sizeof(Compra), offsetof(Compra, order_id), INT64_MIN)) return 0;
+    Compra *bloco = malloc(sizeof(Compra) * REGISTROS_POR_LEITURA);
+    int ok = bloco != NULL;
+    size_t lidos;
+    while (ok && (lidos = leitor_ler(&l, bloco, REGISTROS_POR_LEITURA)) > 0) {
+        for (size_t i = 0; i < lidos; i++) {
+            if (bloco[i].ativo != 'S') continue;
+            EntradaMapa *p = mapa_buscar(precos, bloco[i].product_id);
+            if (!p) continue; // Produto inexistente ou removido
+            p->soma += p->preco * bloco[i].quantity;
+            p->unidades += bloco[i].quantity;
+            p->pedidos++;
+        }
+    }
+    free(bloco);
+    leitor_fechar(&l);
+    return ok;
+}
+
+// --- AGRUPAMENTO (GROUP BY COM HASH E DERRAMAMENTO EM DISCO) ---
+//
+// Receita, unidades e numero de pedidos das compras ATIVAS de produtos
+// ATIVOS, agrupados por category_alias, brand, user_id, product_id ou mes
+// de order_datetime. Os grupos ficam numa tabela hash de enderecamento
+// aberto alocada uma unica vez dentro de um limite de memoria. Quando a
+// tabela atinge o limite, as linhas de grupos que nao cabem sao
+// "derramadas" em AGRUPAR_PARTICOES arquivos temporarios, escolhidos por 4
+// bits do hash; cada particao e depois reagrupada sozinha com a mesma
+// tabela (e, se ainda nao couber, reparticionada pelos 4 bits seguintes).
+// Um grupo esta inteiro na memoria ou inteiro numa particao, entao nenhum
+// total sai dividido.
+//
+// O resultado (um GrupoAgregado por grupo) vai para um arquivo temporario
+// e pode ser ordenado por uma metrica ou pelo grupo, limitado aos N
+// primeiros (heap do TOP-K, sem carregar todos) e escrito em CSV ou NDJSON.
+//
+// Por categoria/brand a juncao e feita em duas fases: primeiro os totais
+// por produto (na tabela de precos do hash join) e depois uma leitura
+// sequencial de produtos.bin soma cada produto no grupo da sua categoria
+// ou brand, sem guardar os textos de todos os produtos na memoria.
+
+typedef enum { GRUPO_CATEGORIA, GRUPO_BRAND, GRUPO_USUARIO, GRUPO_PRODUTO, GRUPO_MES } CampoGrupo;
+typedef enum { ORDEM_NENHUMA, ORDEM_RECEITA, ORDEM_UNIDADES, ORDEM_PEDIDOS, ORDEM_GRUPO } OrdemGrupos;
+
+const char *NOMES_CAMPO_GRUPO[] = {"category_alias", "brand", "user_id", "product_id", "mes"};
+
+#define AGRUPAR_MEMORIA_PADRAO ((size_t)64 << 20) // 64 MB para a tabela de grupos
+#define AGRUPAR_PARTICOES 16
+#define AGRUPAR_NIVEIS_MAX 15 // 4 bits do hash de 64 bits por nivel
+
+typedef struct {
+    int64_t numero;             // user_id, product_id ou AAAAMM (0 nos grupos de texto)
+    char texto[TAM_CATEGORY];   // category_alias ou brand sem padding, completado com '\0'
+    double receita;
+    int64_t unidades;
+    int64_t pedidos;
+} GrupoAgregado;
+
+typedef struct {
+    GrupoAgregado *itens;
+    uint64_t *hashes;       // 0 = posicao livre
+    uint64_t capacidade;    // Potencia de 2
+    uint64_t n;
+    uint64_t max_grupos;    // Ocupacao maxima antes de derramar (70%)
+    unsigned long long linhas_derramadas;
+    int particoes_criadas;
+    int nivel_max;
+} TabelaGrupos;
+
+typedef struct {
+    long n_grupos;
+    unsigned long long linhas_derramadas;
+    int particoes_criadas;
+    int nivel_max;
+} EstatAgrupamento;
+
+/**
+ * @brief Aloca a maior tabela (potencia de 2) que cabe em 'memoria' bytes.
+ */
+int grupos_iniciar(TabelaGrupos *t, size_t memoria) {
+    memset(t, 0, sizeof(*t));
+    uint64_t capacidade = 16;
+    while (capacidade * 2 * (sizeof(GrupoAgregado) + sizeof(uint64_t)) <= memoria) capacidade *= 2;
+    t->itens = malloc(capacidade * sizeof(GrupoAgregado));
+    t->hashes = calloc(capacidade, sizeof(uint64_t));
+    if (!t->itens || !t->hashes) { free(t->itens); free(t->hashes); return 0; }
+    t->capacidade = capacidade;
+    t->max_grupos = capacidade * 7 / 10;
+    return 1;
+}
+
+void grupos_liberar(TabelaGrupos *t) {
+    free(t->itens);
+    free(t->hashes);
+    t->itens = NULL;
+    t->hashes = NULL;
+}
+
+static inline uint64_t grupo_hash(const GrupoAgregado *g) {
+    uint64_t h = (uint64_t)g->numero;
+    for (size_t i = 0; i < TAM_CATEGORY && g->texto[i]; i++) h = (h ^ (unsigned char)g->texto[i]) * 0x100000001B3ull;
+    return espalhar_chave((int64_t)h) | 1; // Nunca 0 (posicao livre)
+}
+
+static inline int mesmo_grupo(const GrupoAgregado *a, const GrupoAgregado *b) {
+    return a->numero == b->numero && memcmp(a->texto, b->texto, TAM_CATEGORY) == 0;
+}
+
+/**
+ * @brief Soma a linha no seu grupo; se o grupo nao esta na tabela e ela
+ * esta cheia, grava a linha na particao correspondente do 'nivel'.
+ * @return 0 se nao foi possivel gravar a particao.
+ */
+int grupos_adicionar(TabelaGrupos *t, const GrupoAgregado *linha, int nivel, FILE *particoes[]) {
+    uint64_t h = grupo_hash(linha);
+    uint64_t i = h & (t->capacidade - 1);
+    for (; t->hashes[i]; i = (i + 1) & (t->capacidade - 1)) {
+        if (t->hashes[i] == h && mesmo_grupo(&t->itens[i], linha)) {
+            t->itens[i].receita += linha->receita;
+            t->itens[i].unidades += linha->unidades;
+            t->itens[i].pedidos += linha->pedidos;
+            return 1;
+        }
+    }
+    if (t->n < t->max_grupos) {
+        t->hashes[i] = h;
+        t->itens[i] = *linha;
+        t->n++;
+        return 1;
+    }
+    int p = (int)((h >> (60 - 4 * nivel)) & (AGRUPAR_PARTICOES - 1));
+    if (!particoes[p]) {
+        particoes[p] = tmpfile();
+        if (!particoes[p]) return 0;
+        t->particoes_criadas++;
+    }
+    if (io_fwrite(linha, sizeof(GrupoAgregado), 1, particoes[p]) != 1) return 0;
+    t->linhas_derramadas++;
+    return 1;
+}
+
+/**
+ * @brief Grava os grupos da tabela no resultado e a esvazia.
+ */
+int grupos_emitir(TabelaGrupos *t, FILE *resultado, long *n_resultado) {
+    for (uint64_t i = 0; i < t->capacidade; i++) {
+        if (!t->hashes[i]) continue;
+        if (io_fwrite(&t->itens[i], sizeof(GrupoAgregado), 1, resultado) != 1) return 0;
+        (*n_resultado)++;
+    }
+    memset(t->hashes, 0, t->capacidade * sizeof(uint64_t));
+    t->n = 0;
+    return 1;
+}
+
+/**
+ * @brief Reagrupa cada particao gerada no 'nivel' (uma de cada vez, com a
+ * tabela vazia), derramando o que ainda nao couber no nivel seguinte.
+ * Fecha todas as particoes.
+ */
+int grupos_processar_particoes(TabelaGrupos *t, FILE *particoes[], int nivel,
+                               FILE *resultado, long *n_resultado) {
+    int ok = 1;
+    GrupoAgregado *buf = malloc(sizeof(GrupoAgregado) * REGISTROS_POR_LEITURA);
+    if (!buf) ok = 0;
+    for (int p = 0; p < AGRUPAR_PARTICOES; p++) {
+        FILE *origem = particoes[p];
+        if (!origem) continue;
+        particoes[p] = NULL;
+        if (!ok || nivel + 1 > AGRUPAR_NIVEIS_MAX) { fclose(origem); ok = 0; continue; }
+        if (nivel + 1 > t->nivel_max) t->nivel_max = nivel + 1;
+
+        FILE *sub[AGRUPAR_PARTICOES] = {0};
+        size_t lidos;
+        rewind(origem);
+        while (ok && (lidos = io_fread(buf, sizeof(GrupoAgregado), REGISTROS_POR_LEITURA, origem)) > 0) {
+            for (size_t j = 0; ok && j < lidos; j++) ok = grupos_adicionar(t, &buf[j], nivel + 1, sub);
+        }
+        fclose(origem);
+        if (ok) ok = grupos_emitir(t, resultado, n_resultado);
+        if (ok) ok = grupos_processar_particoes(t, sub, nivel + 1, resultado, n_resultado);
+        for (int q = 0; q < AGRUPAR_PARTICOES; q++) if (sub[q]) fclose(sub[q]);
+    }
+    free(buf);
+    return ok;
+}
+
+/**
+ * @brief Mes da compra como AAAAMM ("2020-07-20 ..." -> 202007); 0 se a
+ * data nao estiver no formato.
+ */
+static inline int64_t mes_da_compra(const char *data) {
+    for (int i = 0; i < 7; i++) {
+        if (i == 4 ? data[i] != '-' : (data[i] < '0' || data[i] > '9')) return 0;
+    }
+    return (data[0] - '0') * 100000 + (data[1] - '0') * 10000 + (data[2] - '0') * 1000 +
+           (data[3] - '0') * 100 + (data[5] - '0') * 10 + (data[6] - '0');
+}
+
+/**
+ * @brief Executa o agrupamento por 'campo' com no maximo 'memoria' bytes de
+ * tabela de grupos.
+ * @return Arquivo temporario com um GrupoAgregado por grupo (posicionado no
+ * inicio), ou NULL em caso de erro.
+ */
+FILE *agrupar_vendas(CampoGrupo campo, size_t memoria, EstatAgrupamento *estat) {
+    memset(estat, 0, sizeof(*estat));
+    TabelaGrupos t;
+    MapaChaves precos = {0};
+    if (!grupos_iniciar(&t, memoria)) return NULL;
+    FILE *resultado = tmpfile();
+    FILE *particoes[AGRUPAR_PARTICOES] = {0};
+    int ok = resultado && carregar_precos_produtos(&precos);
+    GrupoAgregado g;
+
+    if (ok && (campo == GRUPO_USUARIO || campo == GRUPO_MES)) {
+        // Uma linha por compra: o grupo nao depende de atributos do produto
+        LeitorRegistros l;
+        int aberto = leitor_abrir(&l, TABELA_COMPRAS, ARQ_COMPRAS_BIN, sizeof(Compra), offsetof(Compra, order_id), INT64_MIN);
+        Compra *bloco = malloc(sizeof(Compra) * REGISTROS_POR_LEITURA);
+        ok = aberto && bloco;
+        size_t lidos;
+        memset(&g, 0, sizeof(g));
+        while (ok && (lidos = leitor_ler(&l, bloco, REGISTROS_POR_LEITURA)) > 0) {
+            for (size_t i = 0; ok && i < lidos; i++) {
+                if (bloco[i].ativo != 'S') continue;
+                EntradaMapa *p = mapa_buscar(&precos, bloco[i].product_id);
+                if (!p) continue;
+                g.numero = campo == GRUPO_USUARIO ? bloco[i].user_id : mes_da_compra(bloco[i].order_datetime);
+                g.receita = p->preco * bloco[i].quantity;
+                g.unidades = bloco[i].quantity;
+                g.pedidos = 1;
+                ok = grupos_adicionar(&t, &g, 0, particoes);
+            }
+        }
+        free(bloco);
+        if (aberto) leitor_fechar(&l);
+    } else if (ok) {
+        // Totais por produto no hash join e depois um produto por linha
+        ok = juntar_compras_produtos(&precos);
+        if (ok && campo == GRUPO_PRODUTO) {
+            memset(&g, 0, sizeof(g));
+            for (uint64_t i = 0; ok && i < precos.capacidade; i++) {
+                const EntradaMapa *e = &precos.itens[i];
+                if (!e->usado || e->pedidos == 0) continue;
+                g.numero = e->chave;
+                g.receita = e->soma;
+                g.unidades = e->unidades;
+                g.pedidos = e->pedidos;
+                ok = grupos_adicionar(&t, &g, 0, particoes);
+            }
+        } else if (ok) {
+            LeitorRegistros l;
+            int aberto = leitor_abrir(&l, TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, sizeof(Produto), offsetof(Produto, product_id), INT64_MIN);
+            Produto *bloco = malloc(sizeof(Produto) * REGISTROS_POR_LEITURA);
+            ok = aberto && bloco;
+            size_t lidos;
+            while (ok && (lidos = leitor_ler(&l, bloco, REGISTROS_POR_LEITURA)) > 0) {
+                for (size_t i = 0; ok && i < lidos; i++) {
+                    if (bloco[i].ativo != 'S') continue;
+                    const EntradaMapa *e = mapa_buscar(&precos, bloco[i].product_id);
+                    if (!e || e->pedidos == 0) continue;
+                    const char *texto = campo == GRUPO_BRAND ? bloco[i].brand : bloco[i].category_alias;
+                    size_t tam = tamanho_aparado(texto, campo == GRUPO_BRAND ? TAM_BRAND : TAM_CATEGORY);
+                    memset(&g, 0, sizeof(g));
+                    memcpy(g.texto, texto, tam);
+                    g.receita = e->soma;
+                    g.unidades = e->unidades;
+                    g.pedidos = e->pedidos;
+                    ok = grupos_adicionar(&t, &g, 0, particoes);
+                }
+            }
+            free(bloco);
+            if (aberto) leitor_fechar(&l);
+        }
+    }
+    mapa_liberar(&precos);
+
+    if (ok) ok = grupos_emitir(&t, resultado, &estat->n_grupos);
+    ok = grupos_processar_particoes(&t, particoes, 0, resultado, &estat->n_grupos) && ok;
+    estat->linhas_derramadas = t.linhas_derramadas;
+    estat->particoes_criadas = t.particoes_criadas;
+    estat->nivel_max = t.nivel_max;
+    grupos_liberar(&t);
+    if (!ok) {
+        if (resultado) fclose(resultado);
+        return NULL;
+    }
+    rewind(resultado);
+    return resultado;
+}
+
+static double metrica_grupo(const GrupoAgregado *g, OrdemGrupos ordem) {
+    switch (ordem) {
+        case ORDEM_UNIDADES: return (double)g->unidades;
+        case ORDEM_PEDIDOS: return (double)g->pedidos;
+        default: return g->receita;
+    }
+}
+
+int comparar_grupo_receita(const void *a, const void *b) {
+    double x = ((const GrupoAgregado*)a)->receita, y = ((const GrupoAgregado*)b)->receita;
+    return (x < y) - (x > y);
+}
+
+int comparar_grupo_unidades(const void *a, const void *b) {
+    int64_t x = ((const GrupoAgregado*)a)->unidades, y = ((const GrupoAgregado*)b)->unidades;
+    return (x < y) - (x > y);
+}
+
+int comparar_grupo_pedidos(const void *a, const void *b) {
+    int64_t x = ((const GrupoAgregado*)a)->pedidos, y = ((const GrupoAgregado*)b)->pedidos;
+    return (x < y) - (x > y);
+}
+
+int comparar_grupo_chave(const void *a, const void *b) {
+    const GrupoAgregado *x = a, *y = b;
+    if (x->numero != y->numero) return (x->numero > y->numero) - (x->numero < y->numero);
+    return strncmp(x->texto, y->texto, TAM_CATEGORY);
+}
+
+static void escrever_grupo(BufferSaida *b, const GrupoAgregado *g, CampoGrupo campo, FormatoExportacao formato) {
+    if (formato == FORMATO_NDJSON) {
+        saida_literal(b, "{\"");
+        saida_bytes(b, NOMES_CAMPO_GRUPO[campo], strlen(NOMES_CAMPO_GRUPO[campo]));
+        saida_literal(b, "\":");
+    }
+    if (campo == GRUPO_CATEGORIA || campo == GRUPO_BRAND) {
+        size_t tam = strnlen(g->texto, TAM_CATEGORY);
+        if (formato == FORMATO_NDJSON) saida_texto_json(b, g->texto, tam);
+        else saida_texto_csv(b, g->texto, tam);
+    } else if (campo == GRUPO_MES) {
+        char mes[3] = {'-', (char)('0' + g->numero % 100 / 10), (char)('0' + g->numero % 10)};
+        if (formato == FORMATO_NDJSON) saida_char(b, '"');
+        saida_int64(b, g->numero / 100);
+        saida_bytes(b, mes, 3);
+        if (formato == FORMATO_NDJSON) saida_char(b, '"');
+    } else {
+        saida_int64(b, g->numero);
+    }
+    if (formato == FORMATO_NDJSON) {
+        saida_literal(b, ",\"receita\":");
+        saida_preco(b, g->receita);
+        saida_literal(b, ",\"unidades\":");
+        saida_int64(b, g->unidades);
+        saida_literal(b, ",\"pedidos\":");
+        saida_int64(b, g->pedidos);
+        saida_literal(b, "}\n");
+    } else {
+        saida_char(b, ',');
+        saida_preco(b, g->receita);
+        saida_char(b, ',');
+        saida_int64(b, g->unidades);
+        saida_char(b, ',');
+        saida_int64(b, g->pedidos);
+        saida_char(b, '\n');
+    }
+}
+
+/**
+ * @brief Escreve o resultado de agrupar_vendas em 'destino' (NULL ou "-" =
+ * saida padrao). Com 'limite' > 0 e ordem por metrica usa o heap do TOP-K
+ * (memoria O(limite)); as demais ordenacoes carregam os grupos e usam qsort.
+ * @return 1 se tudo foi gravado.
+ */
+int escrever_agrupamento(FILE *resultado, long n_grupos, CampoGrupo campo, OrdemGrupos ordem,
+                         long limite, FormatoExportacao formato, const char *destino) {
+    int fd = exportar_abrir_destino(destino);
+    BufferSaida b;
+    if (fd < 0) return 0;
+    if (!saida_iniciar(&b, fd, SAIDA_BUFFER_PADRAO)) { if (fd != STDOUT_FILENO) close(fd); return 0; }
+    if (formato == FORMATO_CSV) {
+        saida_bytes(&b, NOMES_CAMPO_GRUPO[campo], strlen(NOMES_CAMPO_GRUPO[campo]));
+        saida_literal(&b, ",receita,unidades,pedidos\n");
+    }
+    if (limite <= 0 || limite > n_grupos) limite = n_grupos;
+
+    int ok = 1;
+    GrupoAgregado g;
+    rewind(resultado);
+    if (ordem == ORDEM_NENHUMA) {
+        for (long i = 0; i < limite && io_fread(&g, sizeof(g), 1, resultado) == 1; i++) escrever_grupo(&b, &g, campo, formato);
+    } else if (ordem != ORDEM_GRUPO && limite < n_grupos) {
+        HeapTopK h;
+        ok = topk_iniciar(&h, (int)limite);
+        for (long i = 0; ok && io_fread(&g, sizeof(g), 1, resultado) == 1; i++) topk_oferecer(&h, i, metrica_grupo(&g, ordem));
+        if (ok) {
+            topk_ordenar(&h);
+            for (int i = 0; i < h.n && ok; i++) {
+                ok = io_fseek(resultado, (long)h.itens[i].chave * (long)sizeof(g), SEEK_SET) == 0 &&
+                     io_fread(&g, sizeof(g), 1, resultado) == 1;
+                if (ok) escrever_grupo(&b, &g, campo, formato);
+            }
+        }
+        free(h.itens);
+    } else {
+        GrupoAgregado *todos = malloc((size_t)(n_grupos > 0 ? n_grupos : 1) * sizeof(GrupoAgregado));
+        ok = todos && (long)io_fread(todos, sizeof(GrupoAgregado), (size_t)n_grupos, resultado) == n_grupos;
+        if (ok) {
+            int (*comparador)(const void*, const void*) =
+                ordem == ORDEM_RECEITA ? comparar_grupo_receita :
+                ordem == ORDEM_UNIDADES ? comparar_grupo_unidades :
+                ordem == ORDEM_PEDIDOS ? comparar_grupo_pedidos : comparar_grupo_chave;
+            qsort(todos, (size_t)n_grupos, sizeof(GrupoAgregado), comparador);
+            for (long i = 0; i < limite; i++) escrever_grupo(&b, &todos[i], campo, formato);
+        }
+        free(todos);
+    }
+    saida_descarregar(&b);
+    ok = ok && !b.erro;
+    saida_finalizar(&b);
+    if (fd != STDOUT_FILENO && close(fd) != 0) ok = 0;
+    return ok;
+}
+
+/**
+ * @brief Agrupa e escreve; as estatisticas do derramamento vao para stderr.
+ */
+int consulta_agrupar(CampoGrupo campo, OrdemGrupos ordem, long limite, FormatoExportacao formato,
+                     const char *destino, size_t memoria) {
+    unsigned long long t0 = instr_inicio();
+    EstatAgrupamento e;
+    FILE *resultado = agrupar_vendas(campo, memoria, &e);
+    if (!resultado) { fprintf(stderr, "ERRO ao agrupar as vendas.\n"); return 0; }
+    fflush(stdout);
+    int ok = escrever_agrupamento(resultado, e.n_grupos, campo, ordem, limite, formato, destino);
+    fclose(resultado);
+    fprintf(stderr, "%ld grupos por %s", e.n_grupos, NOMES_CAMPO_GRUPO[campo]);
+    if (e.linhas_derramadas > 0)
+        fprintf(stderr, " (%llu linhas derramadas em %d particoes, %d nivel(is))",
+                e.linhas_derramadas, e.particoes_criadas, e.nivel_max);
+    fprintf(stderr, "\n");
+    instr_registrar(OP_AGRUPAR, t0);
+    return ok;
+}
 
-        Compra c = {0};
-        char *token = strtok(linha, ",");
-        for (int i = 0; token != NULL && i < 10; i++) {
-            switch(i) {
-                case 0: strncpy(c.order_datetime, token, TAM_DATETIME-1); c.order_datetime[TAM_DATETIME-1]='\0'; break;
-                case 1: c.order_id = atoll(token); break;
-                case 2: c.product_id = atoll(token); break;
-                case 3: c.quantity = atoi(token); break;
-                case 8: c.user_id = atoll(token); break;
+/**
+ * @brief Calcula os K primeiros de 'metrica' em 'h' (ja ordenado, melhor
+ * primeiro). As metricas de receita percorrem o resultado do agrupamento
+ * por produto ou por usuario.
+ * @return 1 se conseguiu, 0 em caso de erro de leitura ou memoria.
+ */
+int calcular_top_k(MetricaTopK metrica, int k, HeapTopK *h) {
+    if (!topk_iniciar(h, k)) return 0;
+    int ok = 1;
+    if (metrica == TOPK_PRECO) {
+        LeitorRegistros l;
+        int aberto = leitor_abrir(&l, TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, sizeof(Produto), offsetof(Produto, product_id), INT64_MIN);
+        Produto *bloco = malloc(sizeof(Produto) * REGISTROS_POR_LEITURA);
+        ok = aberto && bloco;
+        size_t lidos;
+        while (ok && (lidos = leitor_ler(&l, bloco, REGISTROS_POR_LEITURA)) > 0) {
+            for (size_t i = 0; i < lidos; i++) {
+                if (bloco[i].ativo == 'S') topk_oferecer(h, bloco[i].product_id, bloco[i].price);
             }
-            token = strtok(NULL, ",");
         }
-        c.order_datetime[TAM_DATETIME-1] = '\0';
+        free(bloco);
+        if (aberto) leitor_fechar(&l);
+    } else {
+        EstatAgrupamento e;
+        FILE *resultado = agrupar_vendas(metrica == TOPK_RECEITA ? GRUPO_PRODUTO : GRUPO_USUARIO,
+                                         AGRUPAR_MEMORIA_PADRAO, &e);
+        ok = resultado != NULL;
+        GrupoAgregado g;
+        while (ok && io_fread(&g, sizeof(g), 1, resultado) == 1) {
+            if (g.receita > 0) topk_oferecer(h, g.numero, g.receita);
+        }
+        if (resultado) fclose(resultado);
+    }
+    if (ok) topk_ordenar(h);
+    return ok;
+}
 
-        pad_string(c.order_datetime, TAM_DATETIME);
-        c.ativo = 'S';
-        c.newline = '\n';
-        if(c.order_id > 0) { // Ignora registros sem ID de compra
-            compras[n_compras++] = c;
+/**
+ * @brief Imprime o ranking; produtos aparecem com brand e categoria.
+ */
+void consulta_top_k(MetricaTopK metrica, int k) {
+    unsigned long long t0 = instr_inicio();
+    HeapTopK h;
+    if (!calcular_top_k(metrica, k, &h)) {
+        printf("ERRO ao calcular o ranking.\n");
+        free(h.itens);
+        return;
+    }
+    static const char *titulos[] = {"PRODUTOS MAIS CAROS", "PRODUTOS COM MAIOR RECEITA", "USUARIOS COM MAIOR GASTO"};
+    printf("\n--- TOP %d %s ---\n", k, titulos[metrica]);
+    for (int i = 0; i < h.n; i++) {
+        if (metrica == TOPK_GASTO_USUARIO) {
+            printf("%3d. User: %lld | Gasto: R$ %.2f\n", i + 1, (long long)h.itens[i].chave, h.itens[i].valor);
+            continue;
+        }
+        Produto p;
+        char brand[TAM_BRAND + 1] = {0}, categoria[TAM_CATEGORY + 1] = {0};
+        if (localizar_produto(ARQ_PRODUTOS_BIN, h.itens[i].chave, &p) >= 0) {
+            memcpy(brand, p.brand, tamanho_aparado(p.brand, TAM_BRAND));
+            memcpy(categoria, p.category_alias, tamanho_aparado(p.category_alias, TAM_CATEGORY));
         }
+        printf("%3d. ID: %lld | Brand: %s | Category: %s | %s: %.2f\n", i + 1, (long long)h.itens[i].chave,
+               brand, categoria, metrica == TOPK_PRECO ? "Price" : "Receita", h.itens[i].valor);
     }
+    if (h.n == 0) printf("Nenhum resultado.\n");
+    free(h.itens);
+    instr_registrar(OP_TOP_K, t0);
+}
 
-    fclose(fcsv);
-    printf("%d registros lidos para compras.\n", n_compras);
+// --- AGREGADOS MATERIALIZADOS (TOTAL VENDIDO, PRODUTO MAIS CARO) ---
+//
+// Os dados so mudam por quem publica uma geracao (grupos do WAL e a
+// reconstrucao a partir do CSV), entao o valor total vendido e o produto
+// mais caro sao mantidos prontos em ARQ_AGREGADOS e as duas consultas leem
+// so esse cabecalho. Cada publicacao aplica a diferenca do grupo:
+// - As vendas sao as dos ITENS ativos (itens.bin, todas as linhas dos
+//   pedidos): compras.bin guarda so a primeira linha de cada pedido e
+//   contaria a menos os pedidos com varios produtos. Sem itens da geracao
+//   atual de compras (itens_atuais) os agregados nao sao calculados.
+// - Vendas por produto (unidades e pedidos dos itens ativos, ativo ou nao
+//   o produto) ficam em ARQ_AGREGADOS_VENDAS, ordenadas por product_id. A
+//   receita total e a soma de preco * unidades dos produtos ativos, entao
+//   remover/reinserir um produto soma ou desconta as vendas dele sem varrer
+//   itens.bin.
+// - Dinheiro em centavos inteiros: a soma incremental nao acumula erro de
+//   arredondamento e bate exatamente com o recalculo.
+// - Para o maximo sob remocoes, o cabecalho guarda uma reserva com os
+//   AGREGADOS_RESERVA maiores precos (o heap de minimo do TOP-K). A reserva
+//   e sempre o topo exato dos ativos: insercoes so entram se superarem o
+//   pior da reserva, remocoes saem dela. So quando ela esvazia e produtos
+//   ativos ainda existem e que produtos.bin e varrido de novo.
+// O cabecalho guarda a geracao e o tamanho dos dois .bin para os quais
+// vale. Se nao batem (arquivo ausente, queda no meio da publicacao, escrita
+// por versao antiga do programa) as consultas voltam a varrer os .bin e o
+// proximo escritor reconstroi os agregados. "agregados verificar" recalcula
+// tudo e compara.
+
+#define AGREGADOS_MAGICO 0x32524741u // "AGR2" (vendas somadas por item)
+#define AGREGADOS_RESERVA 64         // Maiores precos guardados para o maximo sob remocoes
 
-    // 2. Ordena na RAM
-    qsort(compras, n_compras, sizeof(Compra), comparar_compra);
+typedef struct {
+    uint32_t magico;
+    uint32_t n_reserva;
+    uint64_t geracao[N_TABELAS];  // Geracoes dos .bin refletidas
+    int64_t tamanho[N_TABELAS];   // Tamanhos dos .bin refletidos (-1 = ausente)
+    int64_t produtos_ativos;
+    int64_t itens_ativos;
+    int64_t itens_validos;        // Itens ativos de produtos ativos
+    int64_t receita_centavos;     // Soma de preco * quantidade dos itens validos
+    int64_t n_vendas;             // Registros em ARQ_AGREGADOS_VENDAS
+    Produto mais_caro;            // Valido se n_reserva > 0
+    EntradaTopK reserva[AGREGADOS_RESERVA]; // Heap de minimo (ver TOP-K)
+} CabecalhoAgregados;
 
-    // 3. Grava no .bin, pulando duplicatas
-    FILE *fbin = fopen(bin_path, "wb");
-    if (fbin) {
-        int n_unicos = 0;
-        long long ultimo_id = LLONG_MIN;
-        for (int i = 0; i < n_compras; i++) {
-            if (compras[i].order_id > 0 && compras[i].order_id != ultimo_id) {
-                fwrite(&compras[i], sizeof(Compra), 1, fbin);
-                ultimo_id = compras[i].order_id;
-                n_unicos++;
+typedef struct {
+    int64_t product_id;
+    int64_t unidades;
+    int64_t pedidos;
+} VendasProduto;
+
+static inline int64_t em_centavos(double preco) {
+    return (int64_t)(preco * 100.0 + (preco < 0 ? -0.5 : 0.5));
+}
+
+int comparar_vendas(const void *a, const void *b) {
+    int64_t x = ((const VendasProduto*)a)->product_id, y = ((const VendasProduto*)b)->product_id;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Geracoes e tamanhos atuais dos dois .bin.
+ */
+void agregados_versao_atual(uint64_t geracao[N_TABELAS], int64_t tamanho[N_TABELAS]) {
+    const char *arquivos[N_TABELAS] = {ARQ_PRODUTOS_BIN, ARQ_COMPRAS_BIN};
+    struct stat st;
+    ler_geracoes(geracao);
+    for (int t = 0; t < N_TABELAS; t++) tamanho[t] = stat(arquivos[t], &st) == 0 ? (int64_t)st.st_size : -1;
+}
+
+int agregados_ler(CabecalhoAgregados *cab) {
+    FILE *f = io_fopen(ARQ_AGREGADOS, "rb");
+    if (!f) return 0;
+    int ok = io_fread(cab, sizeof(*cab), 1, f) == 1 && cab->magico == AGREGADOS_MAGICO &&
+             cab->n_reserva <= AGREGADOS_RESERVA;
+    fclose(f);
+    return ok;
+}
+
+/**
+ * @brief Le os agregados e confere que refletem a geracao atual dos .bin.
+ */
+int agregados_atuais(CabecalhoAgregados *cab) {
+    uint64_t geracao[N_TABELAS];
+    int64_t tamanho[N_TABELAS];
+    if (!agregados_ler(cab)) return 0;
+    agregados_versao_atual(geracao, tamanho);
+    return memcmp(cab->geracao, geracao, sizeof(geracao)) == 0 &&
+           memcmp(cab->tamanho, tamanho, sizeof(tamanho)) == 0;
+}
+
+/**
+ * @brief Publica o cabecalho carimbado com a versao atual dos .bin.
+ */
+int agregados_gravar(CabecalhoAgregados *cab) {
+    char caminho_tmp[1024];
+    cab->magico = AGREGADOS_MAGICO;
+    agregados_versao_atual(cab->geracao, cab->tamanho);
+    caminho_temporario(ARQ_AGREGADOS, caminho_tmp, sizeof(caminho_tmp));
+    FILE *f = io_fopen(caminho_tmp, "wb");
+    if (!f) return 0;
+    io_fwrite(cab, sizeof(*cab), 1, f);
+    return publicar_temporario(f, caminho_tmp, ARQ_AGREGADOS);
+}
+
+/**
+ * @brief Leva os agregados para a geracao publicada por reorganizar_em_blocos:
+ * os registros reais nao mudam, so o layout, entao basta recarimbar o
+ * cabecalho se ele valia para a geracao anterior de 'tabela' (e para a atual
+ * da outra). Deve ser chamada com a trava do escritor adquirida.
+ */
+void agregados_recarimbar(TabelaDados tabela, uint64_t geracao_anterior, int64_t tamanho_anterior) {
+    CabecalhoAgregados cab;
+    uint64_t geracao[N_TABELAS];
+    int64_t tamanho[N_TABELAS];
+    if (!agregados_ler(&cab)) return;
+    agregados_versao_atual(geracao, tamanho);
+    geracao[tabela] = geracao_anterior;
+    tamanho[tabela] = tamanho_anterior;
+    if (memcmp(cab.geracao, geracao, sizeof(geracao)) == 0 && memcmp(cab.tamanho, tamanho, sizeof(tamanho)) == 0)
+        agregados_gravar(&cab);
+}
+
+/**
+ * @brief Recalcula tudo do zero: as vendas por produto saem de uma leitura
+ * de itens.bin (ordenadas com qsort) e sao juntadas a produtos.bin por
+ * intercalacao, ja que os dois estao em ordem de product_id.
+ * @param vendas Recebe o vetor ordenado (liberar com free) e n_vendas em cab.
+ * @return 0 em caso de erro ou se os itens estao desatualizados.
+ */
+int agregados_calcular(CabecalhoAgregados *cab, VendasProduto **vendas) {
+    memset(cab, 0, sizeof(*cab));
+    *vendas = NULL;
+    if (!itens_atuais()) return 0;
+    struct stat st;
+    size_t max_vendas = stat(ARQ_ITENS_BIN, &st) == 0 ? (size_t)st.st_size / sizeof(ItemPedido) : 0;
+    VendasProduto *v = malloc((max_vendas > 0 ? max_vendas : 1) * sizeof(VendasProduto));
+    if (!v) return 0;
+
+    int ok = 1;
+    size_t n = 0, lidos;
+    FILE *f = io_fopen(ARQ_ITENS_BIN, "rb");
+    if (f) {
+        ItemPedido *bloco = malloc(sizeof(ItemPedido) * REGISTROS_POR_LEITURA);
+        ok = bloco != NULL;
+        while (ok && (lidos = io_fread(bloco, sizeof(ItemPedido), REGISTROS_POR_LEITURA, f)) > 0) {
+            for (size_t i = 0; i < lidos && n < max_vendas; i++) {
+                if (bloco[i].ativo != 'S') continue;
+                v[n].product_id = bloco[i].product_id;
+                v[n].unidades = bloco[i].quantity;
+                v[n].pedidos = 1;
+                n++;
             }
         }
-        fclose(fbin);
-        printf("%s criado com %d compras unicas.\n", bin_path, n_unicos);
-    } else {
-         printf("ERRO: Nao foi possivel criar o arquivo binario %s.\n", bin_path);
+        free(bloco);
+        fclose(f);
+    }
+    cab->itens_ativos = (int64_t)n;
+    qsort(v, n, sizeof(VendasProduto), comparar_vendas);
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (m > 0 && v[m - 1].product_id == v[i].product_id) {
+            v[m - 1].unidades += v[i].unidades;
+            v[m - 1].pedidos += v[i].pedidos;
+        } else {
+            v[m++] = v[i];
+        }
+    }
+    cab->n_vendas = (int64_t)m;
+
+    HeapTopK r = {cab->reserva, 0, AGREGADOS_RESERVA};
+    f = io_fopen(ARQ_PRODUTOS_BIN, "rb");
+    if (ok && f) {
+        Produto *bloco = malloc(sizeof(Produto) * REGISTROS_POR_LEITURA);
+        ok = bloco != NULL;
+        size_t j = 0;
+        while (ok && (lidos = io_fread(bloco, sizeof(Produto), REGISTROS_POR_LEITURA, f)) > 0) {
+            for (size_t i = 0; i < lidos; i++) {
+                if (bloco[i].ativo != 'S') continue;
+                cab->produtos_ativos++;
+                topk_oferecer(&r, bloco[i].product_id, bloco[i].price);
+                while (j < m && v[j].product_id < bloco[i].product_id) j++;
+                if (j < m && v[j].product_id == bloco[i].product_id) {
+                    cab->receita_centavos += em_centavos(bloco[i].price) * v[j].unidades;
+                    cab->itens_validos += v[j].pedidos;
+                }
+            }
+        }
+        free(bloco);
     }
-    free(compras);
+    if (f) fclose(f);
+    cab->n_reserva = (uint32_t)r.n;
+    if (ok && r.n > 0) {
+        EntradaTopK melhor = r.itens[0];
+        for (int i = 1; i < r.n; i++) if (topk_pior(&melhor, &r.itens[i])) melhor = r.itens[i];
+        ok = localizar_produto(ARQ_PRODUTOS_BIN, melhor.chave, &cab->mais_caro) >= 0;
+    }
+    if (!ok) { free(v); return 0; }
+    *vendas = v;
+    return 1;
 }
 
 /**
- * @brief Le o arquivo .bin sequencialmente e imprime todas as compras ATIVAS.
+ * @brief Recalcula e publica os dois arquivos de agregados.
+ * Deve ser chamada com a trava do escritor adquirida.
  */
-void mostrar_compras(const char *arq_bin) {
-    FILE *fbin = fopen(arq_bin, "rb");
-    if (!fbin) { printf("ERRO ao abrir %s\n", arq_bin); return; }
+int agregados_reconstruir(void) {
+    CabecalhoAgregados cab;
+    VendasProduto *vendas;
+    CONTAR(estat_io.agregados_reconstrucoes, 1);
+    if (!agregados_calcular(&cab, &vendas)) return 0;
+
+    char caminho_tmp[1024];
+    caminho_temporario(ARQ_AGREGADOS_VENDAS, caminho_tmp, sizeof(caminho_tmp));
+    FILE *f = io_fopen(caminho_tmp, "wb");
+    int ok = f != NULL;
+    if (ok) {
+        io_fwrite(vendas, sizeof(VendasProduto), (size_t)cab.n_vendas, f);
+        ok = publicar_temporario(f, caminho_tmp, ARQ_AGREGADOS_VENDAS);
+    }
+    free(vendas);
+    return ok && agregados_gravar(&cab);
+}
 
-    Compra c;
-    int contador = 0;
-    printf("\n--- COMPRAS ATIVAS ---\n");
-    while (fread(&c, sizeof(Compra), 1, fbin) == 1) {
-        if (c.ativo == 'S') {
-            // "Trim"
-            char datetime_trim[TAM_DATETIME+1]={0};
-            strncpy(datetime_trim, c.order_datetime, TAM_DATETIME);
-            for(int i = strlen(datetime_trim)-1; i >=0 && datetime_trim[i] == ' '; i--) datetime_trim[i] = '\0';
+/**
+ * @brief Vendas de um produto (pesquisa binaria em ARQ_AGREGADOS_VENDAS);
+ * zeradas se o produto nao tem compras ativas.
+ */
+static void vendas_do_produto(FILE *f, int64_t n, int64_t product_id, VendasProduto *v) {
+    int64_t ini = 0, fim = n - 1;
+    while (f && ini <= fim) {
+        int64_t meio = ini + (fim - ini) / 2;
+        if (io_fseek(f, (long)(meio * (int64_t)sizeof(VendasProduto)), SEEK_SET) != 0 ||
+            io_fread(v, sizeof(*v), 1, f) != 1) break;
+        if (v->product_id == product_id) return;
+        if (v->product_id < product_id) ini = meio + 1;
+        else fim = meio - 1;
+    }
+    v->product_id = product_id;
+    v->unidades = 0;
+    v->pedidos = 0;
+}
 
-            printf("Order: %lld | Product: %lld | User: %lld | Qty: %d | Date: %s\n",
-                   c.order_id, c.product_id, c.user_id, c.quantity, datetime_trim);
-            contador++;
+static void reserva_remover(HeapTopK *r, int64_t chave) {
+    for (int i = 0; i < r->n; i++) {
+        if (r->itens[i].chave != chave) continue;
+        r->itens[i] = r->itens[--r->n];
+        // O elemento movido pode precisar subir ou descer
+        while (i > 0 && topk_pior(&r->itens[i], &r->itens[(i - 1) / 2])) {
+            EntradaTopK t = r->itens[i]; r->itens[i] = r->itens[(i - 1) / 2]; r->itens[(i - 1) / 2] = t;
+            i = (i - 1) / 2;
         }
+        topk_descer(r, i);
+        return;
     }
-    printf("Total: %d compras\n", contador);
-    fclose(fbin);
 }
 
 /**
- * @brief Insere uma nova compra no arquivo binario.
- * Utiliza a mesma estrategia de "ler tudo -> re-ordenar -> gravar tudo"
- * da funcao inserir_produto, para manter o arquivo ordenado.
- * Tambem valida se o product_id informado existe no arquivo de produtos.
- * @return 1 se foi inserido, 0 se houve erro.
+ * @brief Aplica aos agregados as mudancas de um grupo recem-publicado de
+ * 'tabela'. 'antigos' sao os registros que estavam ativos e sairam
+ * (removidos ou substituidos) e 'novos' os que entraram: Produto, ou
+ * ItemPedido para compras (os itens que itens_apos_escrita tirou e pos).
+ * Se os agregados nao refletiam a geracao anterior, sao reconstruidos.
+ * Deve ser chamada com a trava do escritor.
  */
-int inserir_compra(const char *arq_bin) {
-    Compra c_nova;
-    printf("\n--- INSERIR NOVA COMPRA ---\n");
+void agregados_apos_escrita(TabelaDados tabela, uint64_t geracao_anterior, int64_t tamanho_anterior,
+                            const void *novos, int n_novos, const void *antigos, int n_antigos) {
+    CabecalhoAgregados cab;
+    uint64_t geracao[N_TABELAS];
+    int64_t tamanho[N_TABELAS];
+    agregados_versao_atual(geracao, tamanho);
+    geracao[tabela] = geracao_anterior;
+    tamanho[tabela] = tamanho_anterior;
+    if (!agregados_ler(&cab) || memcmp(cab.geracao, geracao, sizeof(geracao)) != 0 ||
+        memcmp(cab.tamanho, tamanho, sizeof(tamanho)) != 0) {
+        agregados_reconstruir();
+        return;
+    }
 
-    c_nova.order_id = ler_long_long("Digite o order_id: ");
-     if (c_nova.order_id <= 0) {
-        printf("ERRO: ID do pedido deve ser positivo.\n");
-        return 0;
+    if (tabela == TABELA_PRODUTOS) {
+        // Vendas nao mudam: so quais produtos (e precos) contam
+        const Produto *sai = antigos, *entra = novos;
+        HeapTopK r = {cab.reserva, (int)cab.n_reserva, AGREGADOS_RESERVA};
+        FILE *fv = io_fopen(ARQ_AGREGADOS_VENDAS, "rb");
+        VendasProduto v;
+        for (int i = 0; i < n_antigos; i++) {
+            vendas_do_produto(fv, cab.n_vendas, sai[i].product_id, &v);
+            cab.receita_centavos -= em_centavos(sai[i].price) * v.unidades;
+            cab.itens_validos -= v.pedidos;
+            cab.produtos_ativos--;
+            reserva_remover(&r, sai[i].product_id);
+        }
+        for (int i = 0; i < n_novos; i++) {
+            vendas_do_produto(fv, cab.n_vendas, entra[i].product_id, &v);
+            cab.receita_centavos += em_centavos(entra[i].price) * v.unidades;
+            cab.itens_validos += v.pedidos;
+            // Com a reserva incompleta, so entra quem supera o pior dela
+            EntradaTopK candidato = {entra[i].product_id, entra[i].price};
+            if (r.n == cab.produtos_ativos || (r.n > 0 && topk_pior(&r.itens[0], &candidato)))
+                topk_oferecer(&r, entra[i].product_id, entra[i].price);
+            cab.produtos_ativos++;
+        }
+        if (fv) fclose(fv);
+        if (r.n == 0 && cab.produtos_ativos > 0) {
+            // Reserva esgotada pelas remocoes: uma varredura a reabastece
+            FILE *f = io_fopen(ARQ_PRODUTOS_BIN, "rb");
+            Produto *bloco = malloc(sizeof(Produto) * REGISTROS_POR_LEITURA);
+            size_t lidos;
+            while (f && bloco && (lidos = io_fread(bloco, sizeof(Produto), REGISTROS_POR_LEITURA, f)) > 0) {
+                for (size_t i = 0; i < lidos; i++)
+                    if (bloco[i].ativo == 'S') topk_oferecer(&r, bloco[i].product_id, bloco[i].price);
+            }
+            free(bloco);
+            if (f) fclose(f);
+        }
+        cab.n_reserva = (uint32_t)r.n;
+        if (r.n > 0) {
+            EntradaTopK melhor = r.itens[0];
+            for (int i = 1; i < r.n; i++) if (topk_pior(&melhor, &r.itens[i])) melhor = r.itens[i];
+            if (localizar_produto(ARQ_PRODUTOS_BIN, melhor.chave, &cab.mais_caro) < 0) { agregados_reconstruir(); return; }
+        }
+        if (!agregados_gravar(&cab)) agregados_reconstruir();
+        return;
     }
 
-    // 1. Verifica duplicidade de ID da compra
-    long long chave = c_nova.order_id;
-    if (pesquisa_binaria(arq_bin, sizeof(Compra), comparar_compra_chave, &chave, offsetof(Compra, ativo)) >= 0) {
-        printf("ERRO: order_id %lld ja existe!\n", c_nova.order_id);
-        return 0;
+    // Itens: ajustes de unidades/pedidos por produto, ordenados e somados
+    const ItemPedido *sai = antigos, *entra = novos;
+    VendasProduto *ajustes = malloc((size_t)(n_novos + n_antigos) * sizeof(VendasProduto) + 1);
+    if (!ajustes) { agregados_reconstruir(); return; }
+    int n_ajustes = 0;
+    for (int i = 0; i < n_antigos; i++)
+        ajustes[n_ajustes++] = (VendasProduto){sai[i].product_id, -sai[i].quantity, -1};
+    for (int i = 0; i < n_novos; i++)
+        ajustes[n_ajustes++] = (VendasProduto){entra[i].product_id, entra[i].quantity, 1};
+    qsort(ajustes, (size_t)n_ajustes, sizeof(VendasProduto), comparar_vendas);
+    int m = 0;
+    for (int i = 0; i < n_ajustes; i++) {
+        if (m > 0 && ajustes[m - 1].product_id == ajustes[i].product_id) {
+            ajustes[m - 1].unidades += ajustes[i].unidades;
+            ajustes[m - 1].pedidos += ajustes[i].pedidos;
+        } else {
+            ajustes[m++] = ajustes[i];
+        }
+    }
+    cab.itens_ativos += n_novos - n_antigos;
+
+    // Intercala os ajustes com o arquivo de vendas (reescrito por inteiro)
+    char caminho_tmp[1024];
+    caminho_temporario(ARQ_AGREGADOS_VENDAS, caminho_tmp, sizeof(caminho_tmp));
+    FILE *fv = io_fopen(ARQ_AGREGADOS_VENDAS, "rb");
+    FILE *ftmp = io_fopen(caminho_tmp, "wb");
+    VendasProduto *bloco = malloc(sizeof(VendasProduto) * REGISTROS_POR_LEITURA);
+    int ok = ftmp && bloco;
+    int64_t n_vendas = 0;
+    int a = 0;
+    size_t lidos = 0, pos = 0;
+    for (;;) {
+        if (ok && fv && pos == lidos) { lidos = io_fread(bloco, sizeof(VendasProduto), REGISTROS_POR_LEITURA, fv); pos = 0; }
+        int tem_arquivo = ok && pos < lidos;
+        if (!ok || (!tem_arquivo && a == m)) break;
+        VendasProduto atual;
+        if (tem_arquivo && (a == m || bloco[pos].product_id < ajustes[a].product_id)) {
+            atual = bloco[pos++];
+        } else {
+            atual = ajustes[a];
+            if (tem_arquivo && bloco[pos].product_id == ajustes[a].product_id) {
+                atual.unidades += bloco[pos].unidades;
+                atual.pedidos += bloco[pos].pedidos;
+                pos++;
+            }
+            // O preco do produto nao muda neste grupo: a receita varia so
+            // pelas unidades ajustadas, se o produto estiver ativo
+            Produto p;
+            if (localizar_produto(ARQ_PRODUTOS_BIN, ajustes[a].product_id, &p) >= 0 && p.ativo == 'S') {
+                cab.receita_centavos += em_centavos(p.price) * ajustes[a].unidades;
+                cab.itens_validos += ajustes[a].pedidos;
+            }
+            a++;
+            if (atual.pedidos <= 0) continue;
+        }
+        if (io_fwrite(&atual, sizeof(atual), 1, ftmp) != 1) ok = 0;
+        n_vendas++;
     }
+    free(bloco);
+    free(ajustes);
+    if (fv) fclose(fv);
+    if (ftmp) ok = publicar_temporario(ftmp, caminho_tmp, ARQ_AGREGADOS_VENDAS) && ok;
+    cab.n_vendas = n_vendas;
+    if (!ok || !agregados_gravar(&cab)) agregados_reconstruir();
+}
 
-    c_nova.product_id = ler_long_long("Digite o product_id: ");
-    // 2. VALIDA CHAVE ESTRANGEIRA (Product ID)
-    int64_t chave_prod = c_nova.product_id;
-    if (pesquisa_binaria(ARQ_PRODUTOS_BIN, sizeof(Produto), comparar_produto_chave, &chave_prod, offsetof(Produto, ativo)) < 0) {
-        printf("ERRO: product_id %lld nao encontrado ou inativo no cadastro de produtos. Insercao cancelada.\n", c_nova.product_id);
+/**
+ * @brief Recalcula os agregados do zero e compara com os persistidos.
+ * @return 1 se conferem.
+ */
+int agregados_verificar(void) {
+    unsigned long long t0 = instr_inicio();
+    int trava = trava_escrita_adquirir(); // Nenhuma publicacao durante a comparacao
+    CabecalhoAgregados salvo, calculado;
+    VendasProduto *vendas = NULL;
+    int tem_salvo = agregados_ler(&salvo);
+    int atual = tem_salvo && agregados_atuais(&salvo);
+    int ok = agregados_calcular(&calculado, &vendas);
+    if (!ok) {
+        trava_escrita_liberar(trava);
+        printf("ERRO ao recalcular os agregados.\n");
         return 0;
     }
 
-    c_nova.user_id = ler_long_long("Digite o user_id: ");
+    printf("%-22s %20s %20s\n", "", "persistido", "recalculado");
+    #define LINHA_AGREGADO(nome, campo) \
+        printf("%-22s %20lld %20lld%s\n", nome, (long long)salvo.campo, (long long)calculado.campo, \
+               salvo.campo == calculado.campo ? "" : "  <-- DIFERENTE")
+    if (tem_salvo) {
+        LINHA_AGREGADO("produtos ativos", produtos_ativos);
+        LINHA_AGREGADO("itens ativos", itens_ativos);
+        LINHA_AGREGADO("itens validos", itens_validos);
+        LINHA_AGREGADO("receita (centavos)", receita_centavos);
+        LINHA_AGREGADO("produtos vendidos", n_vendas);
+        LINHA_AGREGADO("produto mais caro", mais_caro.product_id);
+    }
+    #undef LINHA_AGREGADO
+    int iguais = atual && salvo.produtos_ativos == calculado.produtos_ativos &&
+                 salvo.itens_ativos == calculado.itens_ativos &&
+                 salvo.itens_validos == calculado.itens_validos &&
+                 salvo.receita_centavos == calculado.receita_centavos &&
+                 salvo.n_vendas == calculado.n_vendas &&
+                 (salvo.n_reserva > 0) == (calculado.n_reserva > 0) &&
+                 (calculado.n_reserva == 0 || salvo.mais_caro.product_id == calculado.mais_caro.product_id);
+
+    // Vendas por produto, registro a registro
+    long divergentes = 0;
+    FILE *fv = iguais ? io_fopen(ARQ_AGREGADOS_VENDAS, "rb") : NULL;
+    if (fv) {
+        VendasProduto v;
+        for (int64_t i = 0; i < calculado.n_vendas; i++) {
+            if (io_fread(&v, sizeof(v), 1, fv) != 1 || memcmp(&v, &vendas[i], sizeof(v)) != 0) divergentes++;
+        }
+        fclose(fv);
+        if (divergentes > 0) { iguais = 0; printf("%ld produtos com vendas divergentes.\n", divergentes); }
+    } else if (iguais) {
+        iguais = calculado.n_vendas == 0;
+    }
+    free(vendas);
+    trava_escrita_liberar(trava);
+
+    if (!tem_salvo) printf("Agregados ausentes (%s).\n", ARQ_AGREGADOS);
+    else if (!atual) printf("Agregados de outra geracao dos arquivos .bin (serao reconstruidos na proxima escrita).\n");
+    printf("%s\n", iguais ? "OK: agregados conferem." : "ERRO: agregados divergentes.");
+    instr_registrar(OP_VERIFICAR_AGREGADOS, t0);
+    return iguais;
+}
 
-    // 3. Valida formato da data
-    while (1) {
-        ler_string("Digite a data/hora (YYYY-MM-DD HH:MM:SS): ", c_nova.order_datetime, TAM_DATETIME);
-        if (validar_e_formatar_data(c_nova.order_datetime, TAM_DATETIME)) {
-            break;
+// --- VARREDURA PARTICIONADA (FAIXAS DO .bin EM N THREADS) ---
+//
+// Para operacoes que leem um .bin inteiro. O arquivo e dividido em N
+// faixas contiguas de registros inteiros (nenhum registro fica entre duas
+// faixas) e cada faixa e lida por uma thread com pread no seu proprio
+// descritor. Cada thread acumula um resultado PARCIAL so dela, sem travas
+// no laco. Depois do join, reduzir junta os parciais na ordem das faixas,
+// entao o resultado nao depende de qual thread terminou primeiro.
+// Com os operadores usados (somas inteiras, contagens, maximo desempatado
+// pela chave) o resultado e o mesmo da varredura serial para qualquer N;
+// com N = 1 a faixa unica e lida na propria thread chamadora.
+// A funcao 'processar' recebe um bloco de registros por vez e deve
+// acumular em variaveis locais, escrevendo no parcial uma vez por bloco:
+// os parciais vizinhos dividem linhas de cache.
+
+#define VARREDURA_THREADS_MAXIMO 64
+
+int threads_varredura = 0; // AED2_THREADS; 0 = um por processador online
+
+typedef void (*ProcessarRegistros)(void *parcial, const char *registros, size_t n, const void *contexto);
+typedef void (*ReduzirParciais)(void *total, const void *parcial);
+
+typedef struct {
+    int fd;
+    size_t tam_registro;
+    int64_t inicio, fim; // Faixa [inicio, fim) em registros
+    ProcessarRegistros processar;
+    void *parcial;
+    const void *contexto;
+    int ok;
+} FaixaVarredura;
+
+/** @brief Threads que varrer_particionado vai usar (threads_varredura ou os processadores). */
+int varredura_n_threads(void) {
+    long n = threads_varredura > 0 ? threads_varredura : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    return n > VARREDURA_THREADS_MAXIMO ? VARREDURA_THREADS_MAXIMO : (int)n;
+}
+
+static void *varrer_faixa(void *arg) {
+    FaixaVarredura *fx = arg;
+    char *bloco = malloc(fx->tam_registro * REGISTROS_POR_LEITURA);
+    fx->ok = bloco != NULL;
+    off_t tam = (off_t)fx->tam_registro;
+    posix_fadvise(fx->fd, fx->inicio * tam, (fx->fim - fx->inicio) * tam, POSIX_FADV_SEQUENTIAL);
+    for (int64_t r = fx->inicio; fx->ok && r < fx->fim;) {
+        size_t quantos = fx->fim - r < REGISTROS_POR_LEITURA ? (size_t)(fx->fim - r) : REGISTROS_POR_LEITURA;
+        ssize_t lidos = pread(fx->fd, bloco, quantos * fx->tam_registro, r * tam);
+        if (lidos != (ssize_t)(quantos * fx->tam_registro)) { fx->ok = 0; break; }
+        CONTAR(estat_io.registros_lidos, quantos);
+        CONTAR(estat_io.bytes_lidos, (unsigned long long)lidos);
+        fx->processar(fx->parcial, bloco, quantos, fx->contexto);
+        r += (int64_t)quantos;
+    }
+    free(bloco);
+    return NULL;
+}
+
+/**
+ * @brief Varre 'arq_dados' em n_threads faixas (ver acima).
+ * @param parciais Vetor de n_threads parciais de 'tam_parcial' bytes, ja
+ * iniciados com o elemento neutro; ao final parciais[0] tem o total.
+ * @return 1 se o arquivo inteiro foi lido.
+ */
+int varrer_particionado(const char *arq_dados, size_t tam_registro, int n_threads, ProcessarRegistros processar,
+                        ReduzirParciais reduzir, const void *contexto, void *parciais, size_t tam_parcial) {
+    int fd = open(arq_dados, O_RDONLY);
+    if (fd < 0) return 0;
+    CONTAR(estat_io.fopens, 1);
+    struct stat st;
+    int64_t n_registros = fstat(fd, &st) == 0 ? (int64_t)st.st_size / (int64_t)tam_registro : 0;
+    if (n_threads < 1) n_threads = 1;
+    if (n_threads > VARREDURA_THREADS_MAXIMO) n_threads = VARREDURA_THREADS_MAXIMO;
+
+    FaixaVarredura faixas[VARREDURA_THREADS_MAXIMO];
+    pthread_t threads[VARREDURA_THREADS_MAXIMO];
+    int iniciadas[VARREDURA_THREADS_MAXIMO] = {0};
+    for (int t = 0; t < n_threads; t++) {
+        faixas[t] = (FaixaVarredura){fd, tam_registro, n_registros * t / n_threads, n_registros * (t + 1) / n_threads,
+                                     processar, (char *)parciais + (size_t)t * tam_parcial, contexto, 0};
+        // A primeira faixa fica com a thread chamadora
+        if (t > 0) iniciadas[t] = pthread_create(&threads[t], NULL, varrer_faixa, &faixas[t]) == 0;
+    }
+    varrer_faixa(&faixas[0]);
+    int ok = faixas[0].ok;
+    for (int t = 1; t < n_threads; t++) {
+        if (!iniciadas[t]) varrer_faixa(&faixas[t]); // Sem thread: le a faixa aqui mesmo
+        else pthread_join(threads[t], NULL);
+        ok = ok && faixas[t].ok;
+        reduzir(parciais, (char *)parciais + (size_t)t * tam_parcial);
+    }
+    close(fd);
+    return ok;
+}
+
+// --- CONSULTAS ESPECIFICAS ---
+
+void imprimir_produto_mais_caro(const Produto *mais_caro) {
+    char brand_trim[TAM_BRAND+1] = {0};
+    char category_trim[TAM_CATEGORY+1] = {0};
+    memcpy(brand_trim, mais_caro->brand, tamanho_aparado(mais_caro->brand, TAM_BRAND));
+    memcpy(category_trim, mais_caro->category_alias, tamanho_aparado(mais_caro->category_alias, TAM_CATEGORY));
+
+    printf("\n--- PRODUTO MAIS CARO ---\n");
+    printf("ID: %lld | Brand: %s | Price: %.2f | Category: %s\n",
+           mais_caro->product_id, brand_trim, mais_caro->price, category_trim);
+}
+
+typedef struct {
+    int achou;
+    EntradaTopK melhor; // Maior preco; no empate, a menor chave (topk_pior)
+} ParcialMaisCaro;
+
+static void mais_caro_processar(void *parcial, const char *registros, size_t n, const void *contexto) {
+    (void)contexto;
+    ParcialMaisCaro *p = parcial, local = *p;
+    const Produto *produtos = (const Produto *)registros;
+    for (size_t i = 0; i < n; i++) {
+        if (produtos[i].ativo != 'S') continue;
+        EntradaTopK e = {produtos[i].product_id, produtos[i].price};
+        if (!local.achou || topk_pior(&local.melhor, &e)) { local.melhor = e; local.achou = 1; }
+    }
+    *p = local;
+}
+
+static void mais_caro_reduzir(void *total, const void *parcial) {
+    ParcialMaisCaro *t = total;
+    const ParcialMaisCaro *p = parcial;
+    if (p->achou && (!t->achou || topk_pior(&t->melhor, &p->melhor))) *t = *p;
+}
+
+/**
+ * @brief Produto mais caro pela varredura particionada de produtos.bin
+ * (varredura_n_threads faixas; um maximo por faixa e a reducao).
+ */
+void produto_mais_caro_varredura() {
+    int n = varredura_n_threads();
+    ParcialMaisCaro *parciais = calloc((size_t)n, sizeof(ParcialMaisCaro));
+    Produto mais_caro;
+    CONTAR(estat_io.agregados_varreduras, 1);
+    if (!parciais || !varrer_particionado(ARQ_PRODUTOS_BIN, sizeof(Produto), n, mais_caro_processar,
+                                          mais_caro_reduzir, NULL, parciais, sizeof(ParcialMaisCaro))) {
+        printf("ERRO ao abrir %s\n", ARQ_PRODUTOS_BIN);
+    } else if (parciais[0].achou && localizar_produto(ARQ_PRODUTOS_BIN, parciais[0].melhor.chave, &mais_caro) >= 0) {
+        imprimir_produto_mais_caro(&mais_caro);
+    } else {
+        printf("Nenhum produto ativo encontrado.\n");
+    }
+    free(parciais);
+}
+
+/**
+ * @brief Agregados atuais sao um candidato de custo quase fixo: um cabecalho.
+ */
+static void considerar_agregados(Planejamento *p) {
+    CabecalhoAgregados cab;
+    if (agregados_atuais(&cab))
+        planejamento_considerar(p, CAMINHO_AGREGADOS, 1, sizeof(cab),
+                                CUSTO_ABERTURA + custo_aleatorio(sizeof(cab), fracao_residente(ARQ_AGREGADOS), 1,
+                                                                 sizeof(cab)));
+}
+
+/**
+ * @brief Planeja o produto mais caro: agregados ou varredura de produtos.bin.
+ */
+CaminhoAcesso planejar_produto_mais_caro(const EstatisticasTabela *produtos, Planejamento *p) {
+    planejamento_iniciar(p);
+    considerar_agregados(p);
+    double leituras = leituras_sequenciais(produtos->bytes);
+    planejamento_considerar(p, CAMINHO_VARREDURA, leituras, (double)produtos->bytes,
+                            CUSTO_ABERTURA + custo_sequencial((double)produtos->bytes, produtos->residente, leituras));
+    return planejamento_escolher(p);
+}
+
+/**
+ * @brief Encontra o produto mais caro: O(1) pelos agregados materializados;
+ * se eles estiverem desatualizados, pela varredura.
+ */
+void consulta_produto_mais_caro() {
+    unsigned long long t0 = instr_inicio();
+    CabecalhoAgregados cab;
+    EstatisticasTabela produtos;
+    Planejamento p;
+    estatisticas_tabela(TABELA_PRODUTOS, &produtos);
+    if (planejar_produto_mais_caro(&produtos, &p) == CAMINHO_AGREGADOS && agregados_atuais(&cab)) {
+        CONTAR(estat_io.agregados_consultas, 1);
+        if (cab.n_reserva > 0) imprimir_produto_mais_caro(&cab.mais_caro);
+        else printf("Nenhum produto ativo encontrado.\n");
+    } else {
+        produto_mais_caro_varredura();
+    }
+    instr_registrar(OP_PRODUTO_MAIS_CARO, t0);
+}
+
+void imprimir_valor_total_vendido(long long total_centavos, long long itens_contados, long long produtos_nao_encontrados) {
+    printf("\n--- VALOR TOTAL VENDIDO ---\n");
+    printf("Total: R$ %s%lld.%02lld\n", total_centavos < 0 ? "-" : "",
+           (total_centavos < 0 ? -total_centavos : total_centavos) / 100,
+           (total_centavos < 0 ? -total_centavos : total_centavos) % 100);
+    printf("(Calculado a partir de %lld itens de pedidos validos. %lld itens com produto nao encontrado/removido)\n",
+           itens_contados, produtos_nao_encontrados);
+}
+
+typedef struct {
+    long long total_centavos;
+    long long itens_contados;
+    long long produtos_nao_encontrados;
+} ParcialVendas;
+
+static void vendas_processar(void *parcial, const char *registros, size_t n, const void *contexto) {
+    (void)contexto;
+    ParcialVendas *p = parcial, local = *p;
+    const ItemPedido *itens = (const ItemPedido *)registros;
+    for (size_t i = 0; i < n; i++) {
+        if (itens[i].ativo != 'S') continue;
+        // Pesquisa binaria no arquivo de produtos. O preco vem da copia lida
+        // pela propria pesquisa (sem reabrir o arquivo pelo offset, que
+        // poderia ser de outra geracao).
+        Produto p_temp;
+        long offset_prod = localizar_produto(ARQ_PRODUTOS_BIN, (int64_t)itens[i].product_id, &p_temp);
+        if (offset_prod >= 0 && p_temp.ativo == 'S') {
+            local.total_centavos += em_centavos(p_temp.price) * itens[i].quantity; // Em centavos, como os agregados
+            local.itens_contados++;
         } else {
-            printf("ERRO: Formato de data/hora invalido. Use YYYY-MM-DD HH:MM:SS.\n");
+            local.produtos_nao_encontrados++; // Produto nao encontrado ou removido
         }
     }
+    *p = local;
+}
 
-    c_nova.quantity = ler_inteiro("Digite a quantidade: ");
-     if (c_nova.quantity <= 0) {
-        printf("ERRO: Quantidade deve ser positiva.\n");
-        return 0;
+/** @brief vendas_processar com o preco vindo da tabela hash ('contexto'). */
+static void vendas_hash_processar(void *parcial, const char *registros, size_t n, const void *contexto) {
+    const MapaChaves *precos = contexto;
+    ParcialVendas *p = parcial, local = *p;
+    const ItemPedido *itens = (const ItemPedido *)registros;
+    for (size_t i = 0; i < n; i++) {
+        if (itens[i].ativo != 'S') continue;
+        const EntradaMapa *produto = mapa_buscar(precos, (int64_t)itens[i].product_id);
+        if (produto) {
+            local.total_centavos += em_centavos(produto->preco) * itens[i].quantity;
+            local.itens_contados++;
+        } else {
+            local.produtos_nao_encontrados++; // So os produtos ativos estao na tabela
+        }
     }
+    *p = local;
+}
 
-    pad_string(c_nova.order_datetime, TAM_DATETIME);
-    c_nova.ativo = 'S';
-    c_nova.newline = '\n';
+static void vendas_reduzir(void *total, const void *parcial) {
+    ParcialVendas *t = total;
+    const ParcialVendas *p = parcial;
+    t->total_centavos += p->total_centavos;
+    t->itens_contados += p->itens_contados;
+    t->produtos_nao_encontrados += p->produtos_nao_encontrados;
+}
+
+/**
+ * @brief Varredura particionada de itens.bin com 'processar' achando o
+ * preco de cada item; imprime o total das faixas. Itens de outra geracao de
+ * compras sao recusados, como na consulta de pedidos.
+ */
+static void valor_total_vendido_juntar(ProcessarRegistros processar, const void *contexto) {
+    if (!itens_atuais()) {
+        printf("ERRO: Tabela de itens %s desatualizada ou nao encontrada (use 'Recriar do CSV' em compras).\n",
+               ARQ_ITENS_BIN);
+        return;
+    }
+    int n = varredura_n_threads();
+    ParcialVendas *parciais = calloc((size_t)n, sizeof(ParcialVendas));
+    if (!parciais) return;
+    printf("Calculando valor total vendido (pode demorar)...\n");
+    CONTAR(estat_io.agregados_varreduras, 1);
+    if (!varrer_particionado(ARQ_ITENS_BIN, sizeof(ItemPedido), n, processar, vendas_reduzir, contexto,
+                             parciais, sizeof(ParcialVendas))) {
+        printf("ERRO ao abrir arquivo de itens %s\n", ARQ_ITENS_BIN);
+    } else {
+        imprimir_valor_total_vendido(parciais[0].total_centavos, parciais[0].itens_contados,
+                                     parciais[0].produtos_nao_encontrados);
+    }
+    free(parciais);
+}
 
-    // 4. Le arquivo atual para RAM
-    FILE *fbin = fopen(arq_bin, "rb");
-    long n_registros = 0;
-    Compra *compras = NULL;
+/**
+ * @brief Calcula o valor total vendido pela varredura.
+ * Esta funcao simula um "JOIN" de banco de dados manualmente.
+ * 1. Le o arquivo de itens em faixas, uma por thread (varrer_particionado):
+ * todas as linhas dos pedidos, nao so a primeira, que e a que fica em compras.bin.
+ * 2. Para cada item ativo, ela usa a 'pesquisa_binaria' (rapida, O(logN))
+ * para encontrar o preco do produto correspondente no arquivo de produtos.
+ * 3. Multiplica preco * quantidade e soma ao total da faixa; a reducao soma
+ * as faixas (inteiros em centavos: o total nao depende do numero de threads).
+ */
+void valor_total_vendido_varredura() {
+    valor_total_vendido_juntar(vendas_processar, NULL);
+}
 
-    if (fbin) {
-        fseek(fbin, 0, SEEK_END);
-        long tamanho_arquivo = ftell(fbin);
-        if (tamanho_arquivo > 0 && tamanho_arquivo % sizeof(Compra) == 0) {
-             n_registros = tamanho_arquivo / sizeof(Compra);
-             compras = malloc((n_registros + 1) * sizeof(Compra));
-             if (!compras) { printf("ERRO ao alocar memoria.\n"); fclose(fbin); return 0; }
-             fseek(fbin, 0, SEEK_SET);
-             fread(compras, sizeof(Compra), n_registros, fbin);
+/**
+ * @brief Calcula o valor total vendido por hash join: os precos dos
+ * produtos ativos vao para uma tabela hash (carregar_precos_produtos, uma
+ * leitura sequencial de produtos.bin) e a varredura particionada de
+ * itens.bin consulta a tabela em vez de pesquisar no arquivo. As threads
+ * so leem a tabela.
+ */
+void valor_total_vendido_hash_join() {
+    MapaChaves precos;
+    if (!carregar_precos_produtos(&precos)) {
+        printf("ERRO ao carregar os precos de %s\n", ARQ_PRODUTOS_BIN);
+        return;
+    }
+    valor_total_vendido_juntar(vendas_hash_processar, &precos);
+    mapa_liberar(&precos);
+}
+
+/**
+ * @brief Planeja o valor total vendido: agregados, hash join ou juncao por
+ * pesquisa binaria (so compensa com poucos itens e muitos produtos). 'itens'
+ * descreve itens.bin (estatisticas_itens), a tabela varrida.
+ */
+CaminhoAcesso planejar_valor_total_vendido(const EstatisticasTabela *produtos, const EstatisticasTabela *itens,
+                                           Planejamento *p) {
+    planejamento_iniciar(p);
+    considerar_agregados(p);
+    double leituras_itens = leituras_sequenciais(itens->bytes);
+    double varrer_itens = CUSTO_ABERTURA +
+                         custo_sequencial((double)itens->bytes, itens->residente, leituras_itens);
+
+    // Hash join: uma leitura de cada tabela, a tabela hash zerada (como em
+    // mapa_iniciar) e uma insercao por produto e uma consulta por item
+    double capacidade = 16;
+    while (capacidade < 2.0 * (double)produtos->registros) capacidade *= 2;
+    double leituras_produtos = leituras_sequenciais(produtos->bytes);
+    planejamento_considerar(p, CAMINHO_HASH_JOIN, leituras_produtos + leituras_itens,
+                            (double)(produtos->bytes + itens->bytes),
+                            varrer_itens + CUSTO_ABERTURA +
+                            custo_sequencial((double)produtos->bytes, produtos->residente, leituras_produtos) +
+                            capacidade * sizeof(EntradaMapa) * CUSTO_BYTE_QUENTE +
+                            (double)(produtos->registros + itens->registros) * CUSTO_ENTRADA_HASH);
+
+    // Juncao binaria: uma pesquisa em produtos.bin por item
+    double buscas = (double)itens->registros * niveis_binaria(produtos->registros);
+    planejamento_considerar(p, CAMINHO_JUNCAO_BINARIA, leituras_itens + buscas,
+                            (double)itens->bytes + buscas * BYTES_POR_PASSO_BINARIA,
+                            varrer_itens + (double)itens->registros * CUSTO_ABERTURA +
+                            custo_aleatorio(produtos->bytes, produtos->residente, buscas, BYTES_POR_PASSO_BINARIA));
+    return planejamento_escolher(p);
+}
+
+/**
+ * @brief Valor total vendido (todos os itens dos pedidos) pelo caminho de
+ * menor custo estimado: O(1) pelos agregados materializados se estiverem
+ * atuais; senao hash join ou, com poucos itens, a varredura com pesquisa binaria.
+ */
+void consulta_valor_total_vendido() {
+    unsigned long long t0 = instr_inicio();
+    CabecalhoAgregados cab;
+    EstatisticasTabela produtos, itens;
+    Planejamento p;
+    estatisticas_tabela(TABELA_PRODUTOS, &produtos);
+    estatisticas_itens(&itens);
+    CaminhoAcesso caminho = planejar_valor_total_vendido(&produtos, &itens, &p);
+    if (caminho == CAMINHO_AGREGADOS && agregados_atuais(&cab)) {
+        CONTAR(estat_io.agregados_consultas, 1);
+        imprimir_valor_total_vendido(cab.receita_centavos, cab.itens_validos,
+                                     cab.itens_ativos - cab.itens_validos);
+    } else if (caminho == CAMINHO_JUNCAO_BINARIA) {
+        valor_total_vendido_varredura();
+    } else {
+        valor_total_vendido_hash_join();
+    }
+    instr_registrar(OP_VALOR_TOTAL_VENDIDO, t0);
+}
+
+// --- SERVIDOR DE CONSULTAS (SOCKET UNIX + POOL DE THREADS) ---
+//
+// Modo nao interativo: "./trabalho_aed2 servidor". Carrega os indices
+// parciais UMA vez (e opcionalmente mapeia os .bin com mmap) e atende
+// outros processos por um socket de dominio Unix, com um numero fixo de
+// threads trabalhadoras.
+//
+// Os arquivos abertos + indices formam uma GERACAO do servidor. Cada
+// requisicao fixa a geracao atual (contador de referencias) e a usa do
+// comeco ao fim, mesmo que um escritor publique outra no meio. Quando uma
+// nova geracao e publicada (por uma escrita do proprio servidor ou de outro
+// processo, detectada em ARQ_GERACOES), ela passa a ser a atual e a antiga
+// e liberada assim que a ultima requisicao que a fixou termina.
+// Protocolo texto, uma requisicao por linha:
+//   PING                          -> PONG
+//   PRODUTO <id>                  -> OK <id>\t<brand>\t<price>\t<category> | NAO_ENCONTRADO | REMOVIDO
+//   COMPRA <id>                   -> OK <order>\t<product>\t<user>\t<qty>\t<datetime> | ...
+//   FAIXA_PRODUTOS <de> <ate> [limite]  -> uma linha "<registro>" por produto ativo e "FIM <n>"
+//   FAIXA_COMPRAS <de> <ate> [limite]   -> idem para compras
+//   TOTAL_VENDIDO                 -> OK <total> <itens_validos> | ERRO itens desatualizados
+//   MAIS_CARO                     -> OK <id>\t<brand>\t<price>\t<category> | NAO_ENCONTRADO
+//   CONTAGEM                      -> OK <produtos_ativos> <compras_ativas>
+//   GERACAO                       -> OK <geracao_produtos> <geracao_compras>
+//   INSERIR_PRODUTO <id>\t<brand>\t<price>\t<category>              -> OK | DUPLICADO
+//   INSERIR_COMPRA <order>\t<product>\t<user>\t<qty>\t<datetime>     -> OK | DUPLICADO | PRODUTO_INVALIDO
+//   REMOVER_PRODUTO <id> / REMOVER_COMPRA <id>                       -> OK | NAO_ENCONTRADO
+//   SAIR                          -> fecha a conexao
+// Erros de sintaxe respondem "ERRO <mensagem>".
+// As escritas de conexoes diferentes que chegam juntas sao confirmadas num
+// mesmo grupo do WAL (group commit): a primeira vira LIDER, espera a janela
+// (--janela-us) e confirma tudo o que estiver na fila com um fsync e uma
+// nova geracao; as outras so esperam a resposta. Enquanto um lider grava,
+// as escritas que chegam formam o proximo grupo.
+
+const char* ARQ_SOCKET_PADRAO = "aed2.sock";
+#define SERVIDOR_THREADS_PADRAO 4
+#define SERVIDOR_FILA_MAX 128    // Conexoes aceitas aguardando uma thread livre
+#define SERVIDOR_LIMITE_FAIXA 1000 // Limite padrao de linhas de uma consulta de faixa
+#define SERVIDOR_INTERVALO_GERACAO_MS 200 // Intervalo entre verificacoes de nova geracao
+#define SERVIDOR_JANELA_GRUPO_US 0 // Espera do lider por mais escritas (0: so as que ja estao na fila)
+
+typedef struct {
+    const char *arq_dados;
+    const char *arq_indice;
+    size_t tam_registro;
+    size_t offset_chave;
+    size_t offset_ativo;
+    int fd;                // Lido com pread (seguro entre threads)
+    long tamanho;
+    char *mapa;            // Arquivo inteiro mapeado (opcao --mmap) ou NULL
+    IndiceCompacto indice; // Indice parcial (compacto) carregado na RAM
+} TabelaServidor;
+
+typedef struct {
+    uint64_t numero[N_TABELAS]; // Geracoes dos .bin (ARQ_GERACOES) quando foram abertos
+    TabelaServidor produtos;
+    TabelaServidor compras;
+    TabelaServidor itens;       // Sem indice, so para TOTAL_VENDIDO (fd -1 se falta)
+    int referencias;            // Requisicoes que a fixaram (+1 enquanto for a atual)
+
+    // Agregados calculados na primeira requisicao e reaproveitados
+    pthread_mutex_t trava_agregados;
+    int agregados_prontos;
+    int itens_atuais;           // itens.bin aberto vale para numero[TABELA_COMPRAS]
+    double total_vendido;       // Soma dos itens (todas as linhas dos pedidos)
+    long itens_validos;
+    long produtos_ativos, compras_ativas;
+    int tem_mais_caro;
+    Produto mais_caro;
+} GeracaoServidor;
+
+// Escrita de uma conexao aguardando o seu grupo
+typedef struct EscritaPendente {
+    TipoOperacaoWAL tipo;
+    union { Produto p; Compra c; int64_t chave; } dados;
+    const char *resposta; // Preenchida pelo lider
+    int pronta;
+    struct EscritaPendente *proxima;
+} EscritaPendente;
+
+typedef struct {
+    GeracaoServidor *atual;
+    pthread_mutex_t trava_geracao;  // Protege 'atual' e os contadores de referencias
+    pthread_mutex_t trava_escritor; // Uma escrita (ou recarga de geracao) por vez
+    int usar_mmap;
+    long geracoes_liberadas;
+
+    // Fila de escritas do proximo grupo (group commit entre conexoes)
+    pthread_mutex_t trava_grupo;
+    pthread_cond_t grupo_confirmado;
+    EscritaPendente *escritas, **fim_escritas;
+    int lider_ativo;
+    long janela_us;
+    long grupos, escritas_agrupadas;
+
+    // Fila de conexoes aceitas (produtor: thread principal; consumidores: pool)
+    pthread_mutex_t trava_fila;
+    pthread_cond_t fila_nao_vazia;
+    pthread_cond_t fila_nao_cheia;
+    int fila[SERVIDOR_FILA_MAX];
+    int fila_inicio, fila_n;
+} EstadoServidor;
+
+volatile sig_atomic_t servidor_encerrar = 0;
+
+void sinal_encerrar_servidor(int sinal) {
+    (void)sinal;
+    servidor_encerrar = 1;
+}
+
+int64_t chave_registro(const TabelaServidor *t, const char *registro) {
+    int64_t chave;
+    memcpy(&chave, registro + t->offset_chave, sizeof(chave));
+    return chave;
+}
+
+/**
+ * @brief Devolve um ponteiro para 'n' registros a partir do registro 'pos'.
+ * Com mmap aponta direto para o mapa; senao faz UM pread para 'buffer'.
+ * @return Numero de registros disponiveis (pode ser menor no fim do arquivo).
+ */
+long obter_registros(const TabelaServidor *t, long pos, long n, char *buffer, const char **saida) {
+    long total = t->tamanho / (long)t->tam_registro;
+    if (pos >= total) return 0;
+    if (pos + n > total) n = total - pos;
+    if (t->mapa) {
+        *saida = t->mapa + pos * (long)t->tam_registro;
+        return n;
+    }
+    ssize_t lidos = pread(t->fd, buffer, (size_t)n * t->tam_registro, pos * (long)t->tam_registro);
+    if (lidos <= 0) return 0;
+    *saida = buffer;
+    return (long)((size_t)lidos / t->tam_registro);
+}
+
+/**
+ * @brief Monta o indice parcial em RAM varrendo o proprio descritor aberto,
+ * de modo que ele corresponde exatamente a geracao fixada.
+ */
+int construir_indice_servidor(TabelaServidor *t) {
+    long n_registros = t->tamanho / (long)t->tam_registro;
+    long capacidade = n_registros / BLOCO_INDICE + 1, n_entradas = 0;
+    char *buffer = malloc((size_t)BLOCO_INDICE * t->tam_registro);
+    int64_t *chaves = malloc((size_t)capacidade * sizeof(int64_t));
+    int64_t *ordinais = malloc((size_t)capacidade * sizeof(int64_t));
+    memset(&t->indice, 0, sizeof(t->indice));
+    if (!chaves || !ordinais || !buffer) { free(buffer); free(chaves); free(ordinais); return 0; }
+
+    long pos = 0, n, ativos = 0;
+    const char *regs;
+    while ((n = obter_registros(t, pos, BLOCO_INDICE, buffer, &regs)) > 0) {
+        for (long i = 0; i < n; i++) {
+            const char *r = regs + i * (long)t->tam_registro;
+            if (r[t->offset_ativo] != 'S') continue;
+            if (ativos % BLOCO_INDICE == 0 && n_entradas < capacidade) {
+                chaves[n_entradas] = chave_registro(t, r);
+                ordinais[n_entradas++] = pos + i;
+            }
+            ativos++;
         }
-        fclose(fbin);
+        pos += n;
     }
-    if (!compras) {
-         n_registros = 0;
-         compras = malloc(sizeof(Compra));
-         if (!compras) { printf("ERRO ao alocar memoria.\n"); return 0; }
-    }
-
-    // 5. Adiciona e re-ordena
-    compras[n_registros] = c_nova;
-    n_registros++;
-    qsort(compras, n_registros, sizeof(Compra), comparar_compra);
+    int ok = indice_compacto_montar(&t->indice, chaves, ordinais, n_entradas);
+    free(buffer);
+    free(chaves);
+    free(ordinais);
+    return ok;
+}
 
-    // 6. Re-escreve arquivo
-    fbin = fopen(arq_bin, "wb");
-    if (!fbin) { printf("ERRO ao abrir arquivo para escrita.\n"); free(compras); return 0; }
+/** @brief Abre (e mapeia, com --mmap) o .bin de uma tabela como esta agora. */
+int abrir_tabela_servidor(TabelaServidor *t, int usar_mmap) {
+    t->fd = open(t->arq_dados, O_RDONLY);
+    if (t->fd < 0) { fprintf(stderr, "ERRO: nao foi possivel abrir %s\n", t->arq_dados); return 0; }
+    struct stat st;
+    fstat(t->fd, &st);
+    t->tamanho = (long)st.st_size;
+    t->mapa = NULL;
+    if (usar_mmap && t->tamanho > 0) {
+        void *m = mmap(NULL, (size_t)t->tamanho, PROT_READ, MAP_SHARED, t->fd, 0);
+        if (m != MAP_FAILED) t->mapa = m;
+    }
+    return 1;
+}
 
-    fwrite(compras, sizeof(Compra), n_registros, fbin);
-    fclose(fbin);
-    free(compras);
+/**
+ * @brief Abre o .bin de uma tabela e carrega seu indice parcial.
+ * @param usar_arquivo_indice Se 1, usa o .idx em disco (criando-o se faltar).
+ * Se 0, monta o indice a partir do arquivo aberto (construir_indice_servidor),
+ * como nas recargas apos uma escrita, em que o .idx pode ainda ser de outra geracao.
+ * @return 1 se a tabela pode ser servida, 0 caso contrario.
+ */
+int carregar_tabela_servidor(TabelaServidor *t, int usar_mmap, int usar_arquivo_indice) {
+    if (!abrir_tabela_servidor(t, usar_mmap)) return 0;
+    if (!usar_arquivo_indice) return construir_indice_servidor(t);
+
+    TabelaDados tabela = t->tam_registro == sizeof(Compra) ? TABELA_COMPRAS : TABELA_PRODUTOS;
+    if (indice_compacto_carregar_atual(&t->indice, t->arq_indice, t->arq_dados, tabela)) return 1;
+    // Sem indice (ou desatualizado): cria agora, uma unica vez, antes de aceitar conexoes
+    fprintf(stderr, "Criando indice %s...\n", t->arq_indice);
+    if (tabela == TABELA_COMPRAS) criar_indice_compra(t->arq_dados, t->arq_indice);
+    else criar_indice_produto(t->arq_dados, t->arq_indice);
+    return indice_compacto_carregar_atual(&t->indice, t->arq_indice, t->arq_dados, tabela);
+}
 
-    printf("Compra %lld inserida com sucesso!\n", c_nova.order_id);
-    return 1; // Sinaliza para reconstruir indice
+void liberar_tabela_servidor(TabelaServidor *t) {
+    if (t->mapa) munmap(t->mapa, (size_t)t->tamanho);
+    if (t->fd >= 0) close(t->fd);
+    indice_compacto_liberar(&t->indice);
 }
 
 /**
- * @brief Realiza a remocao logica de uma compra (marca ativo = 'N').
- * Mesma logica do remover_produto.
- * @return 1 se foi removido, 0 se houve erro.
+ * @brief Abre a versao atual de 't' e monta o seu indice a partir do de
+ * 'anterior' (a mesma tabela na geracao anterior), sem varrer o .bin.
+ * 'inseridas' (ordenadas) sao as chaves dos registros acrescentados ao .bin
+ * denso: cada uma avanca uma posicao as entradas com chave maior; remocoes
+ * nao mudam posicoes. servidor_buscar e servidor_faixa so precisam de uma
+ * posicao de partida com chave <= a procurada, mas percorrem o bloco ate a
+ * proxima: um bloco que recebeu insercoes e passou de 2 * BLOCO_INDICE
+ * registros e reamostrado (uma entrada a cada BLOCO_INDICE ativos, como em
+ * construir_indice_servidor), lendo so o trecho dele. No layout em blocos o
+ * .idx ja foi atualizado pelo escritor (indice_em_blocos_gravar) e e carregado.
+ * Se o tamanho do .bin nao confere com 'n_inseridas', varre o arquivo.
+ * @return 1 se a tabela pode ser servida, 0 caso contrario.
  */
-int remover_compra(const char *arq_bin) {
-    printf("\n--- REMOVER COMPRA ---\n");
-    long long id = ler_long_long("Digite o order_id para remover: ");
-
-    long long chave = id;
-    long offset = pesquisa_binaria(arq_bin, sizeof(Compra), comparar_compra_chave, &chave, offsetof(Compra, ativo));
+int derivar_tabela_servidor(TabelaServidor *t, const TabelaServidor *anterior, const int64_t *inseridas,
+                            int n_inseridas, int usar_mmap) {
+    if (!abrir_tabela_servidor(t, usar_mmap)) return 0;
+    TabelaDados tabela = t->tam_registro == sizeof(Compra) ? TABELA_COMPRAS : TABELA_PRODUTOS;
+    if (tabela_em_blocos(tabela)) {
+        if (indice_compacto_carregar_atual(&t->indice, t->arq_indice, t->arq_dados, tabela)) return 1;
+        return construir_indice_servidor(t);
+    }
+    if (t->tamanho - anterior->tamanho != (long)n_inseridas * (long)t->tam_registro)
+        return construir_indice_servidor(t);
+
+    // Entradas de 'anterior' com as posicoes deslocadas; 'novas[k]' conta as
+    // chaves inseridas no bloco que comeca na entrada k
+    int64_t n = anterior->indice.cab.n_entradas;
+    int64_t *chaves = malloc((size_t)(n + 1) * sizeof(int64_t));
+    int64_t *ordinais = malloc((size_t)(n + 1) * sizeof(int64_t));
+    int *novas = malloc((size_t)(n + 1) * sizeof(int));
+    if (!chaves || !ordinais || !novas) {
+        free(chaves); free(ordinais); free(novas);
+        return construir_indice_servidor(t);
+    }
+    int64_t m = 0;
+    int j = 0;
+    for (int64_t i = 0; i < n; i++) {
+        int64_t chave, ordinal;
+        indice_entrada(&anterior->indice, i, &chave, &ordinal);
+        int j_antes = j;
+        while (j < n_inseridas && inseridas[j] < chave) j++;
+        // Chave nova antes da primeira entrada: a busca precisa partir do inicio
+        if (i == 0 && j > 0) { chaves[m] = inseridas[0]; ordinais[m] = 0; novas[m++] = j; }
+        else if (m > 0) novas[m - 1] = j - j_antes;
+        chaves[m] = chave;
+        ordinais[m] = ordinal + j;
+        novas[m++] = 0;
+    }
+    if (m > 0) novas[m - 1] = n_inseridas - j;
+    if (n == 0 && n_inseridas > 0) { chaves[m] = inseridas[0]; ordinais[m] = 0; novas[m++] = n_inseridas; }
+
+    // Reamostra os blocos que cresceram demais
+    long n_registros = t->tamanho / (long)t->tam_registro;
+    int64_t capacidade = m + 1, n_entradas = 0;
+    int64_t *chaves_finais = malloc((size_t)capacidade * sizeof(int64_t));
+    int64_t *ordinais_finais = malloc((size_t)capacidade * sizeof(int64_t));
+    char *buffer = malloc((size_t)BLOCO_INDICE * t->tam_registro);
+    int ok = chaves_finais && ordinais_finais && buffer;
+    for (int64_t k = 0; ok && k < m; k++) {
+        long inicio = (long)ordinais[k], fim = k + 1 < m ? (long)ordinais[k + 1] : n_registros;
+        if (novas[k] == 0 || fim - inicio <= 2 * BLOCO_INDICE) {
+            chaves_finais[n_entradas] = chaves[k];
+            ordinais_finais[n_entradas++] = ordinais[k];
+            continue;
+        }
+        capacidade += (fim - inicio) / BLOCO_INDICE + 1;
+        int64_t *c = realloc(chaves_finais, (size_t)capacidade * sizeof(int64_t));
+        if (c) chaves_finais = c;
+        int64_t *o = realloc(ordinais_finais, (size_t)capacidade * sizeof(int64_t));
+        if (o) ordinais_finais = o;
+        if (!c || !o) { ok = 0; break; }
+        chaves_finais[n_entradas] = chaves[k];
+        ordinais_finais[n_entradas++] = ordinais[k];
+        long pos = inicio, lidos, ativos = 0;
+        const char *regs;
+        while (pos < fim && (lidos = obter_registros(t, pos, BLOCO_INDICE, buffer, &regs)) > 0) {
+            for (long i = 0; i < lidos && pos + i < fim; i++) {
+                const char *r = regs + i * (long)t->tam_registro;
+                if (r[t->offset_ativo] != 'S') continue;
+                if (ativos > 0 && ativos % BLOCO_INDICE == 0) {
+                    chaves_finais[n_entradas] = chave_registro(t, r);
+                    ordinais_finais[n_entradas++] = pos + i;
+                }
+                ativos++;
+            }
+            pos += lidos;
+        }
+    }
+    if (ok) ok = indice_compacto_montar(&t->indice, chaves_finais, ordinais_finais, n_entradas);
+    free(buffer);
+    free(chaves_finais);
+    free(ordinais_finais);
+    free(chaves);
+    free(ordinais);
+    free(novas);
+    return ok ? 1 : construir_indice_servidor(t);
+}
 
-    if (offset == -1) { printf("Compra %lld nao encontrada.\n", id); return 0; }
-    if (offset == -2) { printf("Compra %lld ja esta removida.\n", id); return 0; }
+/**
+ * @brief Abre itens.bin junto com uma geracao (sem indice: so e varrido por
+ * servidor_calcular_agregados). Se falta, fica com fd -1.
+ */
+void abrir_itens_servidor(TabelaServidor *t, int usar_mmap) {
+    *t = (TabelaServidor){ARQ_ITENS_BIN, ARQ_ITENS_IDX, sizeof(ItemPedido),
+                          offsetof(ItemPedido, order_id), offsetof(ItemPedido, ativo), -1, 0, NULL, {{0}, NULL, NULL}};
+    if (access(ARQ_ITENS_BIN, F_OK) == 0) abrir_tabela_servidor(t, usar_mmap);
+}
 
-    FILE *fbin = fopen(arq_bin, "r+b");
-    if (!fbin) { printf("ERRO ao abrir arquivo para remocao.\n"); return 0; }
-    fseek(fbin, offset + offsetof(Compra, ativo), SEEK_SET);
-    fwrite("N", sizeof(char), 1, fbin);
-    fclose(fbin);
+/**
+ * @brief Abre uma nova geracao: os dois .bin, como estao agora, e seus indices.
+ * O numero e lido ANTES de abrir os arquivos; se um escritor publicar no meio,
+ * a geracao aberta fica com numero antigo e sera recarregada na proxima verificacao.
+ * @return A geracao com uma referencia (a de "atual"), ou NULL em caso de erro.
+ */
+GeracaoServidor *carregar_geracao_servidor(int usar_mmap, int usar_arquivo_indice) {
+    GeracaoServidor *g = calloc(1, sizeof(GeracaoServidor));
+    if (!g) return NULL;
+    ler_geracoes(g->numero);
+    g->produtos = (TabelaServidor){ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX, sizeof(Produto),
+                                   offsetof(Produto, product_id), offsetof(Produto, ativo), -1, 0, NULL, {{0}, NULL, NULL}};
+    g->compras = (TabelaServidor){ARQ_COMPRAS_BIN, ARQ_COMPRAS_IDX, sizeof(Compra),
+                                  offsetof(Compra, order_id), offsetof(Compra, ativo), -1, 0, NULL, {{0}, NULL, NULL}};
+    if (!carregar_tabela_servidor(&g->produtos, usar_mmap, usar_arquivo_indice) ||
+        !carregar_tabela_servidor(&g->compras, usar_mmap, usar_arquivo_indice)) {
+        liberar_tabela_servidor(&g->produtos);
+        liberar_tabela_servidor(&g->compras);
+        free(g);
+        return NULL;
+    }
+    abrir_itens_servidor(&g->itens, usar_mmap);
+    pthread_mutex_init(&g->trava_agregados, NULL);
+    g->referencias = 1;
+    return g;
+}
 
-    printf("Compra %lld removida logicamente.\n", id);
-    return 1; // Sinaliza para reconstruir indice
+void liberar_geracao_servidor(GeracaoServidor *g) {
+    liberar_tabela_servidor(&g->produtos);
+    liberar_tabela_servidor(&g->compras);
+    liberar_tabela_servidor(&g->itens);
+    pthread_mutex_destroy(&g->trava_agregados);
+    free(g);
 }
 
 /**
- * @brief Consulta uma compra usando a pesquisa binaria direta no arquivo.
+ * @brief Fixa a geracao atual para uma requisicao. Nunca bloqueia por causa
+ * de um escritor: a trava so protege a troca do ponteiro e o contador.
  */
-void consultar_compra(const char *arq_bin) {
-    printf("\n--- CONSULTAR COMPRA ---\n");
-    long long id = ler_long_long("Digite o order_id para consultar: ");
+GeracaoServidor *geracao_fixar(EstadoServidor *e) {
+    pthread_mutex_lock(&e->trava_geracao);
+    GeracaoServidor *g = e->atual;
+    g->referencias++;
+    pthread_mutex_unlock(&e->trava_geracao);
+    return g;
+}
 
-    long long chave = id;
-    long offset = pesquisa_binaria(arq_bin, sizeof(Compra), comparar_compra_chave, &chave, offsetof(Compra, ativo));
+/**
+ * @brief Solta uma geracao fixada; a ultima referencia a libera.
+ */
+void geracao_soltar(EstadoServidor *e, GeracaoServidor *g) {
+    pthread_mutex_lock(&e->trava_geracao);
+    int restantes = --g->referencias;
+    if (restantes == 0) e->geracoes_liberadas++;
+    pthread_mutex_unlock(&e->trava_geracao);
+    if (restantes == 0) liberar_geracao_servidor(g);
+}
 
-    if (offset == -1) { printf("Compra %lld nao encontrada.\n", id); }
-    else if (offset == -2) { printf("Compra %lld existe mas foi removida.\n", id); }
-    else {
-        FILE *fbin = fopen(arq_bin, "rb");
-        if (!fbin) { printf("ERRO ao abrir arquivo para leitura.\n"); return; }
-        fseek(fbin, offset, SEEK_SET);
-        Compra c;
-        fread(&c, sizeof(Compra), 1, fbin);
+/**
+ * @brief Torna 'nova' a geracao atual. Requisicoes em andamento continuam na
+ * anterior, que e liberada quando a ultima delas terminar.
+ */
+void geracao_publicar(EstadoServidor *e, GeracaoServidor *nova) {
+    pthread_mutex_lock(&e->trava_geracao);
+    GeracaoServidor *antiga = e->atual;
+    e->atual = nova;
+    pthread_mutex_unlock(&e->trava_geracao);
+    if (antiga) geracao_soltar(e, antiga);
+}
 
-        // "Trim"
-        char datetime_trim[TAM_DATETIME+1]={0};
-        strncpy(datetime_trim, c.order_datetime, TAM_DATETIME);
-        for(int i = strlen(datetime_trim)-1; i >=0 && datetime_trim[i] == ' '; i--) datetime_trim[i] = '\0';
+/**
+ * @brief Carrega e publica uma nova geracao se ARQ_GERACOES mudou (ou sempre,
+ * com 'forcar'). Deve ser chamada com e->trava_escritor adquirida, o que
+ * garante que ninguem mais troca e->atual no meio.
+ * @return 1 se publicou uma nova geracao.
+ */
+int servidor_recarregar(EstadoServidor *e, int forcar) {
+    uint64_t numero[N_TABELAS];
+    ler_geracoes(numero);
+    if (!forcar && memcmp(numero, e->atual->numero, sizeof(numero)) == 0) return 0;
+
+    GeracaoServidor *nova = carregar_geracao_servidor(e->usar_mmap, 0);
+    if (!nova) return 0; // Continua servindo a geracao anterior
+    geracao_publicar(e, nova);
+    return 1;
+}
 
-        printf("\n--- COMPRA ENCONTRADA ---\n");
-        printf("Order ID: %lld\nProduct ID: %lld\nUser ID: %lld\nQuantity: %d\nDate: %s\n",
-               c.order_id, c.product_id, c.user_id, c.quantity, datetime_trim);
-        fclose(fbin);
+/**
+ * @brief Publica a geracao seguinte a um grupo de escritas do proprio
+ * servidor: nenhuma tabela e varrida, os indices sao derivados dos da
+ * geracao 'anterior' (derivar_tabela_servidor). Por tabela: 'alterada' diz
+ * se o grupo publicou uma nova geracao dela e 'inseridas' (ordenadas) sao
+ * as chaves acrescentadas. Se ARQ_GERACOES mostra que outro processo tambem
+ * publicou, recarrega tudo (servidor_recarregar).
+ * Deve ser chamada com e->trava_escritor adquirida.
+ * @return 1 se publicou uma nova geracao.
+ */
+int servidor_recarregar_apos_escrita(EstadoServidor *e, const GeracaoServidor *anterior, const int *alterada,
+                                     int64_t *const *inseridas, const int *n_inseridas) {
+    uint64_t numero[N_TABELAS];
+    ler_geracoes(numero);
+    for (int t = 0; t < N_TABELAS; t++)
+        if (numero[t] != anterior->numero[t] + (alterada[t] ? 1 : 0)) return servidor_recarregar(e, 1);
+
+    GeracaoServidor *nova = calloc(1, sizeof(GeracaoServidor));
+    if (!nova) return 0;
+    memcpy(nova->numero, numero, sizeof(numero));
+    nova->produtos = (TabelaServidor){ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX, sizeof(Produto),
+                                      offsetof(Produto, product_id), offsetof(Produto, ativo), -1, 0, NULL, {{0}, NULL, NULL}};
+    nova->compras = (TabelaServidor){ARQ_COMPRAS_BIN, ARQ_COMPRAS_IDX, sizeof(Compra),
+                                     offsetof(Compra, order_id), offsetof(Compra, ativo), -1, 0, NULL, {{0}, NULL, NULL}};
+    if (!derivar_tabela_servidor(&nova->produtos, &anterior->produtos, inseridas[TABELA_PRODUTOS],
+                                 n_inseridas[TABELA_PRODUTOS], e->usar_mmap) ||
+        !derivar_tabela_servidor(&nova->compras, &anterior->compras, inseridas[TABELA_COMPRAS],
+                                 n_inseridas[TABELA_COMPRAS], e->usar_mmap)) {
+        liberar_tabela_servidor(&nova->produtos);
+        liberar_tabela_servidor(&nova->compras);
+        free(nova);
+        return servidor_recarregar(e, 1);
     }
+    abrir_itens_servidor(&nova->itens, e->usar_mmap);
+    pthread_mutex_init(&nova->trava_agregados, NULL);
+    nova->referencias = 1;
+    geracao_publicar(e, nova);
+    return 1;
 }
 
-// --- CONSULTAS COM INDICE ---
-
 /**
- * @brief Consulta um produto usando o arquivo de indice parcial.
- * ETAPA 1: Carrega o arquivo .idx (pequeno) para a RAM.
- * ETAPA 2: Faz uma busca binaria no array de indices (RAM) para achar o BLOCO
- * onde o registro *deveria* estar.
- * ETAPA 3: Da fseek no arquivo .bin (grande) para o inicio daquele bloco.
- * ETAPA 4: Faz uma busca SEQUENCIAL lendo no maximo 'BLOCO_INDICE' registros
- * dentro daquele bloco ate achar a chave.
+ * @brief Thread que detecta geracoes publicadas por outros processos
+ * (ex: o menu interativo inserindo produtos com o servidor no ar).
  */
-void consultar_produto_com_indice(const char *arq_indice, const char *arq_dados) {
-    printf("\n--- CONSULTAR PRODUTO COM INDICE ---\n");
-    int64_t id = ler_long_long("Digite o product_id para buscar: ");
-
-    // ETAPA 1: Carrega o indice para a RAM
-    FILE *f_idx = fopen(arq_indice, "rb");
-    if (!f_idx) { printf("ERRO: Indice %s nao encontrado.\n", arq_indice); return; }
-
-    fseek(f_idx, 0, SEEK_END);
-    long tam_idx = ftell(f_idx);
-     if (tam_idx <= 0 || tam_idx % sizeof(IndiceProduto) != 0) {
-         printf("ERRO: Arquivo de indice %s invalido ou vazio.\n", arq_indice);
-         fclose(f_idx);
-         return;
+void *servidor_vigia_geracoes(void *arg) {
+    EstadoServidor *e = arg;
+    struct timespec espera = {0, SERVIDOR_INTERVALO_GERACAO_MS * 1000000L};
+    while (!servidor_encerrar) {
+        nanosleep(&espera, NULL);
+        // Se uma escrita do proprio servidor esta em andamento, ela mesma recarrega
+        if (pthread_mutex_trylock(&e->trava_escritor) != 0) continue;
+        servidor_recarregar(e, 0);
+        pthread_mutex_unlock(&e->trava_escritor);
     }
-    int n_indices = tam_idx / sizeof(IndiceProduto);
-    fseek(f_idx, 0, SEEK_SET);
-
-    IndiceProduto *indices = malloc(tam_idx);
-    if (!indices) { printf("ERRO ao alocar memoria para indice.\n"); fclose(f_idx); return; }
+    return NULL;
+}
 
-    fread(indices, sizeof(IndiceProduto), n_indices, f_idx);
-    fclose(f_idx);
+/**
+ * @brief Posicao (em registros) do bloco do indice onde 'chave' deveria estar, ou -1.
+ */
+long bloco_do_indice(const TabelaServidor *t, int64_t chave) {
+    return (long)indice_compacto_bloco(&t->indice, chave);
+}
 
-    // ETAPA 2: Busca binaria no indice (RAM) para achar o bloco
-    int inicio = 0, fim = n_indices - 1;
-    int idx_bloco = -1;
-    while (inicio <= fim) {
-        int meio = inicio + (fim - inicio) / 2;
-        if (indices[meio].chave <= id) {
-            // Encontramos um bloco cuja chave e <= a buscada.
-            // Este e um *candidato* a ser o bloco certo.
-            idx_bloco = meio;
-            inicio = meio + 1; // Tenta achar um bloco "mais proximo"
-        } else {
-            fim = meio - 1;
+/**
+ * @brief Busca pontual no servidor: indice em RAM + leitura do bloco.
+ * @return 1 (ativo), -1 (nao encontrado) ou -2 (removido); 'registro' recebe a copia.
+ */
+int servidor_buscar(const TabelaServidor *t, int64_t chave, char *registro) {
+    long pos = bloco_do_indice(t, chave);
+    if (pos < 0) return -1;
+
+    char *buffer = malloc((size_t)BLOCO_INDICE * t->tam_registro);
+    if (!buffer) return -1;
+    int resultado = -1;
+    const char *regs;
+    long n;
+    // O bloco tem BLOCO_INDICE registros ativos; se houver removidos no meio
+    // ele continua nos registros seguintes.
+    while ((n = obter_registros(t, pos, BLOCO_INDICE, buffer, &regs)) > 0) {
+        if (chave_registro(t, regs + (n - 1) * (long)t->tam_registro) < chave) { pos += n; continue; }
+        for (long i = 0; i < n; i++) {
+            const char *r = regs + i * (long)t->tam_registro;
+            int64_t k = chave_registro(t, r);
+            if (k > chave) break;
+            if (k == chave) {
+                memcpy(registro, r, t->tam_registro);
+                resultado = (r[t->offset_ativo] == 'S') ? 1 : -2;
+                break;
+            }
         }
+        break;
     }
+    free(buffer);
+    return resultado;
+}
 
-    if (idx_bloco == -1) {
-        // ID buscado e menor que a chave do primeiro bloco
-        printf("Produto %lld nao encontrado (fora do range do indice).\n", id);
-        free(indices);
-        return;
-    }
+void copiar_sem_espacos(char *destino, const char *origem, int tam) {
+    int n = tam - 1;
+    while (n > 0 && (origem[n - 1] == ' ' || origem[n - 1] == '\0')) n--;
+    memcpy(destino, origem, n);
+    destino[n] = '\0';
+}
 
-    // ETAPA 3: Acessa o arquivo de dados
-    FILE *f_dados = fopen(arq_dados, "rb");
-    if (!f_dados) { printf("ERRO ao abrir arquivo de dados %s.\n", arq_dados); free(indices); return; }
+void escrever_produto(FILE *saida, const char *prefixo, const Produto *p) {
+    char brand[TAM_BRAND], categoria[TAM_CATEGORY];
+    copiar_sem_espacos(brand, p->brand, TAM_BRAND);
+    copiar_sem_espacos(categoria, p->category_alias, TAM_CATEGORY);
+    fprintf(saida, "%s%lld\t%s\t%.2f\t%s\n", prefixo, (long long)p->product_id, brand, p->price, categoria);
+}
 
-    // Pula para o inicio do bloco encontrado
-    fseek(f_dados, indices[idx_bloco].offset, SEEK_SET);
+void escrever_compra(FILE *saida, const char *prefixo, const Compra *c) {
+    char data[TAM_DATETIME];
+    copiar_sem_espacos(data, c->order_datetime, TAM_DATETIME);
+    fprintf(saida, "%s%lld\t%lld\t%lld\t%d\t%s\n", prefixo, c->order_id, (long long)c->product_id,
+            c->user_id, c->quantity, data);
+}
 
-    // ETAPA 4: Busca sequencial dentro do bloco
-    Produto p;
-    int encontrado = 0;
-    for (int i = 0; i < BLOCO_INDICE; i++) {
-        if (fread(&p, sizeof(Produto), 1, f_dados) != 1) break; // Fim do arquivo
-
-        if (p.product_id == id) {
-            if (p.ativo == 'S') {
-                // "Trim"
-                char brand_trim[TAM_BRAND+1]={0};
-                char category_trim[TAM_CATEGORY+1]={0};
-                strncpy(brand_trim, p.brand, TAM_BRAND);
-                strncpy(category_trim, p.category_alias, TAM_CATEGORY);
-                for(int j = strlen(brand_trim)-1; j >=0 && brand_trim[j] == ' '; j--) brand_trim[j] = '\0';
-                for(int j = strlen(category_trim)-1; j >=0 && category_trim[j] == ' '; j--) category_trim[j] = '\0';
-
-                printf("\n--- PRODUTO ENCONTRADO (via indice) ---\n");
-                printf("ID: %lld | Brand: %s | Price: %.2f | Category: %s\n",
-                       p.product_id, brand_trim, p.price, category_trim);
-                encontrado = 1;
-            } else {
-                printf("Produto %lld existe mas foi removido.\n", id);
-                encontrado = 2; // Encontrado mas removido
-            }
-            break; // Para a busca sequencial
+/**
+ * @brief Lista os registros ativos com chave em [de, ate], no maximo 'limite'.
+ */
+void servidor_faixa(const TabelaServidor *t, int64_t de, int64_t ate, long limite, FILE *saida) {
+    long pos = bloco_do_indice(t, de);
+    if (pos < 0) pos = 0; // 'de' antes da primeira chave: comeca do inicio
+    char *buffer = malloc((size_t)BLOCO_INDICE * t->tam_registro);
+    long enviados = 0, n;
+    const char *regs;
+    int fim = (buffer == NULL);
+    while (!fim && (n = obter_registros(t, pos, BLOCO_INDICE, buffer, &regs)) > 0) {
+        for (long i = 0; i < n; i++) {
+            const char *r = regs + i * (long)t->tam_registro;
+            int64_t k = chave_registro(t, r);
+            if (k > ate || enviados >= limite) { fim = 1; break; }
+            if (k < de || r[t->offset_ativo] != 'S') continue;
+            if (t->tam_registro == sizeof(Produto)) escrever_produto(saida, "", (const Produto*)r);
+            else escrever_compra(saida, "", (const Compra*)r);
+            enviados++;
         }
-
-        // Otimizacao: Se passamos da chave, nao precisamos ler o resto do bloco
-        if (p.product_id > id) break;
+        pos += n;
     }
+    free(buffer);
+    fprintf(saida, "FIM %ld\n", enviados);
+}
 
-    if (encontrado == 0) {
-        printf("Produto %lld nao encontrado no bloco verificado.\n", id);
-    }
+typedef struct {
+    int64_t id;
+    double preco;
+} PrecoProduto;
 
-    fclose(f_dados);
-    free(indices);
+int comparar_preco_produto_chave(const void *a, const void *b) {
+    int64_t id_a = ((const PrecoProduto*)a)->id, id_b = *(const int64_t*)b;
+    return (id_a > id_b) - (id_a < id_b);
 }
 
 /**
- * @brief Consulta uma compra usando o arquivo de indice parcial.
- * Mesma logica da 'consultar_produto_com_indice'.
+ * @brief Calcula (uma vez por geracao) os agregados servidos por TOTAL_VENDIDO,
+ * MAIS_CARO e CONTAGEM. Faz uma varredura dos produtos guardando (id, preco) dos ativos,
+ * uma das compras (contagem) e uma dos itens buscando o preco em RAM.
  */
-void consultar_compra_com_indice(const char *arq_indice, const char *arq_dados) {
-    printf("\n--- CONSULTAR COMPRA COM INDICE ---\n");
-    long long id = ler_long_long("Digite o order_id para buscar: ");
-
-    // ETAPA 1: Carrega o indice para a RAM
-    FILE *f_idx = fopen(arq_indice, "rb");
-    if (!f_idx) { printf("ERRO: Indice %s nao encontrado.\n", arq_indice); return; }
-
-    fseek(f_idx, 0, SEEK_END);
-    long tam_idx = ftell(f_idx);
-     if (tam_idx <= 0 || tam_idx % sizeof(IndiceCompra) != 0) {
-         printf("ERRO: Arquivo de indice %s invalido ou vazio.\n", arq_indice);
-         fclose(f_idx);
-         return;
+void servidor_calcular_agregados(GeracaoServidor *g) {
+    pthread_mutex_lock(&g->trava_agregados);
+    if (g->agregados_prontos) { pthread_mutex_unlock(&g->trava_agregados); return; }
+
+    TabelaServidor *tp = &g->produtos, *tc = &g->compras;
+    long n_prod = tp->tamanho / (long)sizeof(Produto);
+    PrecoProduto *precos = malloc((n_prod > 0 ? n_prod : 1) * sizeof(PrecoProduto));
+    char *buffer = malloc((size_t)BLOCO_INDICE * sizeof(Compra) + BLOCO_INDICE * sizeof(Produto));
+    long n_precos = 0, pos = 0, n;
+    const char *regs;
+
+    g->produtos_ativos = g->compras_ativas = g->itens_validos = 0;
+    g->total_vendido = 0;
+    g->tem_mais_caro = 0;
+    while (precos && buffer && (n = obter_registros(tp, pos, BLOCO_INDICE, buffer, &regs)) > 0) {
+        for (long i = 0; i < n; i++) {
+            const Produto *p = (const Produto*)(regs + i * (long)sizeof(Produto));
+            if (p->ativo != 'S') continue;
+            precos[n_precos].id = p->product_id;
+            precos[n_precos].preco = p->price;
+            n_precos++;
+            if (!g->tem_mais_caro || p->price > g->mais_caro.price) { g->mais_caro = *p; g->tem_mais_caro = 1; }
+        }
+        pos += n;
     }
-    int n_indices = tam_idx / sizeof(IndiceCompra);
-    fseek(f_idx, 0, SEEK_SET);
-
-    IndiceCompra *indices = malloc(tam_idx);
-    if (!indices) { printf("ERRO ao alocar memoria para indice.\n"); fclose(f_idx); return; }
+    g->produtos_ativos = n_precos;
 
-    fread(indices, sizeof(IndiceCompra), n_indices, f_idx);
-    fclose(f_idx);
+    pos = 0;
+    while (buffer && (n = obter_registros(tc, pos, BLOCO_INDICE, buffer, &regs)) > 0) {
+        for (long i = 0; i < n; i++)
+            if (regs[i * (long)sizeof(Compra) + offsetof(Compra, ativo)] == 'S') g->compras_ativas++;
+        pos += n;
+    }
 
-    // ETAPA 2: Busca binaria no indice (RAM) para achar o bloco
-    int inicio = 0, fim = n_indices - 1;
-    int idx_bloco = -1;
-    while (inicio <= fim) {
-        int meio = inicio + (fim - inicio) / 2;
-        if (indices[meio].chave <= id) {
-            idx_bloco = meio;
-            inicio = meio + 1;
-        } else {
-            fim = meio - 1;
+    // O total vem dos itens, se o itens.bin aberto e o da geracao de compras
+    TabelaServidor *ti = &g->itens;
+    FILE *fidx = ti->fd >= 0 ? io_fopen(ti->arq_indice, "rb") : NULL;
+    CabecalhoIndice cab;
+    g->itens_atuais = ti->fd < 0 ? tc->tamanho == 0
+                                 : fidx && indice_ler_cabecalho(fidx, &cab) &&
+                                   cab.geracao == g->numero[TABELA_COMPRAS] && cab.tamanho_dados == ti->tamanho &&
+                                   cab.impressao_dados == impressao_dados(ti->fd, ti->tamanho);
+    if (fidx) fclose(fidx);
+    pos = 0;
+    while (g->itens_atuais && precos && buffer && (n = obter_registros(ti, pos, BLOCO_INDICE, buffer, &regs)) > 0) {
+        for (long i = 0; i < n; i++) {
+            const ItemPedido *it = (const ItemPedido*)(regs + i * (long)sizeof(ItemPedido));
+            if (it->ativo != 'S') continue;
+            int64_t id = it->product_id;
+            const PrecoProduto *pp = bsearch(&id, precos, n_precos, sizeof(PrecoProduto), comparar_preco_produto_chave);
+            if (pp) { g->total_vendido += pp->preco * it->quantity; g->itens_validos++; }
         }
+        pos += n;
     }
+    free(buffer);
+    free(precos);
+    g->agregados_prontos = 1;
+    pthread_mutex_unlock(&g->trava_agregados);
+}
 
-    if (idx_bloco == -1) {
-        printf("Compra %lld nao encontrada (fora do range do indice).\n", id);
-        free(indices);
-        return;
+/**
+ * @brief Estado de um produto depois das escritas lote[0..ate) do grupo:
+ * 1 se a ultima delas o insere (ativo, novo ou nao), 0 se o remove e -1 se
+ * nenhuma o toca.
+ */
+static int produto_no_grupo(EscritaPendente *const *lote, int ate, const int *registrada, int64_t produto) {
+    for (int i = ate - 1; i >= 0; i--) {
+        if (!registrada[i]) continue;
+        if (lote[i]->tipo == WAL_INSERIR_PRODUTO && lote[i]->dados.p.product_id == produto) return 1;
+        if (lote[i]->tipo == WAL_REMOVER_PRODUTO && lote[i]->dados.chave == produto) return 0;
     }
+    return -1;
+}
 
-    // ETAPA 3: Acessa o arquivo de dados
-    FILE *f_dados = fopen(arq_dados, "rb");
-    if (!f_dados) { printf("ERRO ao abrir arquivo de dados %s.\n", arq_dados); free(indices); return; }
-
-    fseek(f_dados, indices[idx_bloco].offset, SEEK_SET);
-
-    // ETAPA 4: Busca sequencial dentro do bloco
-    Compra c;
-    int encontrado = 0;
-    for (int i = 0; i < BLOCO_INDICE; i++) {
-        if (fread(&c, sizeof(Compra), 1, f_dados) != 1) break;
-        if (c.order_id == id) {
-            if (c.ativo == 'S') {
-                char datetime_trim[TAM_DATETIME+1]={0};
-                strncpy(datetime_trim, c.order_datetime, TAM_DATETIME);
-                for(int j = strlen(datetime_trim)-1; j >=0 && datetime_trim[j] == ' '; j--) datetime_trim[j] = '\0';
-
-                printf("\n--- COMPRA ENCONTRADA (via indice) ---\n");
-                printf("Order: %lld | Product: %lld | User: %lld | Qty: %d | Date: %s\n",
-                       c.order_id, c.product_id, c.user_id, c.quantity, datetime_trim);
-                encontrado = 1;
-            } else {
-                printf("Compra %lld existe mas foi removida.\n", id);
-                encontrado = 2;
+/**
+ * @brief Confirma um grupo de escritas de varias conexoes: um unico
+ * wal_confirmar_grupo (um fsync e, por tabela, uma nova geracao dos .bin) e
+ * uma unica geracao nova do servidor. Preenche a resposta de cada escrita.
+ * Chamada pelo lider, sem a trava do grupo.
+ */
+void servidor_confirmar_grupo(EstadoServidor *e, EscritaPendente *const *lote, int n) {
+    int registrada[WAL_GRUPO_MAX], resultados[WAL_GRUPO_MAX], acrescenta[WAL_GRUPO_MAX];
+    int64_t chaves[N_TABELAS][WAL_GRUPO_MAX];
+    int64_t *inseridas[N_TABELAS] = {chaves[TABELA_PRODUTOS], chaves[TABELA_COMPRAS]};
+    int n_inseridas[N_TABELAS] = {0, 0}, alterada[N_TABELAS] = {0, 0}, n_ops = 0;
+
+    pthread_mutex_lock(&e->trava_escritor);
+    GeracaoServidor *g = geracao_fixar(e); // A atual nao muda enquanto a trava estiver com este escritor
+    for (int i = 0; i < n; i++) {
+        EscritaPendente *w = lote[i];
+        registrada[i] = 0;
+        if (w->tipo == WAL_INSERIR_COMPRA) {
+            // Chave estrangeira: o produto precisa estar ativo depois das escritas anteriores do grupo
+            int estado = produto_no_grupo(lote, i, registrada, w->dados.c.product_id);
+            Produto p;
+            if (estado == 0 || (estado < 0 && servidor_buscar(&g->produtos, w->dados.c.product_id, (char*)&p) != 1)) {
+                w->resposta = "PRODUTO_INVALIDO";
+                continue;
             }
-            break;
         }
-        if (c.order_id > id) break;
+        // Uma chave ausente (nem removida) na geracao fixada acrescenta um registro ao .bin
+        union { Produto p; Compra c; } atual;
+        acrescenta[i] = w->tipo == WAL_INSERIR_PRODUTO
+                            ? servidor_buscar(&g->produtos, w->dados.p.product_id, (char*)&atual) == -1
+                      : w->tipo == WAL_INSERIR_COMPRA
+                            ? servidor_buscar(&g->compras, w->dados.c.order_id, (char*)&atual) == -1
+                            : 0;
+        wal_registrar(w->tipo, &w->dados);
+        registrada[i] = 1;
+        resultados[n_ops++] = 0;
     }
-
-    if (encontrado == 0) {
-        printf("Compra %lld nao encontrada no bloco verificado.\n", id);
+    int confirmado = wal_confirmar_grupo(resultados);
+
+    for (int i = 0, op = 0; i < n; i++) {
+        if (!registrada[i]) continue;
+        EscritaPendente *w = lote[i];
+        int insercao = (w->tipo == WAL_INSERIR_PRODUTO || w->tipo == WAL_INSERIR_COMPRA);
+        int t = (w->tipo == WAL_INSERIR_PRODUTO || w->tipo == WAL_REMOVER_PRODUTO) ? TABELA_PRODUTOS : TABELA_COMPRAS;
+        int64_t chave = w->tipo == WAL_INSERIR_PRODUTO ? w->dados.p.product_id
+                      : w->tipo == WAL_INSERIR_COMPRA ? w->dados.c.order_id : w->dados.chave;
+        int aplicada = confirmado && resultados[op++];
+        if (!confirmado) w->resposta = "ERRO falha ao gravar o log";
+        else if (aplicada) w->resposta = "OK";
+        else w->resposta = insercao ? "DUPLICADO" : "NAO_ENCONTRADO";
+        if (!aplicada) continue;
+        alterada[t] = 1;
+        // A ultima escrita aplicada de cada chave decide se ela fica acrescentada
+        int j = 0;
+        while (j < n_inseridas[t] && inseridas[t][j] != chave) j++;
+        if (j < n_inseridas[t] && !insercao) inseridas[t][j] = inseridas[t][--n_inseridas[t]];
+        else if (j == n_inseridas[t] && insercao && acrescenta[i]) inseridas[t][n_inseridas[t]++] = chave;
     }
-
-    fclose(f_dados);
-    free(indices);
+    if (alterada[TABELA_PRODUTOS] || alterada[TABELA_COMPRAS]) {
+        for (int t = 0; t < N_TABELAS; t++) qsort(inseridas[t], (size_t)n_inseridas[t], sizeof(int64_t), comparar_int64);
+        servidor_recarregar_apos_escrita(e, g, alterada, inseridas, n_inseridas);
+    }
+    geracao_soltar(e, g);
+    e->grupos++;
+    e->escritas_agrupadas += n;
+    pthread_mutex_unlock(&e->trava_escritor);
 }
 
-// --- CONSULTAS ESPECIFICAS ---
+/**
+ * @brief Atende os comandos de escrita. A escrita entra na fila do grupo e
+ * a conexao espera a resposta; se nenhum lider estiver gravando, ela mesma
+ * lidera: espera a janela e confirma o que estiver na fila
+ * (servidor_confirmar_grupo). As operacoes passam pelo WAL como no menu
+ * (wal_confirmar_grupo ja serializa com escritores de outros processos);
+ * depois uma nova geracao e publicada com os indices derivados da anterior
+ * (servidor_recarregar_apos_escrita), sem varrer nem recriar o .idx.
+ * Leitores nao esperam por nada disso: continuam na geracao que fixaram.
+ */
+void servidor_escrever(EstadoServidor *e, const char *comando, const char *linha, FILE *saida) {
+    EscritaPendente w;
+    memset(&w, 0, sizeof(w));
+    TipoOperacaoWAL tipo;
+    long long id = 0;
+
+    if (strcmp(comando, "INSERIR_PRODUTO") == 0) {
+        tipo = WAL_INSERIR_PRODUTO;
+        if (sscanf(linha, "%*s %lld\t%49[^\t]\t%lf\t%99[^\r\n]", &id, w.dados.p.brand, &w.dados.p.price,
+                   w.dados.p.category_alias) != 4) {
+            fprintf(saida, "ERRO uso: %s <id>\\t<brand>\\t<price>\\t<category>\n", comando);
+            return;
+        }
+        w.dados.p.product_id = id;
+        pad_string(w.dados.p.brand, TAM_BRAND);
+        pad_string(w.dados.p.category_alias, TAM_CATEGORY);
+        w.dados.p.ativo = 'S';
+        w.dados.p.newline = '\n';
+    } else if (strcmp(comando, "INSERIR_COMPRA") == 0) {
+        tipo = WAL_INSERIR_COMPRA;
+        long long produto = 0;
+        if (sscanf(linha, "%*s %lld\t%lld\t%lld\t%d\t%29[^\r\n]", &w.dados.c.order_id, &produto, &w.dados.c.user_id,
+                   &w.dados.c.quantity, w.dados.c.order_datetime) != 5 ||
+            w.dados.c.order_id <= 0 || w.dados.c.quantity <= 0 ||
+            !validar_e_formatar_data(w.dados.c.order_datetime, TAM_DATETIME)) {
+            fprintf(saida, "ERRO uso: %s <order>\\t<product>\\t<user>\\t<qty>\\t<YYYY-MM-DD HH:MM:SS>\n", comando);
+            return;
+        }
+        w.dados.c.product_id = produto;
+        pad_string(w.dados.c.order_datetime, TAM_DATETIME);
+        w.dados.c.ativo = 'S';
+        w.dados.c.newline = '\n';
+    } else {
+        tipo = (comando[8] == 'P') ? WAL_REMOVER_PRODUTO : WAL_REMOVER_COMPRA;
+        if (sscanf(linha, "%*s %lld", &id) != 1) { fprintf(saida, "ERRO uso: %s <id>\n", comando); return; }
+        w.dados.chave = id;
+    }
+    w.tipo = tipo;
+
+    pthread_mutex_lock(&e->trava_grupo);
+    *e->fim_escritas = &w;
+    e->fim_escritas = &w.proxima;
+    while (!w.pronta) {
+        if (e->lider_ativo) { pthread_cond_wait(&e->grupo_confirmado, &e->trava_grupo); continue; }
+        e->lider_ativo = 1;
+        if (e->janela_us > 0) {
+            pthread_mutex_unlock(&e->trava_grupo);
+            struct timespec janela = {e->janela_us / 1000000, (e->janela_us % 1000000) * 1000};
+            nanosleep(&janela, NULL); // Outras conexoes entram no grupo
+            pthread_mutex_lock(&e->trava_grupo);
+        }
+        EscritaPendente *lote[WAL_GRUPO_MAX];
+        int n = 0;
+        while (e->escritas && n < WAL_GRUPO_MAX) {
+            lote[n++] = e->escritas;
+            e->escritas = e->escritas->proxima;
+        }
+        if (!e->escritas) e->fim_escritas = &e->escritas;
+        pthread_mutex_unlock(&e->trava_grupo);
+        servidor_confirmar_grupo(e, lote, n);
+        pthread_mutex_lock(&e->trava_grupo);
+        for (int i = 0; i < n; i++) lote[i]->pronta = 1;
+        e->lider_ativo = 0;
+        pthread_cond_broadcast(&e->grupo_confirmado);
+    }
+    pthread_mutex_unlock(&e->trava_grupo);
+    fprintf(saida, "%s\n", w.resposta);
+}
 
 /**
- * @brief Encontra o produto mais caro fazendo uma varredura sequencial
- * no arquivo de produtos.
+ * @brief Interpreta e responde uma linha do protocolo. As leituras usam a
+ * geracao fixada no inicio da requisicao.
+ * @return 0 se a conexao deve ser encerrada (SAIR), 1 caso contrario.
  */
-void consulta_produto_mais_caro() {
-    FILE *f = fopen(ARQ_PRODUTOS_BIN, "rb");
-    if (!f) { printf("ERRO ao abrir %s\n", ARQ_PRODUTOS_BIN); return; }
-    Produto p, mais_caro = {0};
-    double max_preco = -1;
-    int encontrado = 0;
-
-    while (fread(&p, sizeof(Produto), 1, f) == 1) {
-        if (p.ativo == 'S') {
-            if (!encontrado || p.price > max_preco) {
-                 max_preco = p.price;
-                 mais_caro = p;
-                 encontrado = 1;
-            }
+int servidor_responder(EstadoServidor *e, char *linha, FILE *saida) {
+    char comando[32] = {0};
+    long long a = 0, b = 0, limite = SERVIDOR_LIMITE_FAIXA;
+    int campos = sscanf(linha, "%31s %lld %lld %lld", comando, &a, &b, &limite);
+    if (campos <= 0) return 1;
+    if (strcmp(comando, "SAIR") == 0) return 0;
+
+    unsigned long long t0 = instr_inicio();
+    if (strncmp(comando, "INSERIR_", 8) == 0 || strncmp(comando, "REMOVER_", 8) == 0) {
+        if (strcmp(comando + 8, "PRODUTO") == 0 || strcmp(comando + 8, "COMPRA") == 0) {
+            servidor_escrever(e, comando, linha, saida);
+        } else {
+            fprintf(saida, "ERRO comando desconhecido: %s\n", comando);
         }
+        instr_registrar(OP_REQUISICAO_SERVIDOR, t0);
+        return 1;
     }
-    fclose(f);
-    if (encontrado) {
-        // "Trim"
-        char brand_trim[TAM_BRAND+1]={0};
-        char category_trim[TAM_CATEGORY+1]={0};
-        strncpy(brand_trim, mais_caro.brand, TAM_BRAND);
-        strncpy(category_trim, mais_caro.category_alias, TAM_CATEGORY);
-        for(int i = strlen(brand_trim)-1; i >=0 && brand_trim[i] == ' '; i--) brand_trim[i] = '\0';
-        for(int i = strlen(category_trim)-1; i >=0 && category_trim[i] == ' '; i--) category_trim[i] = '\0';
 
-        printf("\n--- PRODUTO MAIS CARO ---\n");
-        printf("ID: %lld | Brand: %s | Price: %.2f | Category: %s\n",
-               mais_caro.product_id, brand_trim, mais_caro.price, category_trim);
+    GeracaoServidor *g = geracao_fixar(e);
+    if (strcmp(comando, "PING") == 0) {
+        fprintf(saida, "PONG\n");
+    } else if (strcmp(comando, "PRODUTO") == 0 || strcmp(comando, "COMPRA") == 0) {
+        int produto = (comando[0] == 'P');
+        union { Produto p; Compra c; } reg;
+        int r = (campos < 2) ? 0 : servidor_buscar(produto ? &g->produtos : &g->compras, (int64_t)a, (char*)&reg);
+        if (r == 0) fprintf(saida, "ERRO uso: %s <id>\n", comando);
+        else if (r == -1) fprintf(saida, "NAO_ENCONTRADO\n");
+        else if (r == -2) fprintf(saida, "REMOVIDO\n");
+        else if (produto) escrever_produto(saida, "OK ", &reg.p);
+        else escrever_compra(saida, "OK ", &reg.c);
+    } else if (strcmp(comando, "FAIXA_PRODUTOS") == 0 || strcmp(comando, "FAIXA_COMPRAS") == 0) {
+        if (campos < 3) fprintf(saida, "ERRO uso: %s <de> <ate> [limite]\n", comando);
+        else servidor_faixa(comando[6] == 'P' ? &g->produtos : &g->compras, (int64_t)a, (int64_t)b, (long)limite, saida);
+    } else if (strcmp(comando, "TOTAL_VENDIDO") == 0) {
+        servidor_calcular_agregados(g);
+        if (!g->itens_atuais) fprintf(saida, "ERRO itens desatualizados\n");
+        else fprintf(saida, "OK %.2f %ld\n", g->total_vendido, g->itens_validos);
+    } else if (strcmp(comando, "MAIS_CARO") == 0) {
+        servidor_calcular_agregados(g);
+        if (g->tem_mais_caro) escrever_produto(saida, "OK ", &g->mais_caro);
+        else fprintf(saida, "NAO_ENCONTRADO\n");
+    } else if (strcmp(comando, "CONTAGEM") == 0) {
+        servidor_calcular_agregados(g);
+        fprintf(saida, "OK %ld %ld\n", g->produtos_ativos, g->compras_ativas);
+    } else if (strcmp(comando, "GERACAO") == 0) {
+        fprintf(saida, "OK %llu %llu\n", (unsigned long long)g->numero[TABELA_PRODUTOS],
+                (unsigned long long)g->numero[TABELA_COMPRAS]);
     } else {
-        printf("Nenhum produto ativo encontrado.\n");
+        fprintf(saida, "ERRO comando desconhecido: %s\n", comando);
+    }
+    geracao_soltar(e, g);
+    instr_registrar(OP_REQUISICAO_SERVIDOR, t0);
+    return 1;
+}
+
+void servidor_atender_conexao(EstadoServidor *e, int fd) {
+    FILE *entrada = fdopen(fd, "r");
+    FILE *saida = fdopen(dup(fd), "w");
+    if (!entrada || !saida) {
+        if (entrada) fclose(entrada); else close(fd);
+        if (saida) fclose(saida);
+        return;
+    }
+    char linha[512];
+    while (fgets(linha, sizeof(linha), entrada)) {
+        if (!servidor_responder(e, linha, saida)) break;
+        if (fflush(saida) != 0) break; // Cliente desconectou
     }
+    fclose(saida);
+    fclose(entrada);
+}
+
+void *servidor_trabalhador(void *arg) {
+    EstadoServidor *e = arg;
+    for (;;) {
+        pthread_mutex_lock(&e->trava_fila);
+        while (e->fila_n == 0) pthread_cond_wait(&e->fila_nao_vazia, &e->trava_fila);
+        int fd = e->fila[e->fila_inicio];
+        e->fila_inicio = (e->fila_inicio + 1) % SERVIDOR_FILA_MAX;
+        e->fila_n--;
+        pthread_cond_signal(&e->fila_nao_cheia);
+        pthread_mutex_unlock(&e->trava_fila);
+
+        if (fd < 0) break; // Sinal de encerramento
+        servidor_atender_conexao(e, fd);
+    }
+    return NULL;
+}
+
+void servidor_enfileirar(EstadoServidor *e, int fd) {
+    pthread_mutex_lock(&e->trava_fila);
+    while (e->fila_n == SERVIDOR_FILA_MAX) pthread_cond_wait(&e->fila_nao_cheia, &e->trava_fila);
+    e->fila[(e->fila_inicio + e->fila_n) % SERVIDOR_FILA_MAX] = fd;
+    e->fila_n++;
+    pthread_cond_signal(&e->fila_nao_vazia);
+    pthread_mutex_unlock(&e->trava_fila);
 }
 
 /**
- * @brief Calcula o valor total vendido.
- * Esta funcao simula um "JOIN" de banco de dados manualmente.
- * 1. Le o arquivo de compras sequencialmente.
- * 2. Para cada compra ativa, ela usa a 'pesquisa_binaria' (rapida, O(logN))
- * para encontrar o preco do produto correspondente no arquivo de produtos.
- * 3. Multiplica preco * quantidade e soma ao total.
+ * @brief Executa o servidor ate receber SIGINT/SIGTERM.
+ * @return Codigo de saida do processo.
  */
-void consulta_valor_total_vendido() {
-    FILE *f_comp = fopen(ARQ_COMPRAS_BIN, "rb");
-    if (!f_comp) { printf("ERRO ao abrir arquivo de compras %s\n", ARQ_COMPRAS_BIN); return; }
-
-    printf("Calculando valor total vendido (pode demorar)...\n");
+int executar_servidor(const char *caminho_socket, int n_threads, int usar_mmap, long janela_us) {
+    EstadoServidor *e = calloc(1, sizeof(EstadoServidor));
+    if (!e) return 1;
+    e->usar_mmap = usar_mmap;
+    e->janela_us = janela_us;
+    e->fim_escritas = &e->escritas;
+    e->atual = carregar_geracao_servidor(usar_mmap, 1);
+    if (!e->atual) { free(e); return 1; }
+    pthread_mutex_init(&e->trava_geracao, NULL);
+    pthread_mutex_init(&e->trava_escritor, NULL);
+    pthread_mutex_init(&e->trava_fila, NULL);
+    pthread_cond_init(&e->fila_nao_vazia, NULL);
+    pthread_cond_init(&e->fila_nao_cheia, NULL);
+    pthread_mutex_init(&e->trava_grupo, NULL);
+    pthread_cond_init(&e->grupo_confirmado, NULL);
+
+    int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un endereco;
+    memset(&endereco, 0, sizeof(endereco));
+    endereco.sun_family = AF_UNIX;
+    snprintf(endereco.sun_path, sizeof(endereco.sun_path), "%s", caminho_socket);
+    unlink(caminho_socket);
+    if (srv < 0 || bind(srv, (struct sockaddr*)&endereco, sizeof(endereco)) != 0 || listen(srv, SERVIDOR_FILA_MAX) != 0) {
+        perror("ERRO ao criar o socket");
+        if (srv >= 0) close(srv);
+        geracao_soltar(e, e->atual);
+        free(e);
+        return 1;
+    }
 
-    double total = 0;
-    Compra c;
-    int compras_contadas = 0;
-    int produtos_nao_encontrados = 0;
-
-    // 1. Varre o arquivo de compras
-    while (fread(&c, sizeof(Compra), 1, f_comp) == 1) {
-        if (c.ativo != 'S') continue;
-
-        int64_t id_produto_busca = (int64_t)c.product_id;
-
-        // 2. Para cada compra, faz uma pesquisa binaria no arquivo de produtos
-        long offset_prod = pesquisa_binaria(
-            ARQ_PRODUTOS_BIN, sizeof(Produto), comparar_produto_chave,
-            &id_produto_busca, offsetof(Produto, ativo)
-        );
-
-        if (offset_prod >= 0) {
-            // Se encontrou o produto e ele esta ativo, busca o preco
-            FILE *f_prod_leitura = fopen(ARQ_PRODUTOS_BIN, "rb");
-            if (f_prod_leitura) {
-                Produto p_temp;
-                fseek(f_prod_leitura, offset_prod, SEEK_SET);
-                if(fread(&p_temp, sizeof(Produto), 1, f_prod_leitura) == 1) {
-                    // 3. Soma ao total
-                    total += p_temp.price * c.quantity;
-                    compras_contadas++;
-                } else {
-                    produtos_nao_encontrados++;
-                }
-                fclose(f_prod_leitura);
-            } else {
-                 produtos_nao_encontrados++;
-            }
-        } else {
-             // Produto nao encontrado ou removido (offset -1 ou -2)
-             produtos_nao_encontrados++;
+    // Sem SA_RESTART: o accept e interrompido pelo sinal e o laco termina
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sinal_encerrar_servidor;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN); // Cliente que desconecta nao derruba o servidor
+
+    // Sem todas as trabalhadoras e o vigia o servidor nao chega a aceitar
+    // conexoes: as threads ja criadas sao encerradas pelo caminho normal
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    pthread_t vigia;
+    int criadas = 0;
+    while (threads && criadas < n_threads &&
+           pthread_create(&threads[criadas], NULL, servidor_trabalhador, e) == 0) criadas++;
+    int com_vigia = criadas == n_threads && pthread_create(&vigia, NULL, servidor_vigia_geracoes, e) == 0;
+    if (!com_vigia) {
+        fprintf(stderr, "ERRO ao criar as threads do servidor (%d de %d trabalhadoras)\n", criadas, n_threads);
+        servidor_encerrar = 1;
+    } else
+        fprintf(stderr, "Servidor ouvindo em %s (%d threads, %ld+%ld entradas de indice%s).\n",
+            caminho_socket, n_threads, (long)e->atual->produtos.indice.cab.n_entradas,
+            (long)e->atual->compras.indice.cab.n_entradas,
+            usar_mmap ? ", mmap" : "");
+    while (!servidor_encerrar) {
+        int cliente = accept(srv, NULL, NULL);
+        if (cliente < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
         }
+        servidor_enfileirar(e, cliente);
     }
-    fclose(f_comp);
 
-    printf("\n--- VALOR TOTAL VENDIDO ---\n");
-    printf("Total: R$ %.2f\n", total);
-    printf("(Calculado a partir de %d compras validas. %d produtos/compras nao encontrados/invalidos/removidos)\n",
-           compras_contadas, produtos_nao_encontrados);
+    fprintf(stderr, "Encerrando servidor...\n");
+    close(srv);
+    unlink(caminho_socket);
+    for (int i = 0; i < criadas; i++) servidor_enfileirar(e, -1);
+    for (int i = 0; i < criadas; i++) pthread_join(threads[i], NULL);
+    if (com_vigia) pthread_join(vigia, NULL);
+    free(threads);
+    geracao_soltar(e, e->atual);
+    fprintf(stderr, "%ld geracoes liberadas.\n", e->geracoes_liberadas);
+    if (e->grupos > 0)
+        fprintf(stderr, "%ld escritas confirmadas em %ld grupos (%.1f por fsync).\n", e->escritas_agrupadas,
+                e->grupos, (double)e->escritas_agrupadas / (double)e->grupos);
+    free(e);
+    return com_vigia ? 0 : 1;
 }
 
 // --- MENUS ---
+void menu_estatisticas() {
+    imprimir_estatisticas(stdout);
+    printf("\nZerar as estatisticas (s/n)? ");
+    char resp = getchar();
+    if (resp != '\n') while (getchar() != '\n');
+    if (resp == 's' || resp == 'S') {
+        zerar_estatisticas();
+        printf("Estatisticas zeradas.\n");
+    }
+}
+
 void menu_consultas() {
     int opcao;
     do {
         printf("\n--- CONSULTAS ESPECIFICAS ---\n");
         printf("1. Produto mais caro\n");
         printf("2. Valor total vendido\n");
-        printf("3. Voltar\n");
+        printf("3. Top K (mais caros, maior receita, usuarios com maior gasto)\n");
+        printf("4. Vendas agrupadas (categoria, brand, usuario, produto ou mes)\n");
+        printf("5. Voltar\n");
         opcao = ler_inteiro("Opcao: ");
 
         switch (opcao) {
             case 1: consulta_produto_mais_caro(); break;
             case 2: consulta_valor_total_vendido(); break;
-            case 3: break;
+            case 3: {
+                int metrica = ler_inteiro("Metrica (1 = preco, 2 = receita por produto, 3 = gasto por usuario): ");
+                if (metrica < 1 || metrica > 3) { printf("Metrica invalida\n"); break; }
+                int k = ler_inteiro("K: ");
+                if (k <= 0) { printf("K deve ser positivo\n"); break; }
+                consulta_top_k((MetricaTopK)(metrica - 1), k);
+                break;
+            }
+            case 4: {
+                int campo = ler_inteiro("Agrupar por (1 = categoria, 2 = brand, 3 = usuario, 4 = produto, 5 = mes): ");
+                if (campo < 1 || campo > 5) { printf("Campo invalido\n"); break; }
+                printf("\n--- VENDAS AGRUPADAS (20 maiores receitas, CSV) ---\n");
+                consulta_agrupar((CampoGrupo)(campo - 1), ORDEM_RECEITA, 20, FORMATO_CSV, NULL, AGRUPAR_MEMORIA_PADRAO);
+                break;
+            }
+            case 5: break;
             default: printf("Opcao invalida\n");
         }
-    } while (opcao != 3);
+    } while (opcao != 5);
 }
 
 void menu_produtos() {
@@ -1117,23 +8403,18 @@ void menu_produtos() {
     int reconstruir = 0;
 
     // Verifica se os arquivos .bin e .idx existem na inicializacao
-    FILE *f = fopen(ARQ_PRODUTOS_BIN, "rb");
+    FILE *f = io_fopen(ARQ_PRODUTOS_BIN, "rb");
     if (!f) {
         printf("Arquivo %s nao encontrado. Pre-processando...\n", ARQ_PRODUTOS_BIN);
         pre_processar_produtos(ARQ_CSV, ARQ_PRODUTOS_BIN);
         reconstruir = 1; // Precisa criar o indice pela primeira vez
     } else {
         fclose(f);
-    }
-
-    f = fopen(ARQ_PRODUTOS_IDX, "rb");
-    if (!f) {
-        if (fopen(ARQ_PRODUTOS_BIN,"rb") != NULL) { // So reconstroi se o .bin existir
-             printf("Arquivo de indice %s nao encontrado.\n", ARQ_PRODUTOS_IDX);
-             reconstruir = 1; // Precisa criar o indice
+        // O .bin existe: confere em O(1), pelo cabecalho, se o indice e dele
+        if (!indice_atualizado(ARQ_PRODUTOS_IDX, ARQ_PRODUTOS_BIN, TABELA_PRODUTOS)) {
+            printf("Arquivo de indice %s ausente, invalido ou desatualizado.\n", ARQ_PRODUTOS_IDX);
+            reconstruir = 1;
         }
-    } else {
-        fclose(f);
     }
 
     do {
@@ -1141,13 +8422,12 @@ void menu_produtos() {
         // apos uma insercao/remocao), o indice e recriado.
         if (reconstruir) {
             printf("\n(Sistema: Reconstruindo indice %s...)\n", ARQ_PRODUTOS_IDX);
-            criar_indice(ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX, sizeof(Produto), sizeof(IndiceProduto),
-                         extrai_chave_produto, NULL, 0, offsetof(Produto, ativo));
+            criar_indice_produto(ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX);
             reconstruir = 0; // Zera a flag
         }
 
         printf("\n--- MENU PRODUTOS ---\n");
-        printf("1. Mostrar todos\n");
+        printf("1. Mostrar (paginado)\n");
         printf("2. Inserir produto\n");
         printf("3. Remover produto\n");
         printf("4. Consultar produto (binaria)\n");
@@ -1157,7 +8437,12 @@ void menu_produtos() {
         opcao = ler_inteiro("Opcao: ");
 
         switch (opcao) {
-            case 1: mostrar_produtos(ARQ_PRODUTOS_BIN); break;
+            case 1: {
+                long inicio = (long)ler_long_long("Primeiro registro (0 = inicio): ");
+                long quantidade = (long)ler_long_long("Quantidade (0 = todos): ");
+                mostrar_produtos(ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX, inicio, quantidade);
+                break;
+            }
             case 2:
                 // Se a insercao foi bem-sucedida, ativa a flag
                 if (inserir_produto(ARQ_PRODUTOS_BIN)) reconstruir = 1;
@@ -1193,46 +8478,46 @@ void menu_compras() {
     int reconstruir = 0;
 
     // Verifica se os arquivos .bin e .idx existem na inicializacao
-    FILE *f = fopen(ARQ_COMPRAS_BIN, "rb");
+    FILE *f = io_fopen(ARQ_COMPRAS_BIN, "rb");
     if (!f) {
         printf("Arquivo %s nao encontrado. Pre-processando...\n", ARQ_COMPRAS_BIN);
         pre_processar_compras(ARQ_CSV, ARQ_COMPRAS_BIN);
         reconstruir = 1;
     } else {
         fclose(f);
-    }
-
-     f = fopen(ARQ_COMPRAS_IDX, "rb");
-    if (!f) {
-        if (fopen(ARQ_COMPRAS_BIN,"rb") != NULL) {
-             printf("Arquivo de indice %s nao encontrado.\n", ARQ_COMPRAS_IDX);
-             reconstruir = 1;
+        // O .bin existe: confere em O(1), pelo cabecalho, se o indice e dele
+        if (!indice_atualizado(ARQ_COMPRAS_IDX, ARQ_COMPRAS_BIN, TABELA_COMPRAS)) {
+            printf("Arquivo de indice %s ausente, invalido ou desatualizado.\n", ARQ_COMPRAS_IDX);
+            reconstruir = 1;
         }
-    } else {
-        fclose(f);
     }
 
     do {
         // Logica de reconstrucao, igual ao menu_produtos
         if (reconstruir) {
             printf("\n(Sistema: Reconstruindo indice %s...)\n", ARQ_COMPRAS_IDX);
-            criar_indice(ARQ_COMPRAS_BIN, ARQ_COMPRAS_IDX, sizeof(Compra), sizeof(IndiceCompra),
-                         NULL, extrai_chave_compra, 1, offsetof(Compra, ativo));
+            criar_indice_compra(ARQ_COMPRAS_BIN, ARQ_COMPRAS_IDX);
             reconstruir = 0; // Zera a flag
         }
 
         printf("\n--- MENU COMPRAS ---\n");
-        printf("1. Mostrar todas\n");
+        printf("1. Mostrar (paginado)\n");
         printf("2. Inserir compra\n");
         printf("3. Remover compra\n");
         printf("4. Consultar compra (binaria)\n");
         printf("5. Consultar compra (com indice)\n");
         printf("6. Recriar do CSV\n");
-        printf("7. Voltar\n");
+        printf("7. Itens do pedido\n");
+        printf("8. Voltar\n");
         opcao = ler_inteiro("Opcao: ");
 
         switch (opcao) {
-            case 1: mostrar_compras(ARQ_COMPRAS_BIN); break;
+            case 1: {
+                long inicio = (long)ler_long_long("Primeiro registro (0 = inicio): ");
+                long quantidade = (long)ler_long_long("Quantidade (0 = todas): ");
+                mostrar_compras(ARQ_COMPRAS_BIN, ARQ_COMPRAS_IDX, inicio, quantidade);
+                break;
+            }
             case 2:
                 // Se a insercao foi bem-sucedida, ativa a flag
                 if (inserir_compra(ARQ_COMPRAS_BIN)) reconstruir = 1;
@@ -1256,13 +8541,352 @@ void menu_compras() {
                  }
                  break;
             }
-            case 7: break;
+            case 7: consultar_pedido(ARQ_ITENS_IDX, ARQ_ITENS_BIN); break;
+            case 8: break;
             default: printf("Opcao invalida\n");
         }
-    } while (opcao != 7);
+    } while (opcao != 8);
+}
+
+// --- LINHA DE COMANDO ---
+
+#define MOSTRAR_LIMITE_PADRAO 20 // Linhas por pagina de "mostrar" sem --limit
+
+/**
+ * @brief Trata os modos nao interativos (argumentos na linha de comando).
+ * @return Codigo de saida do processo.
+ */
+int executar_comando(int argc, char **argv) {
+    if (strcmp(argv[1], "servidor") == 0) {
+        const char *socket_path = ARQ_SOCKET_PADRAO;
+        int n_threads = SERVIDOR_THREADS_PADRAO, usar_mmap = 0;
+        long janela_us = SERVIDOR_JANELA_GRUPO_US;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) socket_path = argv[++i];
+            else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) n_threads = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--mmap") == 0) usar_mmap = 1;
+            else if (strcmp(argv[i], "--janela-us") == 0 && i + 1 < argc) janela_us = atol(argv[++i]);
+            else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+        }
+        if (n_threads <= 0) n_threads = SERVIDOR_THREADS_PADRAO;
+        if (janela_us < 0) janela_us = 0;
+        return executar_servidor(socket_path, n_threads, usar_mmap, janela_us);
+    }
+    if (strcmp(argv[1], "mostrar") == 0 && argc >= 3) {
+        long deslocamento = 0, limite = MOSTRAR_LIMITE_PADRAO;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--offset") == 0 && i + 1 < argc) deslocamento = atol(argv[++i]);
+            else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) limite = atol(argv[++i]);
+            else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+        }
+        if (strcmp(argv[2], "produtos") == 0) mostrar_produtos(ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX, deslocamento, limite);
+        else if (strcmp(argv[2], "compras") == 0) mostrar_compras(ARQ_COMPRAS_BIN, ARQ_COMPRAS_IDX, deslocamento, limite);
+        else { fprintf(stderr, "Tabela desconhecida: %s\n", argv[2]); return 1; }
+        return 0;
+    }
+    if (strcmp(argv[1], "agregados") == 0 && argc >= 3) {
+        if (strcmp(argv[2], "verificar") == 0) return agregados_verificar() ? 0 : 1;
+        if (strcmp(argv[2], "reconstruir") == 0) {
+            int trava = trava_escrita_adquirir();
+            int ok = agregados_reconstruir();
+            trava_escrita_liberar(trava);
+            printf(ok ? "Agregados reconstruidos.\n" : "ERRO ao reconstruir os agregados.\n");
+            return ok ? 0 : 1;
+        }
+        fprintf(stderr, "Use: agregados verificar|reconstruir\n");
+        return 1;
+    }
+    if (strcmp(argv[1], "topk") == 0 && argc >= 3) {
+        int k = 10;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--k") == 0 && i + 1 < argc) k = atoi(argv[++i]);
+            else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+        }
+        if (k <= 0) { fprintf(stderr, "K deve ser positivo\n"); return 1; }
+        if (strcmp(argv[2], "preco") == 0) consulta_top_k(TOPK_PRECO, k);
+        else if (strcmp(argv[2], "receita") == 0) consulta_top_k(TOPK_RECEITA, k);
+        else if (strcmp(argv[2], "usuarios") == 0) consulta_top_k(TOPK_GASTO_USUARIO, k);
+        else { fprintf(stderr, "Metrica desconhecida: %s\n", argv[2]); return 1; }
+        return 0;
+    }
+    if (strcmp(argv[1], "agrupar") == 0 && argc >= 3) {
+        static const char *campos[] = {"categoria", "brand", "usuario", "produto", "mes"};
+        static const char *ordens[] = {"nenhuma", "receita", "unidades", "pedidos", "grupo"};
+        int campo = -1, ordem = ORDEM_RECEITA;
+        long limite = 0;
+        FormatoExportacao formato = FORMATO_CSV;
+        const char *destino = NULL;
+        size_t memoria = AGRUPAR_MEMORIA_PADRAO;
+        for (int c = 0; c < 5; c++) if (strcmp(argv[2], campos[c]) == 0) campo = c;
+        if (campo < 0) { fprintf(stderr, "Campo desconhecido: %s\n", argv[2]); return 1; }
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--ordenar") == 0 && i + 1 < argc) {
+                i++;
+                ordem = -1;
+                for (int o = 0; o < 5; o++) if (strcmp(argv[i], ordens[o]) == 0) ordem = o;
+                if (ordem < 0) { fprintf(stderr, "Ordem desconhecida: %s\n", argv[i]); return 1; }
+            }
+            else if (strcmp(argv[i], "--limite") == 0 && i + 1 < argc) limite = atol(argv[++i]);
+            else if (strcmp(argv[i], "--formato") == 0 && i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "csv") == 0) formato = FORMATO_CSV;
+                else if (strcmp(argv[i], "ndjson") == 0) formato = FORMATO_NDJSON;
+                else { fprintf(stderr, "Formato desconhecido: %s\n", argv[i]); return 1; }
+            }
+            else if (strcmp(argv[i], "--saida") == 0 && i + 1 < argc) destino = argv[++i];
+            else if (strcmp(argv[i], "--memoria") == 0 && i + 1 < argc) memoria = (size_t)atol(argv[++i]) << 20;
+            else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+        }
+        return consulta_agrupar((CampoGrupo)campo, (OrdemGrupos)ordem, limite, formato, destino, memoria) ? 0 : 1;
+    }
+    if (strcmp(argv[1], "exportar") == 0 && argc >= 3) {
+        FormatoExportacao formato = FORMATO_CSV;
+        const char *destino = NULL;
+        int64_t de = INT64_MIN, ate = INT64_MAX;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--formato") == 0 && i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "csv") == 0) formato = FORMATO_CSV;
+                else if (strcmp(argv[i], "ndjson") == 0) formato = FORMATO_NDJSON;
+                else { fprintf(stderr, "Formato desconhecido: %s\n", argv[i]); return 1; }
+            }
+            else if (strcmp(argv[i], "--saida") == 0 && i + 1 < argc) destino = argv[++i];
+            else if (strcmp(argv[i], "--de") == 0 && i + 1 < argc) de = atoll(argv[++i]);
+            else if (strcmp(argv[i], "--ate") == 0 && i + 1 < argc) ate = atoll(argv[++i]);
+            else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+        }
+        ResultadoExportacao r;
+        int ok;
+        if (strcmp(argv[2], "produtos") == 0) ok = exportar_produtos(ARQ_PRODUTOS_BIN, destino, formato, de, ate, &r);
+        else if (strcmp(argv[2], "compras") == 0) ok = exportar_compras(ARQ_COMPRAS_BIN, destino, formato, de, ate, &r);
+        else { fprintf(stderr, "Tabela desconhecida: %s\n", argv[2]); return 1; }
+        if (!ok) { fprintf(stderr, "ERRO ao exportar %s\n", argv[2]); return 1; }
+        double mb = 1024.0 * 1024.0, s = r.segundos > 0 ? r.segundos : 1e-9;
+        fprintf(stderr, "Exportados %lld registros em %.3f s: lidos %.1f MB (%.1f MB/s), gravados %.1f MB (%.1f MB/s)\n",
+                r.registros, r.segundos, r.bytes_lidos / mb, r.bytes_lidos / mb / s,
+                r.bytes_escritos / mb, r.bytes_escritos / mb / s);
+        return 0;
+    }
+    if (strcmp(argv[1], "lote") == 0 && argc >= 3) {
+        FormatoExportacao formato = FORMATO_CSV;
+        const char *origem = NULL, *destino = NULL;
+        int profundidade = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--formato") == 0 && i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "csv") == 0) formato = FORMATO_CSV;
+                else if (strcmp(argv[i], "ndjson") == 0) formato = FORMATO_NDJSON;
+                else { fprintf(stderr, "Formato desconhecido: %s\n", argv[i]); return 1; }
+            }
+            else if (strcmp(argv[i], "--entrada") == 0 && i + 1 < argc) origem = argv[++i];
+            else if (strcmp(argv[i], "--profundidade") == 0 && i + 1 < argc) profundidade = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--saida") == 0 && i + 1 < argc) destino = argv[++i];
+            else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+        }
+        TabelaDados tabela;
+        if (strcmp(argv[2], "produtos") == 0) tabela = TABELA_PRODUTOS;
+        else if (strcmp(argv[2], "compras") == 0) tabela = TABELA_COMPRAS;
+        else { fprintf(stderr, "Tabela desconhecida: %s\n", argv[2]); return 1; }
+        ResultadoLote r;
+        unsigned long long t0 = instr_inicio();
+        if (!consultar_em_lote(tabela, origem, destino, formato, profundidade, &r)) {
+            fprintf(stderr, "ERRO na consulta em lote de %s (indice, dados ou arquivo de chaves)\n", argv[2]);
+            return 1;
+        }
+        // Resumo no stderr para nao se misturar com o resultado
+        fprintf(stderr, "%ld chaves: %ld encontradas, %ld removidas, %ld ausentes; %ld leituras (%s) em %.3f s\n",
+                r.encontradas + r.removidas + r.ausentes, r.encontradas, r.removidas, r.ausentes,
+                r.leituras, r.motor, (double)(instr_inicio() - t0) / 1e9);
+        return 0;
+    }
+    if (strcmp(argv[1], "pedido") == 0 && argc >= 3) {
+        long n = mostrar_pedido(ARQ_ITENS_IDX, ARQ_ITENS_BIN, atoll(argv[2]));
+        return n > 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "comprimir") == 0 && argc >= 3) {
+        ResultadoCompressao r;
+        unsigned long long t0 = instr_inicio();
+        int ok;
+        if (strcmp(argv[2], "produtos") == 0)
+            ok = comprimir_tabela(TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, sizeof(Produto), offsetof(Produto, product_id), &r);
+        else if (strcmp(argv[2], "compras") == 0)
+            ok = comprimir_tabela(TABELA_COMPRAS, ARQ_COMPRAS_BIN, sizeof(Compra), offsetof(Compra, order_id), &r);
+        else { fprintf(stderr, "Tabela desconhecida: %s\n", argv[2]); return 1; }
+        if (!ok) { fprintf(stderr, "ERRO ao comprimir %s\n", argv[2]); return 1; }
+        double mb = 1024.0 * 1024.0, segundos = (double)(instr_inicio() - t0) / 1e9;
+        printf("%ld registros em %ld blocos: %.1f MB -> %.1f MB (%.1f%%) em %.3f s\n",
+               r.registros, r.blocos, r.bytes_origem / mb, r.bytes_comprimidos / mb,
+               r.bytes_origem > 0 ? 100.0 * (double)r.bytes_comprimidos / (double)r.bytes_origem : 0.0, segundos);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "aprender") == 0 && argc >= 3) {
+        int epsilon = epsilon_aprendido;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--epsilon") == 0 && i + 1 < argc) epsilon = atoi(argv[++i]);
+            else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+        }
+        if (epsilon < 1 || epsilon > APRENDIDO_EPSILON_MAXIMO) {
+            fprintf(stderr, "epsilon deve estar entre 1 e %d\n", APRENDIDO_EPSILON_MAXIMO);
+            return 1;
+        }
+        ResultadoAprendido r;
+        unsigned long long t0 = instr_inicio();
+        const char *arq_indice;
+        int ok;
+        if (strcmp(argv[2], "produtos") == 0) {
+            arq_indice = ARQ_PRODUTOS_IDX;
+            ok = indice_aprendido_criar(TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, sizeof(Produto),
+                                        offsetof(Produto, product_id), epsilon, &r);
+        } else if (strcmp(argv[2], "compras") == 0) {
+            arq_indice = ARQ_COMPRAS_IDX;
+            ok = indice_aprendido_criar(TABELA_COMPRAS, ARQ_COMPRAS_BIN, sizeof(Compra),
+                                        offsetof(Compra, order_id), epsilon, &r);
+        } else { fprintf(stderr, "Tabela desconhecida: %s\n", argv[2]); return 1; }
+        if (!ok) { fprintf(stderr, "ERRO ao criar o indice aprendido de %s\n", argv[2]); return 1; }
+        printf("%ld registros em %ld segmentos (eps = %d, janela de %d registros): %ld bytes em %.3f s\n",
+               r.registros, r.segmentos, epsilon, 2 * epsilon + 2, r.bytes, (double)(instr_inicio() - t0) / 1e9);
+        IndiceCompacto ic;
+        if (indice_compacto_carregar(&ic, arq_indice)) { // So para comparar os tamanhos
+            printf("Indice parcial %s: %ld entradas, %ld bytes (janela de %d registros)\n", arq_indice,
+                   (long)ic.cab.n_entradas, indice_compacto_bytes(&ic), BLOCO_INDICE);
+            indice_compacto_liberar(&ic);
+        }
+        return 0;
+    }
+
+    if (strcmp(argv[1], "blocos") == 0 && argc >= 3) {
+        int preenchimento = PREENCHIMENTO_PADRAO;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--preenchimento") == 0 && i + 1 < argc) preenchimento = atoi(argv[++i]);
+            else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+        }
+        if (preenchimento < 0 || preenchimento > 100) {
+            fprintf(stderr, "preenchimento deve estar entre 0 (denso) e 100\n");
+            return 1;
+        }
+        unsigned long long t0 = instr_inicio();
+        const char *arq_bin;
+        long n;
+        if (strcmp(argv[2], "produtos") == 0) {
+            arq_bin = ARQ_PRODUTOS_BIN;
+            n = reorganizar_em_blocos(TABELA_PRODUTOS, arq_bin, sizeof(Produto), offsetof(Produto, product_id),
+                                      offsetof(Produto, ativo), preenchimento);
+            if (n >= 0) criar_indice_produto(arq_bin, ARQ_PRODUTOS_IDX);
+        } else if (strcmp(argv[2], "compras") == 0) {
+            arq_bin = ARQ_COMPRAS_BIN;
+            n = reorganizar_em_blocos(TABELA_COMPRAS, arq_bin, sizeof(Compra), offsetof(Compra, order_id),
+                                      offsetof(Compra, ativo), preenchimento);
+            if (n >= 0) criar_indice_compra(arq_bin, ARQ_COMPRAS_IDX);
+        } else { fprintf(stderr, "Tabela desconhecida: %s\n", argv[2]); return 1; }
+        if (n < 0) { fprintf(stderr, "ERRO ao reorganizar %s\n", arq_bin); return 1; }
+        struct stat st;
+        if (stat(arq_bin, &st) != 0) st.st_size = 0;
+        if (preenchimento > 0)
+            printf("%ld registros em blocos de %d posicoes com %d ocupadas: %.1f MB em %.3f s\n", n, BLOCO_INDICE,
+                   registros_por_bloco(preenchimento), (double)st.st_size / (1024.0 * 1024.0),
+                   (double)(instr_inicio() - t0) / 1e9);
+        else
+            printf("%ld registros no layout denso: %.1f MB em %.3f s\n", n, (double)st.st_size / (1024.0 * 1024.0),
+                   (double)(instr_inicio() - t0) / 1e9);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "explain") == 0 && argc >= 3) {
+        EstatisticasTabela produtos, itens;
+        Planejamento p;
+        if (strcmp(argv[2], "busca") == 0 && argc >= 4) {
+            long n = 1;
+            for (int i = 4; i < argc; i++) {
+                if (strcmp(argv[i], "--chaves") == 0 && i + 1 < argc) n = atol(argv[++i]);
+                else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+            }
+            if (n <= 0) { fprintf(stderr, "--chaves deve ser positivo\n"); return 1; }
+            TabelaDados tabela;
+            if (strcmp(argv[3], "produtos") == 0) tabela = TABELA_PRODUTOS;
+            else if (strcmp(argv[3], "compras") == 0) tabela = TABELA_COMPRAS;
+            else { fprintf(stderr, "Tabela desconhecida: %s\n", argv[3]); return 1; }
+            estatisticas_tabela(tabela, &produtos);
+            imprimir_estatisticas_tabela(stdout, &produtos);
+            planejar_busca(&produtos, n, &p);
+            printf("\nbusca de %ld chave(s):\n", n);
+        } else if (strcmp(argv[2], "mais_caro") == 0) {
+            estatisticas_tabela(TABELA_PRODUTOS, &produtos);
+            imprimir_estatisticas_tabela(stdout, &produtos);
+            planejar_produto_mais_caro(&produtos, &p);
+            printf("\nproduto mais caro:\n");
+        } else if (strcmp(argv[2], "total_vendido") == 0) {
+            estatisticas_tabela(TABELA_PRODUTOS, &produtos);
+            estatisticas_itens(&itens);
+            imprimir_estatisticas_tabela(stdout, &produtos);
+            imprimir_estatisticas_tabela(stdout, &itens);
+            planejar_valor_total_vendido(&produtos, &itens, &p);
+            printf("\nvalor total vendido:\n");
+        } else {
+            fprintf(stderr, "Use: explain busca produtos|compras [--chaves N] | explain mais_caro|total_vendido\n");
+            return 1;
+        }
+        imprimir_planejamento(stdout, &p);
+        return 0;
+    }
+
+    fprintf(stderr,
+            "Uso: %s                 (menu interativo)\n"
+            "     %s servidor [--socket caminho] [--threads N] [--mmap] [--janela-us US]\n"
+            "     %s mostrar produtos|compras [--offset N] [--limit N]   (--limit 0 = todos)\n"
+            "     %s exportar produtos|compras [--formato csv|ndjson] [--saida arquivo] [--de chave] [--ate chave]\n"
+            "     %s topk preco|receita|usuarios [--k N]\n"
+            "     %s agregados verificar|reconstruir\n"
+            "     %s comprimir produtos|compras\n"
+            "     %s aprender produtos|compras [--epsilon N]   (indice aprendido <arquivo>.pgm)\n"
+            "     %s blocos produtos|compras [--preenchimento P]   (layout em blocos com P%% ocupados; 0 = denso)\n"
+            "     %s pedido <order_id>   (todos os itens do pedido)\n"
+            "     %s lote produtos|compras [--entrada arquivo] [--formato csv|ndjson] [--saida arquivo]\n"
+            "           [--profundidade N]   (uma chave por linha; sem --entrada le da entrada padrao)\n"
+            "     %s explain busca produtos|compras [--chaves N] | explain mais_caro|total_vendido\n"
+            "           (plano de acesso escolhido e E/S estimada de cada candidato)\n"
+            "     %s agrupar categoria|brand|usuario|produto|mes [--ordenar receita|unidades|pedidos|grupo|nenhuma]\n"
+            "           [--limite N] [--formato csv|ndjson] [--saida arquivo] [--memoria MB]\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+            argv[0]);
+    return 1;
 }
 
-int main() {
+#ifndef ARQUIVO_SEM_MAIN // benchmark.c inclui este arquivo e fornece o proprio main
+int main(int argc, char **argv) {
+    // AED2_ESTATISTICAS=1 (ou =arquivo) imprime os contadores ao sair
+    if (getenv("AED2_ESTATISTICAS")) atexit(despejar_estatisticas_na_saida);
+    // AED2_BLOOM_FP=0.001 muda a taxa de falsos positivos dos filtros novos
+    if (getenv("AED2_BLOOM_FP")) bloom_taxa_fp = atof(getenv("AED2_BLOOM_FP"));
+    // AED2_COMPRIMIR=1 gera tambem a copia comprimida ao criar os indices
+    if (getenv("AED2_COMPRIMIR")) layout_comprimido = atoi(getenv("AED2_COMPRIMIR")) != 0;
+    // AED2_PREBUSCA=1 liga a thread de pre-busca das varreduras
+    if (getenv("AED2_PREBUSCA")) prebusca_ativa = atoi(getenv("AED2_PREBUSCA")) != 0;
+    // AED2_IO_URING=0 faz as pesquisas assincronas usarem o pool de threads
+    if (getenv("AED2_IO_URING")) assincrono_io_uring = atoi(getenv("AED2_IO_URING")) != 0;
+    // AED2_APRENDIDO=1 gera tambem o indice aprendido ao criar os indices (AED2_EPSILON=N o erro maximo)
+    if (getenv("AED2_APRENDIDO")) gerar_aprendido = atoi(getenv("AED2_APRENDIDO")) != 0;
+    if (getenv("AED2_EPSILON")) epsilon_aprendido = atoi(getenv("AED2_EPSILON"));
+    // AED2_THREADS=N fixa as threads das varreduras particionadas (padrao: uma por processador)
+    if (getenv("AED2_THREADS")) threads_varredura = atoi(getenv("AED2_THREADS"));
+    // AED2_CSV_SIMD=0 le o CSV com fgets/strtok (ver LEITURA RAPIDA DO CSV)
+    if (getenv("AED2_CSV_SIMD")) csv_simd = atoi(getenv("AED2_CSV_SIMD")) != 0;
+    // % de cada bloco ocupado ao gravar do CSV (0 = .bin denso; ver LAYOUT EM BLOCOS)
+    if (getenv("AED2_PREENCHIMENTO")) preenchimento_blocos = atoi(getenv("AED2_PREENCHIMENTO"));
+    // AED2_PLANO=binaria|indice|aprendido|varredura|agregados|hash_join|juncao_binaria
+    // forca o caminho de acesso quando ele serve (ver PLANEJADOR DE ACESSO)
+    if (getenv("AED2_PLANO")) caminho_forcado = caminho_por_nome(getenv("AED2_PLANO"));
+
+    // Re-aplica operacoes confirmadas no log que nao chegaram aos .bin
+    int recuperadas = wal_recuperar();
+    if (recuperadas > 0) {
+        // Nao apaga os indices: cada um e carimbado com a geracao, o tamanho e a
+        // impressao do .bin, e indice_atualizado so refaz o de uma tabela que mudou
+        fprintf(stderr, "(Sistema: %d operacoes recuperadas do log %s)\n", recuperadas, ARQ_WAL);
+    }
+
+    if (argc > 1) return executar_comando(argc, argv);
+
     printf("=== Sistema de Arquivos: Produtos e Compras ===\n");
 
     int opcao;
@@ -1271,17 +8895,20 @@ int main() {
         printf("1. Gerenciar Produtos\n");
         printf("2. Gerenciar Compras\n");
         printf("3. Consultas Especificas\n");
-        printf("4. Sair\n");
+        printf("4. Estatisticas de I/O\n");
+        printf("5. Sair\n");
         opcao = ler_inteiro("Opcao: ");
 
         switch (opcao) {
             case 1: menu_produtos(); break;
             case 2: menu_compras(); break;
             case 3: menu_consultas(); break;
-            case 4: printf("Saindo...\n"); break;
+            case 4: menu_estatisticas(); break;
+            case 5: printf("Saindo...\n"); break;
             default: printf("Opcao invalida\n");
         }
-    } while (opcao != 4);
+    } while (opcao != 5);
 
     return 0;
 }
+#endif
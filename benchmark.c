@@ -0,0 +1,1221 @@
+/**
+ * Benchmark do sistema de arquivos de Produtos e Compras.
+ *
+ * Gera arquivos produtos.bin / compras.bin SINTETICOS e deterministicos
+ * (mesma semente -> mesmos arquivos) no tamanho pedido e mede as operacoes
+ * do arquivo.c com cache quente e frio. Cada medicao vira uma linha JSON
+ * (JSON Lines) no arquivo de saida, para acompanhar regressoes ao longo do tempo.
+ *
+ * Compilacao:
+ *   gcc -O2 benchmark.c -o benchmark -pthread
+ * Exemplo:
+ *   ./benchmark --produtos 1000000 --compras 10000000 --dist esparsa --saida resultados.jsonl
+ *
+ * Modo gerador de carga para o servidor (./trabalho_aed2 servidor):
+ *   ./benchmark carga --socket aed2.sock --conexoes 8 --duracao 10
+ */
+#define ARQUIVO_SEM_MAIN
+#include "arquivo.c"
+
+#include <time.h>     // Para clock_gettime
+#include <errno.h>
+#include <sys/stat.h> // Para mkdir
+
+// --- CONFIGURACAO ---
+typedef enum {
+    DIST_SEQUENCIAL, // 1, 2, 3, ... (sem buracos)
+    DIST_ESPARSA,    // Intervalos aleatorios uniformes entre chaves consecutivas
+    DIST_AGRUPADA    // Sequencias densas separadas por saltos grandes
+} DistribuicaoChaves;
+
+typedef struct {
+    long n_produtos;
+    long n_compras;
+    DistribuicaoChaves dist;
+    int n_consultas;      // Consultas pontuais por medicao
+    int n_insercoes;      // Insercoes por medicao (cada uma reescreve o arquivo!)
+    int n_repeticoes;     // Repeticoes das operacoes de varredura completa
+    double taxa_acertos;  // Fracao das consultas que procuram chaves existentes
+    uint64_t semente;
+    const char *diretorio;
+    const char *saida;
+    const char *ops;      // Lista de operacoes separadas por virgula (NULL = todas)
+} ConfigBenchmark;
+
+const char *NOMES_DIST[] = {"sequencial", "esparsa", "agrupada"};
+int preenchimento_bench = 0; // --preenchimento: % ocupado de cada bloco dos .bin gerados (0 = denso)
+
+// --- GERADOR PSEUDO-ALEATORIO (splitmix64, deterministico) ---
+uint64_t estado_rng;
+
+uint64_t splitmix64(uint64_t *estado) {
+    uint64_t z = (*estado += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+uint64_t rng_proximo(void) { return splitmix64(&estado_rng); }
+
+uint64_t rng_intervalo(uint64_t n) { return rng_proximo() % n; }
+
+/**
+ * @brief Calcula a proxima chave de acordo com a distribuicao escolhida.
+ */
+int64_t proxima_chave(DistribuicaoChaves dist, int64_t anterior, long i) {
+    switch (dist) {
+        case DIST_ESPARSA:  return anterior + 1 + (int64_t)rng_intervalo(1000);
+        case DIST_AGRUPADA: return anterior + ((i % 1000 == 0) ? 1 + (int64_t)rng_intervalo(10000000) : 1);
+        default:            return anterior + 1;
+    }
+}
+
+// --- GERACAO DOS ARQUIVOS ---
+const char *MARCAS[] = {"alcora", "sokolov", "sl", "mokobelle", "aquamarine", "pandora", "swarovski", "ametist"};
+const char *CATEGORIAS[] = {"jewelry.earring", "jewelry.ring", "jewelry.pendant", "jewelry.necklace",
+                            "jewelry.bracelet", "jewelry.brooch", "jewelry.souvenir", "jewelry.stud"};
+
+/**
+ * @brief Gera produtos.bin ja ordenado (as chaves sao crescentes por construcao).
+ * @return Vetor com as chaves geradas (usado para sortear chaves estrangeiras).
+ */
+int64_t *gerar_produtos(const ConfigBenchmark *cfg) {
+    int64_t *chaves = malloc((size_t)cfg->n_produtos * sizeof(int64_t));
+    FILE *f = fopen(ARQ_PRODUTOS_BIN, "wb");
+    if (!chaves || !f) { fprintf(stderr, "ERRO ao gerar %s\n", ARQ_PRODUTOS_BIN); exit(1); }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    int64_t chave = 0;
+    for (long i = 0; i < cfg->n_produtos; i++) {
+        Produto p;
+        memset(&p, 0, sizeof(p));
+        chave = proxima_chave(cfg->dist, chave, i);
+        chaves[i] = chave;
+        p.product_id = chave;
+        strcpy(p.brand, MARCAS[rng_intervalo(8)]);
+        strcpy(p.category_alias, CATEGORIAS[rng_intervalo(8)]);
+        p.price = (double)(100 + rng_intervalo(500000)) / 100.0;
+        pad_string(p.brand, TAM_BRAND);
+        pad_string(p.category_alias, TAM_CATEGORY);
+        p.ativo = 'S';
+        p.newline = '\n';
+        fwrite(&p, sizeof(Produto), 1, f);
+    }
+    fclose(f);
+    return chaves;
+}
+
+/**
+ * @brief Gera compras.bin e a tabela de itens (itens.bin): cada pedido tem de
+ * 1 a 4 itens, o primeiro e a propria compra. Os itens saem ja na ordem de
+ * (order_id, product_id), sem montar o vetor inteiro na RAM.
+ */
+void gerar_compras(const ConfigBenchmark *cfg, const int64_t *chaves_produtos) {
+    FILE *f = fopen(ARQ_COMPRAS_BIN, "wb");
+    FILE *fi = fopen(ARQ_ITENS_BIN, "wb");
+    if (!f || !fi) { fprintf(stderr, "ERRO ao gerar %s\n", ARQ_COMPRAS_BIN); exit(1); }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    setvbuf(fi, NULL, _IOFBF, 1 << 20);
+
+    long long chave = 0;
+    for (long i = 0; i < cfg->n_compras; i++) {
+        Compra c;
+        memset(&c, 0, sizeof(c));
+        chave = proxima_chave(cfg->dist, chave, i);
+        c.order_id = chave;
+        c.product_id = chaves_produtos[rng_intervalo((uint64_t)cfg->n_produtos)];
+        c.user_id = 1515915625000000000LL + (long long)rng_intervalo(1000000);
+        snprintf(c.order_datetime, TAM_DATETIME, "20%02d-%02d-%02d %02d:%02d:%02d UTC",
+                 18 + (int)rng_intervalo(4), 1 + (int)rng_intervalo(12), 1 + (int)rng_intervalo(28),
+                 (int)rng_intervalo(24), (int)rng_intervalo(60), (int)rng_intervalo(60));
+        c.quantity = 1 + (int)rng_intervalo(3);
+        pad_string(c.order_datetime, TAM_DATETIME);
+        c.ativo = 'S';
+        c.newline = '\n';
+        fwrite(&c, sizeof(Compra), 1, f);
+
+        ItemPedido itens[4];
+        int n_itens = 1 + (int)rng_intervalo(4);
+        for (int k = 0; k < n_itens; k++) {
+            itens[k] = c;
+            if (k > 0) itens[k].product_id = chaves_produtos[rng_intervalo((uint64_t)cfg->n_produtos)];
+        }
+        qsort(itens, (size_t)n_itens, sizeof(ItemPedido), comparar_item_pedido);
+        for (int k = 0; k < n_itens; k++)
+            if (k == 0 || itens[k].product_id != itens[k - 1].product_id) fwrite(&itens[k], sizeof(ItemPedido), 1, fi);
+    }
+    fclose(f);
+    fclose(fi);
+}
+
+/**
+ * @brief Gera ARQ_CSV no formato de 13 colunas lido por pre_processar_*
+ * (com cabecalho), uma linha por compra gerada (ate 'n_linhas'), com marca,
+ * categoria e preco dos produtos gerados. Usado so para medir a ingestao.
+ */
+void gerar_csv(long n_linhas) {
+    FILE *fc = fopen(ARQ_COMPRAS_BIN, "rb");
+    FILE *fp = fopen(ARQ_PRODUTOS_BIN, "rb");
+    FILE *f = fopen(ARQ_CSV, "w");
+    if (!fc || !fp || !f) { fprintf(stderr, "ERRO ao gerar %s\n", ARQ_CSV); exit(1); }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    fprintf(f, "order_datetime,order_id,product_id,quantity,category_id,category_alias,brand_id,price,"
+               "user_id,gender,color,metal,gem\n");
+    Compra c;
+    Produto p;
+    for (long i = 0; i < n_linhas && fread(&c, sizeof(Compra), 1, fc) == 1; i++) {
+        if (fread(&p, sizeof(Produto), 1, fp) != 1) {
+            rewind(fp);
+            if (fread(&p, sizeof(Produto), 1, fp) != 1) break;
+        }
+        char data[TAM_DATETIME], marca[TAM_BRAND], categoria[TAM_CATEGORY];
+        copiar_sem_espacos(data, c.order_datetime, TAM_DATETIME);
+        copiar_sem_espacos(marca, p.brand, TAM_BRAND);
+        copiar_sem_espacos(categoria, p.category_alias, TAM_CATEGORY);
+        fprintf(f, "%s,%lld,%lld,%d,%lld,%s,%s,%.2f,%lld,f,red,gold,diamond\n", data, c.order_id,
+                (long long)c.product_id, c.quantity, (long long)(p.product_id % 1000), categoria, marca, p.price,
+                c.user_id);
+    }
+    fclose(fc);
+    fclose(fp);
+    fclose(f);
+}
+
+// --- MEDICAO ---
+double agora_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Le os contadores de I/O do processo em /proc/self/io.
+ * rchar = bytes pedidos via read() (inclui acertos no page cache);
+ * read_bytes = bytes que realmente vieram do dispositivo.
+ */
+void ler_contadores_io(long long *rchar, long long *read_bytes) {
+    *rchar = *read_bytes = 0;
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) return;
+    char linha[128];
+    while (fgets(linha, sizeof(linha), f)) {
+        sscanf(linha, "rchar: %lld", rchar);
+        sscanf(linha, "read_bytes: %lld", read_bytes);
+    }
+    fclose(f);
+}
+
+/**
+ * @brief Tira o arquivo do page cache (cache frio). Funciona sem root porque
+ * os arquivos gerados ja estao sincronizados (paginas limpas).
+ */
+void esfriar_arquivo(const char *caminho) {
+    int fd = open(caminho, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+void esfriar_tudo(void) {
+    esfriar_arquivo(ARQ_PRODUTOS_BIN);
+    esfriar_arquivo(ARQ_PRODUTOS_IDX);
+    esfriar_arquivo(ARQ_COMPRAS_BIN);
+    esfriar_arquivo(ARQ_COMPRAS_IDX);
+    esfriar_arquivo(ARQ_ITENS_BIN);
+    esfriar_arquivo(ARQ_ITENS_IDX);
+    char z[256];
+    caminho_comprimido(ARQ_PRODUTOS_BIN, z, sizeof(z));
+    esfriar_arquivo(z);
+    caminho_comprimido(ARQ_COMPRAS_BIN, z, sizeof(z));
+    esfriar_arquivo(z);
+    caminho_aprendido(ARQ_PRODUTOS_BIN, z, sizeof(z));
+    esfriar_arquivo(z);
+    caminho_aprendido(ARQ_COMPRAS_BIN, z, sizeof(z));
+    esfriar_arquivo(z);
+    esfriar_arquivo(ARQ_CSV);
+}
+
+// As funcoes do arquivo.c imprimem mensagens; durante as medicoes elas vao para /dev/null.
+int stdout_original = -1;
+
+void silenciar_stdout(void) {
+    fflush(stdout);
+    stdout_original = dup(STDOUT_FILENO);
+    int nulo = open("/dev/null", O_WRONLY);
+    dup2(nulo, STDOUT_FILENO);
+    close(nulo);
+}
+
+void restaurar_stdout(void) {
+    fflush(stdout);
+    dup2(stdout_original, STDOUT_FILENO);
+    close(stdout_original);
+}
+
+typedef struct {
+    double *latencias_ns;
+    int n;
+    double inicio_ns, total_ns;
+    long long rchar, read_bytes;
+    ContadoresIO io; // Contadores da instrumentacao do arquivo.c no inicio da medicao
+} Medicao;
+
+void medicao_iniciar(Medicao *m, int capacidade) {
+    memset(m, 0, sizeof(*m));
+    m->latencias_ns = malloc((capacidade > 0 ? capacidade : 1) * sizeof(double));
+    ler_contadores_io(&m->rchar, &m->read_bytes);
+    m->io = estat_io;
+}
+
+int comparar_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double percentil(const double *ordenado, int n, double p) {
+    if (n == 0) return 0;
+    int i = (int)(p * (n - 1) + 0.5);
+    return ordenado[i];
+}
+
+/**
+ * @brief Fecha a medicao e grava uma linha JSON com percentis de latencia,
+ * vazao e bytes lidos.
+ */
+void medicao_emitir(Medicao *m, FILE *saida, const ConfigBenchmark *cfg,
+                    const char *op, const char *cache) {
+    long long rchar, read_bytes;
+    ler_contadores_io(&rchar, &read_bytes);
+    rchar -= m->rchar;
+    read_bytes -= m->read_bytes;
+
+    double total_ns = 0;
+    for (int i = 0; i < m->n; i++) total_ns += m->latencias_ns[i];
+    qsort(m->latencias_ns, m->n, sizeof(double), comparar_double);
+
+    fprintf(saida,
+            "{\"timestamp\":%lld,\"op\":\"%s\",\"cache\":\"%s\",\"dist\":\"%s\",\"layout\":\"%s\",\"prebusca\":%d,\"threads\":%d,\"preenchimento\":%d,"
+            "\"produtos\":%ld,\"compras\":%ld,\"n\":%d,"
+            "\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f,"
+            "\"media_us\":%.3f,\"ops_s\":%.3f,\"mb_s\":%.1f,\"bytes_lidos\":%lld,\"bytes_disco\":%lld,"
+            "\"fopens\":%llu,\"seeks\":%llu,\"registros_lidos\":%llu,\"bytes_lidos_registros\":%llu}\n",
+            (long long)time(NULL), op, cache, NOMES_DIST[cfg->dist], layout_comprimido ? "comprimido" : "bruto", prebusca_ativa,
+            varredura_n_threads(), preenchimento_bench,
+            cfg->n_produtos, cfg->n_compras, m->n,
+            percentil(m->latencias_ns, m->n, 0.50) / 1e3, percentil(m->latencias_ns, m->n, 0.90) / 1e3,
+            percentil(m->latencias_ns, m->n, 0.99) / 1e3, percentil(m->latencias_ns, m->n, 0.999) / 1e3,
+            m->n ? m->latencias_ns[m->n - 1] / 1e3 : 0, m->n ? total_ns / m->n / 1e3 : 0,
+            total_ns > 0 ? m->n / (total_ns / 1e9) : 0,
+            total_ns > 0 ? (double)(estat_io.bytes_lidos - m->io.bytes_lidos) / (1024.0 * 1024.0) / (total_ns / 1e9) : 0,
+            rchar, read_bytes,
+            estat_io.fopens - m->io.fopens, estat_io.seeks - m->io.seeks,
+            estat_io.registros_lidos - m->io.registros_lidos, estat_io.bytes_lidos - m->io.bytes_lidos);
+    fflush(saida);
+    free(m->latencias_ns);
+}
+
+// --- SORTEIO DE CHAVES PARA CONSULTA ---
+
+/** @brief Posicoes de registro no arquivo (no layout em blocos inclui as vagas). */
+long registros_no_arquivo(const char *arq_bin, size_t tam_registro) {
+    struct stat st;
+    return stat(arq_bin, &st) == 0 ? (long)(st.st_size / (off_t)tam_registro) : 0;
+}
+
+/**
+ * @brief Sorteia chaves de consulta: uma fracao 'taxa_acertos' e lida de
+ * registros reais do arquivo (acertos), o resto fica alem da maior chave (falhas).
+ */
+int64_t *sortear_chaves(const char *arq_bin, size_t tam_registro, long n_registros,
+                        int n, double taxa_acertos) {
+    int64_t *chaves = malloc((n > 0 ? n : 1) * sizeof(int64_t));
+    FILE *f = fopen(arq_bin, "rb");
+    if (!chaves || !f || n_registros <= 0) { fprintf(stderr, "ERRO ao sortear chaves de %s\n", arq_bin); exit(1); }
+
+    int64_t maior;
+    fseek(f, (n_registros - 1) * (long)tam_registro, SEEK_SET);
+    fread(&maior, sizeof(int64_t), 1, f); // A chave e o primeiro campo das duas structs
+
+    for (int i = 0; i < n; i++) {
+        if ((double)rng_intervalo(1000000) / 1e6 < taxa_acertos) {
+            fseek(f, (long)rng_intervalo((uint64_t)n_registros) * (long)tam_registro, SEEK_SET);
+            fread(&chaves[i], sizeof(int64_t), 1, f);
+        } else {
+            chaves[i] = maior + 1 + (int64_t)rng_intervalo(1000000);
+        }
+    }
+    fclose(f);
+    return chaves;
+}
+
+// --- REFERENCIA: PESQUISA GENERICA POR CALLBACK ---
+//
+// Versao do arquivo.c anterior ao DEFINIR_TABELA, mantida aqui apenas para
+// comparacao: tamanho do registro e posicao do 'ativo' chegam em tempo de
+// execucao e a chave e comparada por ponteiro de funcao a cada sondagem.
+// O noinline impede o compilador de especializar a funcao generica para o
+// comparador usado (o que ele nao faria com ela em outra unidade de traducao).
+
+int comparar_produto_chave(const void* a, const void* b) {
+    int64_t id_a = ((Produto*)a)->product_id;
+    int64_t id_b = *(int64_t*)b;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+int comparar_compra_chave(const void* a, const void* b) {
+    long long id_a = ((Compra*)a)->order_id;
+    long long id_b = *(long long*)b;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+__attribute__((noinline))
+long localizar_registro_callback(const char *arq_bin, size_t tam_registro,
+                                 int (*comparador)(const void*, const void*),
+                                 const void *chave_busca, void *registro_saida) {
+    FILE *fbin = io_fopen(arq_bin, "rb");
+    if (!fbin) return -1;
+    io_fseek(fbin, 0, SEEK_END);
+    long tamanho_arquivo = ftell(fbin);
+    if (tamanho_arquivo <= 0 || tamanho_arquivo % tam_registro != 0) { fclose(fbin); return -1; }
+
+    long inicio = 0, fim = tamanho_arquivo / (long)tam_registro - 1;
+    while (inicio <= fim) {
+        long meio = inicio + (fim - inicio) / 2;
+        if (io_fseek(fbin, meio * tam_registro, SEEK_SET) != 0 ||
+            io_fread(registro_saida, tam_registro, 1, fbin) != 1) break;
+        int cmp = comparador(registro_saida, chave_busca);
+        if (cmp == 0) { fclose(fbin); return meio * tam_registro; }
+        (cmp < 0) ? (inicio = meio + 1) : (fim = meio - 1);
+    }
+    fclose(fbin);
+    return -1;
+}
+
+long pesquisa_binaria_callback(const char *arq_bin, size_t tam_registro,
+                               int (*comparador)(const void*, const void*),
+                               const void *chave_busca, size_t offset_ativo) {
+    char registro[sizeof(Produto) > sizeof(Compra) ? sizeof(Produto) : sizeof(Compra)];
+    unsigned long long t0 = instr_inicio();
+    long offset = localizar_registro_callback(arq_bin, tam_registro, comparador, chave_busca, registro);
+    if (offset >= 0 && registro[offset_ativo] != 'S') offset = -2;
+    instr_registrar(OP_PESQUISA_BINARIA, t0);
+    return offset;
+}
+
+/**
+ * @brief Laco de sondagem generico sobre registros ja na RAM (sem I/O), para
+ * isolar o custo da comparacao por callback.
+ */
+__attribute__((noinline))
+long sondar_callback(const char *base, long n, size_t tam_registro,
+                     int (*comparador)(const void*, const void*), const void *chave) {
+    long inicio = 0, fim = n - 1;
+    while (inicio <= fim) {
+        long meio = inicio + (fim - inicio) / 2;
+        int cmp = comparador(base + meio * (long)tam_registro, chave);
+        if (cmp == 0) return meio;
+        (cmp < 0) ? (inicio = meio + 1) : (fim = meio - 1);
+    }
+    return -1;
+}
+
+/**
+ * @brief O mesmo laco de localizar_produto (DEFINIR_TABELA), sobre a RAM.
+ */
+long sondar_produto(const Produto *base, long n, int64_t chave) {
+    long inicio = 0, fim = n - 1;
+    while (inicio <= fim) {
+        long meio = inicio + (fim - inicio) / 2;
+        if (base[meio].product_id == chave) return meio;
+        (base[meio].product_id < chave) ? (inicio = meio + 1) : (fim = meio - 1);
+    }
+    return -1;
+}
+
+// --- OPERACOES MEDIDAS ---
+
+int op_habilitada(const ConfigBenchmark *cfg, const char *nome) {
+    if (!cfg->ops) return 1;
+    size_t n = strlen(nome);
+    for (const char *p = cfg->ops; (p = strstr(p, nome)) != NULL; p += n) {
+        int inicio_ok = (p == cfg->ops || p[-1] == ',');
+        int fim_ok = (p[n] == '\0' || p[n] == ',');
+        if (inicio_ok && fim_ok) return 1;
+    }
+    return 0;
+}
+
+typedef enum {
+    BUSCA_BINARIA_PRODUTO, BUSCA_BINARIA_COMPRA, BUSCA_INDICE_PRODUTO, BUSCA_INDICE_COMPRA,
+    BUSCA_BINARIA_PRODUTO_CALLBACK, BUSCA_BINARIA_COMPRA_CALLBACK,
+    BUSCA_EXISTENCIA_PRODUTO, BUSCA_EXISTENCIA_COMPRA, BUSCA_PRODUTO_ATIVO, BUSCA_ITENS_PEDIDO,
+    BUSCA_APRENDIDO_PRODUTO, BUSCA_APRENDIDO_COMPRA
+} TipoBusca;
+
+void executar_busca(TipoBusca tipo, int64_t chave) {
+    Produto p;
+    Compra c;
+    long long chave_ll = chave;
+    switch (tipo) {
+        case BUSCA_BINARIA_PRODUTO:
+            pesquisa_binaria_produto(ARQ_PRODUTOS_BIN, chave);
+            break;
+        case BUSCA_BINARIA_COMPRA:
+            pesquisa_binaria_compra(ARQ_COMPRAS_BIN, chave_ll);
+            break;
+        case BUSCA_BINARIA_PRODUTO_CALLBACK:
+            pesquisa_binaria_callback(ARQ_PRODUTOS_BIN, sizeof(Produto), comparar_produto_chave, &chave, offsetof(Produto, ativo));
+            break;
+        case BUSCA_BINARIA_COMPRA_CALLBACK:
+            pesquisa_binaria_callback(ARQ_COMPRAS_BIN, sizeof(Compra), comparar_compra_chave, &chave_ll, offsetof(Compra, ativo));
+            break;
+        case BUSCA_INDICE_PRODUTO:
+            buscar_produto_com_indice(ARQ_PRODUTOS_IDX, ARQ_PRODUTOS_BIN, chave, &p);
+            break;
+        case BUSCA_INDICE_COMPRA:
+            buscar_compra_com_indice(ARQ_COMPRAS_IDX, ARQ_COMPRAS_BIN, chave_ll, &c);
+            break;
+        case BUSCA_APRENDIDO_PRODUTO:
+            buscar_produto_aprendido(ARQ_PRODUTOS_BIN, chave, &p);
+            break;
+        case BUSCA_APRENDIDO_COMPRA:
+            buscar_compra_aprendido(ARQ_COMPRAS_BIN, chave_ll, &c);
+            break;
+        case BUSCA_EXISTENCIA_PRODUTO:
+            existe_produto(ARQ_PRODUTOS_BIN, chave);
+            break;
+        case BUSCA_EXISTENCIA_COMPRA:
+            existe_compra(ARQ_COMPRAS_BIN, chave_ll);
+            break;
+        case BUSCA_PRODUTO_ATIVO:
+            produto_ativo(chave);
+            break;
+        case BUSCA_ITENS_PEDIDO: {
+            ItemPedido *itens;
+            buscar_itens_pedido(ARQ_ITENS_IDX, ARQ_ITENS_BIN, chave_ll, -1, &itens);
+            free(itens);
+            break;
+        }
+    }
+}
+
+void medir_buscas(const ConfigBenchmark *cfg, FILE *saida, const char *nome, TipoBusca tipo,
+                  const int64_t *chaves) {
+    if (!op_habilitada(cfg, nome)) return;
+    for (int frio = 0; frio <= 1; frio++) {
+        // Cache quente de verdade: a medicao anterior pode ter sido fria
+        if (!frio) for (int i = 0; i < cfg->n_consultas; i++) executar_busca(tipo, chaves[i]);
+        Medicao m;
+        medicao_iniciar(&m, cfg->n_consultas);
+        for (int i = 0; i < cfg->n_consultas; i++) {
+            if (frio) esfriar_tudo(); // Fora do tempo medido
+            double t0 = agora_ns();
+            executar_busca(tipo, chaves[i]);
+            m.latencias_ns[m.n++] = agora_ns() - t0;
+        }
+        medicao_emitir(&m, saida, cfg, nome, frio ? "frio" : "quente");
+    }
+}
+
+/**
+ * @brief Mede uma operacao de arquivo inteiro (criar_indice, consultas...)
+ * 'n_repeticoes' vezes, com cache quente e frio.
+ */
+void medir_varredura(const ConfigBenchmark *cfg, FILE *saida, const char *nome, void (*operacao)(void)) {
+    if (!op_habilitada(cfg, nome)) return;
+    for (int frio = 0; frio <= 1; frio++) {
+        Medicao m;
+        medicao_iniciar(&m, cfg->n_repeticoes);
+        for (int i = 0; i < cfg->n_repeticoes; i++) {
+            if (frio) esfriar_tudo();
+            silenciar_stdout();
+            double t0 = agora_ns();
+            operacao();
+            m.latencias_ns[m.n++] = agora_ns() - t0;
+            restaurar_stdout();
+        }
+        medicao_emitir(&m, saida, cfg, nome, frio ? "frio" : "quente");
+    }
+}
+
+/**
+ * @brief Resolve todas as chaves de consulta numa unica busca em lote
+ * (buscar_*_em_lote), com cache quente e frio. Cada chamada e cronometrada
+ * inteira; a latencia por consulta e a media da chamada, comparavel com
+ * indice_produto/indice_compra.
+ */
+void medir_lote(const ConfigBenchmark *cfg, FILE *saida, const char *nome, int produtos, const int64_t *chaves) {
+    if (!op_habilitada(cfg, nome) || cfg->n_consultas <= 0) return;
+    int n = cfg->n_consultas;
+    void *saidas = malloc((size_t)n * (produtos ? sizeof(Produto) : sizeof(Compra)));
+    long *resultados = malloc((size_t)n * sizeof(long));
+    long long *chaves_ll = malloc((size_t)n * sizeof(long long));
+    if (!saidas || !resultados || !chaves_ll) { free(saidas); free(resultados); free(chaves_ll); return; }
+    for (int i = 0; i < n; i++) chaves_ll[i] = chaves[i];
+    for (int frio = 0; frio <= 1; frio++) {
+        Medicao m;
+        medicao_iniciar(&m, cfg->n_repeticoes * n);
+        for (int r = -1; r < cfg->n_repeticoes; r++) {
+            if (r < 0 && frio) continue; // r = -1: aquece o cache, fora da medicao
+            if (frio) esfriar_tudo();
+            ResultadoLote rl;
+            double t0 = agora_ns();
+            if (produtos) buscar_produto_em_lote(ARQ_PRODUTOS_IDX, ARQ_PRODUTOS_BIN, chaves, n, saidas, resultados, &rl);
+            else buscar_compra_em_lote(ARQ_COMPRAS_IDX, ARQ_COMPRAS_BIN, chaves_ll, n, saidas, resultados, &rl);
+            double dt = agora_ns() - t0;
+            if (r < 0) continue;
+            for (int i = 0; i < n; i++) m.latencias_ns[m.n++] = dt / n;
+        }
+        medicao_emitir(&m, saida, cfg, nome, frio ? "frio" : "quente");
+    }
+    free(saidas);
+    free(resultados);
+    free(chaves_ll);
+}
+
+const char *profundidades_assincronas = "1,2,4,8,16,32,64"; // --profundidades
+
+/**
+ * @brief Buscas por segundo x profundidade da fila: todas as chaves de
+ * produto por pesquisa_produto_assincrona (pesquisa binaria no .bin, sem o
+ * indice, para manter as leituras dependentes), com io_uring e com o pool
+ * de threads, cache quente e frio. Uma linha JSON por motor/profundidade,
+ * com a op "assincrona_produto_<motor>_qd<N>".
+ */
+void medir_assincrono(const ConfigBenchmark *cfg, FILE *saida, const int64_t *chaves) {
+    if (!op_habilitada(cfg, "assincrona_produto") || cfg->n_consultas <= 0) return;
+    int n = cfg->n_consultas;
+    long *resultados = malloc((size_t)n * sizeof(long));
+    if (!resultados) return;
+    int io_uring_original = assincrono_io_uring;
+    for (int motor = 1; motor >= 0; motor--) {
+        assincrono_io_uring = motor;
+        for (const char *p = profundidades_assincronas; *p; p += (*p == ',')) {
+            int profundidade = (int)strtol(p, (char **)&p, 10);
+            if (profundidade <= 0) break;
+            for (int frio = 0; frio <= 1; frio++) {
+                Medicao m;
+                ResultadoLote rl = {0};
+                medicao_iniciar(&m, cfg->n_repeticoes * n);
+                if (!frio) pesquisa_produto_assincrona(ARQ_PRODUTOS_BIN, NULL, chaves, n, NULL, resultados, profundidade, &rl);
+                for (int r = 0; r < cfg->n_repeticoes; r++) {
+                    if (frio) esfriar_tudo();
+                    double t0 = agora_ns();
+                    pesquisa_produto_assincrona(ARQ_PRODUTOS_BIN, NULL, chaves, n, NULL, resultados, profundidade, &rl);
+                    double dt = agora_ns() - t0;
+                    for (int i = 0; i < n; i++) m.latencias_ns[m.n++] = dt / n;
+                }
+                char nome[64];
+                snprintf(nome, sizeof(nome), "assincrona_produto_%s_qd%d",
+                         rl.motor ? rl.motor : (motor ? "io_uring" : "threads"), profundidade);
+                medicao_emitir(&m, saida, cfg, nome, frio ? "frio" : "quente");
+            }
+        }
+    }
+    assincrono_io_uring = io_uring_original;
+    free(resultados);
+}
+
+#define SONDAGEM_RODADAS 200 // Passadas sobre as chaves em cada medicao de sondagem em RAM
+
+/**
+ * @brief Compara o laco de sondagem especializado com o generico por callback,
+ * com produtos.bin inteiro na RAM (sem I/O). Cada passada sobre as chaves e
+ * cronometrada inteira; a latencia por consulta e a media da passada.
+ */
+void medir_sondagem(const ConfigBenchmark *cfg, FILE *saida, const int64_t *chaves) {
+    int callback = op_habilitada(cfg, "sondagem_callback");
+    int especializada = op_habilitada(cfg, "sondagem_especializada");
+    if ((!callback && !especializada) || cfg->n_consultas <= 0) return;
+
+    Produto *produtos = malloc((size_t)cfg->n_produtos * sizeof(Produto));
+    FILE *f = fopen(ARQ_PRODUTOS_BIN, "rb");
+    long n = (produtos && f) ? (long)fread(produtos, sizeof(Produto), cfg->n_produtos, f) : 0;
+    if (f) fclose(f);
+
+    volatile long sumidouro = 0; // Impede que o compilador descarte as buscas
+    for (int tipo = 0; tipo <= 1; tipo++) {
+        if (tipo == 0 ? !callback : !especializada) continue;
+        Medicao m;
+        medicao_iniciar(&m, SONDAGEM_RODADAS * cfg->n_consultas);
+        for (int r = 0; r < SONDAGEM_RODADAS; r++) {
+            long soma = 0;
+            double t0 = agora_ns();
+            for (int i = 0; i < cfg->n_consultas; i++) {
+                int64_t chave = chaves[i];
+                soma += (tipo == 0)
+                    ? sondar_callback((const char*)produtos, n, sizeof(Produto), comparar_produto_chave, &chave)
+                    : sondar_produto(produtos, n, chave);
+            }
+            double dt = agora_ns() - t0;
+            sumidouro += soma;
+            for (int i = 0; i < cfg->n_consultas; i++) m.latencias_ns[m.n++] = dt / cfg->n_consultas;
+        }
+        medicao_emitir(&m, saida, cfg, tipo == 0 ? "sondagem_callback" : "sondagem_especializada", "ram");
+    }
+    free(produtos);
+}
+
+void op_criar_indice_produtos(void) {
+    criar_indice_produto(ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX);
+}
+
+long pagina_meio = 0; // Primeiro registro da pagina medida por mostrar_pagina_produtos
+
+void op_mostrar_produtos(void) {
+    mostrar_produtos(ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX, 0, 0);
+}
+
+void op_mostrar_pagina_produtos(void) {
+    mostrar_produtos(ARQ_PRODUTOS_BIN, ARQ_PRODUTOS_IDX, pagina_meio, 20);
+}
+
+void op_verificar_agregados(void) {
+    agregados_verificar();
+}
+
+void op_topk_receita(void) {
+    consulta_top_k(TOPK_RECEITA, 10);
+}
+
+void op_topk_gasto_usuario(void) {
+    consulta_top_k(TOPK_GASTO_USUARIO, 10);
+}
+
+void op_agrupar_categoria(void) {
+    consulta_agrupar(GRUPO_CATEGORIA, ORDEM_RECEITA, 0, FORMATO_CSV, "/dev/null", AGRUPAR_MEMORIA_PADRAO);
+}
+
+void op_agrupar_usuario(void) {
+    consulta_agrupar(GRUPO_USUARIO, ORDEM_RECEITA, 10, FORMATO_CSV, "/dev/null", AGRUPAR_MEMORIA_PADRAO);
+}
+
+void op_agrupar_usuario_derramando(void) {
+    consulta_agrupar(GRUPO_USUARIO, ORDEM_RECEITA, 10, FORMATO_CSV, "/dev/null", (size_t)1 << 20);
+}
+
+void op_exportar_produtos_csv(void) {
+    ResultadoExportacao r;
+    exportar_produtos(ARQ_PRODUTOS_BIN, "/dev/null", FORMATO_CSV, INT64_MIN, INT64_MAX, &r);
+}
+
+void op_exportar_compras_ndjson(void) {
+    ResultadoExportacao r;
+    exportar_compras(ARQ_COMPRAS_BIN, "/dev/null", FORMATO_NDJSON, INT64_MIN, INT64_MAX, &r);
+}
+
+// Ingestao do CSV (so a leitura para a RAM de pre_processar_*, sem ordenar
+// nem gravar): leitor por fgets/strtok contra o caminho rapido
+long linhas_csv = 1000000; // --linhas-csv
+
+void op_ingestao_produtos_strtok(void) {
+    FILE *f = io_fopen(ARQ_CSV, "r");
+    int n;
+    if (f) free(ler_csv_produtos_strtok(f, &n));
+    if (f) fclose(f);
+}
+
+void op_ingestao_produtos_simd(void) {
+    Arena a = {NULL, 0, 0};
+    ler_csv_produtos_simd(ARQ_CSV, &a);
+    arena_liberar(&a);
+}
+
+void op_ingestao_compras_strtok(void) {
+    FILE *f = io_fopen(ARQ_CSV, "r");
+    int n;
+    if (f) free(ler_csv_compras_strtok(f, &n));
+    if (f) fclose(f);
+}
+
+void op_ingestao_compras_simd(void) {
+    Arena a = {NULL, 0, 0};
+    ler_csv_compras_simd(ARQ_CSV, &a);
+    arena_liberar(&a);
+}
+
+/**
+ * @brief Le a tabela inteira pelo LeitorRegistros contando os ativos: mede
+ * so a vazao da varredura (readahead, pre-busca, layout comprimido).
+ */
+void varrer_tabela(TabelaDados tabela, const char *arq, size_t tam_registro, size_t offset_chave, size_t offset_ativo) {
+    LeitorRegistros l;
+    if (!leitor_abrir(&l, tabela, arq, tam_registro, offset_chave, INT64_MIN)) return;
+    char *bloco = malloc(tam_registro * REGISTROS_POR_LEITURA);
+    long ativos = 0;
+    size_t lidos;
+    while (bloco && (lidos = leitor_ler(&l, bloco, REGISTROS_POR_LEITURA)) > 0)
+        for (size_t i = 0; i < lidos; i++) ativos += bloco[i * tam_registro + offset_ativo] == 'S';
+    free(bloco);
+    leitor_fechar(&l);
+    printf("%ld ativos\n", ativos);
+}
+
+void op_varredura_produtos(void) {
+    varrer_tabela(TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, sizeof(Produto), offsetof(Produto, product_id), offsetof(Produto, ativo));
+}
+
+void op_varredura_compras(void) {
+    varrer_tabela(TABELA_COMPRAS, ARQ_COMPRAS_BIN, sizeof(Compra), offsetof(Compra, order_id), offsetof(Compra, ativo));
+}
+
+const char *threads_paralelas = "1,2,4,8"; // --threads
+
+/**
+ * @brief Speedup da varredura particionada: as duas consultas por
+ * varredura com cada numero de threads da lista, como
+ * "<consulta>_t<N>" (campo threads do JSON). O speedup de N threads e a
+ * latencia de _t1 dividida pela de _tN.
+ */
+void medir_paralelo(const ConfigBenchmark *cfg, FILE *saida) {
+    if (!op_habilitada(cfg, "varredura_paralela")) return;
+    ConfigBenchmark todas = *cfg;
+    todas.ops = NULL; // Os nomes _tN sao gerados aqui
+    int original = threads_varredura;
+    for (const char *p = threads_paralelas; *p; p += (*p == ',')) {
+        threads_varredura = (int)strtol(p, (char **)&p, 10);
+        if (threads_varredura <= 0) break;
+        char nome[64];
+        snprintf(nome, sizeof(nome), "produto_mais_caro_varredura_t%d", threads_varredura);
+        medir_varredura(&todas, saida, nome, produto_mais_caro_varredura);
+        snprintf(nome, sizeof(nome), "valor_total_vendido_varredura_t%d", threads_varredura);
+        medir_varredura(&todas, saida, nome, valor_total_vendido_varredura);
+    }
+    threads_varredura = original;
+}
+
+void op_criar_indice_compras(void) {
+    criar_indice_compra(ARQ_COMPRAS_BIN, ARQ_COMPRAS_IDX);
+}
+
+void op_criar_aprendido_produtos(void) {
+    ResultadoAprendido r;
+    indice_aprendido_criar(TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, sizeof(Produto), offsetof(Produto, product_id),
+                           epsilon_aprendido, &r);
+}
+
+/**
+ * @brief Cria os dois indices aprendidos e informa no stderr o tamanho de
+ * cada um ao lado do indice parcial da mesma tabela (a vazao sai nas ops
+ * aprendido_* x indice_*).
+ */
+void criar_aprendidos(void) {
+    const char *nomes[] = {"produtos", "compras"}, *indices[] = {ARQ_PRODUTOS_IDX, ARQ_COMPRAS_IDX};
+    for (int t = 0; t < 2; t++) {
+        ResultadoAprendido r;
+        int ok = t == 0 ? indice_aprendido_criar(TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, sizeof(Produto),
+                                                 offsetof(Produto, product_id), epsilon_aprendido, &r)
+                        : indice_aprendido_criar(TABELA_COMPRAS, ARQ_COMPRAS_BIN, sizeof(Compra),
+                                                 offsetof(Compra, order_id), epsilon_aprendido, &r);
+        IndiceCompacto ic;
+        long bytes_indice = indice_compacto_carregar(&ic, indices[t]) ? indice_compacto_bytes(&ic) : 0;
+        indice_compacto_liberar(&ic);
+        if (ok) fprintf(stderr, "Indice aprendido de %s (eps = %d): %ld segmentos, %ld bytes; indice parcial: %ld bytes\n",
+                        nomes[t], epsilon_aprendido, r.segmentos, r.bytes, bytes_indice);
+    }
+}
+
+/**
+ * @brief Mede insercoes pelo WAL. Com 'tam_grupo' == 1 cada insercao e
+ * confirmada sozinha (como no menu); com tam_grupo == WAL_GRUPO_MAX mede o
+ * group commit. As chaves novas ficam acima da maior chave existente ou,
+ * com 'no_meio', logo depois de uma chave existente sorteada (no layout em
+ * blocos cai num bloco do meio; com --dist sequencial nao ha buracos e a
+ * insercao e ignorada como duplicada).
+ */
+void medir_insercoes(const ConfigBenchmark *cfg, FILE *saida, const char *nome, int produtos, int tam_grupo,
+                     int no_meio) {
+    if (!op_habilitada(cfg, nome) || cfg->n_insercoes <= 0) return;
+    static int64_t proxima_chave_nova = INT64_MAX / 2; // Compartilhada entre as medicoes
+    int64_t *chaves = malloc((size_t)tam_grupo * sizeof(int64_t));
+    if (!chaves) return;
+
+    for (int frio = 0; frio <= 1; frio++) {
+        Medicao m;
+        medicao_iniciar(&m, cfg->n_insercoes);
+        for (int i = 0; i < cfg->n_insercoes; i += tam_grupo) {
+            if (frio) esfriar_tudo();
+            int n = (cfg->n_insercoes - i < tam_grupo) ? cfg->n_insercoes - i : tam_grupo;
+            // Sorteio fora da medicao
+            const char *arq_bin = produtos ? ARQ_PRODUTOS_BIN : ARQ_COMPRAS_BIN;
+            size_t tam = produtos ? sizeof(Produto) : sizeof(Compra);
+            int64_t *sorteadas = no_meio ? sortear_chaves(arq_bin, tam, registros_no_arquivo(arq_bin, tam), n, 1.0) : NULL;
+            for (int j = 0; j < n; j++) chaves[j] = sorteadas ? sorteadas[j] + 1 : proxima_chave_nova++;
+            free(sorteadas);
+            silenciar_stdout();
+            double t0 = agora_ns();
+            for (int j = 0; j < n; j++) {
+                if (produtos) {
+                    Produto p;
+                    memset(&p, 0, sizeof(p));
+                    p.product_id = chaves[j];
+                    strcpy(p.brand, "bench");
+                    strcpy(p.category_alias, "bench");
+                    pad_string(p.brand, TAM_BRAND);
+                    pad_string(p.category_alias, TAM_CATEGORY);
+                    p.price = 1.0;
+                    p.ativo = 'S';
+                    p.newline = '\n';
+                    wal_registrar(WAL_INSERIR_PRODUTO, &p);
+                } else {
+                    Compra c;
+                    memset(&c, 0, sizeof(c));
+                    c.order_id = chaves[j];
+                    strcpy(c.order_datetime, "2021-01-01 00:00:00 UTC");
+                    pad_string(c.order_datetime, TAM_DATETIME);
+                    c.quantity = 1;
+                    c.ativo = 'S';
+                    c.newline = '\n';
+                    wal_registrar(WAL_INSERIR_COMPRA, &c);
+                }
+            }
+            wal_confirmar_grupo(NULL);
+            double dt = agora_ns() - t0;
+            restaurar_stdout();
+            // Latencia por insercao = custo do grupo dividido entre seus membros
+            for (int j = 0; j < n; j++) m.latencias_ns[m.n++] = dt / n;
+        }
+        medicao_emitir(&m, saida, cfg, nome, frio ? "frio" : "quente");
+    }
+    free(chaves);
+}
+
+// --- GERADOR DE CARGA PARA O MODO SERVIDOR ---
+
+typedef struct {
+    const char *socket;
+    const int64_t *chaves;
+    int n_chaves;
+    const char *comando;  // "PRODUTO", "COMPRA" ou NULL (escritas: remove e reinsere produtos)
+    double fim_ns;        // Instante (agora_ns) em que o teste termina
+    uint64_t semente;
+    double *latencias_ns; // Preenchido pela thread
+    long n, capacidade;
+    long erros;
+} ClienteCarga;
+
+int conectar_servidor(const char *caminho) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un endereco;
+    memset(&endereco, 0, sizeof(endereco));
+    endereco.sun_family = AF_UNIX;
+    snprintf(endereco.sun_path, sizeof(endereco.sun_path), "%s", caminho);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&endereco, sizeof(endereco)) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Cliente em laco fechado: envia uma consulta, espera a resposta e
+ * mede a latencia, ate o fim do teste. No modo de escritas alterna
+ * REMOVER_PRODUTO e INSERIR_PRODUTO da mesma chave.
+ */
+void *executar_cliente_carga(void *arg) {
+    ClienteCarga *c = arg;
+    int fd = conectar_servidor(c->socket);
+    if (fd < 0) { c->erros++; return NULL; }
+    FILE *entrada = fdopen(fd, "r");
+    FILE *saida = fdopen(dup(fd), "w");
+    char resposta[512];
+    int64_t chave = 0;
+
+    while (agora_ns() < c->fim_ns) {
+        int reinserir = !c->comando && c->n % 2 == 1;
+        if (!reinserir) chave = c->chaves[splitmix64(&c->semente) % (uint64_t)c->n_chaves];
+        double t0 = agora_ns();
+        if (c->comando) fprintf(saida, "%s %lld\n", c->comando, (long long)chave);
+        else if (reinserir) fprintf(saida, "INSERIR_PRODUTO %lld\tcarga\t1.00\tcarga\n", (long long)chave);
+        else fprintf(saida, "REMOVER_PRODUTO %lld\n", (long long)chave);
+        if (fflush(saida) != 0 || !fgets(resposta, sizeof(resposta), entrada)) { c->erros++; break; }
+        double dt = agora_ns() - t0;
+        if (strncmp(resposta, "ERRO", 4) == 0) c->erros++;
+        if (c->n == c->capacidade) {
+            c->capacidade = c->capacidade ? c->capacidade * 2 : 65536;
+            c->latencias_ns = realloc(c->latencias_ns, c->capacidade * sizeof(double));
+        }
+        c->latencias_ns[c->n++] = dt;
+    }
+    fprintf(saida, "SAIR\n");
+    fclose(saida);
+    fclose(entrada);
+    return NULL;
+}
+
+/**
+ * @brief ./benchmark carga: dispara N conexoes simultaneas contra o servidor
+ * e reporta QPS e percentis de latencia (uma linha JSON).
+ */
+int executar_carga(int argc, char **argv) {
+    const char *socket_path = "aed2.sock", *dir = ".", *tipo = "produto", *arq_saida = NULL;
+    int n_conexoes = 4, n_chaves = 10000;
+    double duracao = 5;
+    for (int i = 1; i < argc; i++) {
+        const char *valor = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!valor) { fprintf(stderr, "Opcao sem valor: %s\n", argv[i]); return 1; }
+        if (strcmp(argv[i], "--socket") == 0) socket_path = valor;
+        else if (strcmp(argv[i], "--dir") == 0) dir = valor;
+        else if (strcmp(argv[i], "--tipo") == 0) tipo = valor;
+        else if (strcmp(argv[i], "--conexoes") == 0) n_conexoes = atoi(valor);
+        else if (strcmp(argv[i], "--duracao") == 0) duracao = atof(valor);
+        else if (strcmp(argv[i], "--chaves") == 0) n_chaves = atoi(valor);
+        else if (strcmp(argv[i], "--saida") == 0) arq_saida = valor;
+        else { fprintf(stderr, "Opcao desconhecida: %s\n", argv[i]); return 1; }
+        i++;
+    }
+    int escrita = (strcmp(tipo, "escrita") == 0), produto = escrita || (strcmp(tipo, "produto") == 0);
+    if (n_conexoes <= 0 || n_chaves <= 0) { fprintf(stderr, "Parametros invalidos\n"); return 1; }
+
+    // Sorteia chaves existentes direto do arquivo de dados que o servidor serve
+    char caminho[1024];
+    snprintf(caminho, sizeof(caminho), "%s/%s", dir, produto ? ARQ_PRODUTOS_BIN : ARQ_COMPRAS_BIN);
+    size_t tam = produto ? sizeof(Produto) : sizeof(Compra);
+    struct stat st;
+    if (stat(caminho, &st) != 0) { perror(caminho); return 1; }
+    estado_rng = 42;
+    int64_t *chaves = sortear_chaves(caminho, tam, (long)(st.st_size / (off_t)tam), n_chaves, 1.0);
+
+    ClienteCarga *clientes = calloc(n_conexoes, sizeof(ClienteCarga));
+    pthread_t *threads = malloc(n_conexoes * sizeof(pthread_t));
+    signal(SIGPIPE, SIG_IGN);
+    double inicio = agora_ns();
+    for (int i = 0; i < n_conexoes; i++) {
+        clientes[i] = (ClienteCarga){socket_path, chaves, n_chaves, escrita ? NULL : produto ? "PRODUTO" : "COMPRA",
+                                     inicio + duracao * 1e9, 1000 + (uint64_t)i, NULL, 0, 0, 0};
+        pthread_create(&threads[i], NULL, executar_cliente_carga, &clientes[i]);
+    }
+    long total = 0, erros = 0;
+    for (int i = 0; i < n_conexoes; i++) {
+        pthread_join(threads[i], NULL);
+        total += clientes[i].n;
+        erros += clientes[i].erros;
+    }
+    double decorrido = (agora_ns() - inicio) / 1e9;
+
+    double *todas = malloc((total > 0 ? total : 1) * sizeof(double));
+    long k = 0;
+    for (int i = 0; i < n_conexoes; i++) {
+        memcpy(todas + k, clientes[i].latencias_ns, clientes[i].n * sizeof(double));
+        k += clientes[i].n;
+        free(clientes[i].latencias_ns);
+    }
+    qsort(todas, total, sizeof(double), comparar_double);
+
+    FILE *saida = arq_saida ? fopen(arq_saida, "a") : stdout;
+    if (!saida) saida = stdout;
+    fprintf(saida,
+            "{\"timestamp\":%lld,\"op\":\"carga_%s\",\"conexoes\":%d,\"duracao_s\":%.3f,\"n\":%ld,\"erros\":%ld,"
+            "\"qps\":%.1f,\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f}\n",
+            (long long)time(NULL), tipo, n_conexoes, decorrido, total, erros,
+            total / decorrido, percentil(todas, (int)total, 0.50) / 1e3, percentil(todas, (int)total, 0.90) / 1e3,
+            percentil(todas, (int)total, 0.99) / 1e3, percentil(todas, (int)total, 0.999) / 1e3,
+            total ? todas[total - 1] / 1e3 : 0);
+    fprintf(stderr, "%ld consultas em %.1fs: %.0f QPS, p99 = %.1f us (%ld erros)\n",
+            total, decorrido, total / decorrido, percentil(todas, (int)total, 0.99) / 1e3, erros);
+    if (saida != stdout) fclose(saida);
+
+    free(todas);
+    free(threads);
+    free(clientes);
+    free(chaves);
+    return erros ? 1 : 0;
+}
+
+// --- PROGRAMA PRINCIPAL ---
+
+void uso(const char *prog) {
+    fprintf(stderr,
+            "Uso: %s [opcoes]\n"
+            "     %s carga [--socket S] [--dir D] [--tipo produto|compra|escrita] [--conexoes N]\n"
+            "           [--duracao SEG] [--chaves N] [--saida ARQ]   (gerador de carga do servidor)\n"
+            "  --produtos N     registros em produtos.bin (padrao 1000000)\n"
+            "  --compras N      registros em compras.bin (padrao 1000000)\n"
+            "  --dist D         sequencial | esparsa | agrupada (padrao esparsa)\n"
+            "  --consultas N    consultas pontuais por medicao (padrao 1000)\n"
+            "  --insercoes N    insercoes por medicao (padrao 4; cada grupo reescreve o arquivo)\n"
+            "  --repeticoes N   repeticoes das varreduras completas (padrao 1)\n"
+            "  --acertos F      fracao de consultas com chave existente (padrao 0.9)\n"
+            "  --semente S      semente do gerador (padrao 42)\n"
+            "  --dir D          diretorio de trabalho (padrao bench_dados)\n"
+            "  --saida ARQ      resultados em JSON Lines (padrao: stdout)\n"
+            "  --bloom-fp F     taxa de falsos positivos dos filtros de Bloom (padrao 0.01)\n"
+            "  --comprimir 0|1  gera e usa as copias comprimidas por blocos (.z) (padrao 0)\n"
+            "  --prebusca 0|1   thread de pre-busca nas varreduras do .bin (padrao 0)\n"
+            "  --profundidades L  filas de assincrona_produto (padrao 1,2,4,8,16,32,64)\n"
+            "  --epsilon N      erro maximo dos indices aprendidos (.pgm) (padrao 32)\n"
+            "  --threads L      threads de varredura_paralela (padrao 1,2,4,8)\n"
+            "  --preenchimento P  grava os .bin no layout em blocos com P%% ocupados (padrao 0 = denso)\n"
+            "  --linhas-csv N   linhas do CSV gerado para as medicoes de ingestao (padrao 1000000)\n"
+            "  --ops LISTA      operacoes separadas por virgula (padrao: todas):\n"
+            "                   binaria_produto,binaria_compra,indice_produto,indice_compra,\n"
+            "                   itens_pedido,lote_produto,lote_compra,assincrona_produto,\n"
+            "                   aprendido_produto,aprendido_compra,\n"
+            "                   binaria_produto_callback,binaria_compra_callback,\n"
+            "                   existencia_produto,existencia_compra,produto_ativo,\n"
+            "                   sondagem_callback,sondagem_especializada,\n"
+            "                   criar_indice_produtos,criar_indice_compras,criar_aprendido_produtos,\n"
+            "                   produto_mais_caro,\n"
+            "                   valor_total_vendido,produto_mais_caro_varredura,\n"
+            "                   valor_total_vendido_varredura,valor_total_vendido_hash_join,\n"
+            "                   varredura_paralela,verificar_agregados,\n"
+            "                   mostrar_produtos,mostrar_pagina_produtos,\n"
+            "                   topk_receita,topk_gasto_usuario,agrupar_categoria,\n"
+            "                   agrupar_usuario,agrupar_usuario_derramando,\n"
+            "                   varredura_produtos,varredura_compras,\n"
+            "                   exportar_produtos_csv,exportar_compras_ndjson,\n"
+            "                   ingestao_produtos_strtok,ingestao_produtos_simd,\n"
+            "                   ingestao_compras_strtok,ingestao_compras_simd,\n"
+            "                   inserir_produto,inserir_produto_grupo,inserir_produto_meio,\n"
+            "                   inserir_compra,inserir_compra_grupo,inserir_compra_meio\n",
+            prog, prog);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "carga") == 0) return executar_carga(argc - 1, argv + 1);
+
+    ConfigBenchmark cfg = {1000000, 1000000, DIST_ESPARSA, 1000, 4, 1, 0.9, 42, "bench_dados", NULL, NULL};
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *valor = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!valor) { uso(argv[0]); return 1; }
+        if (strcmp(arg, "--produtos") == 0) cfg.n_produtos = atol(valor);
+        else if (strcmp(arg, "--compras") == 0) cfg.n_compras = atol(valor);
+        else if (strcmp(arg, "--consultas") == 0) cfg.n_consultas = atoi(valor);
+        else if (strcmp(arg, "--insercoes") == 0) cfg.n_insercoes = atoi(valor);
+        else if (strcmp(arg, "--repeticoes") == 0) cfg.n_repeticoes = atoi(valor);
+        else if (strcmp(arg, "--acertos") == 0) cfg.taxa_acertos = atof(valor);
+        else if (strcmp(arg, "--semente") == 0) cfg.semente = strtoull(valor, NULL, 10);
+        else if (strcmp(arg, "--dir") == 0) cfg.diretorio = valor;
+        else if (strcmp(arg, "--saida") == 0) cfg.saida = valor;
+        else if (strcmp(arg, "--ops") == 0) cfg.ops = valor;
+        else if (strcmp(arg, "--bloom-fp") == 0) bloom_taxa_fp = atof(valor);
+        else if (strcmp(arg, "--comprimir") == 0) layout_comprimido = atoi(valor) != 0;
+        else if (strcmp(arg, "--prebusca") == 0) prebusca_ativa = atoi(valor) != 0;
+        else if (strcmp(arg, "--profundidades") == 0) profundidades_assincronas = valor;
+        else if (strcmp(arg, "--epsilon") == 0) epsilon_aprendido = atoi(valor);
+        else if (strcmp(arg, "--threads") == 0) threads_paralelas = valor;
+        else if (strcmp(arg, "--preenchimento") == 0) preenchimento_bench = atoi(valor);
+        else if (strcmp(arg, "--linhas-csv") == 0) linhas_csv = atol(valor);
+        else if (strcmp(arg, "--dist") == 0) {
+            if (strcmp(valor, "sequencial") == 0) cfg.dist = DIST_SEQUENCIAL;
+            else if (strcmp(valor, "esparsa") == 0) cfg.dist = DIST_ESPARSA;
+            else if (strcmp(valor, "agrupada") == 0) cfg.dist = DIST_AGRUPADA;
+            else { uso(argv[0]); return 1; }
+        } else { uso(argv[0]); return 1; }
+        i++;
+    }
+    if (cfg.n_produtos <= 0 || cfg.n_compras <= 0 || cfg.n_consultas < 0 || cfg.n_repeticoes <= 0 ||
+        preenchimento_bench < 0 || preenchimento_bench > 100) {
+        uso(argv[0]);
+        return 1;
+    }
+
+    // O arquivo de resultados e aberto antes do chdir (caminho relativo ao diretorio atual)
+    FILE *saida = cfg.saida ? fopen(cfg.saida, "a") : stdout;
+    if (!saida) { fprintf(stderr, "ERRO ao abrir %s\n", cfg.saida); return 1; }
+
+    if (mkdir(cfg.diretorio, 0755) != 0 && errno != EEXIST) { perror(cfg.diretorio); return 1; }
+    if (chdir(cfg.diretorio) != 0) { perror(cfg.diretorio); return 1; }
+    remove(ARQ_WAL);
+
+    // 1. Gera os dados (deterministico pela semente)
+    fprintf(stderr, "Gerando %ld produtos e %ld compras (%s)...\n",
+            cfg.n_produtos, cfg.n_compras, NOMES_DIST[cfg.dist]);
+    estado_rng = cfg.semente;
+    int64_t *chaves_produtos = gerar_produtos(&cfg);
+    gerar_compras(&cfg, chaves_produtos);
+    free(chaves_produtos);
+    silenciar_stdout();
+    // Os arquivos gerados sao densos; --preenchimento os reorganiza em blocos
+    avancar_geracao_layout(TABELA_PRODUTOS, 0);
+    avancar_geracao_layout(TABELA_COMPRAS, 0);
+    criar_indice_itens(ARQ_ITENS_BIN, ARQ_ITENS_IDX);
+    agregados_reconstruir();
+    if (preenchimento_bench > 0) {
+        reorganizar_em_blocos(TABELA_PRODUTOS, ARQ_PRODUTOS_BIN, sizeof(Produto), offsetof(Produto, product_id),
+                              offsetof(Produto, ativo), preenchimento_bench);
+        reorganizar_em_blocos(TABELA_COMPRAS, ARQ_COMPRAS_BIN, sizeof(Compra), offsetof(Compra, order_id),
+                              offsetof(Compra, ativo), preenchimento_bench);
+        // Mudar o layout nao muda os itens: o indice de itens segue valendo
+        ItemPedido *itens;
+        long n_itens = buscar_itens_pedido(ARQ_ITENS_IDX, ARQ_ITENS_BIN, 1, -1, &itens);
+        free(itens);
+        if (n_itens < 0) { restaurar_stdout(); fprintf(stderr, "ERRO: itens inacessiveis apos reorganizar compras\n"); return 1; }
+    }
+    op_criar_indice_produtos();
+    op_criar_indice_compras();
+    restaurar_stdout();
+    criar_aprendidos();
+
+    // 2. Consultas pontuais
+    fprintf(stderr, "Medindo consultas pontuais...\n");
+    int64_t *chaves_p = sortear_chaves(ARQ_PRODUTOS_BIN, sizeof(Produto), registros_no_arquivo(ARQ_PRODUTOS_BIN, sizeof(Produto)),
+                                       cfg.n_consultas, cfg.taxa_acertos);
+    int64_t *chaves_c = sortear_chaves(ARQ_COMPRAS_BIN, sizeof(Compra), registros_no_arquivo(ARQ_COMPRAS_BIN, sizeof(Compra)),
+                                       cfg.n_consultas, cfg.taxa_acertos);
+    medir_buscas(&cfg, saida, "binaria_produto", BUSCA_BINARIA_PRODUTO, chaves_p);
+    medir_buscas(&cfg, saida, "binaria_compra", BUSCA_BINARIA_COMPRA, chaves_c);
+    medir_buscas(&cfg, saida, "indice_produto", BUSCA_INDICE_PRODUTO, chaves_p);
+    medir_buscas(&cfg, saida, "indice_compra", BUSCA_INDICE_COMPRA, chaves_c);
+    medir_buscas(&cfg, saida, "aprendido_produto", BUSCA_APRENDIDO_PRODUTO, chaves_p);
+    medir_buscas(&cfg, saida, "aprendido_compra", BUSCA_APRENDIDO_COMPRA, chaves_c);
+    medir_buscas(&cfg, saida, "itens_pedido", BUSCA_ITENS_PEDIDO, chaves_c);
+    medir_lote(&cfg, saida, "lote_produto", 1, chaves_p);
+    medir_lote(&cfg, saida, "lote_compra", 0, chaves_c);
+    medir_assincrono(&cfg, saida, chaves_p);
+    medir_buscas(&cfg, saida, "binaria_produto_callback", BUSCA_BINARIA_PRODUTO_CALLBACK, chaves_p);
+    medir_buscas(&cfg, saida, "binaria_compra_callback", BUSCA_BINARIA_COMPRA_CALLBACK, chaves_c);
+    medir_buscas(&cfg, saida, "existencia_produto", BUSCA_EXISTENCIA_PRODUTO, chaves_p);
+    medir_buscas(&cfg, saida, "existencia_compra", BUSCA_EXISTENCIA_COMPRA, chaves_c);
+    medir_buscas(&cfg, saida, "produto_ativo", BUSCA_PRODUTO_ATIVO, chaves_p);
+    medir_sondagem(&cfg, saida, chaves_p);
+    free(chaves_p);
+    free(chaves_c);
+
+    // 3. Operacoes sobre o arquivo inteiro
+    fprintf(stderr, "Medindo varreduras...\n");
+    medir_varredura(&cfg, saida, "criar_indice_produtos", op_criar_indice_produtos);
+    medir_varredura(&cfg, saida, "criar_indice_compras", op_criar_indice_compras);
+    medir_varredura(&cfg, saida, "criar_aprendido_produtos", op_criar_aprendido_produtos);
+    medir_varredura(&cfg, saida, "produto_mais_caro", consulta_produto_mais_caro);
+    medir_varredura(&cfg, saida, "valor_total_vendido", consulta_valor_total_vendido);
+    medir_varredura(&cfg, saida, "produto_mais_caro_varredura", produto_mais_caro_varredura);
+    medir_varredura(&cfg, saida, "valor_total_vendido_varredura", valor_total_vendido_varredura);
+    medir_varredura(&cfg, saida, "valor_total_vendido_hash_join", valor_total_vendido_hash_join);
+    medir_paralelo(&cfg, saida);
+    medir_varredura(&cfg, saida, "verificar_agregados", op_verificar_agregados);
+    medir_varredura(&cfg, saida, "topk_receita", op_topk_receita);
+    medir_varredura(&cfg, saida, "topk_gasto_usuario", op_topk_gasto_usuario);
+    medir_varredura(&cfg, saida, "agrupar_categoria", op_agrupar_categoria);
+    medir_varredura(&cfg, saida, "agrupar_usuario", op_agrupar_usuario);
+    medir_varredura(&cfg, saida, "agrupar_usuario_derramando", op_agrupar_usuario_derramando);
+    pagina_meio = cfg.n_produtos / 2;
+    medir_varredura(&cfg, saida, "mostrar_produtos", op_mostrar_produtos);
+    medir_varredura(&cfg, saida, "mostrar_pagina_produtos", op_mostrar_pagina_produtos);
+    medir_varredura(&cfg, saida, "varredura_produtos", op_varredura_produtos);
+    medir_varredura(&cfg, saida, "varredura_compras", op_varredura_compras);
+    medir_varredura(&cfg, saida, "exportar_produtos_csv", op_exportar_produtos_csv);
+    medir_varredura(&cfg, saida, "exportar_compras_ndjson", op_exportar_compras_ndjson);
+    if (op_habilitada(&cfg, "ingestao_produtos_strtok") || op_habilitada(&cfg, "ingestao_produtos_simd") ||
+        op_habilitada(&cfg, "ingestao_compras_strtok") || op_habilitada(&cfg, "ingestao_compras_simd"))
+        gerar_csv(linhas_csv);
+    medir_varredura(&cfg, saida, "ingestao_produtos_strtok", op_ingestao_produtos_strtok);
+    medir_varredura(&cfg, saida, "ingestao_produtos_simd", op_ingestao_produtos_simd);
+    medir_varredura(&cfg, saida, "ingestao_compras_strtok", op_ingestao_compras_strtok);
+    medir_varredura(&cfg, saida, "ingestao_compras_simd", op_ingestao_compras_simd);
+
+    // 4. Insercoes por ultimo, pois alteram os arquivos
+    fprintf(stderr, "Medindo insercoes...\n");
+    medir_insercoes(&cfg, saida, "inserir_produto", 1, 1, 0);
+    medir_insercoes(&cfg, saida, "inserir_produto_grupo", 1, WAL_GRUPO_MAX, 0);
+    medir_insercoes(&cfg, saida, "inserir_produto_meio", 1, 1, 1);
+    medir_insercoes(&cfg, saida, "inserir_compra", 0, 1, 0);
+    medir_insercoes(&cfg, saida, "inserir_compra_grupo", 0, WAL_GRUPO_MAX, 0);
+    medir_insercoes(&cfg, saida, "inserir_compra_meio", 0, 1, 1);
+
+    if (saida != stdout) fclose(saida);
+    return 0;
+}